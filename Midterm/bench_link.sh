@@ -0,0 +1,53 @@
+#!/bin/sh
+# Chat latency over impaired links: runs server, then replays a journal
+# through impair with several link profiles and prints replay's throughput
+# and latency lines for each.
+# Usage: ./bench_link.sh [journal] [replay options, e.g. -x 4]
+# Without a journal, 60 users in 6 rooms say 1500 things over about 6 s.
+
+PORT=3590
+PROXY=3591
+
+JOURNAL=$1
+[ $# -gt 0 ] && shift
+
+gcc -O2 -Wall -pthread -o server server.c -lssl -lcrypto || exit 1
+gcc -O2 -Wall -o replay replay.c -lcrypto || exit 1
+gcc -O2 -Wall -o impair impair.c || exit 1
+
+if [ -z "$JOURNAL" ]; then
+	JOURNAL=link_journal.txt
+	awk 'BEGIN {
+		srand(1)
+		for (u = 0; u < 60; u++) printf "%d u%d r%d +\n", u * 5, u, u % 6
+		t = 1000
+		for (k = 0; k < 1500; k++) {
+			t += -4 * log(1 - rand())
+			u = int(rand() * 60)
+			printf "%d u%d r%d message %d from u%d\n", t, u, u % 6, k, u
+		}
+	}' > "$JOURNAL"
+fi
+
+./server -A 0 -p $PORT > /dev/null 2>&1 &
+SERVER=$!
+trap 'kill $SERVER 2>/dev/null' EXIT
+sleep 0.5
+
+# One link per user and direction; -o down leaves the way to the server clean
+while read -r NAME OPTS; do
+	./impair -S 1 $OPTS $PROXY 127.0.0.1:$PORT > impair.log &
+	IMPAIR=$!
+	sleep 0.3
+	echo "== $NAME ($OPTS)"
+	./replay "$@" "$JOURNAL" 127.0.0.1:$PROXY | grep -E '^(sent|received|latency|[0-9]+ connect)'
+	kill $IMPAIR
+	wait $IMPAIR 2>/dev/null
+done <<EOF
+loopback -d 0
+lan -d 0.5 -j 0.2
+wan -d 40 -j 5
+lossy -d 40 -j 5 -l 1
+dsl -d 15 -b 1000
+slow-reader -d 20 -b 64 -q 16384 -o down
+EOF
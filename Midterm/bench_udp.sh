@@ -0,0 +1,22 @@
+#!/bin/sh
+# Loopback UDP benchmark: runs talker -b against listener at several payload
+# sizes and prints the listener's packets/sec and loss for each run.
+# Usage: ./bench_udp.sh [seconds per run] [talker options, e.g. -g or -r 200000]
+
+SECS=${1:-3}
+[ $# -gt 0 ] && shift
+
+gcc -O2 -Wall -o listener listener.c -lcrypto || exit 1
+gcc -O2 -Wall -o talker talker.c || exit 1
+
+./listener > listener.log 2>&1 &
+LISTENER=$!
+trap 'kill $LISTENER 2>/dev/null' EXIT
+sleep 0.5
+
+for SIZE in 64 256 512 1024 1400 8192; do
+	./talker -b -s $SIZE -d "$SECS" "$@" ::1 > /dev/null
+done
+sleep 0.5
+
+grep '^run ' listener.log
@@ -10,23 +10,535 @@
 #include <sys/types.h> 
 #include <netinet/in.h> 
 #include <sys/socket.h> 
+#include <sys/un.h>
 #include <time.h> 
+#include <stdint.h>
+#include <fcntl.h>
 
 #include <arpa/inet.h> 
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+#include <openssl/rand.h>
+#include <openssl/kdf.h>
+#include <openssl/pem.h>
+#include <openssl/x509.h>
 
 #define PORT "3490" // the port client will be connecting to 
+#define TLS_PORT "3443" // the server's TLS listener (-t)
 
 #define MAXDATASIZE 1024 // max number of bytes we can get at once 
 
-// Encryption key - must match server
-#define ENCRYPTION_KEY "NetworksCS522Key"
+// Wire framing - must match server
+// Every record is [2-byte length, network order][1-byte type][payload]
+#define FRAME_HDR     3
+#define SIG_MAX       2420
+#define FRAME_MAX     (MAXDATASIZE + 64 + 2 + SIG_MAX)
+enum {
+	FRAME_CHAT = 1,   // AES ciphertext
+	FRAME_NOTICE,     // plaintext notice
+	FRAME_PING,       // keepalive probe, answer with FRAME_PONG
+	FRAME_PONG,
+	FRAME_TEXT = 11,  // plaintext chat, TLS connections only
+	FRAME_KEX,        // session key exchange, before the username
+	FRAME_SIGKEY,     // our public key out, the server's nonce back
+	FRAME_SIGNED,     // [u16 sig len][signature][chat payload]
+	FRAME_ROSTER = 20 // ask for our room's user list; back come a snapshot, then diffs
+};
+enum { ROSTER_SNAP = 1, ROSTER_MORE, ROSTER_DIFF };
+enum { ROSTER_ADD = 1, ROSTER_DEL };
 
-// Simple XOR encryption/decryption function
-void xor_encrypt_decrypt(char *data, int length, const char *key) {
-	int key_len = strlen(key);
-	for (int i = 0; i < length; i++) {
-		data[i] ^= key[i % key_len];
+#define SIG_NONCE   16
+
+// Key exchange - must match server
+#define KEX_RANDOM  32
+#define KEX_PUB     32
+#define TICKET_LEN  69
+enum { KEX_FULL = 1, KEX_RESUME };
+
+// AES-256 key and IV - must match server
+static const unsigned char AES_KEY[32] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+    0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F
+};
+
+static const unsigned char AES_IV[16] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F
+};
+
+int session;   // FRAME_CHAT uses the exchanged keys, with a random IV per message
+
+// Who is in our room, kept up to date from FRAME_ROSTER
+char (*roster)[64] = NULL;
+int roster_n = 0, roster_cap = 0;
+uint32_t roster_version = 0;
+unsigned char key_c2s[32], key_s2c[32];
+
+// AES-256-CBC encrypt/decrypt (enc = 1 / 0); returns output length or -1
+int aes_crypt_key(int enc, const unsigned char *key, const unsigned char *iv,
+                  const unsigned char *in, int in_len, unsigned char *out) {
+    EVP_CIPHER_CTX *ctx;
+    int len, out_len = -1;
+
+    if (!(ctx = EVP_CIPHER_CTX_new()))
+        return -1;
+
+    if (EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv, enc) == 1 &&
+        EVP_CipherUpdate(ctx, out, &len, in, in_len) == 1) {
+        out_len = len;
+        if (EVP_CipherFinal_ex(ctx, out + len, &len) == 1)
+            out_len += len;
+        else
+            out_len = -1;
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+    return out_len;
+}
+
+int aes_encrypt(const unsigned char *plaintext, int plaintext_len, unsigned char *ciphertext) {
+    if (session) {   // [random IV][ciphertext]
+        if (RAND_bytes(ciphertext, 16) != 1)
+            return -1;
+        int n = aes_crypt_key(1, key_c2s, ciphertext, plaintext, plaintext_len, ciphertext + 16);
+        return n < 0 ? -1 : n + 16;
+    }
+    return aes_crypt_key(1, AES_KEY, AES_IV, plaintext, plaintext_len, ciphertext);
+}
+
+int aes_decrypt(const unsigned char *ciphertext, int ciphertext_len, unsigned char *plaintext) {
+    if (session) {
+        if (ciphertext_len < 32)
+            return -1;
+        return aes_crypt_key(0, key_s2c, ciphertext, ciphertext + 16, ciphertext_len - 16, plaintext);
+    }
+    return aes_crypt_key(0, AES_KEY, AES_IV, ciphertext, ciphertext_len, plaintext);
+}
+
+// HKDF-SHA256, extract and expand in one go
+int hkdf(const unsigned char *salt, int salt_len, const unsigned char *ikm, int ikm_len,
+         const char *info, unsigned char *out, size_t out_len) {
+    EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    int ok = pctx != NULL &&
+        EVP_PKEY_derive_init(pctx) == 1 &&
+        EVP_PKEY_CTX_set_hkdf_md(pctx, EVP_sha256()) == 1 &&
+        EVP_PKEY_CTX_set1_hkdf_salt(pctx, salt, salt_len) == 1 &&
+        EVP_PKEY_CTX_set1_hkdf_key(pctx, ikm, ikm_len) == 1 &&
+        EVP_PKEY_CTX_add1_hkdf_info(pctx, (const unsigned char *)info, strlen(info)) == 1 &&
+        EVP_PKEY_derive(pctx, out, &out_len) == 1;
+    EVP_PKEY_CTX_free(pctx);
+    return ok ? 0 : -1;
+}
+
+SSL *ssl;   // TLS connection (-t), NULL for plain TCP
+
+// Write/read the connection; over TLS OpenSSL frames the records (and hands
+// them to the kernel when kTLS is on)
+int conn_send(int fd, const void *buf, int len) {
+	if (ssl == NULL) {
+		return send(fd, buf, len, 0);
+	}
+	return SSL_write(ssl, buf, len) > 0 ? len : -1;
+}
+
+// Read exactly len bytes; short count on hangup
+int conn_recv_all(int fd, void *buf, int len) {
+	if (ssl == NULL) {
+		return recv(fd, buf, len, MSG_WAITALL);
+	}
+	int got = 0;
+	while (got < len) {
+		int n = SSL_read(ssl, (char *)buf + got, len - got);
+		if (n <= 0) {
+			return SSL_get_error(ssl, n) == SSL_ERROR_ZERO_RETURN || got > 0 ? got : -1;
+		}
+		got += n;
+	}
+	return got;
+}
+
+// Send one frame
+int send_frame(int fd, int type, const unsigned char *payload, int len) {
+	unsigned char frame[FRAME_HDR + FRAME_MAX];
+
+	frame[0] = (len >> 8) & 0xff;
+	frame[1] = len & 0xff;
+	frame[2] = type;
+	if (len > 0) {
+		memcpy(frame + FRAME_HDR, payload, len);
+	}
+	return conn_send(fd, frame, FRAME_HDR + len);
+}
+
+int local;   // connected over the server's AF_UNIX socket: one frame per packet
+
+// Frames that arrived while we waited for a reply of our own; recv_frame()
+// hands them out, in order, before reading the socket again
+typedef struct held_frame {
+	struct held_frame *next;
+	int type, len;
+	unsigned char payload[];
+} held_frame_t;
+
+held_frame_t *held_head = NULL, **held_tail = &held_head;
+int holding = 0;   // set while frames are being held: read the socket only
+
+void hold_frame(int type, const unsigned char *payload, int len) {
+	held_frame_t *h = malloc(sizeof *h + len);
+	if (h == NULL) {
+		fprintf(stderr, "client: out of memory; a message was lost\n");
+		return;
+	}
+	h->next = NULL;
+	h->type = type;
+	h->len = len;
+	memcpy(h->payload, payload, len);
+	*held_tail = h;
+	held_tail = &h->next;
+}
+
+// Receive one whole frame; returns payload length, -1 on error, FRAME_EOF on hangup
+#define FRAME_EOF (-2)
+int recv_frame(int fd, int *type, unsigned char *payload) {
+	if (held_head != NULL && !holding) {
+		held_frame_t *h = held_head;
+		if ((held_head = h->next) == NULL) held_tail = &held_head;
+		*type = h->type;
+		int len = h->len;
+		memcpy(payload, h->payload, len);
+		free(h);
+		return len;
+	}
+	if (local) {
+		unsigned char pkt[FRAME_HDR + FRAME_MAX];
+		int n = recv(fd, pkt, sizeof pkt, 0);
+		if (n == -1) return -1;
+		if (n < FRAME_HDR) return FRAME_EOF;
+		int len = (pkt[0] << 8) | pkt[1];
+		if (FRAME_HDR + len != n) {
+			fprintf(stderr, "client: malformed packet\n");
+			return -1;
+		}
+		memcpy(payload, pkt + FRAME_HDR, len);
+		*type = pkt[2];
+		return len;
+	}
+
+	unsigned char hdr[FRAME_HDR];
+	int n = conn_recv_all(fd, hdr, FRAME_HDR);
+	if (n == -1) return -1;
+	if (n < FRAME_HDR) return FRAME_EOF;
+
+	int len = (hdr[0] << 8) | hdr[1];
+	if (len > FRAME_MAX) {
+		fprintf(stderr, "client: oversized frame\n");
+		return -1;
+	}
+	if (len > 0 && (n = conn_recv_all(fd, payload, len)) < len) {
+		return n == -1 ? -1 : FRAME_EOF;
+	}
+	*type = hdr[2];
+	return len;
+}
+
+// Apply a FRAME_ROSTER. A diff also leaves a line to show in buf ("* alice
+// joined, bob left"); returns its length.
+int roster_apply(int fd, const unsigned char *p, int len, char *buf) {
+	int n = 0, shown = 0, count = 0;
+
+	buf[0] = '\0';
+	if (len < 5) return 0;
+	uint32_t version = ((uint32_t)p[1] << 24) | (p[2] << 16) | (p[3] << 8) | p[4];
+	if (p[0] == ROSTER_SNAP) {
+		roster_n = 0;
+	} else if (version != roster_version + (p[0] == ROSTER_DIFF)) {
+		send_frame(fd, FRAME_ROSTER, NULL, 0);   // missed one: ask for a fresh snapshot
+		return 0;
+	}
+	roster_version = version;
+
+	for (int off = 5; off + 2 <= len && off + 2 + p[off + 1] <= len; off += 2 + p[off + 1]) {
+		char name[64];
+		snprintf(name, sizeof name, "%.*s", p[off + 1], (const char *)p + off + 2);
+		if (p[off] == ROSTER_ADD) {
+			if (roster_n == roster_cap) {
+				char (*grown)[64] = realloc(roster, (roster_cap ? roster_cap * 2 : 64) * sizeof *roster);
+				if (grown != NULL) {
+					roster = grown;
+					roster_cap = roster_cap ? roster_cap * 2 : 64;
+				}
+			}
+			if (roster_n < roster_cap) strcpy(roster[roster_n++], name);   // else /who misses them
+		} else {
+			for (int k = 0; k < roster_n; k++) {
+				if (strcmp(roster[k], name) == 0) {
+					if (k != --roster_n) strcpy(roster[k], roster[roster_n]);
+					break;
+				}
+			}
+		}
+		if (p[0] != ROSTER_DIFF) continue;
+		count++;
+		if (n < 200) {
+			n += snprintf(buf + n, MAXDATASIZE - n, "%s%s %s", n ? ", " : "* ", name,
+				p[off] == ROSTER_ADD ? "joined" : "left");
+			shown++;
+		}
+	}
+	if (count > shown) {
+		n += snprintf(buf + n, MAXDATASIZE - n, " and %d more", count - shown);
+	}
+	return n;
+}
+
+// Receive the next frame worth showing, answering keepalive probes on the way.
+// Chat frames are decrypted; the NUL-terminated text is left in buf. A roster
+// update with nothing to show returns 0 with buf empty.
+int recv_message(int fd, char *buf) {
+	unsigned char payload[FRAME_MAX];
+	int type, len;
+
+	while ((len = recv_frame(fd, &type, payload)) >= 0) {
+		if (type == FRAME_PING) {
+			send_frame(fd, FRAME_PONG, NULL, 0);
+		} else if (type == FRAME_NOTICE || type == FRAME_TEXT) {
+			memcpy(buf, payload, len);
+			buf[len] = '\0';
+			return len;
+		} else if (type == FRAME_CHAT) {
+			int n = aes_decrypt(payload, len, (unsigned char *)buf);
+			if (n < 0) {
+				fprintf(stderr, "Decryption failed\n");
+				continue;
+			}
+			buf[n] = '\0';
+			return n;
+		} else if (type == FRAME_ROSTER) {
+			return roster_apply(fd, payload, len, buf);
+		}
+	}
+	return len;
+}
+
+// Per-connection keys. The first connection does an X25519 exchange; the
+// server's ticket and the session secret are kept in ticket_path (mode 0600)
+// so the next connection resumes without one.
+int kex(int fd, const char *ticket_path) {
+	unsigned char hello[1 + KEX_RANDOM + KEX_PUB + TICKET_LEN], reply[FRAME_MAX];
+	unsigned char saved[TICKET_LEN + 32], salt[2 * KEX_RANDOM], secret[32], psk[32], keys[64];
+	size_t publen = KEX_PUB;
+	int n = 1 + KEX_RANDOM + KEX_PUB, type, len, resume = 0;
+
+	// Our share goes out even when resuming, in case the ticket is refused
+	EVP_PKEY *key = EVP_PKEY_Q_keygen(NULL, NULL, "X25519");
+	if (key == NULL || EVP_PKEY_get_raw_public_key(key, hello + 1 + KEX_RANDOM, &publen) != 1 ||
+			RAND_bytes(hello + 1, KEX_RANDOM) != 1) {
+		goto fail;
+	}
+	int tfd = open(ticket_path, O_RDONLY);
+	if (tfd != -1) {
+		resume = read(tfd, saved, sizeof saved) == (int)sizeof saved;
+		close(tfd);
 	}
+	hello[0] = resume ? KEX_RESUME : KEX_FULL;
+	if (resume) {
+		memcpy(hello + n, saved, TICKET_LEN);
+		n += TICKET_LEN;
+	}
+	if (send_frame(fd, FRAME_KEX, hello, n) == -1) goto fail;
+
+	while ((len = recv_frame(fd, &type, reply)) >= 0 && type != FRAME_KEX) {
+		if (type == FRAME_PING) send_frame(fd, FRAME_PONG, NULL, 0);
+	}
+	if (len < 1 + KEX_RANDOM + TICKET_LEN) goto fail;
+	memcpy(salt, hello + 1, KEX_RANDOM);
+	memcpy(salt + KEX_RANDOM, reply + 1, KEX_RANDOM);
+
+	int off = 1 + KEX_RANDOM;
+	if (reply[0] == KEX_RESUME && resume) {
+		memcpy(secret, saved + TICKET_LEN, 32);
+	} else if (reply[0] == KEX_FULL && len >= off + KEX_PUB + TICKET_LEN) {
+		size_t slen = 32;
+		EVP_PKEY *peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, reply + off, KEX_PUB);
+		EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(key, NULL);
+		int ok = peer != NULL && ctx != NULL && EVP_PKEY_derive_init(ctx) == 1 &&
+			EVP_PKEY_derive_set_peer(ctx, peer) == 1 && EVP_PKEY_derive(ctx, secret, &slen) == 1;
+		EVP_PKEY_CTX_free(ctx);
+		EVP_PKEY_free(peer);
+		if (!ok) goto fail;
+		off += KEX_PUB;
+	} else {
+		goto fail;
+	}
+	if (hkdf(salt, sizeof salt, secret, 32, "chat psk", psk, 32) == -1 ||
+			hkdf(salt, sizeof salt, psk, 32, "chat keys", keys, 64) == -1) {
+		goto fail;
+	}
+	memcpy(key_c2s, keys, 32);
+	memcpy(key_s2c, keys + 32, 32);
+	session = 1;
+	printf("client: session keys %s\n", reply[0] == KEX_RESUME ? "resumed from ticket" : "from X25519 exchange");
+
+	// Keep the new ticket for next time
+	memcpy(saved, reply + off, TICKET_LEN);
+	memcpy(saved + TICKET_LEN, psk, 32);
+	tfd = open(ticket_path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+	if (tfd != -1) {
+		if (write(tfd, saved, sizeof saved) != (int)sizeof saved) unlink(ticket_path);
+		close(tfd);
+	}
+	EVP_PKEY_free(key);
+	OPENSSL_cleanse(psk, sizeof psk);
+	OPENSSL_cleanse(keys, sizeof keys);
+	return 0;
+
+fail:
+	fprintf(stderr, "client: key exchange failed\n");
+	EVP_PKEY_free(key);
+	return -1;
+}
+
+EVP_PKEY *sig_key;   // -g: sign every chat message with this key
+unsigned char sig_nonce[SIG_NONCE];
+uint64_t sig_seq;
+
+// Send chat text: AES-encrypted, or as it is when TLS protects the connection.
+// When signing, the same payload goes out wrapped in FRAME_SIGNED.
+int send_chat(int fd, const char *text) {
+	unsigned char frame[2 + SIG_MAX + 16 + MAXDATASIZE + 16];
+	int len = strlen(text), type = FRAME_TEXT, off = sig_key ? 2 + SIG_MAX : 0;
+	unsigned char *ciphertext = frame + off;
+
+	if (ssl != NULL) {
+		memcpy(ciphertext, text, len);
+	} else {
+		type = FRAME_CHAT;
+		len = aes_encrypt((const unsigned char *)text, len, ciphertext);
+		if (len < 0) {
+			fprintf(stderr, "Encryption failed\n");
+			return 0;
+		}
+	}
+	if (sig_key == NULL) {
+		return send_frame(fd, type, ciphertext, len);
+	}
+
+	// Signed: "chat-sig" | nonce | u64 message number | text
+	unsigned char msg[8 + SIG_NONCE + 8 + MAXDATASIZE];
+	int text_len = strlen(text), msg_len = 16 + SIG_NONCE + text_len;
+	memcpy(msg, "chat-sig", 8);
+	memcpy(msg + 8, sig_nonce, SIG_NONCE);
+	for (int k = 0; k < 8; k++) msg[8 + SIG_NONCE + k] = (sig_seq >> (56 - 8 * k)) & 0xff;
+	memcpy(msg + 16 + SIG_NONCE, text, text_len);
+
+	size_t sig_len = SIG_MAX;
+	EVP_MD_CTX *md = EVP_MD_CTX_new();
+	int ok = md != NULL && EVP_DigestSignInit(md, NULL, NULL, NULL, sig_key) == 1 &&
+		EVP_DigestSign(md, frame + 2, &sig_len, msg, msg_len) == 1;
+	EVP_MD_CTX_free(md);
+	if (!ok) {
+		fprintf(stderr, "Signing failed\n");
+		return 0;
+	}
+	sig_seq++;
+	frame[0] = (sig_len >> 8) & 0xff;
+	frame[1] = sig_len & 0xff;
+	memmove(frame + 2 + sig_len, ciphertext, len);   // close the gap a short signature leaves
+	return send_frame(fd, FRAME_SIGNED, frame, 2 + sig_len + len);
+}
+
+// Load our signing key from path, or make one: ML-DSA-44 where OpenSSL has
+// it (3.5 and later), Ed25519 otherwise
+EVP_PKEY *load_sig_key(const char *path) {
+	EVP_PKEY *key = NULL;
+	FILE *f = fopen(path, "r");
+
+	if (f != NULL) {
+		key = PEM_read_PrivateKey(f, NULL, NULL, NULL);
+		fclose(f);
+		return key;
+	}
+	if ((key = EVP_PKEY_Q_keygen(NULL, NULL, "ML-DSA-44")) == NULL) {
+		key = EVP_PKEY_Q_keygen(NULL, NULL, "ED25519");
+	}
+	int kfd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0600);
+	if (key != NULL && kfd != -1 && (f = fdopen(kfd, "w")) != NULL) {
+		PEM_write_PrivateKey(f, key, NULL, NULL, 0, NULL, NULL);
+		fclose(f);
+		printf("client: new %s signing key in %s\n", EVP_PKEY_get0_type_name(key), path);
+	} else if (kfd != -1) {
+		close(kfd);
+	}
+	return key;
+}
+
+// Register our public key; the server answers with the nonce every signature
+// covers, or a notice if it will not verify signatures
+int sig_register(int fd, EVP_PKEY *key) {
+	unsigned char der[2048], *p = der, payload[FRAME_MAX];
+	int len = i2d_PUBKEY(key, NULL), type;
+
+	if (len <= 0 || len > (int)sizeof der || i2d_PUBKEY(key, &p) != len ||
+			send_frame(fd, FRAME_SIGKEY, der, len) == -1) {
+		return -1;
+	}
+	int r = -1;
+	holding = 1;
+	while ((len = recv_frame(fd, &type, payload)) >= 0) {
+		if (type == FRAME_PING) {
+			send_frame(fd, FRAME_PONG, NULL, 0);
+		} else if (type == FRAME_SIGKEY && len == SIG_NONCE) {
+			memcpy(sig_nonce, payload, SIG_NONCE);
+			sig_key = key;
+			sig_seq = 0;
+			printf("client: signing messages with %s\n", EVP_PKEY_get0_type_name(key));
+			r = 0;
+			break;
+		} else if (type == FRAME_NOTICE) {
+			printf("%.*s", len, (char *)payload);
+			break;
+		} else {
+			hold_frame(type, payload, len);   // room traffic: shown once we are done
+		}
+	}
+	holding = 0;
+	return r;
+}
+
+// TLS 1.3 over the connected socket. With a CA file the server certificate
+// must check out for the host name; without one the link is encrypted but
+// not authenticated, and we say so.
+int tls_connect(int fd, const char *host, const char *ca) {
+	SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+	if (ctx == NULL || !SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION)) {
+		goto fail;
+	}
+	SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+	if (ca != NULL) {
+		if (SSL_CTX_load_verify_locations(ctx, ca, NULL) != 1) goto fail;
+		SSL_CTX_set_verify(ctx, SSL_VERIFY_PEER, NULL);
+	}
+	if ((ssl = SSL_new(ctx)) == NULL || SSL_set_fd(ssl, fd) != 1 ||
+			SSL_set_tlsext_host_name(ssl, host) != 1 ||
+			(ca != NULL && SSL_set1_host(ssl, host) != 1) ||
+			SSL_connect(ssl) != 1) {
+		goto fail;
+	}
+	printf("client: %s, kernel TLS %s%s\n", SSL_get_cipher(ssl),
+		BIO_get_ktls_send(SSL_get_wbio(ssl)) ? "tx" : "off",
+		BIO_get_ktls_recv(SSL_get_rbio(ssl)) ? "+rx" : "");
+	if (ca == NULL) {
+		printf("client: warning: server certificate not verified (use -C ca.pem)\n");
+	}
+	return 0;
+
+fail:
+	fprintf(stderr, "client: TLS handshake failed\n");
+	ERR_print_errors_fp(stderr);
+	return -1;
 }
 
 // Get current timestamp as string
@@ -49,21 +561,60 @@ void *get_in_addr(struct sockaddr *sa)
 int main(int argc, char *argv[]) 
 { 
 	int sockfd, numbytes;  
-	char buf[MAXDATASIZE]; 
+	char buf[FRAME_MAX + 32]; 
 	struct addrinfo hints, *servinfo, *p; 
-	int rv; 
+	int rv, opt, use_tls = 0, static_key = 0, sign = 0; 
 	char s[INET6_ADDRSTRLEN]; 
+	const char *ca = NULL;
 
-	if (argc != 2) { 
-	    fprintf(stderr,"usage: client hostname\n"); 
+	while ((opt = getopt(argc, argv, "tC:sg")) != -1) {
+		switch (opt) {
+		case 'g':   // sign every message (key in ~/.chat_sign_key.pem)
+			sign = 1;
+			break;
+		case 's':   // shared static key, for servers without FRAME_KEX
+			static_key = 1;
+			break;
+		case 'C':   // CA bundle to verify the server with; implies -t
+			ca = optarg;
+			/* fall through */
+		case 't':
+			use_tls = 1;
+			break;
+		default:
+			argc = 0;   // usage below
+		}
+	}
+	argv += optind - 1;
+	argc -= optind - 1;
+
+	if (argc != 2 && argc != 3) { 
+	    fprintf(stderr,"usage: client [-g] [-s | -t [-C ca.pem]] hostname [port]\n"
+	        "       client [-g] [-s] /path/to/local.sock\n"); 
 	    exit(1); 
 	} 
 
+	// A path means the server's same-host socket: no TCP at all
+	if (strchr(argv[1], '/') != NULL && !use_tls) {
+		struct sockaddr_un sun;
+		memset(&sun, 0, sizeof sun);
+		sun.sun_family = AF_UNIX;
+		strncpy(sun.sun_path, argv[1], sizeof(sun.sun_path) - 1);
+		if ((sockfd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1 ||
+				connect(sockfd, (struct sockaddr *)&sun, sizeof sun) == -1) {
+			perror("client: connect");
+			return 2;
+		}
+		local = 1;
+		printf("client: connected to %s\n", argv[1]);
+		goto connected;
+	}
+
 	memset(&hints, 0, sizeof hints);  // prepare hints structure
 	hints.ai_family = AF_UNSPEC; // don't care IPv4 or IPv6
 	hints.ai_socktype = SOCK_STREAM; // TCP stream sockets
 
-	if ((rv = getaddrinfo(argv[1], PORT, &hints, &servinfo)) != 0) { 
+	if ((rv = getaddrinfo(argv[1], argc == 3 ? argv[2] : use_tls ? TLS_PORT : PORT, &hints, &servinfo)) != 0) { 
 		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv)); 
 		return 1; 
 	} 
@@ -100,15 +651,35 @@ int main(int argc, char *argv[])
 
 	freeaddrinfo(servinfo); // all done with this structure 
 
+	if (use_tls && tls_connect(sockfd, argv[1], ca) == -1) {
+		close(sockfd);
+		return 2;
+	}
+
+connected:
 	// Receive welcome message
-	if ((numbytes = recv(sockfd, buf, MAXDATASIZE-1, 0)) == -1) { 
-	    perror("recv"); 
+	if ((numbytes = recv_message(sockfd, buf)) < 0) { 
+	    if (numbytes == -1) perror("recv"); 
 	    exit(1); 
 	} 
 
-	buf[numbytes] = '\0'; 
 	printf("%s", buf);
 	
+	// Fresh keys for this connection (TLS already has its own)
+	if (ssl == NULL && !static_key) {
+		char ticket_path[512], where[300];
+		const char *home = getenv("HOME");
+		snprintf(where, sizeof where, "%s_%s", argv[1], argc == 3 ? argv[2] : PORT);
+		for (char *q = where; *q; q++) {
+			if (*q == '/') *q = '_';
+		}
+		snprintf(ticket_path, sizeof ticket_path, "%s/.chat_ticket_%s", home ? home : "/tmp", where);
+		if (kex(sockfd, ticket_path) == -1) {
+			close(sockfd);
+			return 1;
+		}
+	}
+	
 	// Prompt for username
 	char username[64];
 	printf("Enter your name/identifier: ");
@@ -123,24 +694,34 @@ int main(int argc, char *argv[])
 	username[strcspn(username, "\n")] = '\0';
 	
 	// Send encrypted username to server
-	int username_len = strlen(username);
-	xor_encrypt_decrypt(username, username_len, ENCRYPTION_KEY);
-	if (send(sockfd, username, username_len, 0) == -1) {
+	if (send_chat(sockfd, username) == -1) {
 		perror("send username");
 		close(sockfd);
 		return 1;
 	}
 	
 	// Wait for server acknowledgment
-	if ((numbytes = recv(sockfd, buf, MAXDATASIZE-1, 0)) == -1) {
-		perror("recv");
+	if ((numbytes = recv_message(sockfd, buf)) < 0) {
+		if (numbytes == -1) perror("recv");
 		close(sockfd);
 		return 1;
 	}
-	buf[numbytes] = '\0';
-	xor_encrypt_decrypt(buf, numbytes, ENCRYPTION_KEY);
 	printf("%s\n", buf); 
 
+	if (sign) {
+		char key_path[512];
+		const char *home = getenv("HOME");
+		snprintf(key_path, sizeof key_path, "%s/.chat_sign_key.pem", home ? home : "/tmp");
+		EVP_PKEY *key = load_sig_key(key_path);
+		if (key == NULL || sig_register(sockfd, key) == -1) {
+			fprintf(stderr, "client: continuing without signatures\n");
+			EVP_PKEY_free(key);
+		}
+	}
+
+	// Presence from here on comes as roster updates rather than join/leave lines
+	send_frame(sockfd, FRAME_ROSTER, NULL, 0);
+
 	// Chat loop - bidirectional communication
 	fd_set master_fds, read_fds;
 	int fdmax;
@@ -154,29 +735,31 @@ int main(int argc, char *argv[])
 	
 	while(1) {
 		read_fds = master_fds;
-		if (select(fdmax + 1, &read_fds, NULL, NULL, NULL) == -1) {
+		if ((ssl != NULL && SSL_pending(ssl) > 0) || held_head != NULL) {
+			FD_ZERO(&read_fds);   // OpenSSL (or sig_register) already holds the next message
+			FD_SET(sockfd, &read_fds);
+		} else if (select(fdmax + 1, &read_fds, NULL, NULL, NULL) == -1) {
 			perror("select");
 			break;
 		}
 		
 		// Check if server sent data
 		if (FD_ISSET(sockfd, &read_fds)) {
-			numbytes = recv(sockfd, buf, MAXDATASIZE - 1, 0);
-			if (numbytes <= 0) {
-				if (numbytes == 0) {
+			numbytes = recv_message(sockfd, buf);
+			if (numbytes < 0) {
+				if (numbytes == FRAME_EOF) {
 					printf("\nServer disconnected\n");
 				} else {
 					perror("recv");
 				}
 				break;
 			}
-			buf[numbytes] = '\0';
-			
-			// Decrypt the received message
-			xor_encrypt_decrypt(buf, numbytes, ENCRYPTION_KEY);
 			
 			// Display the message (already includes timestamp and username from server)
 			printf("%s", buf);
+			if (numbytes > 0 && buf[numbytes - 1] != '\n') {
+				printf("\n");
+			}
 			fflush(stdout);
 		}
 		
@@ -184,7 +767,6 @@ int main(int argc, char *argv[])
 		if (FD_ISSET(STDIN_FILENO, &read_fds)) {
 			// User typed something
 			char plaintext[MAXDATASIZE];
-			unsigned char ciphertext[MAXDATASIZE + 16];
 			
 			if (fgets(plaintext, MAXDATASIZE, stdin) == NULL) {
 				break;
@@ -199,22 +781,27 @@ int main(int argc, char *argv[])
 				break;
 			}
 			
-			// Encrypt and send
-			int plaintext_len = strlen(plaintext);
-			int ciphertext_len = aes_encrypt((unsigned char*)plaintext, plaintext_len, ciphertext);
-			
-			if (ciphertext_len < 0) {
-				fprintf(stderr, "Encryption failed\n");
+			// The room's user list is kept here; nothing to ask the server
+			if (strcmp(plaintext, "/who") == 0) {
+				printf("%d user(s) in this room:", roster_n);
+				for (int k = 0; k < roster_n; k++) {
+					printf("%s %s", k ? "," : "", roster[k]);
+				}
+				printf("\n");
 				continue;
 			}
 			
-			if (send(sockfd, ciphertext, ciphertext_len, 0) == -1) {
+			// Encrypt and send
+			if (send_chat(sockfd, plaintext) == -1) {
 				perror("send");
 				break;
 			}
 		}
 	}
 
+	if (ssl != NULL) {
+		SSL_shutdown(ssl);
+	}
 	close(sockfd); 
 
 	return 0; 
@@ -0,0 +1,272 @@
+/* ** fanbench.c -- cost of encrypting one broadcast for N session-key users
+**
+** Every user with session keys needs the message under their own key. This
+** times one broadcast of -s bytes to N users three ways:
+**   evp     one EVP AES-256-CBC call per user (the server before multi-buffer)
+**   aesni   the server's multi-buffer path, 8 users per pass with AES-NI
+**   vaes    16 users per pass, four to an AVX-512 register
+** and prints microseconds per broadcast and how many single encryptions
+** that is worth. Build with -O2.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <immintrin.h>
+
+#define MAXDATASIZE 1024
+#define MB_LANES    16
+#define AES_SCHED   240
+#define MAX_USERS   4096
+
+enum { MODE_EVP, MODE_AESNI, MODE_VAES };
+static const char *mode_name[] = { "evp", "aesni", "vaes" };
+
+unsigned char keys[MAX_USERS][32], sched[MAX_USERS][AES_SCHED];
+unsigned char out[MAX_USERS][16 + MAXDATASIZE + 16];
+
+double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Random IV in front of the ciphertext - same as server.c
+int aes_encrypt_with_random_iv(const unsigned char *key, const unsigned char *plaintext, int plaintext_len,
+                               unsigned char *output) {
+    int len, ciphertext_len = -1;
+
+    if (RAND_bytes(output, 16) != 1)
+        return -1;
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL)
+        return -1;
+    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, output) == 1 &&
+        EVP_EncryptUpdate(ctx, output + 16, &len, plaintext, plaintext_len) == 1) {
+        ciphertext_len = len;
+        if (EVP_EncryptFinal_ex(ctx, output + 16 + len, &len) == 1)
+            ciphertext_len += len;
+        else
+            ciphertext_len = -1;
+    }
+    EVP_CIPHER_CTX_free(ctx);
+    return ciphertext_len < 0 ? -1 : ciphertext_len + 16;
+}
+
+// --- Multi-buffer AES-256-CBC, same as server.c ---
+
+__attribute__((target("aes,sse2")))
+static inline __m128i ks_mix(__m128i k, __m128i t) {
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    return _mm_xor_si128(k, t);
+}
+
+__attribute__((target("aes,sse2")))
+void aes256_schedule(const unsigned char *key, unsigned char *ks) {
+    __m128i k0 = _mm_loadu_si128((const __m128i *)key);
+    __m128i k1 = _mm_loadu_si128((const __m128i *)(key + 16));
+    __m128i *rk = (__m128i *)ks;
+
+    _mm_storeu_si128(rk, k0);
+    _mm_storeu_si128(rk + 1, k1);
+#define KS_ROUND(i, rcon) \
+    k0 = ks_mix(k0, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k1, rcon), 0xff)); \
+    _mm_storeu_si128(rk + i, k0); \
+    if (i < 14) { \
+        k1 = ks_mix(k1, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k0, 0), 0xaa)); \
+        _mm_storeu_si128(rk + i + 1, k1); \
+    }
+    KS_ROUND(2, 0x01) KS_ROUND(4, 0x02) KS_ROUND(6, 0x04) KS_ROUND(8, 0x08)
+    KS_ROUND(10, 0x10) KS_ROUND(12, 0x20) KS_ROUND(14, 0x40)
+#undef KS_ROUND
+}
+
+__attribute__((target("aes,sse2")))
+void cbc_aesni_x8(const unsigned char *plain, int nblocks, unsigned char *const ks[8],
+                  unsigned char *const out[8]) {
+    __m128i x[8];
+
+#pragma GCC unroll 8
+    for (int l = 0; l < 8; l++)
+        x[l] = _mm_loadu_si128((const __m128i *)out[l]);
+    for (int b = 0; b < nblocks; b++) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(plain + 16 * b));
+#pragma GCC unroll 8
+        for (int l = 0; l < 8; l++)
+            x[l] = _mm_xor_si128(_mm_xor_si128(x[l], p), _mm_loadu_si128((const __m128i *)ks[l]));
+        for (int r = 1; r < 14; r++) {
+#pragma GCC unroll 8
+            for (int l = 0; l < 8; l++)
+                x[l] = _mm_aesenc_si128(x[l], _mm_loadu_si128((const __m128i *)(ks[l] + 16 * r)));
+        }
+#pragma GCC unroll 8
+        for (int l = 0; l < 8; l++) {
+            x[l] = _mm_aesenclast_si128(x[l], _mm_loadu_si128((const __m128i *)(ks[l] + 224)));
+            _mm_storeu_si128((__m128i *)(out[l] + 16 + 16 * b), x[l]);
+        }
+    }
+}
+
+__attribute__((target("avx512f")))
+static inline __m512i lanes4(const unsigned char *a, const unsigned char *b,
+                             const unsigned char *c, const unsigned char *d) {
+    __m512i v = _mm512_castsi128_si512(_mm_loadu_si128((const __m128i *)a));
+    v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *)b), 1);
+    v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *)c), 2);
+    return _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *)d), 3);
+}
+
+__attribute__((target("vaes,avx512f")))
+void cbc_vaes_x16(const unsigned char *plain, int nblocks, unsigned char *const ks[16],
+                  unsigned char *const out[16]) {
+    __m512i rk[4][15], x[4];
+
+    for (int g = 0; g < 4; g++) {
+        unsigned char *const *k = ks + 4 * g, *const *o = out + 4 * g;
+        for (int r = 0; r < 15; r++)
+            rk[g][r] = lanes4(k[0] + 16 * r, k[1] + 16 * r, k[2] + 16 * r, k[3] + 16 * r);
+        x[g] = lanes4(o[0], o[1], o[2], o[3]);
+    }
+    for (int b = 0; b < nblocks; b++) {
+        __m512i p = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)(plain + 16 * b)));
+#pragma GCC unroll 4
+        for (int g = 0; g < 4; g++)
+            x[g] = _mm512_xor_si512(_mm512_xor_si512(x[g], p), rk[g][0]);
+        for (int r = 1; r < 14; r++) {
+#pragma GCC unroll 4
+            for (int g = 0; g < 4; g++)
+                x[g] = _mm512_aesenc_epi128(x[g], rk[g][r]);
+        }
+#pragma GCC unroll 4
+        for (int g = 0; g < 4; g++) {
+            unsigned char *const *o = out + 4 * g;
+            int off = 16 + 16 * b;
+            x[g] = _mm512_aesenclast_epi128(x[g], rk[g][14]);
+            _mm_storeu_si128((__m128i *)(o[0] + off), _mm512_extracti32x4_epi32(x[g], 0));
+            _mm_storeu_si128((__m128i *)(o[1] + off), _mm512_extracti32x4_epi32(x[g], 1));
+            _mm_storeu_si128((__m128i *)(o[2] + off), _mm512_extracti32x4_epi32(x[g], 2));
+            _mm_storeu_si128((__m128i *)(o[3] + off), _mm512_extracti32x4_epi32(x[g], 3));
+        }
+    }
+}
+
+// One broadcast of plain[0..len) to n users
+void broadcast(int mode, const unsigned char *msg, int len, int n) {
+	unsigned char plain[MAXDATASIZE + 16], iv[MB_LANES * 16], scratch[16 + MAXDATASIZE + 16] = { 0 };
+	int pad = 16 - len % 16, nblocks = (len + pad) / 16;
+
+	if (mode == MODE_EVP) {
+		for (int u = 0; u < n; u++) {
+			if (aes_encrypt_with_random_iv(keys[u], msg, len, out[u]) < 0) {
+				fprintf(stderr, "fanbench: encrypt failed\n");
+				exit(1);
+			}
+		}
+		return;
+	}
+	memcpy(plain, msg, len);
+	memset(plain + len, pad, pad);
+	int width = mode == MODE_VAES ? 16 : 8;
+	for (int u = 0; u < n; u += width) {
+		unsigned char *k[MB_LANES], *o[MB_LANES];
+		RAND_bytes(iv, 16 * width);
+		for (int l = 0; l < width; l++) {
+			k[l] = sched[u + l < n ? u + l : u];
+			o[l] = u + l < n ? out[u + l] : scratch;
+			memcpy(o[l], iv + 16 * l, 16);
+		}
+		if (mode == MODE_VAES) cbc_vaes_x16(plain, nblocks, k, o); else cbc_aesni_x8(plain, nblocks, k, o);
+	}
+}
+
+// The multi-buffer output must decrypt with EVP under each user's key
+void check(int mode, const unsigned char *msg, int len, int n) {
+	unsigned char dec[MAXDATASIZE + 32];
+	int pad = 16 - len % 16;
+
+	broadcast(mode, msg, len, n);
+	for (int u = 0; u < n; u++) {
+		int l1, l2;
+		EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+		int ok = EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, keys[u], out[u]) == 1 &&
+			EVP_DecryptUpdate(ctx, dec, &l1, out[u] + 16, len + pad) == 1 &&
+			EVP_DecryptFinal_ex(ctx, dec + l1, &l2) == 1 && l1 + l2 == len && memcmp(dec, msg, len) == 0;
+		EVP_CIPHER_CTX_free(ctx);
+		if (!ok) {
+			fprintf(stderr, "fanbench: %s output for user %d does not decrypt\n", mode_name[mode], u);
+			exit(1);
+		}
+	}
+}
+
+double measure(int mode, const unsigned char *msg, int len, int n, double secs) {
+	long rounds = 0;
+	double start = now_sec(), end = start + secs, t;
+
+	do {
+		broadcast(mode, msg, len, n);
+		rounds++;
+	} while ((t = now_sec()) < end);
+	return (t - start) / rounds * 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+	static const int users[] = { 1, 4, 8, 16, 64, 256, 1000 };
+	unsigned char msg[MAXDATASIZE];
+	int opt, size = 100, only = -1;
+	double secs = 0.5;
+
+	while ((opt = getopt(argc, argv, "s:n:d:")) != -1) {
+		switch (opt) {
+		case 's': size = atoi(optarg); break;
+		case 'n': only = atoi(optarg); break;
+		case 'd': secs = atof(optarg); break;
+		default:
+			fprintf(stderr, "usage: fanbench [-s size] [-n users] [-d seconds per point]\n");
+			exit(1);
+		}
+	}
+	if (size < 1 || size > MAXDATASIZE || only == 0 || only > MAX_USERS) {
+		fprintf(stderr, "fanbench: -s is 1..%d, -n 1..%d\n", MAXDATASIZE, MAX_USERS);
+		exit(1);
+	}
+
+	__builtin_cpu_init();
+	int modes = __builtin_cpu_supports("aes") ?
+		(__builtin_cpu_supports("vaes") && __builtin_cpu_supports("avx512f") ? 3 : 2) : 1;
+	if (modes < 3) {
+		printf("%s\n", modes == 1 ? "no AES-NI: EVP only" : "no VAES: skipping vaes");
+	}
+	RAND_bytes(&keys[0][0], sizeof keys);
+	RAND_bytes(msg, sizeof msg);
+	for (int u = 0; u < MAX_USERS && modes > 1; u++) {
+		aes256_schedule(keys[u], sched[u]);
+	}
+	for (int m = MODE_AESNI; m < modes; m++) {
+		check(m, msg, size, 37);
+	}
+
+	double one = measure(MODE_EVP, msg, size, 1, secs);
+	printf("%d-byte message; one EVP encryption %.2f us\n", size, one);
+	printf("%6s", "users");
+	for (int m = 0; m < modes; m++) printf("  %9s us  (x one)", mode_name[m]);
+	printf("\n");
+	for (unsigned i = 0; i < sizeof users / sizeof users[0]; i++) {
+		int n = only > 0 ? only : users[i];
+		printf("%6d", n);
+		for (int m = 0; m < modes; m++) {
+			double us = measure(m, msg, size, n, secs);
+			printf("  %12.2f  (%6.1f)", us, us / one);
+		}
+		printf("\n");
+		if (only > 0) break;
+	}
+	return 0;
+}
@@ -0,0 +1,367 @@
+/* ** filterbench.c -- per-message cost of the server's content filter (-F)
+**
+** Compiles term lists of 10 to 20,000 made-up words (plus the usual link
+** prefixes) into the server's Aho-Corasick automaton and runs it over chat
+** sized messages of ordinary English, the way broadcast_message does: copy
+** the text, then mask it in place. Prints nanoseconds per message for the
+** copy alone and for copy + filter, with the SSSE3 skip and without it.
+** -f runs a real list instead of the made-up ones. Build with -O2.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#define MAXDATASIZE     1024
+#define MESSAGES        256        // distinct messages cycled through
+#define FILTER_MASK     '*'
+#define FILTER_TERM_MAX 255
+#define FILTER_DFA_MAX  (1 << 26)
+#define FILTER_SPARSE   16
+#define FILTER_WORD     0x100
+#define FILTER_HIT      0x80000000u
+
+// Filler for the messages: common words, none of them a term
+static const char *english[] = {
+	"the", "be", "to", "of", "and", "a", "in", "that", "have", "it", "for", "not", "on",
+	"with", "he", "as", "you", "do", "at", "this", "but", "his", "by", "from", "they",
+	"we", "say", "her", "she", "or", "an", "will", "my", "one", "all", "would", "there",
+	"their", "what", "so", "up", "out", "if", "about", "who", "get", "which", "go", "me",
+	"when", "make", "can", "like", "time", "no", "just", "him", "know", "take", "people",
+	"into", "year", "your", "good", "some", "could", "them", "see", "other", "than",
+	"then", "now", "look", "only", "come", "its", "over", "think", "also", "back",
+	"after", "use", "two", "how", "our", "work", "first", "well", "way", "even", "new",
+	"want", "because", "any", "these", "give", "day", "most", "us", "lol", "ok", "thanks",
+};
+
+typedef struct {
+	uint8_t cls[256];
+	int nclass;
+	int nstates;
+	int terms;
+	uint32_t *next;
+	uint16_t *out;
+	uint8_t lead[32];
+	int sparse;
+	uint8_t lead_low[16];
+	uint8_t lead_high[16];
+} filter_t;
+
+int filter_ssse3 = 0;
+
+double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void filter_free(filter_t *f) {
+	if (f == NULL) return;
+	free(f->next);
+	free(f->out);
+	free(f);
+}
+
+// Compile folded terms - same automaton as filter_load() in server.c
+filter_t *filter_build(char **terms, int n) {
+	size_t bytes = 0;
+	filter_t *f = calloc(1, sizeof *f);
+	f->terms = n;
+	f->nclass = 1;
+	for (int t = 0; t < n; t++) {
+		bytes += strlen(terms[t]);
+		for (unsigned char *p = (unsigned char *)terms[t]; *p != '\0'; p++) {
+			if (f->cls[*p] == 0) f->cls[*p] = f->nclass++;
+		}
+	}
+	for (int c = 'A'; c <= 'Z'; c++) f->cls[c] = f->cls[c + 'a' - 'A'];
+
+	size_t states = bytes + 1;
+	if (states * f->nclass > FILTER_DFA_MAX) {
+		fprintf(stderr, "filterbench: %d terms need %zu x %d transitions, over %d\n", n, states, f->nclass, FILTER_DFA_MAX);
+		filter_free(f);
+		return NULL;
+	}
+	f->next = calloc(states * f->nclass, sizeof *f->next);
+	f->out = calloc(states, sizeof *f->out);
+	uint32_t *fail = calloc(states, sizeof *fail);
+	uint32_t *queue = calloc(states, sizeof *queue);
+
+	f->nstates = 1;
+	for (int t = 0; t < n; t++) {
+		int tlen = strlen(terms[t]), word = 0;
+		if (tlen > 1 && terms[t][tlen - 1] == '*') {
+			tlen--;
+			word = FILTER_WORD;
+		}
+		uint32_t s = 0;
+		for (int k = 0; k < tlen; k++) {
+			uint32_t *e = &f->next[s * f->nclass + f->cls[(unsigned char)terms[t][k]]];
+			if (*e == 0) *e = f->nstates++;
+			s = *e;
+		}
+		f->out[s] = tlen | word;
+	}
+
+	int head = 0, tail = 0;
+	for (int c = 0; c < f->nclass; c++) {
+		if (f->next[c] != 0) queue[tail++] = f->next[c];
+	}
+	while (head < tail) {
+		uint32_t s = queue[head++];
+		if (f->out[s] == 0) f->out[s] = f->out[fail[s]];
+		for (int c = 0; c < f->nclass; c++) {
+			uint32_t *e = &f->next[s * f->nclass + c];
+			if (*e != 0) {
+				fail[*e] = f->next[fail[s] * f->nclass + c];
+				queue[tail++] = *e;
+			} else {
+				*e = f->next[fail[s] * f->nclass + c];
+			}
+		}
+	}
+	free(fail);
+	free(queue);
+
+	for (size_t e = 0; e < (size_t)f->nstates * f->nclass; e++) {
+		uint32_t t = f->next[e];
+		f->next[e] = t * f->nclass | (f->out[t] != 0 ? FILTER_HIT : 0);
+	}
+	for (int b = 0; b < 256; b++) {
+		if (f->next[f->cls[b]] == 0) continue;
+		f->lead[b >> 3] |= 1 << (b & 7);
+		f->sparse++;
+		if (b < 0x80) f->lead_low[b & 15] |= 1 << (b >> 4);
+		else f->lead_high[b & 15] |= 1 << ((b >> 4) - 8);
+	}
+	f->sparse = f->sparse <= FILTER_SPARSE;
+	return f;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("ssse3")))
+int filter_skip_ssse3(const filter_t *f, const unsigned char *p, int i, int len) {
+	const __m128i low = _mm_loadu_si128((const __m128i *)f->lead_low);
+	const __m128i high = _mm_loadu_si128((const __m128i *)f->lead_high);
+	const __m128i bit = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+	const __m128i nibble = _mm_set1_epi8(0x0f), seven = _mm_set1_epi8(7);
+
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i lo = _mm_and_si128(v, nibble);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+		__m128i top = _mm_cmpgt_epi8(hi, seven);
+		__m128i row = _mm_or_si128(_mm_andnot_si128(top, _mm_shuffle_epi8(low, lo)),
+			_mm_and_si128(top, _mm_shuffle_epi8(high, lo)));
+		__m128i hit = _mm_and_si128(row, _mm_shuffle_epi8(bit, hi));
+		int miss = _mm_movemask_epi8(_mm_cmpeq_epi8(hit, _mm_setzero_si128()));
+		if (miss != 0xffff) return i + __builtin_ctz(~miss);
+	}
+	while (i < len && !(f->lead[p[i] >> 3] & (1 << (p[i] & 7)))) i++;
+	return i;
+}
+#endif
+
+int filter_skip(const filter_t *f, const unsigned char *p, int i, int len) {
+#if defined(__x86_64__)
+	if (filter_ssse3) return filter_skip_ssse3(f, p, i, len);
+#endif
+	while (i < len && !(f->lead[p[i] >> 3] & (1 << (p[i] & 7)))) i++;
+	return i;
+}
+
+// Same as server.c
+int filter_apply(const filter_t *f, char *text, int len) {
+	const unsigned char *p = (const unsigned char *)text;
+	const uint32_t *next = f->next;
+	const uint8_t *cls = f->cls;
+	const uint32_t skip_from = f->sparse ? 0 : FILTER_HIT;   // a row the scan never enters: no skipping
+	uint32_t s = 0;
+	int hits = 0;
+
+	for (int i = 0; i < len; i++) {
+		if (s == skip_from && !(f->lead[p[i] >> 3] & (1 << (p[i] & 7)))) {
+			i = filter_skip(f, p, i + 1, len);
+			if (i == len) break;
+		}
+		uint32_t e = next[s + cls[p[i]]];
+		s = e & ~FILTER_HIT;
+		if (!(e & FILTER_HIT)) continue;
+		int out = f->out[s / f->nclass];
+		int tlen = out & 0xff;
+		memset(text + i + 1 - tlen, FILTER_MASK, tlen);
+		hits++;
+		if (out & FILTER_WORD) {
+			while (i + 1 < len && text[i + 1] != ' ' && text[i + 1] != '\t' && text[i + 1] != '\n') {
+				text[++i] = FILTER_MASK;
+			}
+			s = 0;
+		}
+	}
+	return hits;
+}
+
+// n made-up lower-case words of 4-10 letters, after the link prefixes
+char **make_terms(int n) {
+	static const char *links[] = { "http://*", "https://*", "www.*" };
+	char **terms = malloc(n * sizeof *terms);
+	for (int t = 0; t < n; t++) {
+		if (t < 3) {
+			terms[t] = strdup(links[t]);
+			continue;
+		}
+		int len = 4 + rand() % 7;
+		terms[t] = malloc(len + 1);
+		for (int k = 0; k < len; k++) terms[t][k] = 'a' + rand() % 26;
+		terms[t][len] = '\0';
+	}
+	return terms;
+}
+
+char **read_terms(const char *path, int *n) {
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		perror(path);
+		exit(1);
+	}
+	char **terms = NULL, *line = NULL;
+	size_t cap = 0;
+	int max = 0;
+	ssize_t len;
+	*n = 0;
+	while ((len = getline(&line, &cap, fp)) != -1) {
+		len = strcspn(line, "\r\n");
+		if (len == 0 || line[0] == '#' || len - (len > 1 && line[len - 1] == '*') > FILTER_TERM_MAX) continue;
+		if (*n == max) {
+			max = max ? max * 2 : 256;
+			terms = realloc(terms, max * sizeof *terms);
+		}
+		for (ssize_t k = 0; k < len; k++) {
+			if (line[k] >= 'A' && line[k] <= 'Z') line[k] += 'a' - 'A';
+		}
+		terms[(*n)++] = strndup(line, len);
+	}
+	free(line);
+	fclose(fp);
+	return terms;
+}
+
+// English of about size bytes; one message in ten carries a term or a link
+void make_messages(char msgs[][MAXDATASIZE], int *lens, int size, char **terms, int nterms) {
+	for (int m = 0; m < MESSAGES; m++) {
+		int len = 0;
+		while (len < size) {
+			const char *w = english[rand() % (sizeof english / sizeof english[0])];
+			len += snprintf(msgs[m] + len, MAXDATASIZE - len, "%s%s", len ? " " : "", w);
+		}
+		if (m % 10 == 0 && nterms > 0) {
+			const char *t = terms[rand() % nterms];
+			int at = rand() % len;
+			int tlen = strcspn(t, "*");
+			if (at + tlen < MAXDATASIZE) memcpy(msgs[m] + at, t, tlen);
+		}
+		lens[m] = len < size ? len : size;
+	}
+}
+
+// ns per message: copy into the broadcast buffer, and filter it unless f is NULL
+double measure(const filter_t *f, char msgs[][MAXDATASIZE], const int *lens, double secs, long *hits) {
+	char clean[MAXDATASIZE];
+	long rounds = 0;
+	double start = now_sec(), end = start + secs, t;
+
+	*hits = 0;
+	do {
+		for (int m = 0; m < MESSAGES; m++) {
+			memcpy(clean, msgs[m], lens[m]);
+			if (f != NULL) *hits += filter_apply(f, clean, lens[m]);
+			__asm__ volatile("" : : "r"(clean) : "memory");
+		}
+		rounds++;
+	} while ((t = now_sec()) < end);
+	*hits /= rounds;
+	return (t - start) / ((double)rounds * MESSAGES) * 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	static const int sizes[] = { 3, 10, 100, 1000, 5000, 20000 };
+	static char msgs[MESSAGES][MAXDATASIZE];
+	int lens[MESSAGES];
+	int opt, size = 120;
+	double secs = 0.5;
+	const char *path = NULL;
+
+	while ((opt = getopt(argc, argv, "s:d:f:")) != -1) {
+		switch (opt) {
+		case 's': size = atoi(optarg); break;
+		case 'd': secs = atof(optarg); break;
+		case 'f': path = optarg; break;
+		default:
+			fprintf(stderr, "usage: filterbench [-s message-size] [-d seconds per point] [-f filter-list]\n");
+			exit(1);
+		}
+	}
+	if (size < 1 || size > MAXDATASIZE - 16) {
+		fprintf(stderr, "filterbench: -s is 1..%d\n", MAXDATASIZE - 16);
+		exit(1);
+	}
+
+	int simd = 0;
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	simd = __builtin_cpu_supports("ssse3");
+#endif
+	if (!simd) printf("no SSSE3: scalar skip only\n");
+
+	long hits;
+	srand(1);
+	make_messages(msgs, lens, size, NULL, 0);
+	double copy = measure(NULL, msgs, lens, secs, &hits);
+	printf("%d-byte messages; copy alone %.1f ns\n", size, copy);
+	printf("%6s %8s %9s  %12s %12s  %10s\n", "terms", "states", "table KB", "scalar ns", "ssse3 ns", "hits/256");
+
+	int points = path != NULL ? 1 : sizeof sizes / sizeof sizes[0];
+	for (int i = 0; i < points; i++) {
+		int n = path != NULL ? 0 : sizes[i];
+		char **terms = path != NULL ? read_terms(path, &n) : make_terms(n);
+		filter_t *f = filter_build(terms, n);
+		if (f == NULL) exit(1);
+		make_messages(msgs, lens, size, terms, n);
+
+		// Both skips must mask the same bytes
+		for (int m = 0; m < MESSAGES && simd; m++) {
+			char a[MAXDATASIZE], b[MAXDATASIZE];
+			memcpy(a, msgs[m], lens[m]);
+			memcpy(b, msgs[m], lens[m]);
+			filter_ssse3 = 0;
+			filter_apply(f, a, lens[m]);
+			filter_ssse3 = 1;
+			filter_apply(f, b, lens[m]);
+			if (memcmp(a, b, lens[m]) != 0) {
+				fprintf(stderr, "filterbench: SSSE3 and scalar disagree on message %d\n", m);
+				exit(1);
+			}
+		}
+
+		filter_ssse3 = 0;
+		double scalar = measure(f, msgs, lens, secs, &hits);
+		double vec = scalar;
+		if (simd) {
+			filter_ssse3 = 1;
+			vec = measure(f, msgs, lens, secs, &hits);
+		}
+		printf("%6d %8d %9zu  %12.1f %12.1f  %10ld\n", n, f->nstates, (size_t)f->nstates * f->nclass * 4 / 1024,
+			scalar, vec, hits);
+		for (int t = 0; t < n; t++) free(terms[t]);
+		free(terms);
+		filter_free(f);
+	}
+	return 0;
+}
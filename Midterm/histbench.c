@@ -0,0 +1,425 @@
+/* ** histbench.c -- /search over the server's message history index (-L)
+**
+** Makes up -n chat messages (default two million) over -r rooms, words drawn
+** with Zipf's law from a common-English head and a long made-up tail, and
+** indexes them the way the server's indexer thread does: postings per
+** (room, word), varint gaps in blocks of 128. Prints how fast that goes and
+** what the index costs, then times a set of searches in one room against the
+** naive way, tokenizing the room's messages newest first until 20 match.
+** Reading the hits back from the log is not included (20 preads).
+** Build with -O2.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#define ROOM_LEN       32
+#define HIST_BLOCK     128
+#define HIST_WORD_MAX  32
+#define HIST_KEY       (ROOM_LEN + HIST_WORD_MAX)
+#define HIST_TERMS     8
+#define HIST_RESULTS   20
+#define TAIL_WORDS     50000      // made-up words after the English ones
+#define REPEAT         50         // runs of each search; the median counts
+
+static const char *english[] = {
+	"the", "be", "to", "of", "and", "a", "in", "that", "have", "it", "for", "not", "on",
+	"with", "he", "as", "you", "do", "at", "this", "but", "his", "by", "from", "they",
+	"we", "say", "her", "she", "or", "an", "will", "my", "one", "all", "would", "there",
+	"their", "what", "so", "up", "out", "if", "about", "who", "get", "which", "go", "me",
+	"when", "make", "can", "like", "time", "no", "just", "him", "know", "take", "people",
+	"into", "year", "your", "good", "some", "could", "them", "see", "other", "than",
+	"then", "now", "look", "only", "come", "its", "over", "think", "also", "back",
+	"after", "use", "two", "how", "our", "work", "first", "well", "way", "even", "new",
+	"want", "because", "any", "these", "give", "day", "most", "us", "lol", "ok", "thanks",
+};
+#define ENGLISH ((int)(sizeof english / sizeof english[0]))
+
+typedef struct {
+	uint32_t first;
+	uint32_t start;
+} hist_block_t;
+
+typedef struct {
+	char key[HIST_KEY];
+	uint8_t klen;
+	uint32_t hash;
+	uint32_t count;
+	uint32_t last;
+	uint32_t nblocks;
+	hist_block_t *blocks;
+	unsigned char *data;
+	uint32_t dlen, dcap;
+} hist_term_t;
+
+typedef struct {
+	const hist_term_t *t;
+	int block, n;
+	uint32_t ids[HIST_BLOCK];
+} hist_cursor_t;
+
+static uint32_t *hist_slots;
+static uint32_t hist_scap;
+static hist_term_t *hist_terms;
+static uint32_t hist_tcount, hist_tcap;
+
+double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+uint64_t rng = 88172645463325252ull;
+
+uint64_t xorshift(void) {
+	rng ^= rng << 13;
+	rng ^= rng >> 7;
+	rng ^= rng << 17;
+	return rng;
+}
+
+void *hist_alloc(void *p, size_t n) {
+	if ((p = realloc(p, n)) == NULL) {
+		fprintf(stderr, "histbench: out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+// The index, as in server.c
+
+int hist_wordch(unsigned char c) {
+	return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') || c >= 0x80;
+}
+
+int hist_word(const char *s, int len, int *pos, char *w) {
+	int i = *pos, n = 0;
+
+	while (i < len && !hist_wordch(s[i])) i++;
+	for (; i < len && hist_wordch(s[i]); i++) {
+		unsigned char ch = s[i];
+		if (n < HIST_WORD_MAX) w[n++] = ch >= 'A' && ch <= 'Z' ? ch + 32 : ch;
+	}
+	*pos = i;
+	return n;
+}
+
+void hist_grow(void) {
+	uint32_t cap = hist_scap ? 2 * hist_scap : 1 << 16;
+	uint32_t *slots = calloc(cap, sizeof *slots);
+
+	if (slots == NULL) {
+		fprintf(stderr, "histbench: out of memory\n");
+		exit(1);
+	}
+	for (uint32_t k = 0; k < hist_tcount; k++) {
+		uint32_t j = hist_terms[k].hash & (cap - 1);
+		while (slots[j] != 0) j = (j + 1) & (cap - 1);
+		slots[j] = k + 1;
+	}
+	free(hist_slots);
+	hist_slots = slots;
+	hist_scap = cap;
+}
+
+hist_term_t *hist_term(const char *room, int rlen, const char *w, int wn, int create) {
+	char key[HIST_KEY];
+
+	if (rlen > ROOM_LEN - 1) rlen = ROOM_LEN - 1;
+	memcpy(key, room, rlen);
+	key[rlen] = '\0';
+	memcpy(key + rlen + 1, w, wn);
+	int klen = rlen + 1 + wn;
+	uint32_t h = 2166136261u;
+	for (int i = 0; i < klen; i++) h = (h ^ (unsigned char)key[i]) * 16777619u;
+
+	if (create && 2 * (hist_tcount + 1) > hist_scap) hist_grow();
+	if (hist_scap == 0) return NULL;
+	for (uint32_t i = h & (hist_scap - 1);; i = (i + 1) & (hist_scap - 1)) {
+		if (hist_slots[i] == 0) {
+			if (!create) return NULL;
+			if (hist_tcount == hist_tcap) {
+				hist_tcap = hist_tcap ? 2 * hist_tcap : 1 << 16;
+				hist_terms = hist_alloc(hist_terms, hist_tcap * sizeof *hist_terms);
+			}
+			hist_term_t *t = &hist_terms[hist_tcount++];
+			memset(t, 0, sizeof *t);
+			memcpy(t->key, key, klen);
+			t->klen = klen;
+			t->hash = h;
+			hist_slots[i] = hist_tcount;
+			return t;
+		}
+		hist_term_t *t = &hist_terms[hist_slots[i] - 1];
+		if (t->hash == h && t->klen == klen && memcmp(t->key, key, klen) == 0) return t;
+	}
+}
+
+void hist_post(hist_term_t *t, uint32_t id) {
+	if (t->count > 0 && t->last == id) return;
+	if (t->count % HIST_BLOCK == 0) {
+		if ((t->nblocks & (t->nblocks - 1)) == 0) {
+			t->blocks = hist_alloc(t->blocks, (t->nblocks ? 2 * t->nblocks : 1) * sizeof *t->blocks);
+		}
+		t->blocks[t->nblocks].first = id;
+		t->blocks[t->nblocks++].start = t->dlen;
+	} else {
+		if (t->dlen + 5 > t->dcap) {
+			t->dcap = t->dcap ? 2 * t->dcap : 16;
+			t->data = hist_alloc(t->data, t->dcap);
+		}
+		uint32_t gap = id - t->last;
+		while (gap >= 0x80) {
+			t->data[t->dlen++] = gap | 0x80;
+			gap >>= 7;
+		}
+		t->data[t->dlen++] = gap;
+	}
+	t->last = id;
+	t->count++;
+}
+
+int hist_decode(const hist_term_t *t, uint32_t b, uint32_t *ids) {
+	uint32_t p = t->blocks[b].start, end = b + 1 < t->nblocks ? t->blocks[b + 1].start : t->dlen;
+	uint32_t id = t->blocks[b].first;
+	int n = 0;
+
+	ids[n++] = id;
+	while (p < end) {
+		uint32_t gap = 0;
+		for (int shift = 0;; shift += 7) {
+			gap |= (uint32_t)(t->data[p] & 0x7f) << shift;
+			if (!(t->data[p++] & 0x80)) break;
+		}
+		id += gap;
+		ids[n++] = id;
+	}
+	return n;
+}
+
+int64_t hist_seek(hist_cursor_t *c, uint32_t want) {
+	const hist_term_t *t = c->t;
+
+	if (c->block < 0 || want < c->ids[0]) {
+		int lo = 0, hi = (c->block < 0 ? (int)t->nblocks : c->block) - 1;
+		if (hi < 0 || t->blocks[0].first > want) return -1;
+		while (lo < hi) {
+			int mid = (lo + hi + 1) / 2;
+			if (t->blocks[mid].first <= want) lo = mid; else hi = mid - 1;
+		}
+		c->block = lo;
+		c->n = hist_decode(t, lo, c->ids);
+	}
+	int lo = 0, hi = c->n - 1;
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (c->ids[mid] <= want) lo = mid; else hi = mid - 1;
+	}
+	return c->ids[lo];
+}
+
+int hist_match(hist_cursor_t *c, int nt, uint32_t *hits) {
+	int64_t want = UINT32_MAX;
+	int nh = 0, agree = 0;
+
+	for (int k = 0; nh < HIST_RESULTS; k = (k + 1) % nt) {
+		int64_t id = hist_seek(&c[k], want);
+		if (id < 0) break;
+		if (id == want) {
+			agree++;
+		} else {
+			want = id;
+			agree = 1;
+		}
+		if (agree == nt) {
+			hits[nh++] = want;
+			if (want == 0) break;
+			want--;
+			agree = 0;
+		}
+	}
+	return nh;
+}
+
+// The server's search, less the reply
+int search(const char *room, const char *q, uint32_t *hits) {
+	hist_cursor_t cur[HIST_TERMS];
+	char w[HIST_WORD_MAX];
+	int nt = 0, pos = 0, wn, rlen = strlen(room);
+
+	while (nt < HIST_TERMS && (wn = hist_word(q, strlen(q), &pos, w)) > 0) {
+		hist_term_t *t = hist_term(room, rlen, w, wn, 0);
+		if (t == NULL) return 0;
+		int k = nt, dup = 0;
+		for (int j = 0; j < nt; j++) dup |= cur[j].t == t;
+		if (dup) continue;
+		while (k > 0 && cur[k - 1].t->count > t->count) {
+			cur[k].t = cur[k - 1].t;
+			k--;
+		}
+		cur[k].t = t;
+		nt++;
+	}
+	for (int k = 0; k < nt; k++) cur[k].block = -1;
+	return nt > 0 ? hist_match(cur, nt, hits) : 0;
+}
+
+// The made-up traffic: message i is text + off[i], in room[i]
+char *text;
+uint64_t *off;
+uint8_t *room_of;
+char rooms[256][ROOM_LEN];
+
+// Without an index: every message in the room, newest first, split into
+// words and checked for all of the query's
+int scan(int r, const char *q, uint32_t n, uint32_t *hits) {
+	char qw[HIST_TERMS][HIST_WORD_MAX], w[HIST_WORD_MAX];
+	int ql[HIST_TERMS], nq = 0, pos = 0, wn, nh = 0;
+
+	while (nq < HIST_TERMS && (wn = hist_word(q, strlen(q), &pos, qw[nq])) > 0) ql[nq++] = wn;
+	for (int64_t i = (int64_t)n - 1; i >= 0 && nh < HIST_RESULTS; i--) {
+		if (room_of[i] != r) continue;
+		const char *s = text + off[i];
+		int len = off[i + 1] - off[i], seen = 0;
+		pos = 0;
+		while ((wn = hist_word(s, len, &pos, w)) > 0) {
+			for (int k = 0; k < nq; k++) {
+				if (wn == ql[k] && memcmp(w, qw[k], wn) == 0) seen |= 1 << k;
+			}
+		}
+		if (seen == (1 << nq) - 1) hits[nh++] = i;
+	}
+	return nh;
+}
+
+int cmp_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]) {
+	uint32_t n = 2000000;
+	int nrooms = 8, opt;
+
+	while ((opt = getopt(argc, argv, "n:r:")) != -1) {
+		switch (opt) {
+		case 'n':
+			n = strtoul(optarg, NULL, 10);
+			break;
+		case 'r':
+			nrooms = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: histbench [-n messages] [-r rooms]\n");
+			exit(1);
+		}
+	}
+	if (n == 0 || nrooms < 1 || nrooms > 256) {
+		fprintf(stderr, "usage: histbench [-n messages] [-r rooms]\n");
+		exit(1);
+	}
+	for (int r = 0; r < nrooms; r++) snprintf(rooms[r], ROOM_LEN, r == 0 ? "lobby" : "room%d", r);
+
+	// Vocabulary by rank, and Zipf's law over it
+	int nvocab = ENGLISH + TAIL_WORDS;
+	char (*vocab)[12] = malloc(nvocab * sizeof *vocab);
+	double *cdf = malloc(nvocab * sizeof *cdf), sum = 0;
+	for (int v = 0; v < nvocab; v++) {
+		if (v < ENGLISH) snprintf(vocab[v], sizeof vocab[v], "%s", english[v]);
+		else snprintf(vocab[v], sizeof vocab[v], "w%05d", v - ENGLISH);
+		cdf[v] = sum += 1.0 / (v + 1);
+	}
+
+	printf("making %u messages in %d room(s)...\n", n, nrooms);
+	uint64_t cap = (uint64_t)n * 64;
+	text = malloc(cap);
+	off = malloc((n + 1) * sizeof *off);
+	room_of = malloc(n);
+	if (vocab == NULL || cdf == NULL || text == NULL || off == NULL || room_of == NULL) {
+		fprintf(stderr, "histbench: out of memory\n");
+		exit(1);
+	}
+	uint64_t len = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		off[i] = len;
+		room_of[i] = xorshift() % nrooms;
+		int words = 4 + xorshift() % 11;
+		for (int k = 0; k < words; k++) {
+			double u = (xorshift() >> 11) * (sum / 9007199254740992.0);
+			int lo = 0, hi = nvocab - 1;
+			while (lo < hi) {
+				int mid = (lo + hi) / 2;
+				if (cdf[mid] < u) lo = mid + 1; else hi = mid;
+			}
+			if (len + 16 > cap) text = hist_alloc(text, cap *= 2);
+			len += sprintf(text + len, k ? " %s" : "%s", vocab[lo]);
+		}
+	}
+	off[n] = len;
+
+	double t0 = now_sec();
+	uint64_t postings = 0;
+	for (uint32_t i = 0; i < n; i++) {
+		const char *s = text + off[i], *r = rooms[room_of[i]];
+		int pos = 0, wn;
+		char w[HIST_WORD_MAX];
+		while ((wn = hist_word(s, off[i + 1] - off[i], &pos, w)) > 0) {
+			hist_term_t *t = hist_term(r, strlen(r), w, wn, 1);
+			uint32_t before = t->count;
+			hist_post(t, i);
+			postings += t->count - before;
+		}
+	}
+	double took = now_sec() - t0;
+	uint64_t bytes = (uint64_t)hist_scap * sizeof *hist_slots + (uint64_t)hist_tcap * sizeof *hist_terms, data = 0;
+	for (uint32_t i = 0; i < hist_tcount; i++) {
+		hist_term_t *t = &hist_terms[i];
+		uint32_t bcap = 1;
+		while (bcap < t->nblocks) bcap *= 2;   // hist_post() doubles the block table
+		bytes += t->dcap + bcap * sizeof(hist_block_t);
+		data += t->dlen + t->nblocks * sizeof(hist_block_t);
+	}
+	printf("indexed         %.1f MB of text in %.2f s, %.0f messages/s\n", len / 1048576.0, took, n / took);
+	printf("index           %u words, %llu postings, %.2f bytes/posting packed, %.1f MB allocated\n",
+		hist_tcount, (unsigned long long)postings, (double)data / postings, bytes / 1048576.0);
+
+	// Searches in the first room, from one word that is everywhere to
+	// pairs that rarely meet
+	char q[12][64];
+	int nqs = 0;
+	snprintf(q[nqs++], 64, "%s", english[0]);
+	snprintf(q[nqs++], 64, "%s", english[60]);
+	snprintf(q[nqs++], 64, "%s", vocab[1000]);
+	snprintf(q[nqs++], 64, "%s", vocab[40000]);
+	snprintf(q[nqs++], 64, "%s %s", english[0], english[1]);
+	snprintf(q[nqs++], 64, "%s %s", english[0], vocab[1000]);
+	snprintf(q[nqs++], 64, "%s %s", vocab[1000], vocab[2000]);
+	snprintf(q[nqs++], 64, "%s %s %s", english[2], english[5], vocab[3000]);
+	snprintf(q[nqs++], 64, "nosuchword");
+
+	printf("\n%-26s %8s %12s %12s\n", "search in 'lobby'", "matches", "index ms", "scan ms");
+	for (int k = 0; k < nqs; k++) {
+		uint32_t hits[HIST_RESULTS], shits[HIST_RESULTS];
+		double runs[REPEAT];
+		int nh = 0;
+		for (int r = 0; r < REPEAT; r++) {
+			double s = now_sec();
+			nh = search(rooms[0], q[k], hits);
+			runs[r] = now_sec() - s;
+		}
+		qsort(runs, REPEAT, sizeof runs[0], cmp_double);
+		double s = now_sec();
+		int sh = scan(0, q[k], n, shits);
+		double st = now_sec() - s;
+		if (sh != nh || memcmp(hits, shits, nh * sizeof hits[0]) != 0) {
+			fprintf(stderr, "histbench: '%s' found %d with the index, %d by scanning\n", q[k], nh, sh);
+			return 1;
+		}
+		printf("%-26s %8d %12.3f %12.3f\n", q[k], nh, runs[REPEAT / 2] * 1e3, st * 1e3);
+	}
+	return 0;
+}
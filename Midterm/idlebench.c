@@ -0,0 +1,227 @@
+/* ** idlebench.c -- server memory per idle connection
+**
+** Opens -n connections to a running server and leaves them idle, then reads
+** the server's resident set from /proc/<pid>/status and prints how many
+** bytes each connection added. Exits 1 if that is over -t bytes, so a
+** change that fattens idle connections fails the run.
+**
+** The connections stay before login (a million joins would be a million
+** broadcasts to everyone already in the room), so they must all be open
+** inside the server's 30 s handshake timeout. Start the server with -A 0
+** so its accept and per-address limits do not get in the way, and spread
+** the connections over -s loopback addresses (127.0.0.1, .2, ...) since one
+** source address runs out of ports at about 28,000.
+**
+** The full run is -n 1000000; both ends need that many descriptors
+** (ulimit -n, fs.nr_open) and the kernel about 4 GB for the sockets.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#define PORT        "3490"
+#define IDLE_TARGET 1024     // bytes of server memory an idle connection may cost
+#define WAVE        2000     // connects in flight at once
+#define WAVE_MS     5000     // time a wave gets to connect and see the banner
+#define SETTLE_MS   1000     // before the second memory reading
+#define FRAME_HDR   3
+
+double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// VmRSS of a process in bytes, -1 if it cannot be read
+long long rss_bytes(int pid) {
+	char path[64], line[256];
+	long long kb = -1;
+
+	snprintf(path, sizeof path, "/proc/%d/status", pid);
+	FILE *f = fopen(path, "r");
+	if (f == NULL) return -1;
+	while (fgets(line, sizeof line, f) != NULL) {
+		if (sscanf(line, "VmRSS: %lld kB", &kb) == 1) break;
+	}
+	fclose(f);
+	return kb < 0 ? -1 : kb * 1024;
+}
+
+// Start a nonblocking connect from 127.0.0.<src>, port picked at connect time
+int open_one(const struct sockaddr_in *to, int src) {
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) return -1;
+
+	struct sockaddr_in from;
+	int yes = 1;
+	memset(&from, 0, sizeof from);
+	from.sin_family = AF_INET;
+	from.sin_addr.s_addr = htonl(0x7f000000 | src);
+	setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &yes, sizeof yes);
+	if (bind(fd, (struct sockaddr *)&from, sizeof from) == -1 ||
+			(connect(fd, (const struct sockaddr *)to, sizeof *to) == -1 && errno != EINPROGRESS)) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+int main(int argc, char *argv[]) {
+	int nconns = 100000, sources = 0, opt;
+	long long target = IDLE_TARGET;
+
+	while ((opt = getopt(argc, argv, "n:s:t:")) != -1) {
+		switch (opt) {
+		case 'n':
+			nconns = atoi(optarg);
+			break;
+		case 's':
+			sources = atoi(optarg);
+			break;
+		case 't':
+			target = atoll(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: idlebench [-n connections] [-s source-addresses] [-t target-bytes] server-pid [host[:port]]\n");
+			exit(1);
+		}
+	}
+	if (optind >= argc || nconns <= 0) {
+		fprintf(stderr, "usage: idlebench [-n connections] [-s source-addresses] [-t target-bytes] server-pid [host[:port]]\n");
+		exit(1);
+	}
+	int pid = atoi(argv[optind]);
+	char host[256] = "127.0.0.1", port[16] = PORT;
+	if (optind + 1 < argc) {
+		char *colon = strrchr(argv[optind + 1], ':');
+		if (colon != NULL) {
+			snprintf(port, sizeof port, "%s", colon + 1);
+			*colon = '\0';
+		}
+		snprintf(host, sizeof host, "%s", argv[optind + 1]);
+	}
+	if (sources <= 0) {
+		sources = nconns / 25000 + 1;
+	}
+	if (sources > 254) sources = 254;
+
+	struct addrinfo hints, *ai;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET;   // the source addresses are 127.0.0.x
+	hints.ai_socktype = SOCK_STREAM;
+	int rv = getaddrinfo(host, port, &hints, &ai);
+	if (rv != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+		exit(1);
+	}
+	struct sockaddr_in to = *(struct sockaddr_in *)ai->ai_addr;
+	freeaddrinfo(ai);
+
+	struct rlimit rl;
+	getrlimit(RLIMIT_NOFILE, &rl);
+	if (rl.rlim_max < (rlim_t)nconns + 64) {
+		fprintf(stderr, "idlebench: %d connections need ulimit -n %d (hard limit is %llu)\n",
+			nconns, nconns + 64, (unsigned long long)rl.rlim_max);
+		exit(1);
+	}
+	rl.rlim_cur = nconns + 64;
+	setrlimit(RLIMIT_NOFILE, &rl);
+
+	long long base = rss_bytes(pid);
+	if (base == -1) {
+		fprintf(stderr, "idlebench: no process %d\n", pid);
+		exit(1);
+	}
+
+	int *fds = malloc(nconns * sizeof *fds);
+	struct epoll_event *ev = malloc(WAVE * sizeof *ev);
+	int ep = epoll_create1(EPOLL_CLOEXEC);
+	if (fds == NULL || ev == NULL || ep == -1) {
+		perror("idlebench");
+		exit(1);
+	}
+
+	// Waves of WAVE connects; a connection counts once the server's banner
+	// (its first frame) has arrived, i.e. the server holds state for it
+	double start = now_sec();
+	int open_n = 0, failed = 0;
+	unsigned char buf[4096];
+	while (open_n < nconns) {
+		int want = nconns - open_n < WAVE ? nconns - open_n : WAVE, pending = 0;
+		for (int k = 0; k < want; k++) {
+			int fd = open_one(&to, 1 + (open_n + k) % sources);
+			if (fd == -1) {
+				failed++;
+				continue;
+			}
+			struct epoll_event e = { EPOLLIN, { .u32 = (uint32_t)fd } };
+			epoll_ctl(ep, EPOLL_CTL_ADD, fd, &e);
+			pending++;
+		}
+		double deadline = now_sec() + WAVE_MS / 1000.0;
+		while (pending > 0 && now_sec() < deadline) {
+			int n = epoll_wait(ep, ev, WAVE, 100);
+			for (int k = 0; k < n; k++) {
+				int fd = ev[k].data.u32;
+				int got = recv(fd, buf, sizeof buf, 0);
+				if (got == -1 && errno == EAGAIN) continue;
+				epoll_ctl(ep, EPOLL_CTL_DEL, fd, NULL);
+				pending--;
+				if (got >= FRAME_HDR) {
+					fds[open_n++] = fd;
+				} else {
+					close(fd);   // refused, reset or closed
+					failed++;
+				}
+			}
+		}
+		if (pending > 0) {
+			fprintf(stderr, "idlebench: %d connect(s) got no banner within %d ms\n", pending, WAVE_MS);
+			exit(1);   // their descriptors are still in ep; nothing more to measure
+		}
+		if (failed > 0) {
+			fprintf(stderr, "idlebench: %d connection(s) failed after %d were open (server without -A 0?)\n", failed, open_n);
+			exit(1);
+		}
+	}
+	double took = now_sec() - start;
+
+	usleep(SETTLE_MS * 1000);
+	long long rss = rss_bytes(pid);
+	if (rss == -1) {
+		fprintf(stderr, "idlebench: server %d went away\n", pid);
+		exit(1);
+	}
+
+	// Every connection must still be there: the server closing some would
+	// flatter the figure
+	int lost = 0;
+	for (int k = 0; k < open_n; k++) {
+		int got = recv(fds[k], buf, sizeof buf, MSG_DONTWAIT);
+		if (got == 0 || (got == -1 && errno != EAGAIN)) lost++;
+	}
+
+	double per = (double)(rss - base) / open_n;
+	printf("connections     %d from %d source address(es), opened in %.1f s (%.0f/s)\n",
+		open_n, sources, took, open_n / took);
+	printf("server RSS      %.1f MB before, %.1f MB after\n", base / 1048576.0, rss / 1048576.0);
+	printf("per connection  %.0f bytes (target %lld)\n", per, target);
+	if (lost > 0) {
+		printf("%d connection(s) were closed by the server before the reading\n", lost);
+		return 1;
+	}
+	return per > target ? 1 : 0;
+}
@@ -0,0 +1,685 @@
+/* ** impair.c -- a bad network between a client and a server, on one host
+**
+** Listens on a port and relays every connection (or, with -u, every UDP
+** peer) to an upstream host:port, holding each piece of data back the way a
+** real link would: -d ms of one-way delay, -j ms of jitter either side of
+** it, a -b kbit/s bottleneck with a -q byte queue, and -l % loss. Each
+** connection and each direction gets its own link, like users on their own
+** access lines; -o up or -o down impairs only the way to or from the server.
+**
+** TCP cannot lose bytes, so loss there is what the peers would see of it: a
+** lost segment arrives an RTO (-R ms) late and holds up everything behind
+** it. A full queue stops reading from the sender, so the backpressure
+** reaches it as it would through a slow link. UDP datagrams are dropped
+** instead, when lost or when the queue is full; jitter can swap them, and
+** -r % of them skip the delay altogether (netem's reorder).
+**
+** Upstream connections from a 127.x address are made from the same
+** address, so a server still tells loopback clients apart (replay -s).
+** Counters are printed on SIGUSR1 and at exit. -S fixes the random seed so
+** a run can be repeated.
+*/
+
+#define _GNU_SOURCE   // accept4()
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#define SEGMENT      1448        // TCP bytes per simulated segment (-m)
+#define QUEUE_BYTES  (256*1024)  // per link (-q)
+#define RTO_MS       200         // a lost TCP segment arrives this much later (-R)
+#define READ_CHUNK   65536
+#define UDP_MAX      65536
+#define UDP_IDLE_MS  30000       // a UDP peer silent this long loses its flow
+#define FLOW_BUCKETS 4096
+#define EV_BATCH     256
+
+struct pair;
+
+typedef struct pkt {
+	int64_t due;
+	uint64_t seq;            // arrival order, to keep ties stable
+	struct pair *p;
+	int dir;
+	int len;
+	struct pkt *next;        // TCP: due but not yet taken by the socket
+	unsigned char data[];
+} pkt_t;
+
+typedef struct {
+	int64_t free_at;         // the bottleneck is busy until then
+	int64_t last_due;        // TCP: nothing may overtake
+	long queued;             // bytes on the link
+	pkt_t *out, *out_tail;   // TCP
+	int out_off;
+	int eof, shut;
+} link_t;
+
+// A side is what epoll hands back: which fd of which pair
+typedef struct {
+	struct pair *p;
+	int idx;
+	uint32_t events;
+} side_t;
+
+// TCP: fd[0] is the client, fd[1] the upstream connection. UDP: fd[1] is the
+// upstream socket and the client is peer, reached through the listener.
+// link[0] carries client to server, link[1] server to client.
+typedef struct pair {
+	int fd[2];
+	side_t side[2];
+	link_t link[2];
+	int connecting;
+	int dead;
+	int inflight;            // packets in the heap
+	struct sockaddr_storage peer;
+	socklen_t peerlen;
+	int64_t seen;            // UDP
+	struct pair *hnext;      // UDP flow table, then the dead list
+} pair_t;
+
+typedef struct {
+	uint64_t pkts, bytes, lost, full, reordered;
+} stats_t;
+
+int udp = 0, ep, lfd;
+int64_t delay_ns = 0, jitter_ns = 0, rto_ns = RTO_MS * 1000000LL;
+double rate_bps = 0, loss_pct = 0, reorder_pct = 0;
+long qmax = QUEUE_BYTES;
+int segment = SEGMENT;
+int impaired[2] = { 1, 1 };
+struct sockaddr_storage upstream;
+socklen_t upstream_len;
+
+pkt_t **heap;
+int heap_n = 0, heap_cap = 0;
+uint64_t next_seq = 0;
+
+stats_t stats[2];
+uint64_t pairs_opened = 0, pairs_open = 0;
+pair_t *flows[FLOW_BUCKETS];
+pair_t *dead_pairs;         // closed, freed once no packet or event can name them
+uint64_t rng;
+volatile sig_atomic_t want_report = 0, want_exit = 0;
+
+int64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// xorshift64*: cheap, and repeatable with -S
+double uniform(void) {
+	rng ^= rng >> 12;
+	rng ^= rng << 25;
+	rng ^= rng >> 27;
+	return ((rng * 2685821657736338717ULL) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+int heap_before(const pkt_t *a, const pkt_t *b) {
+	return a->due < b->due || (a->due == b->due && a->seq < b->seq);
+}
+
+void heap_push(pkt_t *k) {
+	if (heap_n == heap_cap) {
+		heap_cap = heap_cap ? 2 * heap_cap : 1024;
+		heap = realloc(heap, heap_cap * sizeof *heap);
+		if (heap == NULL) {
+			perror("impair");
+			exit(1);
+		}
+	}
+	int i = heap_n++;
+	while (i > 0 && heap_before(k, heap[(i - 1) / 2])) {
+		heap[i] = heap[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap[i] = k;
+}
+
+pkt_t *heap_pop(void) {
+	pkt_t *top = heap[0], *last = heap[--heap_n];
+	int i = 0;
+	for (;;) {
+		int c = 2 * i + 1;
+		if (c >= heap_n) break;
+		if (c + 1 < heap_n && heap_before(heap[c + 1], heap[c])) c++;
+		if (!heap_before(heap[c], last)) break;
+		heap[i] = heap[c];
+		i = c;
+	}
+	if (heap_n > 0) heap[i] = last;
+	return top;
+}
+
+void set_events(pair_t *p, int i, uint32_t events) {
+	side_t *s = &p->side[i];
+	if (p->fd[i] == -1 || s->events == events) return;
+	struct epoll_event e = { events, { .ptr = s } };
+	epoll_ctl(ep, EPOLL_CTL_MOD, p->fd[i], &e);
+	s->events = events;
+}
+
+// Read from a side while its link has room; write to it while the other
+// link has bytes the socket would not take
+void update_events(pair_t *p) {
+	for (int i = 0; i < 2; i++) {
+		link_t *in = &p->link[i], *out = &p->link[1 - i];
+		uint32_t events = 0;
+		if (!in->eof && (udp || in->queued < qmax)) events |= EPOLLIN;
+		if (out->out != NULL || (i == 1 && p->connecting)) events |= EPOLLOUT;
+		set_events(p, i, events);
+	}
+}
+
+void free_pair(pair_t *p) {
+	for (int d = 0; d < 2; d++) {
+		while (p->link[d].out != NULL) {
+			pkt_t *k = p->link[d].out;
+			p->link[d].out = k->next;
+			free(k);
+		}
+	}
+	free(p);
+}
+
+void kill_pair(pair_t *p) {
+	if (p->dead) return;
+	for (int i = 0; i < 2; i++) {
+		if (p->fd[i] != -1) close(p->fd[i]);
+		p->fd[i] = -1;
+	}
+	p->dead = 1;
+	pairs_open--;
+	p->hnext = dead_pairs;
+	dead_pairs = p;
+}
+
+void bury(void) {
+	for (pair_t **pp = &dead_pairs; *pp != NULL;) {
+		pair_t *p = *pp;
+		if (p->inflight > 0) {
+			pp = &p->hnext;
+			continue;
+		}
+		*pp = p->hnext;
+		free_pair(p);
+	}
+}
+
+// Put bytes on a link: queue behind the bottleneck, then fly for the delay
+void submit(pair_t *p, int dir, const unsigned char *buf, int len, int64_t now) {
+	link_t *l = &p->link[dir];
+	stats_t *st = &stats[dir];
+
+	if (udp && l->queued + len > qmax) {
+		st->full++;   // tail drop, as a router would
+		return;
+	}
+	int64_t due = now;
+	if (impaired[dir]) {
+		int64_t start = l->free_at > now ? l->free_at : now;
+		l->free_at = start + (rate_bps > 0 ? (int64_t)(len * 8 * 1e9 / rate_bps) : 0);
+		due = l->free_at + delay_ns;
+		if (jitter_ns > 0) due += (int64_t)((2 * uniform() - 1) * jitter_ns);
+		if (loss_pct > 0 && uniform() * 100 < loss_pct) {
+			st->lost++;
+			if (udp) return;
+			due += rto_ns;
+		}
+		if (udp && reorder_pct > 0 && uniform() * 100 < reorder_pct) {
+			due = l->free_at;
+			st->reordered++;
+		}
+	}
+	if (!udp) {
+		if (due < l->last_due) due = l->last_due;
+		l->last_due = due;
+	}
+	if (due < now) due = now;
+
+	pkt_t *k = malloc(sizeof *k + len);
+	if (k == NULL) {
+		perror("impair");
+		exit(1);
+	}
+	k->due = due;
+	k->seq = next_seq++;
+	k->p = p;
+	k->dir = dir;
+	k->len = len;
+	k->next = NULL;
+	memcpy(k->data, buf, len);
+	l->queued += len;
+	p->inflight++;
+	heap_push(k);
+}
+
+// TCP: write what is due; pass on a half-close once the link is empty
+void flush_link(pair_t *p, int dir) {
+	link_t *l = &p->link[dir];
+	int fd = p->fd[1 - dir];
+
+	while (l->out != NULL && !p->connecting) {
+		pkt_t *k = l->out;
+		ssize_t n = send(fd, k->data + l->out_off, k->len - l->out_off, MSG_NOSIGNAL);
+		if (n == -1) {
+			if (errno == EAGAIN || errno == ENOTCONN) break;
+			kill_pair(p);
+			return;
+		}
+		l->out_off += n;
+		if (l->out_off < k->len) break;
+		stats[dir].pkts++;
+		stats[dir].bytes += k->len;
+		l->queued -= k->len;
+		l->out = k->next;
+		l->out_off = 0;
+		free(k);
+	}
+	if (l->eof && l->queued == 0 && !l->shut) {
+		shutdown(fd, SHUT_WR);
+		l->shut = 1;
+		if (p->link[1 - dir].shut) {
+			kill_pair(p);
+			return;
+		}
+	}
+	update_events(p);
+}
+
+// Packets whose time has come leave the link
+void release(int64_t now) {
+	while (heap_n > 0 && heap[0]->due <= now) {
+		pkt_t *k = heap_pop();
+		pair_t *p = k->p;
+		p->inflight--;
+		if (p->dead) {
+			free(k);
+			continue;
+		}
+		link_t *l = &p->link[k->dir];
+		if (udp) {
+			ssize_t n = k->dir == 0 ? send(p->fd[1], k->data, k->len, 0) :
+				sendto(lfd, k->data, k->len, 0, (struct sockaddr *)&p->peer, p->peerlen);
+			if (n == k->len) {
+				stats[k->dir].pkts++;
+				stats[k->dir].bytes += k->len;
+			} else {
+				stats[k->dir].full++;   // socket buffer full: gone, like any datagram
+			}
+			l->queued -= k->len;
+			free(k);
+			continue;
+		}
+		if (l->out_tail != NULL && l->out != NULL) l->out_tail->next = k; else l->out = k;
+		l->out_tail = k;
+		flush_link(p, k->dir);
+	}
+}
+
+int is_loopback4(const struct sockaddr_storage *a, struct in_addr *v4) {
+	if (a->ss_family == AF_INET) {
+		*v4 = ((const struct sockaddr_in *)a)->sin_addr;
+	} else if (a->ss_family == AF_INET6 && IN6_IS_ADDR_V4MAPPED(&((const struct sockaddr_in6 *)a)->sin6_addr)) {
+		memcpy(v4, ((const struct sockaddr_in6 *)a)->sin6_addr.s6_addr + 12, 4);
+	} else {
+		return 0;
+	}
+	return (ntohl(v4->s_addr) >> 24) == 127;
+}
+
+// Socket to the server, from the client's own address when both are on loopback
+int open_upstream(const struct sockaddr_storage *client, int type) {
+	int fd = socket(upstream.ss_family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0), yes = 1;
+	if (fd == -1) return -1;
+	struct in_addr src, dst;
+	if (is_loopback4(client, &src) && is_loopback4(&upstream, &dst)) {
+		struct sockaddr_in from;
+		memset(&from, 0, sizeof from);
+		from.sin_family = AF_INET;
+		from.sin_addr = src;
+		setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &yes, sizeof yes);
+		bind(fd, (struct sockaddr *)&from, sizeof from);
+	}
+	if (type == SOCK_STREAM) setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+	if (connect(fd, (struct sockaddr *)&upstream, upstream_len) == -1 && errno != EINPROGRESS) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+pair_t *new_pair(int cfd, const struct sockaddr_storage *peer, socklen_t peerlen, int type) {
+	pair_t *p = calloc(1, sizeof *p);
+	if (p == NULL) return NULL;
+	p->fd[0] = cfd;
+	p->fd[1] = open_upstream(peer, type);
+	if (p->fd[1] == -1) {
+		free(p);
+		return NULL;
+	}
+	p->connecting = type == SOCK_STREAM;
+	memcpy(&p->peer, peer, peerlen);
+	p->peerlen = peerlen;
+	for (int i = 0; i < 2; i++) {
+		p->side[i].p = p;
+		p->side[i].idx = i;
+		if (p->fd[i] == -1) continue;
+		p->side[i].events = i == 1 && p->connecting ? EPOLLIN | EPOLLOUT : EPOLLIN;
+		struct epoll_event e = { p->side[i].events, { .ptr = &p->side[i] } };
+		epoll_ctl(ep, EPOLL_CTL_ADD, p->fd[i], &e);
+	}
+	pairs_opened++;
+	pairs_open++;
+	return p;
+}
+
+void tcp_accept(void) {
+	for (;;) {
+		struct sockaddr_storage peer;
+		socklen_t len = sizeof peer;
+		int fd = accept4(lfd, (struct sockaddr *)&peer, &len, SOCK_NONBLOCK | SOCK_CLOEXEC), yes = 1;
+		if (fd == -1) return;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+		if (new_pair(fd, &peer, len, SOCK_STREAM) == NULL) close(fd);
+	}
+}
+
+// Cut what a side sends into segments and put them on its link
+void tcp_read(pair_t *p, int i, int64_t now) {
+	static unsigned char buf[READ_CHUNK];
+	link_t *l = &p->link[i];
+
+	while (!p->dead && !l->eof && l->queued < qmax) {
+		long room = qmax - l->queued;
+		ssize_t n = recv(p->fd[i], buf, room < READ_CHUNK ? room : READ_CHUNK, 0);
+		if (n == -1 && errno == EAGAIN) break;
+		if (n == -1) {
+			kill_pair(p);
+			return;
+		}
+		if (n == 0) {
+			l->eof = 1;
+			flush_link(p, i);   // shuts the other side now if nothing is queued
+			return;
+		}
+		for (ssize_t off = 0; off < n; off += segment) {
+			submit(p, i, buf + off, n - off < segment ? n - off : segment, now);
+		}
+	}
+	if (!p->dead) update_events(p);
+}
+
+// UDP flows are keyed by the client's address and port
+uint32_t flow_hash(const struct sockaddr_storage *a, socklen_t len) {
+	uint32_t h = 2166136261u;
+	const unsigned char *b = (const unsigned char *)a;
+	for (socklen_t k = 0; k < len; k++) h = (h ^ b[k]) * 16777619u;
+	return h % FLOW_BUCKETS;
+}
+
+void udp_from_clients(int64_t now) {
+	static unsigned char buf[UDP_MAX];
+	for (;;) {
+		struct sockaddr_storage peer;
+		socklen_t len = sizeof peer;
+		memset(&peer, 0, sizeof peer);
+		ssize_t n = recvfrom(lfd, buf, sizeof buf, 0, (struct sockaddr *)&peer, &len);
+		if (n == -1) return;
+		uint32_t h = flow_hash(&peer, len);
+		pair_t *p = flows[h];
+		while (p != NULL && (p->peerlen != len || memcmp(&p->peer, &peer, len) != 0)) p = p->hnext;
+		if (p == NULL) {
+			if ((p = new_pair(-1, &peer, len, SOCK_DGRAM)) == NULL) continue;
+			p->hnext = flows[h];
+			flows[h] = p;
+		}
+		p->seen = now;
+		submit(p, 0, buf, n, now);
+	}
+}
+
+void udp_from_server(pair_t *p, int64_t now) {
+	static unsigned char buf[UDP_MAX];
+	ssize_t n;
+	while ((n = recv(p->fd[1], buf, sizeof buf, 0)) >= 0) {
+		p->seen = now;
+		submit(p, 1, buf, n, now);
+	}
+}
+
+void udp_expire(int64_t now) {
+	for (int h = 0; h < FLOW_BUCKETS; h++) {
+		for (pair_t **pp = &flows[h]; *pp != NULL;) {
+			pair_t *p = *pp;
+			if (now - p->seen < UDP_IDLE_MS * 1000000LL) {
+				pp = &p->hnext;
+				continue;
+			}
+			*pp = p->hnext;
+			kill_pair(p);
+		}
+	}
+}
+
+void report(void) {
+	static const char *name[2] = { "to server", "to client" };
+	printf("%s: %llu opened, %llu open\n", udp ? "flows" : "connections",
+		(unsigned long long)pairs_opened, (unsigned long long)pairs_open);
+	for (int d = 0; d < 2; d++) {
+		stats_t *s = &stats[d];
+		printf("%-10s %llu %s, %llu bytes, %llu lost", name[d], (unsigned long long)s->pkts,
+			udp ? "datagrams" : "segments", (unsigned long long)s->bytes, (unsigned long long)s->lost);
+		if (udp) {
+			printf(", %llu dropped at a full queue, %llu reordered",
+				(unsigned long long)s->full, (unsigned long long)s->reordered);
+		}
+		printf("\n");
+	}
+	fflush(stdout);
+}
+
+void on_signal(int sig) {
+	if (sig == SIGUSR1) want_report = 1; else want_exit = 1;
+}
+
+int split_hostport(char *arg, char **host, char **port) {
+	char *colon = strrchr(arg, ':');
+	if (colon == NULL) return -1;
+	*colon = '\0';
+	*port = colon + 1;
+	*host = arg;
+	if (arg[0] == '[' && colon > arg && colon[-1] == ']') {   // [::1]:4950
+		colon[-1] = '\0';
+		*host = arg + 1;
+	}
+	return 0;
+}
+
+int main(int argc, char *argv[]) {
+	int opt;
+	const char *usage = "usage: impair [-u] [-d delay-ms] [-j jitter-ms] [-b kbit/s] [-l loss-%] [-r reorder-%] "
+		"[-q queue-bytes] [-m segment-bytes] [-R rto-ms] [-o up|down] [-S seed] [listen-host:]port host:port\n";
+
+	rng = (uint64_t)now_ns() ^ (uint64_t)getpid() << 32;
+	while ((opt = getopt(argc, argv, "ud:j:b:l:r:q:m:R:o:S:")) != -1) {
+		switch (opt) {
+		case 'u':
+			udp = 1;
+			break;
+		case 'd':
+			delay_ns = (int64_t)(atof(optarg) * 1e6);
+			break;
+		case 'j':
+			jitter_ns = (int64_t)(atof(optarg) * 1e6);
+			break;
+		case 'b':   // kbit/s, per direction of each connection
+			rate_bps = atof(optarg) * 1000;
+			break;
+		case 'l':
+			loss_pct = atof(optarg);
+			break;
+		case 'r':
+			reorder_pct = atof(optarg);
+			break;
+		case 'q':
+			qmax = atol(optarg);
+			break;
+		case 'm':
+			segment = atoi(optarg);
+			break;
+		case 'R':
+			rto_ns = (int64_t)(atof(optarg) * 1e6);
+			break;
+		case 'o':   // impair one direction only
+			if (strcmp(optarg, "up") == 0) {
+				impaired[1] = 0;
+			} else if (strcmp(optarg, "down") == 0) {
+				impaired[0] = 0;
+			} else {
+				fprintf(stderr, "%s", usage);
+				exit(1);
+			}
+			break;
+		case 'S':
+			rng = strtoull(optarg, NULL, 0);
+			break;
+		default:
+			fprintf(stderr, "%s", usage);
+			exit(1);
+		}
+	}
+	if (rng == 0) rng = 1;   // xorshift's one fixed point
+	if (optind + 2 != argc || qmax <= 0 || segment <= 0 || delay_ns < 0 || jitter_ns < 0) {
+		fprintf(stderr, "%s", usage);
+		exit(1);
+	}
+	int type = udp ? SOCK_DGRAM : SOCK_STREAM;
+
+	char *lhost = NULL, *lport = argv[optind], *uhost, *uport;
+	if (strchr(lport, ':') != NULL) split_hostport(argv[optind], &lhost, &lport);
+	if (split_hostport(argv[optind + 1], &uhost, &uport) == -1) {
+		fprintf(stderr, "%s", usage);
+		exit(1);
+	}
+
+	struct addrinfo hints, *ai;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_socktype = type;
+	int rv = getaddrinfo(uhost, uport, &hints, &ai);
+	if (rv != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+		exit(1);
+	}
+	memcpy(&upstream, ai->ai_addr, ai->ai_addrlen);
+	upstream_len = ai->ai_addrlen;
+	freeaddrinfo(ai);
+
+	// With no host, listen on both families (IPv4 peers show up v4-mapped)
+	hints.ai_family = lhost == NULL ? AF_INET6 : AF_UNSPEC;
+	hints.ai_flags = AI_PASSIVE;
+	if ((rv = getaddrinfo(lhost, lport, &hints, &ai)) != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+		exit(1);
+	}
+	int yes = 1, no = 0;
+	lfd = socket(ai->ai_family, type | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (lfd == -1) {
+		perror("socket");
+		exit(1);
+	}
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof yes);
+	if (ai->ai_family == AF_INET6) setsockopt(lfd, IPPROTO_IPV6, IPV6_V6ONLY, &no, sizeof no);
+	if (bind(lfd, ai->ai_addr, ai->ai_addrlen) == -1 || (!udp && listen(lfd, SOMAXCONN) == -1)) {
+		perror("bind");
+		exit(1);
+	}
+	freeaddrinfo(ai);
+
+	ep = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event le = { EPOLLIN, { .ptr = NULL } };
+	epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &le);
+
+	struct sigaction sa;
+	memset(&sa, 0, sizeof sa);
+	sa.sa_handler = on_signal;
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("impair: %s %s -> %s:%s, delay %.1f ms, jitter %.1f ms, rate %s, loss %g%%",
+		udp ? "udp" : "tcp", argv[optind], uhost, uport, delay_ns / 1e6, jitter_ns / 1e6,
+		rate_bps > 0 ? "capped" : "unlimited", loss_pct);
+	if (rate_bps > 0) printf(" (%.0f kbit/s, queue %ld bytes)", rate_bps / 1000, qmax);
+	if (udp) printf(", reorder %g%%", reorder_pct);
+	printf("%s (pid %d)\n", impaired[0] && impaired[1] ? "" : impaired[0] ? ", to server only" : ", to client only",
+		(int)getpid());
+	fflush(stdout);
+
+	struct epoll_event events[EV_BATCH];
+	int64_t next_expire = now_ns() + 1000000000LL;
+	while (!want_exit) {
+		int64_t now = now_ns();
+		release(now);
+		if (want_report) {
+			want_report = 0;
+			report();
+		}
+		if (udp && now >= next_expire) {
+			udp_expire(now);
+			next_expire = now + 1000000000LL;
+		}
+		int timeout = -1;
+		if (heap_n > 0) timeout = heap[0]->due > now ? (int)((heap[0]->due - now + 999999) / 1000000) : 0;
+		if (udp && (timeout == -1 || timeout > 1000)) timeout = 1000;
+		int n = epoll_wait(ep, events, EV_BATCH, timeout);
+		now = now_ns();
+		for (int k = 0; k < n; k++) {
+			side_t *s = events[k].data.ptr;
+			if (s == NULL) {
+				if (udp) udp_from_clients(now); else tcp_accept();
+				continue;
+			}
+			pair_t *p = s->p;
+			if (p->dead) continue;   // killed earlier in this batch
+			if (udp) {
+				udp_from_server(p, now);
+				continue;
+			}
+			if (p->connecting && s->idx == 1 && (events[k].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+				int err = 0;
+				socklen_t len = sizeof err;
+				getsockopt(p->fd[1], SOL_SOCKET, SO_ERROR, &err, &len);
+				if (err != 0) {
+					kill_pair(p);
+					continue;
+				}
+				p->connecting = 0;
+			}
+			if ((events[k].events & EPOLLERR) || ((events[k].events & EPOLLHUP) && p->link[s->idx].eof)) {
+				kill_pair(p);   // that end is gone both ways
+				continue;
+			}
+			if (events[k].events & (EPOLLIN | EPOLLHUP)) tcp_read(p, s->idx, now);
+			if (!p->dead && (events[k].events & EPOLLOUT)) flush_link(p, 1 - s->idx);
+		}
+		bury();
+	}
+	report();
+	return 0;
+}
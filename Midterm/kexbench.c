@@ -0,0 +1,188 @@
+/* ** kexbench.c -- server cost of a full key exchange vs. a ticket resumption
+**
+** Runs the server's side of FRAME_KEX in a loop on one core, both ways:
+**   full    X25519 key pair + derive, HKDF, seal a new ticket
+**   resume  open the client's ticket, HKDF, seal a new ticket
+** and prints handshakes/sec for each. A reconnect storm costs about
+** (clients / full rate) seconds of CPU without tickets, (clients / resume
+** rate) with them.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#include <openssl/kdf.h>
+
+#define KEX_RANDOM          32
+#define KEX_PUB             32
+#define TICKET_LEN          69
+#define TICKET_LIFETIME_S   3600
+
+unsigned char ticket_key[32];
+
+double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void put_be(unsigned char *p, uint64_t v, int n) {
+	while (n-- > 0) {
+		p[n] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+// HKDF-SHA256 - same as server.c
+int hkdf(const unsigned char *salt, int salt_len, const unsigned char *ikm, int ikm_len,
+         const char *info, unsigned char *out, size_t out_len) {
+    EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    int ok = pctx != NULL &&
+        EVP_PKEY_derive_init(pctx) == 1 &&
+        EVP_PKEY_CTX_set_hkdf_md(pctx, EVP_sha256()) == 1 &&
+        EVP_PKEY_CTX_set1_hkdf_salt(pctx, salt, salt_len) == 1 &&
+        EVP_PKEY_CTX_set1_hkdf_key(pctx, ikm, ikm_len) == 1 &&
+        EVP_PKEY_CTX_add1_hkdf_info(pctx, (const unsigned char *)info, strlen(info)) == 1 &&
+        EVP_PKEY_derive(pctx, out, &out_len) == 1;
+    EVP_PKEY_CTX_free(pctx);
+    return ok ? 0 : -1;
+}
+
+EVP_PKEY *x25519_keygen(unsigned char pub[KEX_PUB]) {
+    size_t len = KEX_PUB;
+    EVP_PKEY *key = EVP_PKEY_Q_keygen(NULL, NULL, "X25519");
+    if (key != NULL && EVP_PKEY_get_raw_public_key(key, pub, &len) != 1) {
+        EVP_PKEY_free(key);
+        key = NULL;
+    }
+    return key;
+}
+
+int x25519_derive(EVP_PKEY *key, const unsigned char peer_pub[KEX_PUB], unsigned char secret[32]) {
+    size_t len = 32;
+    EVP_PKEY *peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, peer_pub, KEX_PUB);
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(key, NULL);
+    int ok = peer != NULL && ctx != NULL &&
+        EVP_PKEY_derive_init(ctx) == 1 &&
+        EVP_PKEY_derive_set_peer(ctx, peer) == 1 &&
+        EVP_PKEY_derive(ctx, secret, &len) == 1 && len == 32;
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(peer);
+    return ok ? 0 : -1;
+}
+
+// Ticket seal/open - same layout as server.c, one key
+int ticket_seal(const unsigned char psk[32], unsigned char *t) {
+    unsigned char plain[40];
+    int len, ok;
+
+    put_be(plain, (uint64_t)time(NULL) + TICKET_LIFETIME_S, 8);
+    memcpy(plain + 8, psk, 32);
+    t[0] = 0;
+    if (RAND_bytes(t + 1, 12) != 1)
+        return -1;
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    ok = ctx != NULL &&
+        EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, ticket_key, t + 1) == 1 &&
+        EVP_EncryptUpdate(ctx, NULL, &len, t, 1) == 1 &&
+        EVP_EncryptUpdate(ctx, t + 13, &len, plain, sizeof plain) == 1 &&
+        EVP_EncryptFinal_ex(ctx, t + 13 + len, &len) == 1 &&
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16, t + 53) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+    return ok ? 0 : -1;
+}
+
+int ticket_open(const unsigned char *t, unsigned char psk[32]) {
+    unsigned char plain[40] = { 0 };
+    int len, ok;
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    ok = ctx != NULL &&
+        EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, ticket_key, t + 1) == 1 &&
+        EVP_DecryptUpdate(ctx, NULL, &len, t, 1) == 1 &&
+        EVP_DecryptUpdate(ctx, plain, &len, t + 13, sizeof plain) == 1 &&
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, 16, (void *)(t + 53)) == 1 &&
+        EVP_DecryptFinal_ex(ctx, plain + len, &len) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+    uint64_t expiry = 0;
+    for (int k = 0; k < 8; k++) expiry = (expiry << 8) | plain[k];
+    if (!ok || expiry < (uint64_t)time(NULL))
+        return -1;
+    memcpy(psk, plain + 8, 32);
+    return 0;
+}
+
+// One server-side handshake; returns -1 on any failure
+int handshake(int resume, const unsigned char *client_pub, const unsigned char *ticket) {
+	unsigned char salt[2 * KEX_RANDOM], secret[32], psk[32], keys[64], pub[KEX_PUB], out[TICKET_LEN];
+
+	memset(salt, 0x5a, KEX_RANDOM);
+	if (RAND_bytes(salt + KEX_RANDOM, KEX_RANDOM) != 1) return -1;
+	if (resume) {
+		if (ticket_open(ticket, secret) == -1) return -1;
+	} else {
+		EVP_PKEY *key = x25519_keygen(pub);
+		int ok = key != NULL && x25519_derive(key, client_pub, secret) == 0;
+		EVP_PKEY_free(key);
+		if (!ok) return -1;
+	}
+	if (hkdf(salt, sizeof salt, secret, 32, "chat psk", psk, 32) == -1 ||
+			hkdf(salt, sizeof salt, psk, 32, "chat keys", keys, 64) == -1 ||
+			ticket_seal(psk, out) == -1) {
+		return -1;
+	}
+	return 0;
+}
+
+double measure(int resume, double secs, const unsigned char *client_pub, const unsigned char *ticket) {
+	long n = 0;
+	double start = now_sec(), end = start + secs, t;
+
+	do {
+		for (int k = 0; k < 64; k++, n++) {
+			if (handshake(resume, client_pub, ticket) == -1) {
+				fprintf(stderr, "kexbench: handshake failed\n");
+				exit(1);
+			}
+		}
+	} while ((t = now_sec()) < end);
+	return n / (t - start);
+}
+
+int main(int argc, char *argv[])
+{
+	double secs = 2;
+	unsigned char client_pub[KEX_PUB], psk[32], ticket[TICKET_LEN];
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:")) != -1) {
+		if (opt == 'd') {
+			secs = atof(optarg);
+		} else {
+			fprintf(stderr, "usage: kexbench [-d seconds per mode]\n");
+			exit(1);
+		}
+	}
+
+	EVP_PKEY *client = x25519_keygen(client_pub);
+	if (client == NULL || RAND_bytes(ticket_key, sizeof ticket_key) != 1 ||
+			RAND_bytes(psk, sizeof psk) != 1 || ticket_seal(psk, ticket) == -1) {
+		fprintf(stderr, "kexbench: setup failed\n");
+		return 1;
+	}
+
+	double full = measure(0, secs, client_pub, ticket);
+	double resume = measure(1, secs, client_pub, ticket);
+	printf("full exchange  %9.0f handshakes/s  %7.1f us each\n", full, 1e6 / full);
+	printf("resumption     %9.0f handshakes/s  %7.1f us each  (%.1fx)\n", resume, 1e6 / resume, resume / full);
+	printf("10000 reconnecting clients: %.2f s of CPU without tickets, %.2f s with\n",
+		10000 / full, 10000 / resume);
+	EVP_PKEY_free(client);
+	return 0;
+}
@@ -1,94 +1,593 @@
-/* ** listener.c -- a datagram sockets "server" demo 
-*/ 
-
-#include <stdio.h> 
-#include <stdlib.h> 
-#include <unistd.h> 
-#include <errno.h> 
-#include <string.h> 
-#include <sys/types.h> 
-#include <sys/socket.h> 
-#include <netinet/in.h> 
-#include <arpa/inet.h> 
-#include <netdb.h> 
-
-#define MYPORT "4950" // the port users will be connecting to 
-
-#define MAXBUFLEN 100 
-
-// get sockaddr, IPv4 or IPv6: 
-void *get_in_addr(struct sockaddr *sa) 
-{ 
-	if (sa->sa_family == AF_INET) { 
-		return &(((struct sockaddr_in*)sa)->sin_addr); 
-	} 
-
-	return &(((struct sockaddr_in6*)sa)->sin6_addr); 
-} 
-
-int main(void) 
-{ 
-	int sockfd; 
-	struct addrinfo hints, *servinfo, *p; 
-	int rv; 
-	int numbytes; 
-	struct sockaddr_storage their_addr; 
-	char buf[MAXBUFLEN]; 
-	socklen_t addr_len; 
-	char s[INET6_ADDRSTRLEN]; 
-
-	memset(&hints, 0, sizeof hints); 
-	hints.ai_family = AF_INET6; // set to AF_INET to use IPv4 
-	hints.ai_socktype = SOCK_DGRAM; 
-	hints.ai_flags = AI_PASSIVE; // use my IP 
-
-	if ((rv = getaddrinfo(NULL, MYPORT, &hints, &servinfo)) != 0) { 
-		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv)); 
-		return 1; 
-	} 
-
-	// loop through all the results and bind to the first we can 
-	for(p = servinfo; p != NULL; p = p->ai_next) { 
-		if ((sockfd = socket(p->ai_family, p->ai_socktype, 
-				p->ai_protocol)) == -1) { 
-			perror("listener: socket"); 
-			continue; 
-		} 
-
-		if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) { 
-			close(sockfd); 
-			perror("listener: bind"); 
-			continue; 
-		} 
-
-		break; 
-	} 
-
-	if (p == NULL) { 
-		fprintf(stderr, "listener: failed to bind socket\n"); 
-		return 2; 
-	} 
-
-	freeaddrinfo(servinfo); 
-
-	printf("listener: waiting to recvfrom...\n"); 
-
-	addr_len = sizeof their_addr; 
-	if ((numbytes = recvfrom(sockfd, buf, MAXBUFLEN-1 , 0, 
-		(struct sockaddr *)&their_addr, &addr_len)) == -1) { 
-		perror("recvfrom"); 
-		exit(1); 
-	} 
-
-	printf("listener: got packet from %s\n", 
-		inet_ntop(their_addr.ss_family, 
-			get_in_addr((struct sockaddr *)&their_addr), 
-			s, sizeof s)); 
-	printf("listener: packet is %d bytes long\n", numbytes); 
-	buf[numbytes] = '\0'; 
-	printf("listener: packet contains \"%s\"\n", buf); 
-
-	close(sockfd); 
-
-	return 0; 
-}
\ No newline at end of file
+/* ** listener.c -- a datagram sockets "server" demo
+**
+** Receives in batches with recvmmsg() into a preallocated ring of buffers,
+** with UDP GRO where the kernel has it. Plain datagrams are printed as
+** before; datagrams from "talker -b" are counted, and each run gets a
+** packets/sec and loss summary.
+**
+** With -m it is the receiving side of the chat server's multicast fan-out:
+** it logs in over TCP, takes room traffic from the group, and asks the
+** server to resend lost datagrams (NAK) over the TCP connection.
+*/
+
+#define _GNU_SOURCE   // recvmmsg()
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <sys/select.h>
+#include <openssl/evp.h>
+
+#define MYPORT "4950" // the port users will be connecting to
+
+#define MAXBUFLEN 65536   // one GRO super-datagram
+#define RX_BATCH  64      // datagrams per recvmmsg()
+#define RCVBUF    (4 * 1024 * 1024)
+
+// Benchmark datagram header (see talker.c)
+#define BENCH_MAGIC 0x55445042   // "UDPB"
+#define BENCH_END   UINT64_MAX   // seq of the end marker; payload = packets sent
+
+typedef struct {
+	uint32_t magic;
+	uint32_t run;
+	uint64_t seq;
+} bench_hdr_t;
+
+// Chat server protocol - must match server.c
+#define CHATPORT      "3490"
+#define MAXDATASIZE   1024
+#define FRAME_HDR     3
+#define FRAME_MAX     (MAXDATASIZE + 64)
+#define FRAME_EOF     (-2)
+enum {
+	FRAME_CHAT = 1, FRAME_NOTICE, FRAME_PING, FRAME_PONG,
+	FRAME_PEER_HELLO, FRAME_RELAY, FRAME_MCAST, FRAME_NAK, FRAME_REPAIR
+};
+#define MCAST_MAGIC   0x4d435354   // "MCST"
+#define MCAST_HDR     18           // [u32 magic][u32 epoch][u64 seq][u8 kind][u8 room_len]
+#define MCAST_HISTORY 1024         // server keeps this many datagrams for repair
+#define NAK_MAX       256
+enum { MCAST_DATA = 1, MCAST_HEARTBEAT };
+
+// AES-256 key and IV - must match server
+static const unsigned char AES_KEY[32] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+    0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F
+};
+
+static const unsigned char AES_IV[16] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F
+};
+
+// Multicast receiver state
+int chat_fd = -1;
+char room[64] = "lobby";
+int started;                 // server has told us where the stream starts
+uint32_t rx_epoch;
+uint64_t rx_next;            // next sequence number we expect
+uint64_t seen[MCAST_HISTORY];   // seq + 1 of delivered datagrams, for duplicates
+uint64_t rx_msgs, rx_repaired, rx_naks, rx_lost;
+
+// Per-run counters
+typedef struct {
+	uint32_t run;
+	int active;
+	uint64_t packets;
+	uint64_t bytes;
+	uint64_t max_seq;
+	int size;
+	double first, last;
+} run_stats_t;
+
+// Receive ring: buffers, iovecs, headers and control space are set up once
+static char bufs[RX_BATCH][MAXBUFLEN];
+static struct iovec iovs[RX_BATCH];
+static struct mmsghdr msgs[RX_BATCH];
+static struct sockaddr_storage addrs[RX_BATCH];
+static char cmsgs[RX_BATCH][CMSG_SPACE(sizeof(int))];
+
+run_stats_t stats;
+uint32_t done_run;           // last run reported complete, to ignore repeated end markers
+int have_done;
+uint64_t calls, datagrams;   // recvmmsg() calls and segments, for the batch average
+
+// get sockaddr, IPv4 or IPv6:
+void *get_in_addr(struct sockaddr *sa)
+{
+	if (sa->sa_family == AF_INET) {
+		return &(((struct sockaddr_in*)sa)->sin_addr);
+	}
+
+	return &(((struct sockaddr_in6*)sa)->sin6_addr);
+}
+
+double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void ring_reset(int i)
+{
+	iovs[i].iov_base = bufs[i];
+	iovs[i].iov_len = MAXBUFLEN;
+	memset(&msgs[i].msg_hdr, 0, sizeof msgs[i].msg_hdr);
+	msgs[i].msg_hdr.msg_name = &addrs[i];
+	msgs[i].msg_hdr.msg_namelen = sizeof addrs[i];
+	msgs[i].msg_hdr.msg_iov = &iovs[i];
+	msgs[i].msg_hdr.msg_iovlen = 1;
+	msgs[i].msg_hdr.msg_control = cmsgs[i];
+	msgs[i].msg_hdr.msg_controllen = sizeof cmsgs[i];
+}
+
+// GRO segment size of a received buffer, or 0 if it holds one datagram
+int gro_size(struct msghdr *mh)
+{
+#ifdef UDP_GRO
+	struct cmsghdr *cm;
+	for (cm = CMSG_FIRSTHDR(mh); cm != NULL; cm = CMSG_NXTHDR(mh, cm)) {
+		if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+			int seg;
+			memcpy(&seg, CMSG_DATA(cm), sizeof seg);
+			return seg;
+		}
+	}
+#endif
+	return 0;
+}
+
+// AES-256-CBC encrypt/decrypt (enc = 1 / 0); returns output length or -1
+int aes_crypt(int enc, const unsigned char *in, int in_len, unsigned char *out) {
+    EVP_CIPHER_CTX *ctx;
+    int len, out_len = -1;
+
+    if (!(ctx = EVP_CIPHER_CTX_new()))
+        return -1;
+
+    if (EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, AES_KEY, AES_IV, enc) == 1 &&
+        EVP_CipherUpdate(ctx, out, &len, in, in_len) == 1) {
+        out_len = len;
+        if (EVP_CipherFinal_ex(ctx, out + len, &len) == 1)
+            out_len += len;
+        else
+            out_len = -1;
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+    return out_len;
+}
+
+// Send one frame
+int send_frame(int fd, int type, const unsigned char *payload, int len) {
+	unsigned char frame[FRAME_HDR + FRAME_MAX];
+
+	frame[0] = (len >> 8) & 0xff;
+	frame[1] = len & 0xff;
+	frame[2] = type;
+	if (len > 0) {
+		memcpy(frame + FRAME_HDR, payload, len);
+	}
+	return send(fd, frame, FRAME_HDR + len, 0);
+}
+
+int send_chat(int fd, const char *text) {
+	unsigned char cipher[MAXDATASIZE + 16];
+	int len = aes_crypt(1, (const unsigned char *)text, strlen(text), cipher);
+	return len < 0 ? -1 : send_frame(fd, FRAME_CHAT, cipher, len);
+}
+
+// Receive one whole frame; returns payload length, -1 on error, FRAME_EOF on hangup
+int recv_frame(int fd, int *type, unsigned char *payload) {
+	unsigned char hdr[FRAME_HDR];
+	int n = recv(fd, hdr, FRAME_HDR, MSG_WAITALL);
+	if (n == -1) return -1;
+	if (n < FRAME_HDR) return FRAME_EOF;
+
+	int len = (hdr[0] << 8) | hdr[1];
+	if (len > FRAME_MAX) {
+		fprintf(stderr, "listener: oversized frame\n");
+		return -1;
+	}
+	if (len > 0 && (n = recv(fd, payload, len, MSG_WAITALL)) < len) {
+		return n == -1 ? -1 : FRAME_EOF;
+	}
+	*type = hdr[2];
+	return len;
+}
+
+uint64_t get_be(const unsigned char *p, int n) {
+	uint64_t v = 0;
+	while (n-- > 0) v = (v << 8) | *p++;
+	return v;
+}
+
+// Decrypt and print a chat frame [len][type][ciphertext]
+void print_chat(const unsigned char *frame, int len, const char *tag) {
+	char text[FRAME_MAX + 32];
+	int n;
+
+	if (len < FRAME_HDR || frame[2] != FRAME_CHAT ||
+			(n = aes_crypt(0, frame + FRAME_HDR, len - FRAME_HDR, (unsigned char *)text)) < 0) {
+		fprintf(stderr, "listener: undecryptable message\n");
+		return;
+	}
+	text[n] = '\0';
+	printf("%s%s%s", tag, text, n > 0 && text[n - 1] == '\n' ? "" : "\n");
+	fflush(stdout);
+}
+
+// Ask the server for [first, first + count), NAK_MAX at a time
+void send_nak(uint64_t first, uint64_t count) {
+	unsigned char nak[10];
+
+	if (count > MCAST_HISTORY) {   // the server cannot have more than this
+		rx_lost += count - MCAST_HISTORY;
+		first += count - MCAST_HISTORY;
+		count = MCAST_HISTORY;
+	}
+	while (count > 0) {
+		int n = count > NAK_MAX ? NAK_MAX : count;
+		for (int k = 0; k < 8; k++) nak[k] = first >> (56 - 8 * k);
+		nak[8] = n >> 8;
+		nak[9] = n & 0xff;
+		send_frame(chat_fd, FRAME_NAK, nak, sizeof nak);
+		rx_naks++;
+		first += n;
+		count -= n;
+	}
+}
+
+// One multicast datagram, straight from the group or resent over TCP
+void mcast_datagram(const unsigned char *d, int len, int repaired) {
+	if (len < MCAST_HDR || get_be(d, 4) != MCAST_MAGIC || !started) return;
+
+	uint32_t epoch = get_be(d + 4, 4);
+	uint64_t seq = get_be(d + 8, 8);
+	int kind = d[16], rl = d[17];
+	if (MCAST_HDR + rl > len) return;
+
+	if (epoch != rx_epoch) {   // the server restarted cold: a new stream
+		rx_epoch = epoch;
+		rx_next = seq;
+		memset(seen, 0, sizeof seen);
+	}
+
+	// Anything between what we expected and this datagram went missing
+	uint64_t upto = kind == MCAST_HEARTBEAT ? seq + 1 : seq;
+	if (upto > rx_next) {
+		send_nak(rx_next, upto - rx_next);
+		rx_next = upto;
+	}
+	if (kind != MCAST_DATA) return;
+
+	if (seen[seq & (MCAST_HISTORY - 1)] == seq + 1) return;   // already shown
+	seen[seq & (MCAST_HISTORY - 1)] = seq + 1;
+	if (seq >= rx_next) rx_next = seq + 1;
+
+	rx_msgs++;
+	if (repaired) rx_repaired++;
+	if ((int)strlen(room) == rl && memcmp(d + MCAST_HDR, room, rl) == 0) {
+		print_chat(d + MCAST_HDR + rl, len - MCAST_HDR - rl, repaired ? "(repaired) " : "");
+	}
+}
+
+// Handle one frame from the chat server; -1 when the connection is gone
+int chat_frame(void) {
+	unsigned char payload[FRAME_MAX];
+	int type, len = recv_frame(chat_fd, &type, payload);
+
+	if (len < 0) return -1;
+	switch (type) {
+	case FRAME_PING:
+		send_frame(chat_fd, FRAME_PONG, NULL, 0);
+		break;
+	case FRAME_NOTICE:
+		printf("%.*s", len, payload);
+		fflush(stdout);
+		break;
+	case FRAME_CHAT: {   // direct replies (welcome, /join) still come over TCP
+		unsigned char frame[FRAME_HDR + FRAME_MAX] = { 0, 0, FRAME_CHAT };
+		memcpy(frame + FRAME_HDR, payload, len);
+		print_chat(frame, FRAME_HDR + len, "");
+		break;
+	}
+	case FRAME_MCAST:
+		if (len >= 12) {
+			rx_epoch = get_be(payload, 4);
+			rx_next = get_be(payload + 4, 8);
+			started = 1;
+		}
+		break;
+	case FRAME_REPAIR:
+		mcast_datagram(payload, len, 1);
+		break;
+	}
+	return 0;
+}
+
+// Log in to the chat server over TCP and ask for multicast delivery
+int chat_connect(const char *server, const char *name) {
+	struct addrinfo hints, *ai, *p;
+	char host[256], port[16] = CHATPORT;
+	const char *colon = strrchr(server, ':');
+	int rv;
+
+	snprintf(host, sizeof host, "%.*s", colon ? (int)(colon - server) : (int)strlen(server), server);
+	if (colon) snprintf(port, sizeof port, "%s", colon + 1);
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if ((rv = getaddrinfo(host, port, &hints, &ai)) != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+		return -1;
+	}
+	for (p = ai; p != NULL; p = p->ai_next) {
+		if ((chat_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) continue;
+		if (connect(chat_fd, p->ai_addr, p->ai_addrlen) == 0) break;
+		close(chat_fd);
+		chat_fd = -1;
+	}
+	freeaddrinfo(ai);
+	if (chat_fd == -1) {
+		perror("listener: connect");
+		return -1;
+	}
+
+	char cmd[80];
+	send_chat(chat_fd, name);
+	if (strcmp(room, "lobby") != 0) {
+		snprintf(cmd, sizeof cmd, "/join %s", room);
+		send_chat(chat_fd, cmd);
+	}
+	send_frame(chat_fd, FRAME_MCAST, NULL, 0);
+	return 0;
+}
+
+// Join the group and print room traffic until the server hangs up
+int mcast_receive(const char *spec, const char *server, const char *name) {
+	char group[64], ifaddr[64] = "0.0.0.0";
+	int port, sockfd, on = 1, rcvbuf = RCVBUF, i, n;
+	struct ip_mreq mreq;
+	struct sockaddr_in sin;
+
+	if (sscanf(spec, "%63[^:]:%d@%63s", group, &port, ifaddr) < 2 ||
+			inet_pton(AF_INET, group, &mreq.imr_multiaddr) != 1 ||
+			inet_pton(AF_INET, ifaddr, &mreq.imr_interface) != 1) {
+		fprintf(stderr, "listener: bad multicast group %s (want group:port[@ifaddr])\n", spec);
+		return 1;
+	}
+
+	// Several receivers on one host may share the group port
+	memset(&sin, 0, sizeof sin);
+	sin.sin_family = AF_INET;
+	sin.sin_port = htons(port);
+	sin.sin_addr = mreq.imr_multiaddr;
+	if ((sockfd = socket(AF_INET, SOCK_DGRAM, 0)) == -1 ||
+			setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on) == -1 ||
+			bind(sockfd, (struct sockaddr *)&sin, sizeof sin) == -1 ||
+			setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof mreq) == -1) {
+		perror("listener: multicast");
+		return 2;
+	}
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+
+	if (chat_connect(server, name) == -1) {
+		return 2;
+	}
+	printf("listener: %s receiving room '%s' from %s\n", name, room, spec);
+	fflush(stdout);
+
+	for (i = 0; i < RX_BATCH; i++) {
+		ring_reset(i);
+	}
+
+	while (1) {
+		fd_set fds;
+		FD_ZERO(&fds);
+		FD_SET(sockfd, &fds);
+		FD_SET(chat_fd, &fds);
+		if (select((sockfd > chat_fd ? sockfd : chat_fd) + 1, &fds, NULL, NULL, NULL) == -1) {
+			if (errno == EINTR) continue;
+			perror("select");
+			return 4;
+		}
+
+		if (FD_ISSET(chat_fd, &fds) && chat_frame() == -1) {
+			break;
+		}
+		if (FD_ISSET(sockfd, &fds)) {
+			n = recvmmsg(sockfd, msgs, RX_BATCH, MSG_DONTWAIT, NULL);
+			for (i = 0; i < n; i++) {
+				mcast_datagram((unsigned char *)bufs[i], msgs[i].msg_len, 0);
+				ring_reset(i);
+			}
+		}
+	}
+
+	printf("listener: server closed the connection (%llu messages, %llu repaired, "
+		"%llu NAKs, %llu unrecoverable)\n",
+		(unsigned long long)rx_msgs, (unsigned long long)rx_repaired,
+		(unsigned long long)rx_naks, (unsigned long long)rx_lost);
+	return 0;
+}
+
+void run_report(const char *why)
+{
+	double secs = stats.last - stats.first;
+	uint64_t expected = stats.max_seq + 1;
+
+	if (!stats.active) return;
+	if (secs <= 0) secs = 1e-9;
+	printf("run %u: %d bytes  %llu packets  %.0f pkt/s  %.1f Mbit/s  loss %.2f%%  (avg batch %.1f, %s)\n",
+		stats.run, stats.size, (unsigned long long)stats.packets,
+		stats.packets / secs, stats.bytes * 8 / secs / 1e6,
+		expected > stats.packets ? 100.0 * (expected - stats.packets) / expected : 0.0,
+		calls ? (double)datagrams / calls : 0.0, why);
+	fflush(stdout);
+	stats.active = 0;
+}
+
+// Account one datagram
+void on_datagram(char *data, int len, struct sockaddr_storage *from, double now)
+{
+	bench_hdr_t h;
+	char s[INET6_ADDRSTRLEN];
+
+	if (len < (int)sizeof h || (memcpy(&h, data, sizeof h), h.magic != BENCH_MAGIC)) {
+		printf("listener: got packet from %s\n",
+			inet_ntop(from->ss_family, get_in_addr((struct sockaddr *)from), s, sizeof s));
+		printf("listener: packet is %d bytes long\n", len);
+		printf("listener: packet contains \"%.*s\"\n", len, data);
+		fflush(stdout);
+		return;
+	}
+
+	if (have_done && h.run == done_run) {
+		return;   // stragglers and repeated end markers of a finished run
+	}
+	if (!stats.active || h.run != stats.run) {
+		run_report("superseded");
+		memset(&stats, 0, sizeof stats);
+		stats.run = h.run;
+		stats.active = 1;
+		stats.first = now;
+		calls = datagrams = 0;
+	}
+
+	if (h.seq == BENCH_END) {
+		uint64_t sent;
+		if (len >= (int)(sizeof h + sizeof sent)) {
+			memcpy(&sent, data + sizeof h, sizeof sent);
+			if (sent > 0) stats.max_seq = sent - 1;
+		}
+		run_report("complete");
+		done_run = h.run;
+		have_done = 1;
+		return;
+	}
+
+	stats.packets++;
+	stats.bytes += len;
+	stats.size = len;
+	stats.last = now;
+	if (h.seq > stats.max_seq) stats.max_seq = h.seq;
+}
+
+int main(int argc, char *argv[])
+{
+	int sockfd;
+	struct addrinfo hints, *servinfo, *p;
+	int rv, i, n, opt;
+	int on = 1, rcvbuf = RCVBUF;
+	const char *group = NULL, *server = "localhost", *name = "listener";
+
+	while ((opt = getopt(argc, argv, "m:c:u:r:")) != -1) {
+		switch (opt) {
+		case 'm': group = optarg; break;
+		case 'c': server = optarg; break;
+		case 'u': name = optarg; break;
+		case 'r': snprintf(room, sizeof room, "%s", optarg); break;
+		default:
+			fprintf(stderr, "usage: listener\n"
+				"       listener -m group:port[@ifaddr] [-c server[:port]] [-u name] [-r room]\n");
+			return 1;
+		}
+	}
+	if (group != NULL) {
+		return mcast_receive(group, server, name);
+	}
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET6; // set to AF_INET to use IPv4
+	hints.ai_socktype = SOCK_DGRAM;
+	hints.ai_flags = AI_PASSIVE; // use my IP
+
+	if ((rv = getaddrinfo(NULL, MYPORT, &hints, &servinfo)) != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+		return 1;
+	}
+
+	// loop through all the results and bind to the first we can
+	for(p = servinfo; p != NULL; p = p->ai_next) {
+		if ((sockfd = socket(p->ai_family, p->ai_socktype,
+				p->ai_protocol)) == -1) {
+			perror("listener: socket");
+			continue;
+		}
+
+		if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) {
+			close(sockfd);
+			perror("listener: bind");
+			continue;
+		}
+
+		break;
+	}
+
+	if (p == NULL) {
+		fprintf(stderr, "listener: failed to bind socket\n");
+		return 2;
+	}
+
+	freeaddrinfo(servinfo);
+
+	// A deep receive queue absorbs bursts between batches
+	setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof rcvbuf);
+#ifdef UDP_GRO
+	if (setsockopt(sockfd, SOL_UDP, UDP_GRO, &on, sizeof on) == -1) {
+		printf("listener: UDP GRO not available\n");
+	}
+#endif
+	(void)on;
+
+	for (i = 0; i < RX_BATCH; i++) {
+		ring_reset(i);
+	}
+
+	printf("listener: waiting to recvmmsg...\n");
+	fflush(stdout);
+
+	while (1) {
+		// Block for the first datagram, then take whatever else is queued
+		n = recvmmsg(sockfd, msgs, RX_BATCH, MSG_WAITFORONE, NULL);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			perror("recvmmsg");
+			exit(1);
+		}
+
+		double now = now_sec();
+		calls++;
+		for (i = 0; i < n; i++) {
+			int len = msgs[i].msg_len;
+			int seg = gro_size(&msgs[i].msg_hdr);
+			if (seg <= 0 || seg > len) seg = len;
+
+			for (int off = 0; off < len; off += seg) {
+				int l = len - off < seg ? len - off : seg;
+				on_datagram(bufs[i] + off, l, &addrs[i], now);
+				datagrams++;
+			}
+			ring_reset(i);
+		}
+	}
+
+	close(sockfd);
+
+	return 0;
+}
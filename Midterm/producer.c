@@ -0,0 +1,276 @@
+/* ** producer.c -- a same-host message producer for the chat server
+**
+** Connects to the server's AF_UNIX socket, logs in, and hands the server a
+** shared-memory ring. Lines from stdin (or -n generated messages) are then
+** written into the ring; the server only needs a wakeup frame when it was
+** about to sleep, so a busy producer makes no syscall per message.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/mman.h>
+#include <openssl/evp.h>
+
+#define LOCAL_SOCK   "/tmp/chat_server.3490.sock"
+
+#define MAXDATASIZE 1024
+
+// Wire framing - must match server
+#define FRAME_HDR     3
+#define FRAME_MAX     (MAXDATASIZE + 64)
+enum {
+	FRAME_CHAT = 1, FRAME_NOTICE, FRAME_PING, FRAME_PONG,
+	FRAME_PEER_HELLO, FRAME_RELAY, FRAME_MCAST, FRAME_NAK, FRAME_REPAIR, FRAME_RING
+};
+
+// Ring layout - must match server
+#define RING_MAGIC   0x52494e47   // "RING"
+#define RING_SLOTS   1024
+
+typedef struct {
+	uint32_t magic;
+	uint32_t slots;
+	_Alignas(64) _Atomic uint32_t head;
+	_Alignas(64) _Atomic uint32_t tail;
+	_Atomic uint32_t sleeping;
+	_Alignas(64) struct {
+		uint16_t len;
+		char text[MAXDATASIZE];
+	} slot[RING_SLOTS];
+} ring_t;
+
+// AES-256 key and IV - must match server
+static const unsigned char AES_KEY[32] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+    0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F
+};
+
+static const unsigned char AES_IV[16] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F
+};
+
+int sockfd;
+ring_t *ring;
+unsigned long doorbells, stalls;
+
+// AES-256-CBC encrypt
+int aes_encrypt(const unsigned char *in, int in_len, unsigned char *out) {
+    EVP_CIPHER_CTX *ctx;
+    int len, out_len = -1;
+
+    if (!(ctx = EVP_CIPHER_CTX_new()))
+        return -1;
+
+    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, AES_KEY, AES_IV) == 1 &&
+        EVP_EncryptUpdate(ctx, out, &len, in, in_len) == 1) {
+        out_len = len;
+        if (EVP_EncryptFinal_ex(ctx, out + len, &len) == 1)
+            out_len += len;
+        else
+            out_len = -1;
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+    return out_len;
+}
+
+// Send one frame (one packet)
+int send_frame(int type, const void *payload, int len) {
+	unsigned char frame[FRAME_HDR + FRAME_MAX];
+
+	frame[0] = (len >> 8) & 0xff;
+	frame[1] = len & 0xff;
+	frame[2] = type;
+	memcpy(frame + FRAME_HDR, payload, len);
+	return send(sockfd, frame, FRAME_HDR + len, MSG_NOSIGNAL);
+}
+
+int send_chat(const char *text) {
+	unsigned char cipher[MAXDATASIZE + 16];
+	int len = aes_encrypt((const unsigned char *)text, strlen(text), cipher);
+	return len < 0 ? -1 : send_frame(FRAME_CHAT, cipher, len);
+}
+
+// Read one packet; returns its frame type, 0 if none is waiting, -1 on hangup.
+// Room traffic is discarded, but it must be read or the server drops us as a
+// slow reader.
+int recv_packet(int flags, unsigned char *pkt, int *len) {
+	int n = recv(sockfd, pkt, FRAME_HDR + FRAME_MAX, flags);
+	if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+	if (n < FRAME_HDR) return -1;
+	*len = n - FRAME_HDR;
+	if (pkt[2] == FRAME_PING) {
+		send_frame(FRAME_PONG, NULL, 0);
+	}
+	return pkt[2];
+}
+
+void drain_socket(void) {
+	unsigned char pkt[FRAME_HDR + FRAME_MAX];
+	int len, type;
+
+	while ((type = recv_packet(MSG_DONTWAIT, pkt, &len)) > 0)
+		;
+	if (type == -1) {
+		fprintf(stderr, "producer: server closed the connection\n");
+		exit(1);
+	}
+}
+
+// Wait for the server's notice (skipping room traffic); returns its text
+int wait_notice(char *buf, int size) {
+	unsigned char pkt[FRAME_HDR + FRAME_MAX];
+	int len, type;
+
+	while ((type = recv_packet(0, pkt, &len)) != -1) {
+		if (type == FRAME_NOTICE) {
+			snprintf(buf, size, "%.*s", len, (char *)pkt + FRAME_HDR);
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// Create the ring and give it to the server
+int ring_create(char *name, int size) {
+	snprintf(name, size, "/chat_ring.%d", (int)getpid());
+	int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+	if (fd == -1 || ftruncate(fd, sizeof(ring_t)) == -1) {
+		perror("producer: shm_open");
+		return -1;
+	}
+	ring = mmap(NULL, sizeof(ring_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (ring == MAP_FAILED) {
+		perror("producer: mmap");
+		shm_unlink(name);
+		return -1;
+	}
+	ring->magic = RING_MAGIC;
+	ring->slots = RING_SLOTS;
+
+	char reply[128];
+	if (send_frame(FRAME_RING, name, strlen(name)) == -1 || wait_notice(reply, sizeof reply) == -1 ||
+			strncmp(reply, "Ring attached", 13) != 0) {
+		fprintf(stderr, "producer: server refused the ring\n");
+		shm_unlink(name);
+		return -1;
+	}
+	return 0;
+}
+
+// Ring the doorbell only if the server asked for one (it is about to sleep)
+void doorbell(void) {
+	if (atomic_load(&ring->sleeping) && atomic_exchange(&ring->sleeping, 0)) {
+		send_frame(FRAME_RING, NULL, 0);
+		doorbells++;
+	}
+}
+
+void ring_publish(const char *text) {
+	uint32_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	int len = strlen(text);
+
+	// Full: the server is behind, make sure it is awake and wait for a slot
+	while (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= RING_SLOTS) {
+		doorbell();
+		drain_socket();
+		sched_yield();
+		stalls++;
+	}
+	if (len > MAXDATASIZE) len = MAXDATASIZE;
+	ring->slot[head & (RING_SLOTS - 1)].len = len;
+	memcpy(ring->slot[head & (RING_SLOTS - 1)].text, text, len);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_seq_cst);
+	doorbell();
+}
+
+double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = LOCAL_SOCK, *name = "producer", *room = NULL;
+	long count = -1;
+	int opt;
+	char ring_name[64], buf[MAXDATASIZE + 2];
+
+	while ((opt = getopt(argc, argv, "s:u:r:n:")) != -1) {
+		switch (opt) {
+		case 's': path = optarg; break;
+		case 'u': name = optarg; break;
+		case 'r': room = optarg; break;
+		case 'n': count = atol(optarg); break;
+		default:
+			fprintf(stderr, "usage: producer [-s socket] [-u name] [-r room] [-n count]\n");
+			exit(1);
+		}
+	}
+
+	struct sockaddr_un sun;
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	strncpy(sun.sun_path, path, sizeof(sun.sun_path) - 1);
+	if ((sockfd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1 ||
+			connect(sockfd, (struct sockaddr *)&sun, sizeof sun) == -1) {
+		perror("producer: connect");
+		return 2;
+	}
+
+	// Banner, then log in like any other client
+	if (wait_notice(buf, sizeof buf) == -1 || send_chat(name) == -1) {
+		fprintf(stderr, "producer: login failed\n");
+		return 2;
+	}
+	if (room != NULL) {
+		snprintf(buf, sizeof buf, "/join %s", room);
+		send_chat(buf);
+	}
+	if (ring_create(ring_name, sizeof ring_name) == -1) {
+		return 2;
+	}
+	fprintf(stderr, "producer: publishing as %s via %s\n", name, ring_name);
+
+	long sent = 0;
+	double start = now_sec();
+	while (count == -1 ? fgets(buf, sizeof buf, stdin) != NULL : sent < count) {
+		if (count == -1) {
+			buf[strcspn(buf, "\n")] = '\0';
+		} else {
+			snprintf(buf, sizeof buf, "message %ld", sent);
+		}
+		ring_publish(buf);
+		if (++sent % 64 == 0) drain_socket();
+	}
+
+	// Wait until the server has taken everything out of the ring
+	while (atomic_load(&ring->tail) != atomic_load(&ring->head)) {
+		doorbell();
+		drain_socket();
+		usleep(100);
+	}
+	double secs = now_sec() - start;
+
+	fprintf(stderr, "producer: %ld messages in %.3f s (%.0f msg/s), %lu doorbells, %lu full-ring waits\n",
+		sent, secs, secs > 0 ? sent / secs : 0.0, doorbells, stalls);
+	shm_unlink(ring_name);
+	close(sockfd);
+	return 0;
+}
@@ -0,0 +1,627 @@
+/* ** replay.c -- re-drive a recorded chat journal against a server
+**
+** Reads a journal and plays it against a running server with one connection
+** per user, keeping the recorded arrival times, or -x times faster. The
+** journal is either a server history log (-L, what `server -L` writes) or
+** text, one event per line:
+**
+**     <ms> <user> <room> +        connect and join the room
+**     <ms> <user> <room> <text>   say something (joining the room first
+**                                 if the user is elsewhere)
+**     <ms> <user> <room> -        quit
+**
+** ms counts from any origin; lines may come in any order. A user with no
+** '+' connects -j ms before their first message, so a history log (which
+** holds messages only) replays with joins spread the way speakers came. -d
+** prints a journal as text instead of playing it, to edit or cut down.
+**
+** Each message gets a short marker (" ~" and a base-36 number) so copies
+** can be matched when they arrive. Latency runs from handing a message to
+** the socket to each copy arriving, and is reported as percentiles with the
+** throughput reached and how far the driver fell behind the schedule. The
+** server's per-address limits are sidestepped by spreading connections over
+** -s loopback addresses; its per-connection rate limit still paces a user
+** the journal (or -x) makes faster than CONN_MSG_RATE, as it would in life.
+** Start the server with -A 0 to let a join storm in as fast as it was
+** recorded.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/evp.h>
+
+#define PORT          "3490"
+#define MAXDATASIZE   1024
+#define ROOM_LEN      32
+#define DEFAULT_ROOM  "lobby"
+#define FRAME_HDR     3
+#define RBUF          4096
+#define TEXT_MAX      (MAXDATASIZE - 64)   // longest replayed text, leaving room for the marker
+#define LEAD_MS       1000                 // a user connects this long before their first message
+#define LINGER_MS     2000                 // wait for the last copies after the last event
+#define EV_BATCH      256
+
+enum { FRAME_CHAT = 1, FRAME_NOTICE, FRAME_PING, FRAME_PONG };
+enum { EV_CONNECT = 1, EV_SAY, EV_QUIT };   // also the order of events at the same ms
+
+static const char B36[] = "0123456789abcdefghijklmnopqrstuvwxyz";   // marker digits
+
+// AES-256 key and IV - must match server
+static const unsigned char AES_KEY[32] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+    0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F
+};
+
+static const unsigned char AES_IV[16] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F
+};
+
+typedef struct {
+	int64_t t;              // ms, journal time
+	int kind;
+	int user, room;
+	int seq;                // order in the journal, to keep ties stable
+	char *text;             // EV_SAY
+} event_t;
+
+typedef struct {
+	int fd;                 // -1 = not connected
+	int room;               // where the server has (or will have) us
+	int quitting;
+	unsigned char *out;     // frames not yet taken by the socket
+	int olen, ocap;
+	unsigned char in[RBUF];
+	int ilen;
+} user_t;
+
+// Interned strings (user and room names)
+typedef struct {
+	char **v;
+	int n, cap;
+	int *slot;              // open addressing, index + 1
+	int scap;
+} names_t;
+
+names_t users, rooms;
+user_t *conn;
+event_t *ev;
+int nev = 0, evcap = 0;
+
+EVP_CIPHER_CTX *cipher;
+int ep;
+struct sockaddr_in to;
+int sources = 0;
+
+int64_t *sent_ns;           // per marker: when it went to the socket, 0 = never
+int nsent = 0;
+uint32_t *lat_us;           // one sample per copy received
+uint64_t nlat = 0, latcap = 0;
+uint32_t *lag_us;           // per message: how late the driver was
+uint64_t closed_by_server = 0, failed = 0;
+
+int64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void *xrealloc(void *p, size_t n) {
+	if ((p = realloc(p, n)) == NULL) {
+		fprintf(stderr, "replay: out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+uint32_t fnv(const char *s) {
+	uint32_t h = 2166136261u;
+	while (*s != '\0') h = (h ^ (unsigned char)*s++) * 16777619u;
+	return h;
+}
+
+int intern(names_t *t, const char *s) {
+	if (2 * (t->n + 1) > t->scap) {
+		int cap = t->scap ? 2 * t->scap : 1024;
+		int *slot = xrealloc(NULL, cap * sizeof *slot);
+		memset(slot, 0, cap * sizeof *slot);
+		for (int k = 0; k < t->n; k++) {
+			uint32_t i = fnv(t->v[k]) & (cap - 1);
+			while (slot[i] != 0) i = (i + 1) & (cap - 1);
+			slot[i] = k + 1;
+		}
+		free(t->slot);
+		t->slot = slot;
+		t->scap = cap;
+	}
+	uint32_t i = fnv(s) & (t->scap - 1);
+	for (; t->slot[i] != 0; i = (i + 1) & (t->scap - 1)) {
+		if (strcmp(t->v[t->slot[i] - 1], s) == 0) return t->slot[i] - 1;
+	}
+	if (t->n == t->cap) {
+		t->cap = t->cap ? 2 * t->cap : 1024;
+		t->v = xrealloc(t->v, t->cap * sizeof *t->v);
+	}
+	t->v[t->n] = strdup(s);
+	t->slot[i] = t->n + 1;
+	return t->n++;
+}
+
+void add_event(int64_t t, int kind, const char *user, const char *room, const char *text, int len) {
+	if (nev == evcap) {
+		evcap = evcap ? 2 * evcap : 4096;
+		ev = xrealloc(ev, evcap * sizeof *ev);
+	}
+	event_t *e = &ev[nev];
+	e->t = t;
+	e->kind = kind;
+	e->user = intern(&users, user);
+	e->room = intern(&rooms, room);
+	e->seq = nev++;
+	e->text = NULL;
+	if (kind == EV_SAY) {
+		if (len > TEXT_MAX) len = TEXT_MAX;
+		e->text = xrealloc(NULL, len + 1);
+		memcpy(e->text, text, len);
+		e->text[len] = '\0';
+	}
+}
+
+// Server history log: [u32 length][i64 ms][u8 room length][room][u8 name
+// length][name][text], host byte order
+void load_history(FILE *f) {
+	static unsigned char rec[8 + 2 + 2 * 255 + MAXDATASIZE];
+	uint32_t body;
+
+	while (fread(&body, 4, 1, f) == 1) {
+		if (body < 10 || body > sizeof rec || fread(rec, 1, body, f) != body) break;
+		int rlen = rec[8];
+		if (10 + rlen > (int)body || 10 + rlen + rec[9 + rlen] > (int)body) break;
+		int nlen = rec[9 + rlen];
+		int64_t ms;
+		char room[256], name[256];
+		memcpy(&ms, rec, 8);
+		memcpy(room, rec + 9, rlen);
+		room[rlen] = '\0';
+		memcpy(name, rec + 10 + rlen, nlen);
+		name[nlen] = '\0';
+		char *text = (char *)rec + 10 + rlen + nlen;
+		int len = body - 10 - rlen - nlen;
+		int k = len;
+		while (k > 0 && text[k - 1] != '\0' && strchr(B36, text[k - 1]) != NULL) k--;
+		if (k >= 2 && k < len && text[k - 1] == '~' && text[k - 2] == ' ') len = k - 2;   // logged from an earlier replay
+		add_event(ms, EV_SAY, name, room, text, len);
+	}
+}
+
+void load_text(FILE *f) {
+	char *line = NULL, user[64], room[ROOM_LEN];
+	size_t cap = 0;
+	ssize_t len;
+	int lineno = 0;
+
+	while ((len = getline(&line, &cap, f)) != -1) {
+		long long ms;
+		int used;
+		lineno++;
+		while (len > 0 && (line[len - 1] == '\n' || line[len - 1] == '\r')) line[--len] = '\0';
+		if (len == 0 || line[0] == '#') continue;
+		if (sscanf(line, "%lld %63s %31s %n", &ms, user, room, &used) != 3 || used > len) {
+			fprintf(stderr, "replay: line %d: expected <ms> <user> <room> <text|+|->\n", lineno);
+			exit(1);
+		}
+		const char *rest = line + used;
+		if (strcmp(rest, "+") == 0) {
+			add_event(ms, EV_CONNECT, user, room, NULL, 0);
+		} else if (strcmp(rest, "-") == 0) {
+			add_event(ms, EV_QUIT, user, room, NULL, 0);
+		} else if (*rest != '\0') {
+			add_event(ms, EV_SAY, user, room, rest, len - used);
+		}
+	}
+	free(line);
+}
+
+int event_cmp(const void *a, const void *b) {
+	const event_t *x = a, *y = b;
+	if (x->t != y->t) return x->t < y->t ? -1 : 1;
+	if (x->kind != y->kind) return x->kind - y->kind;
+	return x->seq - y->seq;
+}
+
+// Connect users who speak without having connected (or after quitting)
+// lead ms before they do, then put everything in time order
+void plan(int64_t lead) {
+	int64_t origin = INT64_MAX;
+	int n = nev;
+	char *online = calloc(users.n, 1);
+
+	qsort(ev, nev, sizeof *ev, event_cmp);
+	for (int i = 0; i < n; i++) {
+		event_t e = ev[i];
+		if (e.kind == EV_CONNECT) {
+			online[e.user] = 1;
+		} else if (e.kind == EV_QUIT) {
+			online[e.user] = 0;
+		} else if (!online[e.user]) {
+			add_event(e.t - lead, EV_CONNECT, users.v[e.user], rooms.v[e.room], NULL, 0);
+			online[e.user] = 1;
+		}
+	}
+	free(online);
+	qsort(ev, nev, sizeof *ev, event_cmp);
+	for (int i = 0; i < nev; i++) {
+		if (ev[i].t < origin) origin = ev[i].t;
+	}
+	for (int i = 0; i < nev; i++) {
+		ev[i].t -= origin;
+		ev[i].seq = i;
+	}
+}
+
+void queue_frame(user_t *u, int type, const unsigned char *payload, int len) {
+	if (u->olen + FRAME_HDR + len > u->ocap) {
+		u->ocap = 2 * (u->olen + FRAME_HDR + len);
+		u->out = xrealloc(u->out, u->ocap);
+	}
+	unsigned char *p = u->out + u->olen;
+	p[0] = (len >> 8) & 0xff;
+	p[1] = len & 0xff;
+	p[2] = type;
+	memcpy(p + FRAME_HDR, payload, len);
+	u->olen += FRAME_HDR + len;
+}
+
+int aes(int enc, const unsigned char *in, int len, unsigned char *out) {
+	int n, fin;
+	if (EVP_CipherInit_ex(cipher, EVP_aes_256_cbc(), NULL, AES_KEY, AES_IV, enc) != 1 ||
+			EVP_CipherUpdate(cipher, out, &n, in, len) != 1 ||
+			EVP_CipherFinal_ex(cipher, out + n, &fin) != 1) {
+		return -1;
+	}
+	return n + fin;
+}
+
+void queue_chat(user_t *u, const char *text) {
+	unsigned char ciphertext[MAXDATASIZE + 16];
+	int n = aes(1, (const unsigned char *)text, strlen(text), ciphertext);
+	if (n > 0) queue_frame(u, FRAME_CHAT, ciphertext, n);
+}
+
+void drop(user_t *u) {
+	if (u->fd == -1) return;
+	if (!u->quitting) closed_by_server++;
+	close(u->fd);
+	u->fd = -1;
+	u->olen = u->ilen = 0;
+}
+
+void flush_out(user_t *u) {
+	int off = 0;
+	while (off < u->olen) {
+		ssize_t n = send(u->fd, u->out + off, u->olen - off, MSG_NOSIGNAL);
+		if (n > 0) {
+			off += n;
+			continue;
+		}
+		if (n == -1 && (errno == EAGAIN || errno == ENOTCONN)) break;
+		drop(u);
+		return;
+	}
+	memmove(u->out, u->out + off, u->olen - off);
+	u->olen -= off;
+	struct epoll_event e = { EPOLLIN | (u->olen > 0 ? EPOLLOUT : 0), { .u32 = (uint32_t)(u - conn) } };
+	epoll_ctl(ep, EPOLL_CTL_MOD, u->fd, &e);
+}
+
+// Log in and go to the room; the server takes the frames in order, so
+// nothing has to wait for its replies
+void open_user(int id, int room) {
+	user_t *u = &conn[id];
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0), yes = 1;
+	if (fd == -1) {
+		failed++;
+		return;
+	}
+	if (sources > 0) {
+		struct sockaddr_in from;
+		memset(&from, 0, sizeof from);
+		from.sin_family = AF_INET;
+		from.sin_addr.s_addr = htonl(0x7f000000 | (1 + id % sources));
+		setsockopt(fd, IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, &yes, sizeof yes);
+		bind(fd, (struct sockaddr *)&from, sizeof from);
+	}
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);
+	if (connect(fd, (struct sockaddr *)&to, sizeof to) == -1 && errno != EINPROGRESS) {
+		close(fd);
+		failed++;
+		return;
+	}
+	u->fd = fd;
+	u->quitting = 0;
+	u->olen = u->ilen = 0;
+	struct epoll_event e = { EPOLLIN | EPOLLOUT, { .u32 = (uint32_t)id } };
+	epoll_ctl(ep, EPOLL_CTL_ADD, fd, &e);
+	queue_chat(u, users.v[id]);
+	u->room = intern(&rooms, DEFAULT_ROOM);
+	if (room != u->room) {
+		char cmd[8 + ROOM_LEN];
+		snprintf(cmd, sizeof cmd, "/join %s", rooms.v[room]);
+		queue_chat(u, cmd);
+		u->room = room;
+	}
+}
+
+void fire(const event_t *e, int64_t late_ns) {
+	user_t *u = &conn[e->user];
+	char msg[MAXDATASIZE];
+
+	switch (e->kind) {
+	case EV_CONNECT:
+		if (u->fd == -1) open_user(e->user, e->room);
+		return;
+	case EV_QUIT:
+		if (u->fd == -1) return;
+		queue_chat(u, "quit");
+		u->quitting = 1;   // the server closes on us
+		break;
+	case EV_SAY:
+		if (u->fd == -1) open_user(e->user, e->room);   // quit and back, or the connect failed
+		if (u->fd == -1) return;
+		if (u->room != e->room) {
+			snprintf(msg, sizeof msg, "/join %s", rooms.v[e->room]);
+			queue_chat(u, msg);
+			u->room = e->room;
+		}
+		int seq = nsent++;
+		char mark[16];
+		int m = sizeof mark;
+		mark[--m] = '\0';
+		for (int v = seq; m == (int)sizeof mark - 1 || v > 0; v /= 36) mark[--m] = B36[v % 36];
+		snprintf(msg, sizeof msg, "%s ~%s", e->text, mark + m);
+		queue_chat(u, msg);
+		sent_ns[seq] = now_ns();
+		lag_us[seq] = late_ns > 0 ? late_ns / 1000 : 0;
+		break;
+	}
+	flush_out(u);
+}
+
+// A copy of someone's message: find its marker and take the sample (join
+// notices and anything else without one are not ours)
+void delivered(const char *text, int len, int64_t now) {
+	int i = len;
+	while (i > 0 && text[i - 1] != '~') i--;
+	if (i < 2 || i == len || text[i - 2] != ' ') return;
+	long seq = 0;
+	for (int k = i; k < len && seq < nsent; k++) {
+		const char *d = text[k] != '\0' ? strchr(B36, text[k]) : NULL;
+		if (d == NULL) return;
+		seq = seq * 36 + (d - B36);
+	}
+	if (seq >= nsent || sent_ns[seq] == 0) return;
+	if (nlat == latcap) {
+		latcap = latcap ? 2 * latcap : 1 << 16;
+		lat_us = xrealloc(lat_us, latcap * sizeof *lat_us);
+	}
+	int64_t us = (now - sent_ns[seq]) / 1000;
+	lat_us[nlat++] = us > UINT32_MAX ? UINT32_MAX : us;
+}
+
+void readable(user_t *u, int64_t now) {
+	for (;;) {
+		ssize_t n = recv(u->fd, u->in + u->ilen, RBUF - u->ilen, 0);
+		if (n == 0 || (n == -1 && errno != EAGAIN)) {
+			drop(u);
+			return;
+		}
+		if (n == -1) return;
+		u->ilen += n;
+		int off = 0;
+		while (u->ilen - off >= FRAME_HDR) {
+			unsigned char *p = u->in + off;
+			int len = (p[0] << 8) | p[1];
+			if (FRAME_HDR + len > RBUF) {
+				drop(u);   // bigger than any chat frame; not a server we know
+				return;
+			}
+			if (u->ilen - off < FRAME_HDR + len) break;
+			if (p[2] == FRAME_PING) {
+				queue_frame(u, FRAME_PONG, NULL, 0);
+				flush_out(u);
+				if (u->fd == -1) return;
+			} else if (p[2] == FRAME_CHAT) {
+				char text[RBUF + 16];
+				int tl = aes(0, p + FRAME_HDR, len, (unsigned char *)text);
+				if (tl > 0) delivered(text, tl, now);
+			}
+			off += FRAME_HDR + len;
+		}
+		memmove(u->in, u->in + off, u->ilen - off);
+		u->ilen -= off;
+	}
+}
+
+int cmp_u32(const void *a, const void *b) {
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+void percentiles(const char *what, uint32_t *v, uint64_t n) {
+	static const double pct[] = { 50, 90, 99, 99.9 };
+	printf("%-15s", what);
+	if (n == 0) {
+		printf(" none\n");
+		return;
+	}
+	qsort(v, n, sizeof *v, cmp_u32);
+	for (int p = 0; p < 4; p++) {
+		uint64_t k = (uint64_t)(n * pct[p] / 100.0);
+		printf(" p%g %.2f ms", pct[p], v[k < n ? k : n - 1] / 1e3);
+	}
+	printf(" max %.2f ms\n", v[n - 1] / 1e3);
+}
+
+int main(int argc, char *argv[]) {
+	double speed = 1;
+	int64_t lead = LEAD_MS, linger = LINGER_MS;
+	int history = 0, dump = 0, opt;
+	const char *usage = "usage: replay [-L] [-d] [-x speedup] [-j lead-ms] [-t linger-ms] [-s source-addresses] "
+		"journal [host[:port]]\n";
+
+	while ((opt = getopt(argc, argv, "Ldx:j:t:s:")) != -1) {
+		switch (opt) {
+		case 'L':   // the journal is a server history log
+			history = 1;
+			break;
+		case 'd':   // print it as a text journal instead
+			dump = 1;
+			break;
+		case 'x':
+			speed = atof(optarg);
+			break;
+		case 'j':
+			lead = atoll(optarg);
+			break;
+		case 't':
+			linger = atoll(optarg);
+			break;
+		case 's':
+			sources = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "%s", usage);
+			exit(1);
+		}
+	}
+	if (optind >= argc || speed <= 0 || sources < 0 || sources > 254) {
+		fprintf(stderr, "%s", usage);
+		exit(1);
+	}
+
+	FILE *f = strcmp(argv[optind], "-") == 0 ? stdin : fopen(argv[optind], "rb");
+	if (f == NULL) {
+		perror(argv[optind]);
+		exit(1);
+	}
+	if (history) load_history(f); else load_text(f);
+	if (f != stdin) fclose(f);
+	if (nev == 0) {
+		fprintf(stderr, "replay: %s holds no events\n", argv[optind]);
+		exit(1);
+	}
+	plan(lead);
+
+	if (dump) {
+		for (int i = 0; i < nev; i++) {
+			event_t *e = &ev[i];
+			printf("%lld %s %s %s\n", (long long)e->t, users.v[e->user], rooms.v[e->room],
+				e->kind == EV_SAY ? e->text : e->kind == EV_CONNECT ? "+" : "-");
+		}
+		return 0;
+	}
+
+	char host[256] = "127.0.0.1", port[16] = PORT;
+	if (optind + 1 < argc) {
+		char *colon = strrchr(argv[optind + 1], ':');
+		if (colon != NULL) {
+			snprintf(port, sizeof port, "%s", colon + 1);
+			*colon = '\0';
+		}
+		snprintf(host, sizeof host, "%s", argv[optind + 1]);
+	}
+	struct addrinfo hints, *ai;
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	int rv = getaddrinfo(host, port, &hints, &ai);
+	if (rv != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+		exit(1);
+	}
+	to = *(struct sockaddr_in *)ai->ai_addr;
+	freeaddrinfo(ai);
+	if (sources == 0 && (ntohl(to.sin_addr.s_addr) >> 24) == 127) {
+		sources = users.n < 254 ? users.n : 254;   // the server's per-address buckets are not the test
+	}
+
+	struct rlimit rl;
+	getrlimit(RLIMIT_NOFILE, &rl);
+	if (rl.rlim_max < (rlim_t)users.n + 64) {
+		fprintf(stderr, "replay: %d users need ulimit -n %d (hard limit is %llu)\n",
+			users.n, users.n + 64, (unsigned long long)rl.rlim_max);
+		exit(1);
+	}
+	rl.rlim_cur = users.n + 64;
+	setrlimit(RLIMIT_NOFILE, &rl);
+
+	int says = 0;
+	for (int i = 0; i < nev; i++) says += ev[i].kind == EV_SAY;
+	conn = calloc(users.n, sizeof *conn);
+	sent_ns = calloc(says + 1, sizeof *sent_ns);
+	lag_us = calloc(says + 1, sizeof *lag_us);
+	cipher = EVP_CIPHER_CTX_new();
+	ep = epoll_create1(EPOLL_CLOEXEC);
+	if (conn == NULL || sent_ns == NULL || lag_us == NULL || cipher == NULL || ep == -1) {
+		perror("replay");
+		exit(1);
+	}
+	for (int i = 0; i < users.n; i++) conn[i].fd = -1;
+
+	double span = ev[nev - 1].t / 1e3;
+	printf("replaying %d event(s): %d message(s) from %d user(s) in %d room(s), %.1f s of journal at x%g\n",
+		nev, says, users.n, rooms.n, span, speed);
+
+	struct epoll_event events[EV_BATCH];
+	int64_t start = now_ns(), end = -1;
+	int next = 0;
+	for (;;) {
+		int64_t now = now_ns();
+		while (next < nev && start + (int64_t)(ev[next].t * 1e6 / speed) <= now) {
+			fire(&ev[next], now - start - (int64_t)(ev[next].t * 1e6 / speed));
+			next++;
+		}
+		if (next == nev && end == -1) end = now_ns() + linger * 1000000;
+		now = now_ns();
+		if (end != -1 && now >= end) break;
+		int64_t wake = next < nev ? start + (int64_t)(ev[next].t * 1e6 / speed) : end;
+		int timeout = wake > now ? (int)((wake - now + 999999) / 1000000) : 0;
+		int n = epoll_wait(ep, events, EV_BATCH, timeout);
+		now = now_ns();
+		for (int k = 0; k < n; k++) {
+			user_t *u = &conn[events[k].data.u32];
+			if (u->fd == -1) continue;
+			if (events[k].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) readable(u, now);
+			if (u->fd != -1 && (events[k].events & EPOLLOUT)) flush_out(u);
+		}
+	}
+	double took = (end - start) / 1e9 - linger / 1e3;
+
+	printf("took            %.2f s for %.2f s of schedule\n", took, span / speed);
+	printf("sent            %d message(s), %.0f/s\n", nsent, nsent / took);
+	printf("received        %llu cop(ies), %.0f/s, %.1f per message\n", (unsigned long long)nlat,
+		nlat / took, nsent ? (double)nlat / nsent : 0);
+	percentiles("latency", lat_us, nlat);
+	percentiles("behind schedule", lag_us, nsent);
+	if (failed > 0 || closed_by_server > 0) {
+		printf("%llu connect(s) failed, %llu connection(s) closed by the server\n",
+			(unsigned long long)failed, (unsigned long long)closed_by_server);
+	}
+	return failed > 0 || closed_by_server > 0;
+}
@@ -1,6 +1,8 @@
 /* ** server_broadcast.c -- a chat server that broadcasts messages to all clients
 */ 
 
+#define _GNU_SOURCE   // accept4()
+
 #include <stdio.h> 
 #include <stdlib.h> 
 #include <unistd.h> 
@@ -8,19 +10,304 @@
 #include <string.h> 
 #include <sys/types.h> 
 #include <sys/socket.h> 
+#include <sys/un.h>
+#include <sys/stat.h>
 #include <netinet/in.h> 
 #include <netdb.h> 
 #include <arpa/inet.h> 
 #include <time.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <stdint.h>
+#include <limits.h>
+#include <stddef.h>
+#include <sys/time.h>
+#include <sys/mman.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/ioctl.h>
+#include <sched.h>
+#include <signal.h>
 #include <openssl/evp.h>
-#include <openssl/aes.h>
 #include <openssl/rand.h>
 #include <openssl/err.h>
+#include <openssl/ssl.h>
+#include <openssl/kdf.h>
+#include <openssl/x509.h>
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
 
 #define PORT "3490" // the port users will be connecting to 
-#define BACKLOG 10   // how many pending connections queue will hold 
-#define MAX_CLIENTS 10
+#define BACKLOG 1024   // how many pending connections queue will hold (capped by net.core.somaxconn)
+#define MAX_CLIENTS (1 << 20)   // slots are touched only once used, so this costs address space
+#define FD_RESERVE  1024        // descriptors beyond MAX_CLIENTS (listeners, peers, rings)
+#define EV_BATCH    256         // readiness events taken per epoll_wait()
 #define MAXDATASIZE 1024
+#define SIG_MAX     2420   // largest signature we take (ML-DSA-44; Ed25519 is 64)
+
+// Flood protection - token buckets charged on every recv(). Rates are per
+// second, bursts are the bucket depth. A connection (or address) that runs its
+// bucket dry is throttled: its socket is left out of the epoll read interest
+// until the bucket refills, so TCP flow control pushes back on the sender.
+#define CONN_MSG_RATE    20      // messages/sec per connection
+#define CONN_MSG_BURST   40
+#define CONN_BYTE_RATE   8192    // bytes/sec per connection
+#define CONN_BYTE_BURST  16384
+#define IP_MSG_RATE      50      // messages/sec shared by all connections from one IP
+#define IP_MSG_BURST     100
+#define IP_BYTE_RATE     32768   // bytes/sec shared by all connections from one IP
+#define IP_BYTE_BURST    65536
+#define IP_CONN_RATE     5       // new connections/sec per IP
+#define IP_CONN_BURST    20
+#define IP_TABLE_SIZE    (1 << 17)   // per-IP accounting slots (power of two); 3/4 of it bounds
+                                     // how many distinct addresses can be connected at once
+#define IP_COMPACT_MS    1000        // at most one table rebuild this often
+
+// Admission control - connection storms are shed before any per-client state
+// exists. When the accept bucket runs dry (or the server is full) the listener
+// is dropped from the read set and the kernel backlog absorbs the surge.
+#define ACCEPT_BATCH       64    // max connections accepted per wakeup
+#define ACCEPT_RATE        200   // accepts/sec for the whole server
+#define ACCEPT_BURST       400
+#define DEFER_ACCEPT_SECS  0     // TCP_DEFER_ACCEPT; only pays off for clients that speak first,
+                                 // and ours wait for the welcome banner
+#define OUTQ_MAX  (256 * 1024)   // queued output bytes before a slow reader is dropped
+
+// Buffer pool - a connection borrows a read buffer, and its first output
+// buffer, only while bytes are in flight and gives them back as soon as they
+// drain, so an idle connection holds nothing but its client_t.
+#define BUF_SIZE       4096      // one pooled buffer; holds a whole frame (FRAME_HDR + FRAME_MAX)
+#define BUF_POOL_KEEP  4096      // free buffers kept for reuse, the rest go back to malloc
+
+// Output lanes - what a connection cannot take right away waits by class.
+// Control frames (pings, notices, joins and leaves, handshake replies) go
+// first, always. Room chat waits in a lane per room, and the lanes share
+// what is left by deficit round robin, LANE_QUANTUM bytes x the room's
+// weight (-W room=weight) per turn.
+#define OUT_LANES      16        // bulk lanes per connection; more rooms than this share
+#define LANE_QUANTUM   2048      // bytes per round at weight 1
+#define OUT_FILL       BUF_SIZE  // bytes moved from the lanes to the socket queue at a time
+#define MAX_ROOM_WEIGHTS 16
+
+// Content filter (-F file) - banned terms and links, one per line, masked
+// out of chat before it is broadcast. The list is compiled into one
+// Aho-Corasick automaton and reloaded on SIGHUP.
+#define FILTER_MASK        '*'
+#define FILTER_TERM_MAX    255        // longest term, bytes
+#define FILTER_DFA_MAX     (1 << 26)  // transition table entries (x4 bytes) a list may compile to
+#define FILTER_SPARSE      16         // skip ahead with SIMD when at most this many bytes start a term
+
+// Presence roster - a FRAME_ROSTER subscriber gets its room's user list once,
+// then add/remove diffs. Changes are batched for ROSTER_BATCH_MS, so a join
+// storm costs each subscriber a frame or two per batch, not a line per join.
+#define ROSTER_BATCH_MS    100
+#define ROSTER_CHUNK       MAXDATASIZE   // payload bytes per roster frame
+#define ROSTER_HASH        1024          // buckets for rooms that have subscribers
+
+// Hot restart - a new binary started with -u connects here and the running
+// server passes it the listener and every client socket (SCM_RIGHTS).
+#define HANDOFF_SOCK     "/tmp/chat_server.%s.handoff"   // %s = listening port
+#define HANDOFF_MAGIC    0x43484154   // "CHAT"
+#define HANDOFF_VERSION  9            // bump whenever handoff_client_t changes
+
+// Same-host transports. Local clients connect to an AF_UNIX SOCK_SEQPACKET
+// socket and carry exactly one frame per packet. A local producer can also
+// hand over a shared-memory ring (FRAME_RING with the shm_open name) and
+// write messages into it without a syscall per message.
+#define LOCAL_SOCK   "/tmp/chat_server.%s.sock"   // %s = listening port
+#define RING_MAGIC   0x52494e47                   // "RING"
+#define RING_SLOTS   1024                         // power of two
+#define RING_NAME    64
+#define RING_BUDGET  256                          // messages taken from one ring per loop pass
+
+// TLS 1.3 listener (-c cert.pem). OpenSSL does the handshake; the record
+// keys then go to the kernel (kTLS) when it supports them, so broadcasts are
+// plain send()s of the frame. Chat on these connections is FRAME_TEXT.
+#define TLS_PORT     "3443"
+
+// Per-connection keys (FRAME_KEX). A client's X25519 share and ours give a
+// shared secret; HKDF-SHA256 turns it into a session secret and from that the
+// two AES-256 keys. The session secret also goes into a ticket, sealed with a
+// key only the server knows, so a reconnecting client skips the X25519 step.
+// The exchange is unauthenticated (use TLS when the server must prove who it is).
+#define KEX_RANDOM          32
+#define KEX_PUB             32           // X25519 public key
+#define TICKET_LEN          69           // [u8 key id][12 nonce][u64 expiry + 32 secret][16 tag]
+#define TICKET_LIFETIME_S   3600
+#define TICKET_ROTATE_MS    3600000      // a ticket key stays valid for one period after it retires
+
+// Signed chat (FRAME_SIGKEY / FRAME_SIGNED)
+#define SIG_KEY_MAX         1400         // DER public key (ML-DSA-44 is 1334 bytes)
+#define SIG_NONCE           16
+
+// Crypto pool - decrypting and verifying chat frames, and encrypting output
+// for clients with session keys, runs on worker threads so the loop thread
+// only does I/O. Results come back through an eventfd and are acted on in
+// each client's own order.
+#define CRYPTO_THREADS_MAX   16
+#define CRYPTO_BATCH         32          // jobs moved per lock round (hand-out, take, steal)
+#define CRYPTO_INFLIGHT_MAX  64          // chat frames per client in the pool; we stop reading it above this
+#define MB_LANES             16          // streams per multi-buffer AES pass
+#define AES_SCHED            240         // expanded AES-256 key: 15 round keys
+
+// Each room's crypto has an owner worker, found by consistent hashing: every
+// worker holds CRYPTO_VNODES points on a 32-bit ring and a room belongs to
+// the first point at or after its hash. A client's jobs go to the owner of
+// its room, so a broadcast is encrypted on one core, in order, and a client
+// that changes room takes its work along. A room only moves when its owner
+// has taken more than CRYPTO_LOAD_SLACK percent of the mean load and the
+// next worker round the ring can take the room without going over too.
+#define CRYPTO_VNODES        64
+#define CRYPTO_STEAL_MIN     (2 * CRYPTO_BATCH)   // shorter queues are left to their owner
+#define CRYPTO_REBALANCE_MS  100         // load window; room owners are re-checked this often
+#define CRYPTO_LOAD_SLACK    125
+#define ROOM_OWNER_SLOTS     4096        // rooms whose owner is remembered, power of two
+#define ROOM_OWNER_WAYS      4           // per set; the least recently used room of a full set goes
+
+// Federation - nodes started with -n ID and one -P host:port per peer relay
+// room traffic to each other. A node sends only over the links it dials and
+// never re-forwards what arrives on inbound links, so peers form a full mesh.
+#define MAX_PEERS          16
+#define MAX_NODES          256      // node ids are 1..MAX_NODES-1
+#define PEER_RETRY_MS      500      // first redial delay, doubled on each failure
+#define PEER_RETRY_MAX_MS  30000
+#define RELAY_WINDOW       64       // per-origin duplicate window (sequence numbers)
+
+// Multicast fan-out - with -m group:port[@ifaddr] every room message is
+// encrypted once and published to an IPv4 multicast group. Users that opt in
+// with FRAME_MCAST get room traffic only from the group (listener -m) and ask
+// for lost datagrams over TCP with FRAME_NAK.
+#define MCAST_MAGIC         0x4d435354   // "MCST"
+#define MCAST_HISTORY       1024         // datagrams kept for repair (power of two)
+#define MCAST_HEARTBEAT_MS  1000         // lets receivers notice loss at the tail
+#define MCAST_TTL           1            // stay on the LAN segment
+#define MCAST_HDR           18           // [u32 magic][u32 epoch][u64 seq][u8 kind][u8 room_len]
+#define MCAST_DGRAM_MAX     (MCAST_HDR + ROOM_LEN + FRAME_HDR + MAXDATASIZE + 16)
+#define NAK_MAX             256          // sequence numbers repaired per NAK
+
+// Wire trace (-w file.pcapng). The loop thread copies every segment it reads
+// or writes, and stage timings, into a lock-free ring; a writer thread turns
+// them into pcapng with synthesized IP/TCP headers, so Wireshark follows each
+// connection as a TCP stream. When the writer falls behind, records are
+// dropped (and counted) rather than stall the loop.
+#define TAP_RING        (8 * 1024 * 1024)   // bytes, power of two
+#define TAP_SNAP        65535               // longest segment kept whole
+#define TAP_POLL_US     2000                // writer nap when the ring is empty
+#define TAP_TEXT        200                 // longest stage note
+
+// Message history (-L file). deliver_local() copies each chat line into a
+// ring; an indexer thread appends it to the log and to an inverted index from
+// (room, word) to the messages holding it. Message ids count up in arrival
+// order, so a posting list is also a time line, kept as varint gaps in blocks
+// that each start with a whole id. /search travels the same ring, so it sees
+// every message sent before it; the answer comes back through hist_efd.
+#define HIST_RING       (4 * 1024 * 1024)   // bytes, power of two
+#define HIST_POLL_US    2000                // indexer nap when the ring is empty
+#define HIST_BLOCK      128                 // postings per block
+#define HIST_WORD_MAX   32                  // longer words are indexed by their first 32 bytes
+#define HIST_KEY        (ROOM_LEN + HIST_WORD_MAX)
+#define HIST_TERMS      8                   // words one search may name
+#define HIST_RESULTS    20                  // newest matches a search returns
+
+// Busy-poll mode (-B cpus) - the loop thread is pinned to the first CPU
+// given and never sleeps: it spins on epoll_wait(0), and the kernel polls
+// the NIC queue from our context instead of waiting for an interrupt
+#define BUSY_POLL_US     50      // per-socket and per-epoll busy-poll time
+#define BUSY_POLL_BUDGET 64      // packets per busy-poll round
+
+// Latency histogram (-H) - from the moment input reached the socket to each
+// send it caused, reported on SIGUSR1. Log-linear buckets: 16 per power of
+// two, so a reported value is within 1/16 of the true one.
+#define LAT_SUB_BITS 4
+#define LAT_BUCKETS  ((64 - LAT_SUB_BITS) << LAT_SUB_BITS)
+
+#ifndef EPIOCSPARAMS   // Linux 6.9 <linux/eventpoll.h>; older headers lack it
+struct epoll_params {
+	uint32_t busy_poll_usecs;
+	uint16_t busy_poll_budget;
+	uint8_t prefer_busy_poll;
+	uint8_t pad;
+};
+#define EPIOCSPARAMS _IOW(0x8A, 0x01, struct epoll_params)
+#endif
+
+// Gateway multiplexing - a gateway fronting many end users keeps one
+// connection and carries each user as a session, addressed by a stream id in
+// FRAME_MUX_* frames. A room broadcast reaches all of a gateway's recipients
+// in one FRAME_MUX_FAN. Each session has a send window the gateway tops up.
+#define MAX_SESSIONS        8192         // across all gateways; one FAN frame can name them all
+#define SESSION_HASH        16384        // (gateway, stream) lookup, power of two
+#define SESSION_QUEUE_MAX   (64 * 1024)  // bytes held for a session out of window before it is closed
+#define GATEWAY_SESSIONS    2048         // per gateway link, so one gateway cannot take them all
+#define GATEWAY_MSG_RATE    4000         // frames/sec per gateway link, MUX control frames included
+#define GATEWAY_MSG_BURST   8000
+#define GATEWAY_BYTE_RATE   (1024 * 1024)
+#define GATEWAY_BYTE_BURST  (2 * 1024 * 1024)
+#define MAX_GATEWAYS        16           // addresses allowed to open gateway links (-G)
+
+#define ROOM_LEN       32
+#define DEFAULT_ROOM   "lobby"
+
+// Connection deadlines, all driven by the timer wheel
+#define TIMER_TICK_MS        10      // wheel resolution
+#define HANDSHAKE_TIMEOUT_MS 30000   // time allowed to send a username
+#define IDLE_TIMEOUT_MS      600000  // evict users who have not chatted for this long
+#define KEEPALIVE_MS         30000   // ping a peer that has been silent this long
+#define PONG_TIMEOUT_MS      10000   // drop it if the ping goes unanswered
+
+// Wire framing - must match client
+// Every record is [2-byte length, network order][1-byte type][payload]
+#define FRAME_HDR     3
+#define FRAME_MAX     (MAXDATASIZE + 64 + 2 + SIG_MAX)   // largest payload we accept (a signed chat)
+enum {
+	FRAME_CHAT = 1,   // AES ciphertext (username, chat text, server messages)
+	FRAME_NOTICE,     // plaintext notice (welcome, server full)
+	FRAME_PING,       // keepalive probe, echoed back as FRAME_PONG
+	FRAME_PONG,
+	FRAME_PEER_HELLO, // node-to-node: encrypted [u16 node id], first frame on a link
+	FRAME_RELAY,      // node-to-node: encrypted batch of relay records
+	FRAME_MCAST,      // client: take room traffic from the multicast group;
+	                  // server reply: [u32 epoch][u64 next seq]
+	FRAME_NAK,        // client: [u64 first seq][u16 count] missing from the group
+	FRAME_REPAIR,     // server: one multicast datagram, resent in answer to a NAK
+	FRAME_RING,       // local client: shm name of its ring (first time), then a doorbell
+	FRAME_TEXT,       // plaintext chat, only on TLS connections (the record layer encrypts)
+	FRAME_KEX,        // client: [kind][random][X25519 pub][ticket if resuming], before the username;
+	                  // server: [kind][random][X25519 pub if full][new ticket]
+	FRAME_SIGKEY,     // client: DER public key to verify its messages with; server: [nonce]
+	FRAME_SIGNED,     // client: [u16 sig len][signature][chat payload as it would be sent unsigned];
+	                  // the signature covers "chat-sig" | nonce | u64 message number | text
+	FRAME_MUX_OPEN,   // gateway: [u32 stream][u32 window], a new end user; its first chat is the username
+	FRAME_MUX,        // [u32 stream][u8 type][payload]: one session's frame, either way
+	FRAME_MUX_FAN,    // server: [u16 count][u32 stream x count][u8 type][payload], one frame for many sessions
+	FRAME_MUX_CLOSE,  // [u32 stream]: the end user left (gateway) or was dropped (server)
+	FRAME_MUX_WINDOW, // gateway: [u32 stream][u32 bytes] more the session may be sent
+	FRAME_ROSTER      // client: send me my room's roster; server: [u8 kind][u32 version][entries],
+	                  // an entry being [u8 ROSTER_ADD / ROSTER_DEL][u8 len][username]
+};
+
+enum { KEX_FULL = 1, KEX_RESUME };
+
+// FRAME_ROSTER kinds: a snapshot (ROSTER_SNAP, continued by ROSTER_MORE) is the
+// list at version; a diff takes a list at version - 1 to version
+enum { ROSTER_SNAP = 1, ROSTER_MORE, ROSTER_DIFF };
+enum { ROSTER_ADD = 1, ROSTER_DEL };
+enum { ROSTER_OFF = 0, ROSTER_WANT, ROSTER_ON };   // a subscriber: owed a snapshot / up to date
+
+enum { MCAST_DATA = 1, MCAST_HEARTBEAT };
+
+// What is on the other end of a connection
+enum {
+	CONN_USER = 0,    // chat client
+	CONN_PEER_IN,     // a peer node dialed us; we receive relays on it
+	CONN_PEER_OUT,    // we dialed a peer node; we send relays on it
+	CONN_GATEWAY      // carries many users as sessions (FRAME_MUX_*)
+};
 
 // Remove old XOR key:
 // #define ENCRYPTION_KEY "NetworksCS522Key"
@@ -39,15 +326,493 @@ static const unsigned char AES_IV[16] = {
     0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F
 };
 
-// Client structure
+// Token bucket. Levels are kept in milli-tokens so a refill is one multiply;
+// a charge may drive the level negative, which is repaid before the next read.
+typedef struct {
+	int64_t level;
+	int64_t stamp;   // monotonic ms of the last refill
+} bucket_t;
+
+// Per-IP accounting slot (open addressing, linear probing)
+enum { IP_FREE = 0, IP_USED, IP_DEAD };
+
+typedef struct {
+	int state;
+	int refs;        // connections currently charged to this slot
+	unsigned char key[16];
+	bucket_t msgs;
+	bucket_t bytes;
+	bucket_t conns;
+} ip_entry_t;
+
+// Timer wheel entry, embedded in the object it belongs to
+typedef struct timer_node {
+	struct timer_node *next, *prev;
+	int64_t expires;                        // absolute tick
+	void (*fn)(struct timer_node *t);
+} timer_node_t;
+
+// Single-producer/single-consumer ring shared with a local producer. The
+// producer fills slot[head % RING_SLOTS] and then publishes head; we read
+// up to head and publish tail. 'sleeping' is set while we may block in
+// epoll_wait(); a producer that sees it sends one FRAME_RING to wake us.
+typedef struct {
+	uint32_t magic;
+	uint32_t slots;
+	_Alignas(64) _Atomic uint32_t head;
+	_Alignas(64) _Atomic uint32_t tail;
+	_Atomic uint32_t sleeping;
+	_Alignas(64) struct {
+		uint16_t len;
+		char text[MAXDATASIZE];
+	} slot[RING_SLOTS];
+} ring_t;
+
+// Session keys (FRAME_KEX), allocated when a connection gets them
+typedef struct {
+	unsigned char key_in[32], key_out[32];
+	unsigned char ks_out[AES_SCHED];   // key_out expanded, for multi-buffer fan-out
+} sess_keys_t;
+
+// A connection's address without sockaddr_storage's padding (AF_UNIX
+// clients keep only the family)
+typedef union {
+	struct sockaddr sa;
+	struct sockaddr_in in;
+	struct sockaddr_in6 in6;
+} conn_addr_t;
+
+// Output class of what is being written; crypto jobs carry it along
+enum { OUT_CTRL = 0, OUT_BULK };
+typedef struct {
+	int cls;
+	uint32_t key;        // room hash, picks the bulk lane
+	int weight;
+} out_tag_t;
+
+typedef struct qframe {
+	struct qframe *next;
+	int len;
+	unsigned char data[];
+} qframe_t;
+
+typedef struct {
+	qframe_t *head, *tail;
+	uint32_t key;
+	int weight;
+	int deficit;
+} lane_t;
+
+// A connection's waiting output, allocated while it is backlogged
+typedef struct {
+	qframe_t *ctrl, *ctrl_tail;
+	lane_t lane[OUT_LANES];
+	int cur;             // lane the round robin is on
+	int topped;          // ... and whether it has had this turn's quantum
+	int bytes;           // in all lanes
+	int bulk;            // in the bulk lanes
+} outq_t;
+
+// Client structure. Slots never move (fd == -1 marks a free slot) because
+// the wheel links straight into the embedded timers. It is kept small: an
+// idle connection costs its slot and nothing more. Buffers come from the pool
+// while bytes are in flight, and what only some connections need (session
+// keys, a ring's name) hangs off a pointer.
 typedef struct {
 	int fd;
+	uint8_t kind;        // CONN_USER / CONN_PEER_IN / CONN_PEER_OUT / CONN_GATEWAY
+	uint8_t connecting;  // outbound connect() still in progress
+	uint8_t throttled;
+	uint8_t ping_out;    // keepalive probe in flight
+	uint8_t mcast;       // room traffic goes out on the multicast group instead
+	uint8_t local;       // AF_UNIX SOCK_SEQPACKET, one frame per packet
+	uint8_t tls;         // chat travels as FRAME_TEXT
+	uint8_t handshaking; // TLS handshake still in progress
+	uint8_t ktls_tx;     // the kernel seals records we send
+	uint8_t ktls_rx;     // the kernel opens records we receive
+	uint8_t sess;        // FRAME_CHAT uses keys with a random IV, not AES_KEY
+	uint8_t stalled;     // a frame that skips the pool waits in rbuf until the pool catches up
+	uint8_t dead;        // write failed; closed at the end of the loop pass
+	uint8_t tap_open;    // the trace has shown this connection's handshake
+	uint16_t tap_port;
+	int peer;            // peers[] index for CONN_PEER_OUT
+	int ip_slot;         // index into ip_table, -1 for peer links
 	char username[64];
-	struct sockaddr_storage addr;
+	char room[ROOM_LEN];
+	conn_addr_t addr;
+	bucket_t msgs;
+	bucket_t bytes;
+	int64_t last_rx;     // monotonic ms of the last byte received
+	int64_t last_chat;   // monotonic ms of the last chat message
+	ring_t *ring;        // shared-memory ring of a local producer
+	char *ring_name;     // its shm name (malloc'd), for a successor to re-map
+	SSL *ssl;            // TLS connection state, NULL for plain TCP
+	sess_keys_t *keys;   // set with sess
+	uint32_t gen;        // bumped whenever the slot is reused; crypto jobs check it
+	uint8_t roster;      // ROSTER_WANT / ROSTER_ON: takes presence as FRAME_ROSTER
+	EVP_PKEY *sig_key;   // chat must be signed with this key
+	unsigned char sig_nonce[SIG_NONCE];
+	uint64_t sig_seq;    // number of the next signed message
+	uint32_t in_seq, in_done;     // chat frames handed to the crypto pool / acted on
+	uint32_t out_seq, out_done;   // output frames handed to the pool / queued
+	struct crypto_job *in_held, *out_held;   // finished ahead of an earlier job, by seq
+	uint32_t tap_rx, tap_tx;   // trace stream positions: bytes received / sent + 1
+	unsigned char tap_addr[16];   // our end of the connection, as the trace shows it
+	int mux_head;        // CONN_GATEWAY: first of its sessions, -1 if none
+	int mux_count;
+	timer_node_t deadline;   // handshake deadline, then idle eviction
+	timer_node_t keepalive;  // ping / pong timeout
+	timer_node_t wake;       // end of a throttle period
+	char *obuf;              // socket queue, pending bytes are obuf[ooff..olen); NULL when empty
+	int ooff, olen, ocap;
+	outq_t *q;               // frames not yet in obuf, by class; NULL when none
+	int rlen;                // bytes buffered towards the next frame
+	unsigned char *rbuf;     // borrowed while rlen > 0 (and during a read)
 } client_t;
 
+#define RBUF_LEN  (FRAME_HDR + FRAME_MAX)   // how much of a read buffer a connection uses
+
+#define client_of(node, member) ((client_t *)((char *)(node) - offsetof(client_t, member)))
+
+// One end user behind a gateway. Free slots are chained through next.
+typedef struct {
+	int gw;              // clients[] index of its gateway, -1 = free slot
+	uint32_t stream;
+	int next, prev;      // the gateway's sessions
+	int hnext;           // session_hash chain
+	char username[64];
+	char room[ROOM_LEN];
+	uint8_t roster;      // as client_t
+	int64_t window;      // bytes (type + payload per frame) we may still send it
+	bucket_t msgs;
+	int64_t last_chat;
+	unsigned char *q;    // frames held while out of window, [u16 len][u8 type][payload]
+	int qoff, qlen, qcap;
+} session_t;
+
+// A session stands in for a sender fd in broadcasts (real fds are >= 0, -1 is nobody)
+#define SESSION_ID(i)  (-2 - (i))
+
+// Presence roster of a room, kept while someone in the room is subscribed
+typedef struct roster {
+	struct roster *next;     // hash chain
+	char room[ROOM_LEN];
+	uint32_t version;        // of the last diff sent
+	int subs;                // subscribers in the room
+	int want;                // ... owed a snapshot
+	unsigned char *diff;     // entries since version
+	int dlen, dcap;
+	unsigned char *members;  // entries for the snapshot being built
+	int mlen, mcap;
+	unsigned char *out;      // this batch's frames: diffs in [0, snap), the snapshot after
+	int olen, ocap, snap;
+} roster_t;
+
 client_t clients[MAX_CLIENTS];
 int client_count = 0;
+int client_hwm = 0;             // slots at and above this have never been used
+int client_free[MAX_CLIENTS];   // freed slots below client_hwm, reused last-in first-out
+int client_nfree = 0;
+
+session_t sessions[MAX_SESSIONS];
+int session_hash[SESSION_HASH];
+int session_free = -1;   // first free slot
+int session_count = 0;
+unsigned char gateway_addrs[MAX_GATEWAYS][16];   // ip_key() form
+int gateway_count = 0;
+
+roster_t *rosters[ROSTER_HASH];
+timer_node_t roster_tick;
+int roster_quiet = 0;    // set while a local join or leave line goes out: subscribers have it as a diff
+
+int epfd;             // epoll instance
+int fd_limit;         // descriptors we track: the tables below have this many entries
+int *fd_client;       // fd -> clients[] index, -1 if none
+uint8_t *fd_events;   // fd -> interest registered with epoll (EV_IN | EV_OUT)
+void *buf_pool = NULL;   // free pooled buffers, chained through their first bytes
+int buf_pooled = 0;
+out_tag_t out_tag = { OUT_CTRL, 0, 1 };   // class of output written now
+struct { char room[ROOM_LEN]; int weight; } room_weights[MAX_ROOM_WEIGHTS];
+int room_weight_count = 0;
+int busy_poll = 0;           // -B
+cpu_set_t busy_loop_cpu;     // the loop thread's CPU
+cpu_set_t busy_other_cpus;   // everything else: workers and the trace writer
+int lat_on = 0;              // -H
+uint64_t lat_hist[LAT_BUCKETS];
+uint64_t lat_samples = 0;
+int64_t lat_max = 0;
+int64_t lat_wake = 0;        // monotonic ns the input being handled arrived; 0 = none
+volatile sig_atomic_t lat_report_due = 0;
+const char *filter_path = NULL;    // -F
+volatile sig_atomic_t filter_reload_due = 0;
+int accept_rate = ACCEPT_RATE;     // -A; 0 lifts the server-wide and per-address connection limits
+int accept_burst = ACCEPT_BURST;
+
+int listener;         // listening socket descriptor
+int local_listener = -1;   // AF_UNIX SOCK_SEQPACKET listener for same-host clients
+int ring_count = 0;        // clients with an attached ring
+SSL_CTX *tls_ctx = NULL;   // set up by -c
+int tls_listener = -1;
+const char *tls_port = TLS_PORT;
+unsigned char ticket_key[2][32];   // current = [ticket_gen & 1], the other one retired
+uint32_t ticket_gen = 0;
+timer_node_t ticket_rotate;
+
+// Crypto pool. The loop thread stages jobs during a pass and hands them to
+// their room owners' queues in batches; a worker that runs dry steals half of
+// a queue that has grown past CRYPTO_STEAL_MIN. Jobs from one client can
+// therefore finish out of order, so each carries a per-client sequence
+// number and early finishers wait in the client's held list.
+enum { JOB_IN = 1, JOB_OUT, JOB_RAW };
+enum { CIPHER_NONE = 0, CIPHER_STATIC, CIPHER_SESS };
+
+typedef struct crypto_job {
+	struct crypto_job *next;
+	int kind;               // JOB_IN: decrypt (and verify) a chat frame; JOB_OUT: encrypt one
+	                        // JOB_RAW: a frame that must wait behind JOB_OUTs
+	int client;             // clients[] index ...
+	uint32_t gen;           // ... and its generation when the job was queued
+	uint32_t seq;           // place in the client's in_ or out_ order
+	int cipher;
+	unsigned char key[32];
+	unsigned char ks[AES_SCHED];   // JOB_OUT: the key expanded, when multi-buffer is on
+	EVP_PKEY *sig_key;      // a reference of the job's own; NULL when unsigned
+	int64_t t_queued, t_ran, t_done;   // monotonic ns, taken only while tracing
+	int64_t t_wake;         // lat_wake of the input that queued it (-H)
+	out_tag_t tag;          // JOB_OUT, JOB_RAW: output class
+	int ok;                 // JOB_IN: 1 good, 0 bad signature, -1 undecryptable
+	int sig_len, in_len, out_len;
+	unsigned char *sig, *in, *out;   // all point into data[]
+	unsigned char data[];
+} crypto_job_t;
+
+#define JOB_TEXT  (16 + SIG_NONCE)   // JOB_IN out[] is "chat-sig" | nonce | u64 seq | text
+
+typedef struct {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t wake;    // with crypto_idle_lock
+	crypto_job_t *head, *tail;
+	_Atomic int queued;     // changed under lock; read without it to decide on waking
+	_Atomic uint64_t ran, stolen;
+} crypto_worker_t;
+
+typedef struct {
+	uint32_t point;
+	int worker;
+} crypto_vnode_t;
+
+typedef struct {
+	uint32_t room;          // room hash
+	int owner;              // -1 = free slot
+	int64_t until;          // owner re-checked after this
+	uint32_t jobs, load;    // this window's jobs, the last window's
+} room_owner_t;
+
+crypto_worker_t crypto_workers[CRYPTO_THREADS_MAX];
+int crypto_threads = 0;       // 0 = run jobs inline on the loop thread
+int crypto_efd = -1;          // readable when finished jobs are waiting
+pthread_mutex_t crypto_idle_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t crypto_done_lock = PTHREAD_MUTEX_INITIALIZER;
+crypto_job_t *crypto_done, *crypto_done_tail;
+crypto_job_t *crypto_staged[CRYPTO_THREADS_MAX], *crypto_staged_tail[CRYPTO_THREADS_MAX];   // not yet handed out
+int crypto_staged_n[CRYPTO_THREADS_MAX];
+crypto_vnode_t crypto_ring[CRYPTO_THREADS_MAX * CRYPTO_VNODES];   // sorted by point
+room_owner_t room_owners[ROOM_OWNER_SLOTS];
+uint32_t crypto_handed[CRYPTO_THREADS_MAX];   // jobs given to each worker this window ...
+uint32_t crypto_load[CRYPTO_THREADS_MAX];     // ... and decayed over the past ones
+int64_t crypto_window_end = 0;
+uint64_t crypto_moves = 0;    // rooms handed to another worker
+int crypto_inflight = 0;      // jobs staged, queued or running
+EVP_MD_CTX *crypto_md;        // for inline verification
+bucket_t accept_bucket;
+timer_node_t accept_wake;
+
+int reap_list[MAX_CLIENTS];   // clients marked dead during this pass
+int reap_count = 0;
+
+int handoff_fd = -1;  // control socket a successor connects to
+
+const char *listen_port = PORT;
+int local_users = 0;  // joined users on this node
+
+// Outbound link to a peer node
+typedef struct {
+	char host[256];
+	char port[16];
+	int conn;              // clients[] index of the link, -1 while down
+	int64_t backoff;
+	timer_node_t retry;
+} peer_t;
+
+// What we know about each origin node: its user count and which of its
+// relay sequence numbers we have already delivered
+typedef struct {
+	uint32_t epoch;
+	uint32_t top;          // highest sequence number seen
+	uint64_t window;       // bit i set = top - i seen
+	int users;
+} node_state_t;
+
+int node_id = 0;          // 0 = not federated
+uint32_t node_epoch;      // changes every cold start so peers reset their windows
+uint32_t relay_seq = 0;
+peer_t peers[MAX_PEERS];
+int peer_count = 0;
+unsigned char peer_addrs[MAX_PEERS * 4][16];   // -P hosts, the only ones that may link in
+int peer_addr_count = 0;
+node_state_t nodes[MAX_NODES];
+
+// Relay records produced during one loop pass; encrypted once and written to
+// every peer link at the end of the pass
+enum { RELAY_MSG = 1, RELAY_USERS };
+unsigned char relay_batch[MAXDATASIZE];
+int relay_len = 2;        // leading u16 = record count
+int relay_count = 0;
+int announced_users = -1; // user count last sent to peers
+
+// Multicast publisher and the history NAKs are repaired from
+typedef struct {
+	uint64_t seq;
+	int len;                   // 0 = empty
+	unsigned char data[MCAST_DGRAM_MAX];
+} mcast_slot_t;
+
+int mcast_fd = -1;
+struct sockaddr_in mcast_group;
+uint64_t mcast_seq = 0;        // next sequence number
+int mcast_subs = 0;            // users taking room traffic from the group
+mcast_slot_t mcast_ring[MCAST_HISTORY];
+timer_node_t mcast_heartbeat;
+
+// Wire trace records, as they sit in the ring (data follows the header)
+enum { TAP_OPEN = 1, TAP_IN, TAP_OUT, TAP_CLOSE, TAP_STAGE };
+
+typedef struct {
+	uint32_t size;          // whole record, rounded up to 8
+	uint16_t kind;
+	uint16_t family;        // AF_INET or AF_INET6; 0 for a stage note
+	int64_t ts;             // CLOCK_REALTIME ns
+	uint32_t rx, tx;        // the connection's stream positions before this segment
+	uint16_t cport, sport;  // client's port, ours
+	uint32_t len;
+	unsigned char caddr[16], saddr[16];
+} tap_rec_t;
+
+int tap_on = 0;
+const char *tap_path = NULL;
+unsigned char *tap_ring;
+_Alignas(64) _Atomic uint64_t tap_head;   // advanced by the loop thread
+_Alignas(64) _Atomic uint64_t tap_tail;   // advanced by the writer
+_Atomic int tap_stopping;
+uint64_t tap_drops = 0;
+FILE *tap_file;
+pthread_t tap_thread;
+
+// History ring records (room, sender name and text follow the header) and
+// the answers to searches
+enum { HIST_MSG = 1, HIST_QUERY };
+
+typedef struct {
+	uint32_t size;          // whole record, rounded up to 8
+	uint8_t kind;
+	uint8_t rlen, nlen;
+	int64_t ts;             // wall clock ms
+	int32_t client;         // HIST_QUERY: who asked - clients[] index ...
+	int32_t session;        // ... sessions[] index, -1 for a direct user ...
+	uint32_t gen, stream;   // ... and what those slots held then
+	uint32_t len;
+} hist_rec_t;
+
+typedef struct hist_reply {
+	struct hist_reply *next;
+	int32_t client, session;
+	uint32_t gen, stream;
+	int len;
+	char text[];            // lines, each ending in '\0'
+} hist_reply_t;
+
+int hist_on = 0;
+const char *hist_path = NULL;
+unsigned char *hist_ring;
+_Alignas(64) _Atomic uint64_t hist_head;   // advanced by the loop thread
+_Alignas(64) _Atomic uint64_t hist_tail;   // advanced by the indexer
+_Atomic int hist_stopping;
+uint64_t hist_drops = 0;
+int hist_load = 0;          // the indexer first reads what the log already holds
+FILE *hist_file;            // the log, appended through stdio ...
+int hist_fd = -1;           // ... and read back with pread()
+pthread_t hist_thread;
+int hist_efd = -1;          // readable when answers are waiting
+pthread_mutex_t hist_done_lock = PTHREAD_MUTEX_INITIALIZER;
+hist_reply_t *hist_done, *hist_done_tail;
+
+// Hot restart stream: one header, then per client a record carrying its
+// socket, followed by rlen bytes of partial input and olen bytes of queued
+// output. Both sides are on one host, so monotonic timestamps carry over.
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t record_size;
+	int32_t nclients;
+	uint32_t node_epoch;   // the successor continues our relay stream
+	uint32_t relay_seq;
+	uint64_t mcast_seq;
+	int32_t tls_listener;  // a second fd message carrying it follows
+	uint32_t ticket_gen;   // outstanding tickets stay good
+	unsigned char ticket_key[2][32];
+} handoff_hdr_t;
+
+typedef struct {
+	int32_t kind;
+	char username[64];
+	char room[ROOM_LEN];
+	struct sockaddr_storage addr;
+	bucket_t msgs;
+	bucket_t bytes;
+	int64_t last_rx;
+	int64_t last_chat;
+	int32_t throttled;
+	int32_t ping_out;
+	int32_t mcast;
+	int32_t local;
+	char ring_name[RING_NAME];
+	int32_t tls;           // kTLS in both directions; userspace TLS is not handed over
+	int32_t sess;
+	unsigned char key_in[32], key_out[32];
+	int32_t sig_key_len;   // DER public key, 0 if the client does not sign
+	unsigned char sig_key[SIG_KEY_MAX];
+	unsigned char sig_nonce[SIG_NONCE];
+	uint64_t sig_seq;
+	int32_t roster;        // subscribed; the successor sends a fresh snapshot
+	int32_t rlen;
+	int32_t olen;
+	int32_t nsessions;     // a gateway's sessions follow, each with its held frames
+} handoff_client_t;
+
+typedef struct {
+	uint32_t stream;
+	char username[64];
+	char room[ROOM_LEN];
+	int64_t window;
+	bucket_t msgs;
+	int64_t last_chat;
+	int32_t roster;
+	int32_t qlen;
+} handoff_session_t;
+
+ip_entry_t ip_table[IP_TABLE_SIZE];
+int ip_slots_taken = 0;   // used + dead slots, drives compaction
+int ip_unreferenced = 0;  // used slots no connection holds: they go idle and can be reclaimed
+int ip_dead = 0;          // tombstones left by reclaimed slots
+int64_t ip_compacted_at = -IP_COMPACT_MS;
+
+int aes_encrypt(unsigned char *plaintext, int plaintext_len, unsigned char *ciphertext);
+int aes_decrypt(unsigned char *ciphertext, int ciphertext_len, unsigned char *plaintext);
+int aes_encrypt_with_random_iv(const unsigned char *key, const unsigned char *plaintext, int plaintext_len,
+                               unsigned char *output);
+int aes_decrypt_with_iv(const unsigned char *key, const unsigned char *input, int input_len,
+                        unsigned char *plaintext);
 
 // Get current timestamp as string
 void get_timestamp(char *buffer, size_t size) {
@@ -65,226 +830,5247 @@ void *get_in_addr(struct sockaddr *sa)
 	return &(((struct sockaddr_in6*)sa)->sin6_addr); 
 }
 
-// Broadcast message to all clients except sender
-void broadcast_message(const char *message, int sender_fd, const char *sender_name) {
-    char plaintext[MAXDATASIZE];
-    unsigned char ciphertext[MAXDATASIZE + 16]; // Extra space for padding
-    char timestamp[64];
-    get_timestamp(timestamp, sizeof(timestamp));
-    
-    // Format: [timestamp] Username: message
-    int plaintext_len = snprintf(plaintext, sizeof(plaintext), "%s %s: %s", 
-                                  timestamp, sender_name, message);
-    
-    // Encrypt the message
-    int ciphertext_len = aes_encrypt((unsigned char*)plaintext, plaintext_len, ciphertext);
-    if (ciphertext_len < 0) {
-        fprintf(stderr, "Encryption failed\n");
-        return;
-    }
-    
-    // Broadcast to all clients except sender
-    for (int i = 0; i < client_count; i++) {
-        if (clients[i].fd != sender_fd && clients[i].fd != -1) {
-            send(clients[i].fd, ciphertext, ciphertext_len, 0);
-        }
-    }
+// Monotonic clock in milliseconds (immune to wall-clock jumps)
+int64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
 }
 
-// Add client to list
-int add_client(int fd, struct sockaddr_storage *addr) {
-	if (client_count >= MAX_CLIENTS) {
-		return -1;
+int64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Start a bucket full
+void bucket_init(bucket_t *b, int64_t burst, int64_t now) {
+	b->level = burst * 1000;
+	b->stamp = now;
+}
+
+// Credit the tokens earned since the last refill, capped at the burst size
+void bucket_refill(bucket_t *b, int64_t rate, int64_t burst, int64_t now) {
+	if (now > b->stamp) {
+		b->level += (now - b->stamp) * rate;
+		if (b->level > burst * 1000) {
+			b->level = burst * 1000;
+		}
+		b->stamp = now;
 	}
-	
-	clients[client_count].fd = fd;
-	clients[client_count].addr = *addr;
-	clients[client_count].username[0] = '\0';
-	client_count++;
-	return client_count - 1;
 }
 
-// Remove client from list
-void remove_client(int index) {
-	if (index < 0 || index >= client_count) return;
-	
-	printf("%s disconnected\n", clients[index].username);
-	close(clients[index].fd);
-	
-	// Shift remaining clients down
-	for (int i = index; i < client_count - 1; i++) {
-		clients[i] = clients[i + 1];
+// Milliseconds until the bucket is positive again (0 = may read now)
+int64_t bucket_wait(const bucket_t *b, int64_t rate) {
+	if (b->level > 0) return 0;
+	return (-b->level) / rate + 1;
+}
+
+// Map an IPv4/IPv6 address to a 16-byte key (IPv4 as v4-mapped)
+void ip_key(const struct sockaddr_storage *addr, unsigned char key[16]) {
+	memset(key, 0, 16);
+	if (addr->ss_family == AF_INET) {
+		key[10] = key[11] = 0xff;
+		memcpy(key + 12, &((const struct sockaddr_in *)addr)->sin_addr, 4);
+	} else {
+		memcpy(key, &((const struct sockaddr_in6 *)addr)->sin6_addr, 16);
 	}
-	client_count--;
 }
 
-// Find client index by fd
-int find_client(int fd) {
-	for (int i = 0; i < client_count; i++) {
-		if (clients[i].fd == fd) {
-			return i;
-		}
+// Resolve host and add each of its addresses to an allowlist; -1 on failure
+int addr_list_add(const char *host, unsigned char (*list)[16], int *n, int max) {
+	struct addrinfo hints, *ai, *a;
+	struct sockaddr_storage ss;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, NULL, &hints, &ai) != 0) return -1;
+	for (a = ai; a != NULL && *n < max; a = a->ai_next) {
+		memset(&ss, 0, sizeof ss);
+		memcpy(&ss, a->ai_addr, a->ai_addrlen);
+		ip_key(&ss, list[(*n)++]);
 	}
-	return -1;
+	freeaddrinfo(ai);
+	return 0;
 }
 
-// void xor_encrypt_decrypt(char *data, int length, const char *key) { ... }
+// Is the address on the allowlist? AF_UNIX clients never are
+int addr_listed(const conn_addr_t *addr, unsigned char (*list)[16], int n) {
+	struct sockaddr_storage ss;
+	unsigned char key[16];
 
-// Add AES encryption function
-int aes_encrypt(unsigned char *plaintext, int plaintext_len,
-                unsigned char *ciphertext) {
-    EVP_CIPHER_CTX *ctx;
-    int len;
-    int ciphertext_len;
+	if (addr->sa.sa_family != AF_INET && addr->sa.sa_family != AF_INET6) return 0;
+	memset(&ss, 0, sizeof ss);
+	memcpy(&ss, addr, sizeof *addr);
+	ip_key(&ss, key);
+	for (int i = 0; i < n; i++) {
+		if (memcmp(list[i], key, 16) == 0) return 1;
+	}
+	return 0;
+}
 
-    // Create and initialize the context
-    if (!(ctx = EVP_CIPHER_CTX_new()))
-        return -1;
+unsigned int ip_hash(const unsigned char key[16]) {
+	unsigned int h = 2166136261u;   // FNV-1a
+	for (int i = 0; i < 16; i++) {
+		h = (h ^ key[i]) * 16777619u;
+	}
+	return h;
+}
 
-    // Initialize encryption operation with AES-256-CBC
-    if (1 != EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, AES_KEY, AES_IV))
-        return -1;
+// An unreferenced slot is kept until its buckets have refilled, so dropping
+// and reopening a connection does not hand an address a fresh burst.
+int ip_entry_idle(ip_entry_t *e, int64_t now) {
+	if (e->refs > 0) return 0;
+	bucket_refill(&e->msgs, IP_MSG_RATE, IP_MSG_BURST, now);
+	bucket_refill(&e->bytes, IP_BYTE_RATE, IP_BYTE_BURST, now);
+	bucket_refill(&e->conns, IP_CONN_RATE, IP_CONN_BURST, now);
+	return e->msgs.level == IP_MSG_BURST * 1000 && e->bytes.level == IP_BYTE_BURST * 1000 &&
+		e->conns.level == IP_CONN_BURST * 1000;
+}
 
-    // Encrypt the plaintext
-    if (1 != EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext, plaintext_len))
-        return -1;
-    ciphertext_len = len;
+// Rebuild the table without dead/idle slots and re-point the clients at it
+void ip_table_compact(int64_t now) {
+	static ip_entry_t old[IP_TABLE_SIZE];
+	static int remap[IP_TABLE_SIZE];
 
-    // Finalize encryption (handles padding)
-    if (1 != EVP_EncryptFinal_ex(ctx, ciphertext + len, &len))
-        return -1;
-    ciphertext_len += len;
+	memcpy(old, ip_table, sizeof(old));
+	memset(ip_table, 0, sizeof(ip_table));
+	ip_slots_taken = ip_unreferenced = ip_dead = 0;
+	ip_compacted_at = now;
 
-    // Clean up
-    EVP_CIPHER_CTX_free(ctx);
+	for (int i = 0; i < IP_TABLE_SIZE; i++) {
+		remap[i] = -1;
+		if (old[i].state != IP_USED || ip_entry_idle(&old[i], now)) continue;
+		unsigned int j = ip_hash(old[i].key) & (IP_TABLE_SIZE - 1);
+		while (ip_table[j].state != IP_FREE) {
+			j = (j + 1) & (IP_TABLE_SIZE - 1);
+		}
+		ip_table[j] = old[i];
+		remap[i] = j;
+		ip_slots_taken++;
+		if (old[i].refs == 0) ip_unreferenced++;
+	}
+	for (int i = 0; i < client_hwm; i++) {
+		if (clients[i].fd != -1 && clients[i].ip_slot != -1) {
+			clients[i].ip_slot = remap[clients[i].ip_slot];
+		}
+	}
+}
 
-    return ciphertext_len;
+// Find (or create) the accounting slot for an address and take a reference.
+// IPv6 is accounted per /64, the smallest block a host is usually given.
+int ip_acquire(const struct sockaddr_storage *addr, int64_t now) {
+	static const unsigned char v4mapped[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+	unsigned char key[16];
+	int reuse = -1;
+
+	ip_key(addr, key);
+	if (memcmp(key, v4mapped, 12) != 0) memset(key + 8, 0, 8);
+	// Rebuild only when that frees a good share of the table; a table full
+	// of live addresses is not worth a 128K-slot copy on every accept
+	int full = ip_slots_taken >= IP_TABLE_SIZE * 3 / 4;
+	if (full && ip_unreferenced + ip_dead >= IP_TABLE_SIZE / 8 && now - ip_compacted_at >= IP_COMPACT_MS) {
+		ip_table_compact(now);
+		full = ip_slots_taken >= IP_TABLE_SIZE * 3 / 4;
+	}
+
+	unsigned int j = ip_hash(key) & (IP_TABLE_SIZE - 1);
+	for (int probes = 0; probes < IP_TABLE_SIZE; probes++) {
+		ip_entry_t *e = &ip_table[j];
+		if (e->state == IP_FREE) break;
+		if (e->state == IP_USED && memcmp(e->key, key, 16) == 0) {
+			if (e->refs++ == 0) ip_unreferenced--;
+			return j;
+		}
+		if (e->state == IP_USED && ip_entry_idle(e, now)) {
+			e->state = IP_DEAD;   // reclaimed on the way past
+			ip_unreferenced--;
+			ip_dead++;
+		}
+		if (e->state == IP_DEAD && reuse == -1) reuse = j;
+		j = (j + 1) & (IP_TABLE_SIZE - 1);
+	}
+
+	if (reuse != -1) {
+		ip_dead--;
+	} else {
+		if (full || ip_table[j].state != IP_FREE) return -1;   // table full
+		reuse = j;
+		ip_slots_taken++;
+	}
+	ip_entry_t *e = &ip_table[reuse];
+	e->state = IP_USED;
+	e->refs = 1;
+	memcpy(e->key, key, 16);
+	bucket_init(&e->msgs, IP_MSG_BURST, now);
+	bucket_init(&e->bytes, IP_BYTE_BURST, now);
+	bucket_init(&e->conns, IP_CONN_BURST, now);
+	return reuse;
 }
 
-// Add AES decryption function
-int aes_decrypt(unsigned char *ciphertext, int ciphertext_len,
-                unsigned char *plaintext) {
-    EVP_CIPHER_CTX *ctx;
-    int len;
-    int plaintext_len;
+void ip_release(int slot) {
+	if (slot < 0) return;
+	if (--ip_table[slot].refs == 0) ip_unreferenced++;
+}
 
-    // Create and initialize the context
-    if (!(ctx = EVP_CIPHER_CTX_new()))
-        return -1;
+// Take one new-connection token from an address; 0 if it is connecting too fast
+int ip_admit(int slot, int64_t now) {
+	bucket_t *b = &ip_table[slot].conns;
 
-    // Initialize decryption operation with AES-256-CBC
-    if (1 != EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, AES_KEY, AES_IV))
-        return -1;
+	if (accept_rate == 0) return 1;   // -A 0: connection floods are the point
+	bucket_refill(b, IP_CONN_RATE, IP_CONN_BURST, now);
+	if (b->level < 1000) return 0;
+	b->level -= 1000;
+	return 1;
+}
 
-    // Decrypt the ciphertext
-    if (1 != EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, ciphertext_len))
-        return -1;
-    plaintext_len = len;
+// Per-connection bucket sizes; a gateway link carries many users at once
+typedef struct {
+	int64_t msg_rate, msg_burst, byte_rate, byte_burst;
+} conn_limits_t;
 
-    // Finalize decryption (removes padding)
-    if (1 != EVP_DecryptFinal_ex(ctx, plaintext + len, &len))
-        return -1;
-    plaintext_len += len;
+const conn_limits_t user_limits = { CONN_MSG_RATE, CONN_MSG_BURST, CONN_BYTE_RATE, CONN_BYTE_BURST };
+const conn_limits_t gateway_limits = { GATEWAY_MSG_RATE, GATEWAY_MSG_BURST, GATEWAY_BYTE_RATE, GATEWAY_BYTE_BURST };
 
-    // Clean up
-    EVP_CIPHER_CTX_free(ctx);
+// Charge received frames and bytes against the connection and its address
+// (local clients and gateways have no address slot)
+void rate_charge(client_t *c, int nmsgs, int nbytes, int64_t now) {
+	const conn_limits_t *l = c->kind == CONN_GATEWAY ? &gateway_limits : &user_limits;
+	bucket_refill(&c->msgs, l->msg_rate, l->msg_burst, now);
+	bucket_refill(&c->bytes, l->byte_rate, l->byte_burst, now);
+	c->msgs.level -= (int64_t)nmsgs * 1000;
+	c->bytes.level -= (int64_t)nbytes * 1000;
+	if (c->ip_slot == -1) return;
 
-    return plaintext_len;
+	ip_entry_t *e = &ip_table[c->ip_slot];
+	bucket_refill(&e->msgs, IP_MSG_RATE, IP_MSG_BURST, now);
+	bucket_refill(&e->bytes, IP_BYTE_RATE, IP_BYTE_BURST, now);
+	e->msgs.level -= (int64_t)nmsgs * 1000;
+	e->bytes.level -= (int64_t)nbytes * 1000;
 }
 
-// Encrypt with random IV and prepend IV to output
-int aes_encrypt_with_random_iv(unsigned char *plaintext, int plaintext_len,
-                                unsigned char *output) {
-    unsigned char iv[16];
-    
-    // Generate random IV
-    if (RAND_bytes(iv, sizeof(iv)) != 1)
-        return -1;
-    
-    // Copy IV to output (first 16 bytes)
-    memcpy(output, iv, 16);
-    
-    // Encrypt with random IV
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-    EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, AES_KEY, iv);
-    
-    int len, ciphertext_len;
-    EVP_EncryptUpdate(ctx, output + 16, &len, plaintext, plaintext_len);
-    ciphertext_len = len;
-    
-    EVP_EncryptFinal_ex(ctx, output + 16 + len, &len);
-    ciphertext_len += len;
-    
-    EVP_CIPHER_CTX_free(ctx);
-    
-    return ciphertext_len + 16; // Total: IV + ciphertext
+// Milliseconds before this client may be read again (0 = readable now)
+int64_t rate_wait(client_t *c, int64_t now) {
+	const conn_limits_t *l = c->kind == CONN_GATEWAY ? &gateway_limits : &user_limits;
+	int64_t wait = 0, w;
+
+	bucket_refill(&c->msgs, l->msg_rate, l->msg_burst, now);
+	bucket_refill(&c->bytes, l->byte_rate, l->byte_burst, now);
+	if ((w = bucket_wait(&c->msgs, l->msg_rate)) > wait) wait = w;
+	if ((w = bucket_wait(&c->bytes, l->byte_rate)) > wait) wait = w;
+	if (c->ip_slot == -1) return wait;
+
+	ip_entry_t *e = &ip_table[c->ip_slot];
+	bucket_refill(&e->msgs, IP_MSG_RATE, IP_MSG_BURST, now);
+	bucket_refill(&e->bytes, IP_BYTE_RATE, IP_BYTE_BURST, now);
+	if ((w = bucket_wait(&e->msgs, IP_MSG_RATE)) > wait) wait = w;
+	if ((w = bucket_wait(&e->bytes, IP_BYTE_RATE)) > wait) wait = w;
+	return wait;
 }
 
-// Decrypt with IV extraction
-int aes_decrypt_with_iv(unsigned char *input, int input_len,
-                         unsigned char *plaintext) {
-    // Extract IV (first 16 bytes)
-    unsigned char iv[16];
-    memcpy(iv, input, 16);
-    
-    // Decrypt (skip first 16 bytes)
-    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
-    EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, AES_KEY, iv);
-    
-    int len, plaintext_len;
-    EVP_DecryptUpdate(ctx, plaintext, &len, input + 16, input_len - 16);
-    plaintext_len = len;
-    
-    EVP_DecryptFinal_ex(ctx, plaintext + len, &len);
-    plaintext_len += len;
-    
-    EVP_CIPHER_CTX_free(ctx);
-    
-    return plaintext_len;
+// Hierarchical timer wheel: WHEEL_LEVELS levels of WHEEL_SIZE slots at
+// TIMER_TICK_MS resolution (~46 hours of range). Arm and cancel are O(1) list
+// splices; when an inner level wraps, the next outer slot is cascaded down.
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+
+timer_node_t wheel[WHEEL_LEVELS][WHEEL_SIZE];   // circular list heads
+int64_t wheel_tick;       // last tick processed
+int timers_armed = 0;
+
+void wheel_init(int64_t now) {
+	for (int l = 0; l < WHEEL_LEVELS; l++) {
+		for (int j = 0; j < WHEEL_SIZE; j++) {
+			wheel[l][j].next = wheel[l][j].prev = &wheel[l][j];
+		}
+	}
+	wheel_tick = now / TIMER_TICK_MS;
 }
 
-int main(void) 
-{ 
-	int listener;  // listening socket descriptor
-	int newfd;     // newly accepted socket descriptor
-	struct sockaddr_storage remoteaddr; // client address
-	socklen_t addrlen;
+void timer_init(timer_node_t *t, void (*fn)(timer_node_t *)) {
+	t->next = t->prev = NULL;
+	t->fn = fn;
+}
+
+// File a timer under the slot matching its distance from the current tick
+void wheel_insert(timer_node_t *t) {
+	int64_t delta = t->expires - wheel_tick;
+	int level = 0;
+
+	while (level < WHEEL_LEVELS - 1 && delta >= ((int64_t)1 << (WHEEL_BITS * (level + 1)))) {
+		level++;
+	}
+	if (delta >= ((int64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))) {
+		t->expires = wheel_tick + ((int64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1;
+	}
+
+	timer_node_t *head = &wheel[level][(t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK];
+	t->prev = head->prev;
+	t->next = head;
+	head->prev->next = t;
+	head->prev = t;
+}
+
+void timer_cancel(timer_node_t *t) {
+	if (t->next == NULL) return;
+	t->prev->next = t->next;
+	t->next->prev = t->prev;
+	t->next = t->prev = NULL;
+	timers_armed--;
+}
+
+// (Re)arm a timer to fire delay_ms from now
+void timer_arm(timer_node_t *t, int64_t delay_ms) {
+	timer_cancel(t);
+	if (timers_armed == 0) {
+		wheel_tick = now_ms() / TIMER_TICK_MS;   // wheel may have slept through idle time
+	}
+	t->expires = wheel_tick + (delay_ms + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+	if (t->expires <= wheel_tick) {
+		t->expires = wheel_tick + 1;
+	}
+	wheel_insert(t);
+	timers_armed++;
+}
+
+// Move every timer in an outer slot down to the level it now belongs to
+int wheel_cascade(int level) {
+	int idx = (wheel_tick >> (WHEEL_BITS * level)) & WHEEL_MASK;
+	timer_node_t *head = &wheel[level][idx];
+	timer_node_t *t = head->next;
+
+	head->next = head->prev = head;
+	while (t != head) {
+		timer_node_t *next = t->next;
+		wheel_insert(t);
+		t = next;
+	}
+	return idx;
+}
+
+// Run every timer that is due by 'now'
+void wheel_advance(int64_t now) {
+	int64_t target = now / TIMER_TICK_MS;
+
+	if (timers_armed == 0 && target > wheel_tick) {
+		wheel_tick = target;
+		return;
+	}
+	while (wheel_tick < target) {
+		wheel_tick++;
+		int idx = wheel_tick & WHEEL_MASK;
+		if (idx == 0) {
+			for (int l = 1; l < WHEEL_LEVELS && wheel_cascade(l) == 0; l++)
+				;
+		}
+		timer_node_t *head = &wheel[0][idx];
+		while (head->next != head) {
+			timer_node_t *t = head->next;
+			timer_cancel(t);
+			t->fn(t);
+		}
+	}
+}
+
+// epoll_wait() timeout in ms: the next busy slot, or the next cascade point
+// (-1 = nothing armed, block indefinitely)
+int64_t wheel_next_ms(int64_t now) {
+	if (timers_armed == 0) return -1;
+
+	int64_t tick = wheel_tick + 1;
+	for (int k = 0; k < WHEEL_SIZE; k++, tick++) {
+		timer_node_t *head = &wheel[0][tick & WHEEL_MASK];
+		if ((tick & WHEEL_MASK) == 0 || head->next != head) break;
+	}
+	int64_t wait = tick * TIMER_TICK_MS - now;
+	return wait > 0 ? wait : 0;
+}
+
+// Readiness interest. Everything registers through these so the loop does
+// not care which backend (epoll) is underneath. Each fd is registered once
+// with the union of what it wants, and only a change costs a syscall.
+#define EV_IN  1
+#define EV_OUT 2
+
+void ev_set(int fd, int bit, int on) {
+	int old = fd_events[fd];
+	int want = on ? old | bit : old & ~bit;
+	if (want == old) return;
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof ev);
+	ev.events = (want & EV_IN ? EPOLLIN : 0) | (want & EV_OUT ? EPOLLOUT : 0);
+	ev.data.fd = fd;
+	int op = old == 0 ? EPOLL_CTL_ADD : want == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+	int r = epoll_ctl(epfd, op, fd, &ev);
+	if (r == -1 && errno == EEXIST) r = epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &ev);   // inherited fd
+	if (r == -1 && errno == ENOENT && want != 0) r = epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+	if (r == -1 && errno != ENOENT && errno != EBADF) {
+		perror("epoll_ctl");
+	}
+	fd_events[fd] = want;
+}
+
+void ev_read(int fd, int on) {
+	ev_set(fd, EV_IN, on);
+}
+
+void ev_write(int fd, int on) {
+	ev_set(fd, EV_OUT, on);
+}
+
+// Close a socket with an RST instead of a FIN: no TIME_WAIT left behind
+void reset_close(int fd) {
+	struct linger lg = { 1, 0 };
+	setsockopt(fd, SOL_SOCKET, SO_LINGER, &lg, sizeof lg);
+	close(fd);
+}
+
+// Stop all I/O on a client and queue it for removal after this loop pass
+void mark_dead(client_t *c) {
+	if (c->dead) return;
+	c->dead = 1;
+	ev_read(c->fd, 0);
+	ev_write(c->fd, 0);
+	reap_list[reap_count++] = c - clients;
+}
+
+// errno for a failed SSL_read()/SSL_write()
+int tls_errno(SSL *ssl, int ret) {
+	switch (SSL_get_error(ssl, ret)) {
+	case SSL_ERROR_WANT_READ:
+	case SSL_ERROR_WANT_WRITE:
+		return EAGAIN;
+	case SSL_ERROR_SYSCALL:
+		return errno ? errno : EPIPE;
+	default:
+		return EPROTO;
+	}
+}
+
+// Latency histogram. Bucket k < 16 holds k ns; above that each power of
+// two is split into 16 equal sub-buckets.
+int lat_bucket(int64_t ns) {
+	if (ns < (1 << LAT_SUB_BITS)) return ns < 0 ? 0 : (int)ns;
+	int msb = 63 - __builtin_clzll((uint64_t)ns);
+	int shift = msb - LAT_SUB_BITS;
+	return ((shift + 1) << LAT_SUB_BITS) + (int)((ns >> shift) & ((1 << LAT_SUB_BITS) - 1));
+}
+
+int64_t lat_bucket_ns(int k) {
+	if (k < (1 << LAT_SUB_BITS)) return k;
+	int shift = (k >> LAT_SUB_BITS) - 1;
+	return ((int64_t)((1 << LAT_SUB_BITS) + (k & ((1 << LAT_SUB_BITS) - 1)))) << shift;
+}
+
+void lat_record(void) {
+	int64_t ns = now_ns() - lat_wake;
+	lat_hist[lat_bucket(ns)]++;
+	lat_samples++;
+	if (ns > lat_max) lat_max = ns;
+}
+
+// The kernel's receive timestamp (SO_TIMESTAMPNS, wall clock) moves the
+// wakeup back to when the bytes arrived, so time spent before epoll_wait()
+// returned - a sleeping loop being woken - is counted too
+void lat_rx(struct msghdr *msg) {
+	for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm != NULL; cm = CMSG_NXTHDR(msg, cm)) {
+		if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_TIMESTAMPNS) continue;
+		struct timespec ts, now;
+		memcpy(&ts, CMSG_DATA(cm), sizeof ts);
+		clock_gettime(CLOCK_REALTIME, &now);
+		int64_t age = (int64_t)(now.tv_sec - ts.tv_sec) * 1000000000 + (now.tv_nsec - ts.tv_nsec);
+		int64_t at = now_ns() - (age > 0 ? age : 0);
+		if (lat_wake == 0 || at < lat_wake) lat_wake = at;
+	}
+}
+
+void on_sigusr1(int sig) {
+	(void)sig;
+	lat_report_due = 1;
+}
+
+void on_sighup(int sig) {
+	(void)sig;
+	filter_reload_due = 1;
+}
+
+// Print the distribution so far and start a new one
+void lat_report(void) {
+	static const double pct[] = { 50, 90, 99, 99.9, 99.99 };
+	lat_report_due = 0;
+	printf("Wakeup-to-send latency, %s, %llu send(s):", busy_poll ? "busy poll" : "blocking",
+		(unsigned long long)lat_samples);
+	uint64_t seen = 0;
+	int k = 0;
+	for (int p = 0; p < 5 && lat_samples > 0; p++) {
+		uint64_t want = (uint64_t)(lat_samples * pct[p] / 100.0 + 0.5);
+		if (want == 0) want = 1;
+		while (seen + lat_hist[k] < want) seen += lat_hist[k++];
+		printf(" p%g %.1f us", pct[p], lat_bucket_ns(k) / 1e3);
+	}
+	printf(" max %.1f us\n", lat_max / 1e3);
+	if (crypto_threads > 0) {
+		printf("Crypto pool, jobs run by their room's owner/stolen:");
+		for (int w = 0; w < crypto_threads; w++) {
+			printf(" %llu/%llu", (unsigned long long)atomic_exchange(&crypto_workers[w].ran, 0),
+				(unsigned long long)atomic_exchange(&crypto_workers[w].stolen, 0));
+		}
+		printf(", %llu room move(s)\n", (unsigned long long)crypto_moves);
+		crypto_moves = 0;
+	}
+	fflush(stdout);
+	memset(lat_hist, 0, sizeof lat_hist);
+	lat_samples = 0;
+	lat_max = 0;
+}
+
+// Parse a CPU list like "2", "2,3" or "2-5" into busy_loop_cpu (the first)
+// and busy_other_cpus (the rest; all other allowed CPUs if there is no rest)
+int busy_cpus(const char *list) {
+	cpu_set_t all;
+	int first = -1, rest = 0;
+
+	CPU_ZERO(&busy_loop_cpu);
+	CPU_ZERO(&busy_other_cpus);
+	for (const char *p = list; *p != '\0'; ) {
+		char *end;
+		long lo = strtol(p, &end, 10), hi = lo;
+		if (end == p || lo < 0 || lo >= CPU_SETSIZE) return -1;
+		if (*end == '-') {
+			p = end + 1;
+			hi = strtol(p, &end, 10);
+			if (end == p || hi < lo || hi >= CPU_SETSIZE) return -1;
+		}
+		for (long cpu = lo; cpu <= hi; cpu++) {
+			if (first == -1) {
+				first = cpu;
+				CPU_SET(cpu, &busy_loop_cpu);
+			} else {
+				CPU_SET(cpu, &busy_other_cpus);
+				rest = 1;
+			}
+		}
+		p = *end == ',' ? end + 1 : end;
+		if (*end != ',' && *end != '\0') return -1;
+	}
+	if (first == -1) return -1;
+	if (!rest && sched_getaffinity(0, sizeof all, &all) == 0) {
+		CPU_CLR(first, &all);
+		busy_other_cpus = all;
+	}
+	return first;
+}
+
+// Keep a helper thread off the loop's CPU
+void busy_pin(pthread_t t) {
+	if (busy_poll && CPU_COUNT(&busy_other_cpus) > 0) {
+		pthread_setaffinity_np(t, sizeof busy_other_cpus, &busy_other_cpus);
+	}
+}
+
+// Per-socket busy polling (and receive timestamps for -H), for each new
+// TCP connection. Raising SO_BUSY_POLL above net.core.busy_read takes
+// CAP_NET_ADMIN; without it we still spin, the kernel just does not poll.
+void busy_socket(int fd) {
+	static int warned = 0;
+	int on = 1, us = BUSY_POLL_US, budget = BUSY_POLL_BUDGET;
+
+	if (lat_on) {
+		setsockopt(fd, SOL_SOCKET, SO_TIMESTAMPNS, &on, sizeof on);
+	}
+	if (!busy_poll) return;
+	if ((setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &us, sizeof us) == -1 ||
+			setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &on, sizeof on) == -1 ||
+			setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL_BUDGET, &budget, sizeof budget) == -1) && !warned) {
+		warned = 1;
+		fprintf(stderr, "busy poll: socket options refused (%s); spinning without kernel polling\n", strerror(errno));
+	}
+}
+
+// Pin the loop thread and its helpers, and have epoll busy-poll. Called once
+// every helper thread is running; threads started later call busy_pin().
+void busy_start(int cpu) {
+	struct epoll_params ep;
+
+	for (int i = 0; i < crypto_threads; i++) {
+		busy_pin(crypto_workers[i].thread);
+	}
+	if (tap_on) busy_pin(tap_thread);
+	if (pthread_setaffinity_np(pthread_self(), sizeof busy_loop_cpu, &busy_loop_cpu) != 0) {
+		fprintf(stderr, "busy poll: cannot pin the loop to CPU %d\n", cpu);
+	}
+	memset(&ep, 0, sizeof ep);
+	ep.busy_poll_usecs = BUSY_POLL_US;
+	ep.busy_poll_budget = BUSY_POLL_BUDGET;
+	ep.prefer_busy_poll = 1;
+	if (ioctl(epfd, EPIOCSPARAMS, &ep) == -1) {
+		fprintf(stderr, "busy poll: epoll busy polling unavailable (%s)\n", strerror(errno));
+	}
+}
+
+// Socket I/O for every connection. Without a kernel TLS direction OpenSSL
+// seals/opens the records; with one (or no TLS at all) it is plain send/recv.
+int conn_send(client_t *c, const void *data, int len) {
+	if (c->ssl == NULL || c->ktls_tx) {
+		return send(c->fd, data, len, MSG_NOSIGNAL);
+	}
+	ERR_clear_error();
+	int n = SSL_write(c->ssl, data, len);
+	if (n > 0) return n;
+	errno = tls_errno(c->ssl, n);
+	return -1;
+}
+
+int conn_recv(client_t *c, void *buf, int len) {
+	if (c->ssl == NULL && lat_on) {
+		char ctl[CMSG_SPACE(sizeof(struct timespec))];
+		struct iovec iov = { buf, len };
+		struct msghdr msg;
+		memset(&msg, 0, sizeof msg);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ctl;
+		msg.msg_controllen = sizeof ctl;
+		int n = recvmsg(c->fd, &msg, 0);
+		if (n > 0) lat_rx(&msg);
+		return n;
+	}
+	if (c->ssl == NULL || c->ktls_rx) {
+		return recv(c->fd, buf, len, 0);
+	}
+	ERR_clear_error();
+	int n = SSL_read(c->ssl, buf, len);
+	if (n > 0) return n;
+	if (SSL_get_error(c->ssl, n) == SSL_ERROR_ZERO_RETURN) return 0;
+	errno = tls_errno(c->ssl, n);
+	return -1;
+}
+
+// OpenSSL may hold decrypted input the socket no longer signals
+int tls_buffered(client_t *c) {
+	return c->ssl != NULL && !c->ktls_rx && !c->dead && !c->throttled && SSL_pending(c->ssl) > 0;
+}
+
+// Wire trace. tap_writer() and the pcapng helpers it uses run on the writer
+// thread; everything else runs on the loop thread.
+void put_be(unsigned char *p, uint64_t v, int n);
+
+static unsigned char tap_blk[TAP_SNAP + 512];   // the block being written
+
+#define TAP_EPB_DATA  28   // block header + enhanced packet block fields
+
+int64_t tap_clock(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void tap_copy_in(uint64_t pos, const void *src, uint32_t len) {
+	uint32_t off = pos & (TAP_RING - 1), first = TAP_RING - off;
+	if (first > len) first = len;
+	memcpy(tap_ring + off, src, first);
+	if (len > first) memcpy(tap_ring, (const unsigned char *)src + first, len - first);
+}
+
+void tap_copy_out(void *dst, uint64_t pos, uint32_t len) {
+	uint32_t off = pos & (TAP_RING - 1), first = TAP_RING - off;
+	if (first > len) first = len;
+	memcpy(dst, tap_ring + off, first);
+	if (len > first) memcpy((unsigned char *)dst + first, tap_ring, len - first);
+}
+
+// Append a pcapng option (code, length, value padded to 4); returns its size
+int tap_opt(unsigned char *p, uint16_t code, const void *val, int len) {
+	uint16_t h[2] = { code, (uint16_t)len };
+	int padded = (len + 3) & ~3;
+	memcpy(p, h, 4);
+	if (len > 0) memcpy(p + 4, val, len);
+	memset(p + 4 + len, 0, padded - len);
+	return 4 + padded;
+}
+
+// Wrap the body at tap_blk + 8 as a block and write it out
+void tap_block(uint32_t type, int body) {
+	uint32_t total = 8 + body + 4;
+	memcpy(tap_blk, &type, 4);
+	memcpy(tap_blk + 4, &total, 4);
+	memcpy(tap_blk + 8 + body, &total, 4);
+	fwrite(tap_blk, 1, total, tap_file);
+}
+
+void tap_iface(uint16_t linktype, const char *name, const char *desc) {
+	unsigned char *p = tap_blk + 8;
+	uint16_t lt[2] = { linktype, 0 };
+	uint32_t snap = TAP_SNAP;
+	uint8_t resol = 9;   // nanosecond timestamps
+	int n = 8;
+
+	memcpy(p, lt, 4);
+	memcpy(p + 4, &snap, 4);
+	n += tap_opt(p + n, 2, name, strlen(name));   // if_name
+	n += tap_opt(p + n, 3, desc, strlen(desc));   // if_description
+	n += tap_opt(p + n, 9, &resol, 1);            // if_tsresol
+	n += tap_opt(p + n, 0, NULL, 0);
+	tap_block(1, n);
+}
+
+// Section header and our two interfaces: 0 carries the connections as raw
+// IP, 1 carries the stage notes (text, also attached as packet comments)
+void tap_header(void) {
+	unsigned char *p = tap_blk + 8;
+	uint32_t bom = 0x1A2B3C4D;
+	uint16_t ver[2] = { 1, 0 };
+	int64_t section = -1;   // length unknown
+	int n = 16;
+
+	memcpy(p, &bom, 4);
+	memcpy(p + 4, ver, 4);
+	memcpy(p + 8, &section, 8);
+	n += tap_opt(p + n, 4, "chat server", 11);    // shb_userappl
+	n += tap_opt(p + n, 0, NULL, 0);
+	tap_block(0x0A0D0D0A, n);
+	tap_iface(101, "chat", "frames as sent and received, in synthesized TCP/IP");   // LINKTYPE_RAW
+	tap_iface(147, "stages", "decrypt and broadcast timings");                      // LINKTYPE_USER0
+}
+
+// Enhanced packet block for the packet already at tap_blk + TAP_EPB_DATA
+void tap_epb(uint32_t iface, int64_t ts, int len, const char *comment, int clen) {
+	unsigned char *p = tap_blk + 8;
+	uint32_t f[5] = { iface, (uint32_t)((uint64_t)ts >> 32), (uint32_t)ts, (uint32_t)len, (uint32_t)len };
+	int n = 20 + ((len + 3) & ~3);
+
+	memcpy(p, f, sizeof f);
+	memset(p + 20 + len, 0, n - 20 - len);
+	if (clen > 0) {
+		n += tap_opt(p + n, 1, comment, clen);   // opt_comment
+		n += tap_opt(p + n, 0, NULL, 0);
+	}
+	tap_block(6, n);
+}
+
+uint32_t csum_add(uint32_t sum, const unsigned char *p, int len) {
+	for (; len > 1; p += 2, len -= 2) sum += (p[0] << 8) | p[1];
+	if (len > 0) sum += p[0] << 8;
+	return sum;
+}
+
+uint16_t csum_fold(uint32_t sum) {
+	while (sum >> 16) sum = (sum & 0xffff) + (sum >> 16);
+	return ~sum;
+}
+
+// Build the IP and TCP headers at p for len bytes of data already placed
+// after them; returns the packet length
+int tap_tcp(unsigned char *p, const tap_rec_t *r, int from_client, int flags,
+		uint32_t seq, uint32_t ack, int len) {
+	int v6 = r->family == AF_INET6, alen = v6 ? 16 : 4, ip = v6 ? 40 : 20;
+	const unsigned char *src = from_client ? r->caddr : r->saddr;
+	const unsigned char *dst = from_client ? r->saddr : r->caddr;
+	unsigned char *t = p + ip;
+
+	memset(p, 0, ip + 20);
+	if (v6) {
+		p[0] = 0x60;
+		put_be(p + 4, 20 + len, 2);
+		p[6] = IPPROTO_TCP;
+		p[7] = 64;
+		memcpy(p + 8, src, 16);
+		memcpy(p + 24, dst, 16);
+	} else {
+		p[0] = 0x45;
+		put_be(p + 2, ip + 20 + len, 2);
+		p[6] = 0x40;   // don't fragment
+		p[8] = 64;
+		p[9] = IPPROTO_TCP;
+		memcpy(p + 12, src, 4);
+		memcpy(p + 16, dst, 4);
+		put_be(p + 10, csum_fold(csum_add(0, p, 20)), 2);
+	}
+	put_be(t, from_client ? r->cport : r->sport, 2);
+	put_be(t + 2, from_client ? r->sport : r->cport, 2);
+	put_be(t + 4, seq, 4);
+	put_be(t + 8, ack, 4);
+	t[12] = 5 << 4;
+	t[13] = flags;
+	put_be(t + 14, 65535, 2);
+	uint32_t sum = csum_add(csum_add(0, src, alen), dst, alen) + IPPROTO_TCP + 20 + len;
+	put_be(t + 16, csum_fold(csum_add(sum, t, 20 + len)), 2);
+	return ip + 20 + len;
+}
+
+// Turn one ring record (its data starts at pos) into pcapng
+void tap_emit(const tap_rec_t *r, uint64_t pos) {
+	unsigned char *p = tap_blk + TAP_EPB_DATA;
+	int hl = r->family == AF_INET6 ? 60 : 40;
+
+	switch (r->kind) {
+	case TAP_STAGE:
+		tap_copy_out(p, pos, r->len);
+		tap_epb(1, r->ts, r->len, (const char *)p, r->len);
+		break;
+	case TAP_OPEN:   // a handshake, so Wireshark numbers each stream from 1
+		tap_epb(0, r->ts, tap_tcp(p, r, 1, TH_SYN, 0, 0, 0), NULL, 0);
+		tap_epb(0, r->ts, tap_tcp(p, r, 0, TH_SYN | TH_ACK, 0, 1, 0), NULL, 0);
+		tap_epb(0, r->ts, tap_tcp(p, r, 1, TH_ACK, 1, 1, 0), NULL, 0);
+		break;
+	case TAP_IN:
+		tap_copy_out(p + hl, pos, r->len);
+		tap_epb(0, r->ts, tap_tcp(p, r, 1, TH_PUSH | TH_ACK, r->rx, r->tx, r->len), NULL, 0);
+		break;
+	case TAP_OUT:
+		tap_copy_out(p + hl, pos, r->len);
+		tap_epb(0, r->ts, tap_tcp(p, r, 0, TH_PUSH | TH_ACK, r->tx, r->rx, r->len), NULL, 0);
+		break;
+	case TAP_CLOSE:
+		tap_epb(0, r->ts, tap_tcp(p, r, 0, TH_FIN | TH_ACK, r->tx, r->rx, 0), NULL, 0);
+		tap_epb(0, r->ts, tap_tcp(p, r, 1, TH_FIN | TH_ACK, r->rx, r->tx + 1, 0), NULL, 0);
+		break;
+	}
+}
+
+// Writer thread: drain the ring into the file, flushing whenever it runs dry
+void *tap_writer(void *arg) {
+	(void)arg;
+	for (;;) {
+		uint64_t tail = atomic_load_explicit(&tap_tail, memory_order_relaxed);
+		if (tail == atomic_load_explicit(&tap_head, memory_order_acquire)) {
+			if (atomic_load(&tap_stopping)) break;
+			fflush(tap_file);
+			usleep(TAP_POLL_US);
+			continue;
+		}
+		tap_rec_t r;
+		tap_copy_out(&r, tail, sizeof r);
+		tap_emit(&r, tail + sizeof r);
+		atomic_store_explicit(&tap_tail, tail + r.size, memory_order_release);
+	}
+	return NULL;
+}
+
+// Copy a record and its data into the ring. A full ring drops it; the
+// stream positions still advance, so Wireshark marks the gap.
+void tap_put(tap_rec_t *r, const void *data, int len) {
+	uint64_t head = atomic_load_explicit(&tap_head, memory_order_relaxed);
+
+	r->len = len;
+	r->size = (sizeof *r + len + 7) & ~7u;
+	if (head + r->size - atomic_load_explicit(&tap_tail, memory_order_acquire) > TAP_RING) {
+		tap_drops++;
+		return;
+	}
+	r->ts = tap_clock();
+	tap_copy_in(head, r, sizeof *r);
+	if (len > 0) tap_copy_in(head + sizeof *r, data, len);
+	atomic_store_explicit(&tap_head, head + r->size, memory_order_release);
+}
+
+// Both ends of a connection as the trace shows them. Local clients have no
+// address; they appear as 127.0.0.2 with their socket number as the port.
+void tap_endpoints(client_t *c, tap_rec_t *r) {
+	memset(r, 0, sizeof *r);
+	r->rx = c->tap_rx;
+	r->tx = c->tap_tx;
+	memcpy(r->saddr, c->tap_addr, 16);
+	r->sport = c->tap_port;
+	if (c->addr.sa.sa_family == AF_INET6) {
+		struct sockaddr_in6 *a = &c->addr.in6;
+		r->family = AF_INET6;
+		memcpy(r->caddr, &a->sin6_addr, 16);
+		r->cport = ntohs(a->sin6_port);
+	} else if (c->addr.sa.sa_family == AF_INET) {
+		struct sockaddr_in *a = &c->addr.in;
+		r->family = AF_INET;
+		memcpy(r->caddr, &a->sin_addr, 4);
+		r->cport = ntohs(a->sin_port);
+	} else {
+		static const unsigned char lo2[4] = { 127, 0, 0, 2 };
+		r->family = AF_INET;
+		memcpy(r->caddr, lo2, 4);
+		r->cport = c->fd;
+	}
+}
+
+// First traced segment of a connection: look up our end and show a handshake
+void tap_connect(client_t *c) {
+	struct sockaddr_storage self;
+	socklen_t len = sizeof self;
+	tap_rec_t r;
+
+	c->tap_open = 1;
+	c->tap_rx = c->tap_tx = 1;   // the SYNs took 0
+	memset(c->tap_addr, 0, sizeof c->tap_addr);
+	if (c->local || getsockname(c->fd, (struct sockaddr *)&self, &len) == -1) {
+		static const unsigned char lo[4] = { 127, 0, 0, 1 };
+		memcpy(c->tap_addr, lo, 4);
+		c->tap_port = atoi(listen_port);
+	} else if (self.ss_family == AF_INET6) {
+		memcpy(c->tap_addr, &((struct sockaddr_in6 *)&self)->sin6_addr, 16);
+		c->tap_port = ntohs(((struct sockaddr_in6 *)&self)->sin6_port);
+	} else {
+		memcpy(c->tap_addr, &((struct sockaddr_in *)&self)->sin_addr, 4);
+		c->tap_port = ntohs(((struct sockaddr_in *)&self)->sin_port);
+	}
+	tap_endpoints(c, &r);
+	r.kind = TAP_OPEN;
+	tap_put(&r, NULL, 0);
+}
+
+// Trace a segment read from (TAP_IN) or written to (TAP_OUT) a connection
+void tap_segment(client_t *c, int kind, const void *data, int len) {
+	tap_rec_t r;
+
+	if (!c->tap_open) tap_connect(c);
+	if (len > TAP_SNAP - 60) len = TAP_SNAP - 60;   // never, with our frame sizes
+	tap_endpoints(c, &r);
+	r.kind = kind;
+	tap_put(&r, data, len);
+	if (kind == TAP_IN) c->tap_rx += len; else c->tap_tx += len;
+}
+
+void tap_close(client_t *c) {
+	tap_rec_t r;
+
+	tap_endpoints(c, &r);
+	r.kind = TAP_CLOSE;
+	tap_put(&r, NULL, 0);
+	c->tap_open = 0;
+}
+
+// A stage note: shows on the "stages" interface at the time it was taken
+void tap_stage(const char *fmt, ...) {
+	char text[TAP_TEXT];
+	va_list ap;
+	tap_rec_t r;
+
+	va_start(ap, fmt);
+	int n = vsnprintf(text, sizeof text, fmt, ap);
+	va_end(ap);
+	if (n >= (int)sizeof text) n = sizeof text - 1;
+	memset(&r, 0, sizeof r);
+	r.kind = TAP_STAGE;
+	tap_put(&r, text, n);
+}
+
+// Open the trace (appending a new section after a handoff) and start the writer
+int tap_start(const char *path, int append) {
+	if (tap_ring == NULL && (tap_ring = malloc(TAP_RING)) == NULL) {
+		fprintf(stderr, "trace: out of memory\n");
+		return -1;
+	}
+	if ((tap_file = fopen(path, append ? "ab" : "wb")) == NULL) {
+		perror(path);
+		return -1;
+	}
+	tap_header();
+	atomic_store(&tap_head, 0);
+	atomic_store(&tap_tail, 0);
+	atomic_store(&tap_stopping, 0);
+	tap_drops = 0;
+	for (int i = 0; i < client_hwm; i++) {
+		clients[i].tap_open = 0;   // each section shows its connections opening
+	}
+	if (pthread_create(&tap_thread, NULL, tap_writer, NULL) != 0) {
+		perror("pthread_create");
+		fclose(tap_file);
+		return -1;
+	}
+	busy_pin(tap_thread);
+	tap_on = 1;
+	return 0;
+}
+
+// Drain the ring, record how much it dropped and close the file
+void tap_stop(void) {
+	if (!tap_on) return;
+	tap_on = 0;
+	atomic_store(&tap_stopping, 1);
+	pthread_join(tap_thread, NULL);
+
+	unsigned char *p = tap_blk + 8;
+	int64_t ts = tap_clock();
+	uint32_t f[3] = { 0, (uint32_t)((uint64_t)ts >> 32), (uint32_t)ts };
+	memcpy(p, f, sizeof f);
+	int n = 12 + tap_opt(p + 12, 5, &tap_drops, 8);   // isb_ifdrop
+	n += tap_opt(p + n, 0, NULL, 0);
+	tap_block(5, n);
+	fclose(tap_file);
+	if (tap_drops > 0) {
+		printf("Wire trace dropped %llu record(s)\n", (unsigned long long)tap_drops);
+	}
+}
+
+// Message history. The index and reading the log back belong to the indexer
+// thread; hist_put() and what calls it, and hist_complete(), run on the loop.
+typedef struct {
+	uint32_t first;         // the block's first message id, whole
+	uint32_t start;         // where the gaps after it begin in data
+} hist_block_t;
+
+typedef struct {
+	char key[HIST_KEY];     // room '\0' word
+	uint8_t klen;
+	uint32_t hash;
+	uint32_t count;         // messages holding the word
+	uint32_t last;          // the newest of them
+	uint32_t nblocks;
+	hist_block_t *blocks;
+	unsigned char *data;    // varint gaps between consecutive ids
+	uint32_t dlen, dcap;
+} hist_term_t;
+
+// A search's place in one term's postings, newest first
+typedef struct {
+	const hist_term_t *t;
+	int block, n;           // block decoded into ids, -1 = none yet
+	uint32_t ids[HIST_BLOCK];
+} hist_cursor_t;
+
+static uint32_t *hist_slots;      // open addressing, power of two: hist_terms index + 1, 0 = free
+static uint32_t hist_scap;
+static hist_term_t *hist_terms;   // in the order the words first came
+static uint32_t hist_tcount, hist_tcap;
+static uint64_t *hist_docs;       // message id -> where its record starts in the log
+static uint32_t hist_ndocs, hist_dcap;
+static uint64_t hist_end;         // log length
+
+#define HIST_BODY_MAX (8 + 2 + 2 * 255 + MAXDATASIZE)   // log record after its length
+
+void send_encrypted(client_t *c, const char *message, int len);
+void session_text(session_t *s, const char *msg, int len);
+
+void hist_copy_in(uint64_t pos, const void *src, uint32_t len) {
+	uint32_t off = pos & (HIST_RING - 1), first = HIST_RING - off;
+	if (first > len) first = len;
+	memcpy(hist_ring + off, src, first);
+	if (len > first) memcpy(hist_ring, (const unsigned char *)src + first, len - first);
+}
+
+void hist_copy_out(void *dst, uint64_t pos, uint32_t len) {
+	uint32_t off = pos & (HIST_RING - 1), first = HIST_RING - off;
+	if (first > len) first = len;
+	memcpy(dst, hist_ring + off, first);
+	if (len > first) memcpy((unsigned char *)dst + first, hist_ring, len - first);
+}
+
+void *hist_alloc(void *p, size_t n) {
+	if ((p = realloc(p, n)) == NULL) {
+		fprintf(stderr, "history: out of memory\n");
+		exit(1);
+	}
+	return p;
+}
+
+int hist_wordch(unsigned char c) {
+	return (c >= '0' && c <= '9') || ((c | 0x20) >= 'a' && (c | 0x20) <= 'z') || c >= 0x80;
+}
+
+// Next word of s[0..len) from *pos, lower-cased into w; 0 when none is left
+int hist_word(const char *s, int len, int *pos, char *w) {
+	int i = *pos, n = 0;
+
+	while (i < len && !hist_wordch(s[i])) i++;
+	for (; i < len && hist_wordch(s[i]); i++) {
+		unsigned char ch = s[i];
+		if (n < HIST_WORD_MAX) w[n++] = ch >= 'A' && ch <= 'Z' ? ch + 32 : ch;
+	}
+	*pos = i;
+	return n;
+}
+
+void hist_grow(void) {
+	uint32_t cap = hist_scap ? 2 * hist_scap : 1 << 16;
+	uint32_t *slots = calloc(cap, sizeof *slots);
+
+	if (slots == NULL) {
+		fprintf(stderr, "history: out of memory\n");
+		exit(1);
+	}
+	for (uint32_t k = 0; k < hist_tcount; k++) {
+		uint32_t j = hist_terms[k].hash & (cap - 1);
+		while (slots[j] != 0) j = (j + 1) & (cap - 1);
+		slots[j] = k + 1;
+	}
+	free(hist_slots);
+	hist_slots = slots;
+	hist_scap = cap;
+}
+
+hist_term_t *hist_term(const char *room, int rlen, const char *w, int wn, int create) {
+	char key[HIST_KEY];
+
+	if (rlen > ROOM_LEN - 1) rlen = ROOM_LEN - 1;
+	memcpy(key, room, rlen);
+	key[rlen] = '\0';
+	memcpy(key + rlen + 1, w, wn);
+	int klen = rlen + 1 + wn;
+	uint32_t h = 2166136261u;
+	for (int i = 0; i < klen; i++) h = (h ^ (unsigned char)key[i]) * 16777619u;
+
+	if (create && 2 * (hist_tcount + 1) > hist_scap) hist_grow();
+	if (hist_scap == 0) return NULL;
+	for (uint32_t i = h & (hist_scap - 1);; i = (i + 1) & (hist_scap - 1)) {
+		if (hist_slots[i] == 0) {
+			if (!create) return NULL;
+			if (hist_tcount == hist_tcap) {
+				hist_tcap = hist_tcap ? 2 * hist_tcap : 1 << 16;
+				hist_terms = hist_alloc(hist_terms, hist_tcap * sizeof *hist_terms);
+			}
+			hist_term_t *t = &hist_terms[hist_tcount++];
+			memset(t, 0, sizeof *t);
+			memcpy(t->key, key, klen);
+			t->klen = klen;
+			t->hash = h;
+			hist_slots[i] = hist_tcount;
+			return t;
+		}
+		hist_term_t *t = &hist_terms[hist_slots[i] - 1];
+		if (t->hash == h && t->klen == klen && memcmp(t->key, key, klen) == 0) return t;
+	}
+}
+
+// Add message id (newer than any the term holds) to its postings
+void hist_post(hist_term_t *t, uint32_t id) {
+	if (t->count > 0 && t->last == id) return;   // the word came twice in one message
+	if (t->count % HIST_BLOCK == 0) {
+		if ((t->nblocks & (t->nblocks - 1)) == 0) {
+			t->blocks = hist_alloc(t->blocks, (t->nblocks ? 2 * t->nblocks : 1) * sizeof *t->blocks);
+		}
+		t->blocks[t->nblocks].first = id;
+		t->blocks[t->nblocks++].start = t->dlen;
+	} else {
+		if (t->dlen + 5 > t->dcap) {
+			t->dcap = t->dcap ? 2 * t->dcap : 16;
+			t->data = hist_alloc(t->data, t->dcap);
+		}
+		uint32_t gap = id - t->last;
+		while (gap >= 0x80) {
+			t->data[t->dlen++] = gap | 0x80;
+			gap >>= 7;
+		}
+		t->data[t->dlen++] = gap;
+	}
+	t->last = id;
+	t->count++;
+}
+
+// Expand block b of a term's postings into ids (oldest first); returns how many
+int hist_decode(const hist_term_t *t, uint32_t b, uint32_t *ids) {
+	uint32_t p = t->blocks[b].start, end = b + 1 < t->nblocks ? t->blocks[b + 1].start : t->dlen;
+	uint32_t id = t->blocks[b].first;
+	int n = 0;
+
+	ids[n++] = id;
+	while (p < end) {
+		uint32_t gap = 0;
+		for (int shift = 0;; shift += 7) {
+			gap |= (uint32_t)(t->data[p] & 0x7f) << shift;
+			if (!(t->data[p++] & 0x80)) break;
+		}
+		id += gap;
+		ids[n++] = id;
+	}
+	return n;
+}
+
+// Newest id <= want in the cursor's term, -1 if there is none. A search only
+// ever asks for smaller ids, so the block decoded last usually answers.
+int64_t hist_seek(hist_cursor_t *c, uint32_t want) {
+	const hist_term_t *t = c->t;
+
+	if (c->block < 0 || want < c->ids[0]) {
+		int lo = 0, hi = (c->block < 0 ? (int)t->nblocks : c->block) - 1;
+		if (hi < 0 || t->blocks[0].first > want) return -1;
+		while (lo < hi) {
+			int mid = (lo + hi + 1) / 2;
+			if (t->blocks[mid].first <= want) lo = mid; else hi = mid - 1;
+		}
+		c->block = lo;
+		c->n = hist_decode(t, lo, c->ids);
+	}
+	int lo = 0, hi = c->n - 1;   // ids[0] <= want
+	while (lo < hi) {
+		int mid = (lo + hi + 1) / 2;
+		if (c->ids[mid] <= want) lo = mid; else hi = mid - 1;
+	}
+	return c->ids[lo];
+}
+
+// Newest messages holding every term: each cursor in turn moves to the
+// newest id no newer than the candidate, until all of them agree on one.
+// Returns the number found, newest first in hits.
+int hist_match(hist_cursor_t *c, int nt, uint32_t *hits) {
+	int64_t want = UINT32_MAX;
+	int nh = 0, agree = 0;
+
+	for (int k = 0; nh < HIST_RESULTS; k = (k + 1) % nt) {
+		int64_t id = hist_seek(&c[k], want);
+		if (id < 0) break;
+		if (id == want) {
+			agree++;
+		} else {
+			want = id;
+			agree = 1;
+		}
+		if (agree == nt) {
+			hits[nh++] = want;
+			if (want == 0) break;
+			want--;
+			agree = 0;
+		}
+	}
+	return nh;
+}
+
+// Give a message the next id and post it under each of its words
+void hist_note(uint64_t off, const char *room, int rlen, const char *text, int len) {
+	char w[HIST_WORD_MAX];
+	int pos = 0, wn;
+
+	if (hist_ndocs == hist_dcap) {
+		hist_dcap = hist_dcap ? 2 * hist_dcap : 1 << 16;
+		hist_docs = hist_alloc(hist_docs, hist_dcap * sizeof *hist_docs);
+	}
+	uint32_t id = hist_ndocs++;
+	hist_docs[id] = off;
+	while ((wn = hist_word(text, len, &pos, w)) > 0) {
+		hist_post(hist_term(room, rlen, w, wn, 1), id);
+	}
+}
+
+// Log a message, [u32 length][i64 ms][u8 room length][room][u8 name length]
+// [name][text] in host byte order, and index it
+void hist_add(const hist_rec_t *r, const char *p) {
+	uint32_t body = 8 + 1 + r->rlen + 1 + r->nlen + r->len;
+	unsigned char hdr[13];
+
+	memcpy(hdr, &body, 4);
+	memcpy(hdr + 4, &r->ts, 8);
+	hdr[12] = r->rlen;
+	fwrite(hdr, 1, sizeof hdr, hist_file);
+	fwrite(p, 1, r->rlen, hist_file);
+	fputc(r->nlen, hist_file);
+	fwrite(p + r->rlen, 1, r->nlen + r->len, hist_file);
+	hist_note(hist_end, p, r->rlen, p + r->rlen + r->nlen, r->len);
+	hist_end += 4 + body;
+}
+
+// Index what earlier runs logged. A torn record at the end (the server died
+// mid-write) is cut off, so the next one starts on a record boundary.
+void hist_reload(void) {
+	static unsigned char rec[HIST_BODY_MAX];
+	int64_t start = now_ns();
+	uint64_t off = 0;
+	uint32_t body;
+	struct stat st;
+
+	FILE *f = fopen(hist_path, "rb");
+	if (f == NULL || fstat(hist_fd, &st) == -1) {
+		if (f != NULL) fclose(f);
+		return;
+	}
+	while (fread(&body, 4, 1, f) == 1) {
+		if (body < 10 || body > sizeof rec || fread(rec, 1, body, f) != body) break;
+		int rlen = rec[8];
+		if (10 + rlen > (int)body || 10 + rlen + rec[9 + rlen] > (int)body) break;
+		int nlen = rec[9 + rlen];
+		hist_note(off, (char *)rec + 9, rlen, (char *)rec + 10 + rlen + nlen, body - 10 - rlen - nlen);
+		off += 4 + body;
+	}
+	fclose(f);
+	if (off < (uint64_t)st.st_size) {
+		fprintf(stderr, "history: dropping %llu torn byte(s) at the end of %s\n",
+			(unsigned long long)(st.st_size - off), hist_path);
+		if (ftruncate(hist_fd, off) == -1) perror(hist_path);
+	}
+	hist_end = off;
+	printf("History: %u message(s), %u word(s) indexed from %s in %.2f s\n",
+		hist_ndocs, hist_tcount, hist_path, (now_ns() - start) / 1e9);
+}
+
+// A logged message as the room showed it: "[time] name: text"
+int hist_line(uint32_t id, char *out) {
+	static unsigned char rec[HIST_BODY_MAX];
+	uint32_t body;
+
+	if (pread(hist_fd, &body, 4, hist_docs[id]) != 4 || body < 10 || body > sizeof rec ||
+			pread(hist_fd, rec, body, hist_docs[id] + 4) != (ssize_t)body) {
+		return snprintf(out, MAXDATASIZE, "(message %u could not be read back)", id);
+	}
+	int64_t ms;
+	memcpy(&ms, rec, 8);
+	time_t secs = ms / 1000;
+	struct tm tm;
+	char when[64];
+	localtime_r(&secs, &tm);
+	strftime(when, sizeof when, "[%Y-%m-%d %H:%M:%S]", &tm);
+	int rlen = rec[8], nlen = rec[9 + rlen];
+	int n = snprintf(out, MAXDATASIZE, "%s %.*s: %.*s", when, nlen, (char *)rec + 10 + rlen,
+		(int)body - 10 - rlen - nlen, (char *)rec + 10 + rlen + nlen);
+	return n >= MAXDATASIZE ? MAXDATASIZE - 1 : n;
+}
+
+// Answer a /search: the newest messages in the asker's room holding every
+// word, oldest of them first, then a line saying what was searched
+void hist_search(const hist_rec_t *r, const char *p) {
+	int64_t start = now_ns();
+	const char *q = p + r->rlen + r->nlen;
+	hist_cursor_t cur[HIST_TERMS];
+	uint32_t hits[HIST_RESULTS];
+	char w[HIST_WORD_MAX];
+	int nt = 0, nh = 0, pos = 0, wn, missing = 0;
+
+	while (nt < HIST_TERMS && (wn = hist_word(q, r->len, &pos, w)) > 0) {
+		hist_term_t *t = hist_term(p, r->rlen, w, wn, 0);
+		if (t == NULL) {
+			missing = 1;   // nothing can match
+			break;
+		}
+		int k = nt, dup = 0;
+		for (int j = 0; j < nt; j++) dup |= cur[j].t == t;
+		if (dup) continue;
+		while (k > 0 && cur[k - 1].t->count > t->count) {   // rarest first
+			cur[k].t = cur[k - 1].t;
+			k--;
+		}
+		cur[k].t = t;
+		nt++;
+	}
+	for (int k = 0; k < nt; k++) cur[k].block = -1;
+	if (nt > 0 && !missing) nh = hist_match(cur, nt, hits);
+	double ms = (now_ns() - start) / 1e6;
+
+	hist_reply_t *a = hist_alloc(NULL, sizeof *a + (nh + 1) * MAXDATASIZE);
+	a->client = r->client;
+	a->session = r->session;
+	a->gen = r->gen;
+	a->stream = r->stream;
+	a->len = 0;
+	fflush(hist_file);   // the hits may still sit in stdio's buffer
+	for (int k = nh - 1; k >= 0; k--) {
+		a->len += hist_line(hits[k], a->text + a->len) + 1;
+	}
+	int qlen = r->len;
+	while (qlen > 0 && (q[qlen - 1] == ' ' || q[qlen - 1] == '\n')) qlen--;
+	while (qlen > 0 && *q == ' ') q++, qlen--;
+	if (qlen > 64) qlen = 64;
+	if (nt == 0 && !missing) {
+		a->len += snprintf(a->text + a->len, MAXDATASIZE, "Usage: /search word ... (messages in this room holding every word)") + 1;
+	} else {
+		a->len += snprintf(a->text + a->len, MAXDATASIZE, "-- %d%s match(es) for '%.*s' in '%.*s' (%.2f ms over %u message(s))",
+			nh, nh == HIST_RESULTS ? " newest" : "", qlen, q, r->rlen, p, ms, hist_ndocs) + 1;
+	}
+
+	uint64_t one = 1;
+	pthread_mutex_lock(&hist_done_lock);
+	a->next = NULL;
+	if (hist_done_tail != NULL) hist_done_tail->next = a; else hist_done = a;
+	hist_done_tail = a;
+	pthread_mutex_unlock(&hist_done_lock);
+	if (write(hist_efd, &one, sizeof one) == -1) {
+		perror("history: eventfd");
+	}
+}
+
+// Indexer thread: index what the log holds, then log, index and search in
+// ring order, flushing the log whenever the ring runs dry
+void *hist_indexer(void *arg) {
+	static char p[2 * 255 + MAXDATASIZE];
+
+	(void)arg;
+	if (hist_load) hist_reload();
+	for (;;) {
+		uint64_t tail = atomic_load_explicit(&hist_tail, memory_order_relaxed);
+		if (tail == atomic_load_explicit(&hist_head, memory_order_acquire)) {
+			if (atomic_load(&hist_stopping)) break;
+			fflush(hist_file);
+			usleep(HIST_POLL_US);
+			continue;
+		}
+		hist_rec_t r;
+		hist_copy_out(&r, tail, sizeof r);
+		hist_copy_out(p, tail + sizeof r, r.rlen + r.nlen + r.len);
+		if (r.kind == HIST_MSG) hist_add(&r, p); else hist_search(&r, p);
+		atomic_store_explicit(&hist_tail, tail + r.size, memory_order_release);
+	}
+	fflush(hist_file);
+	return NULL;
+}
+
+// Copy a record, its room, name and text into the ring; -1 if it is full
+int hist_put(hist_rec_t *r, const char *room, const char *name, const char *text, int len) {
+	uint64_t head = atomic_load_explicit(&hist_head, memory_order_relaxed);
+	struct timespec ts;
+
+	r->rlen = strnlen(room, ROOM_LEN - 1);
+	r->nlen = strnlen(name, 255);
+	r->len = len < MAXDATASIZE ? len : MAXDATASIZE;
+	r->size = (sizeof *r + r->rlen + r->nlen + r->len + 7) & ~7u;
+	if (head + r->size - atomic_load_explicit(&hist_tail, memory_order_acquire) > HIST_RING) {
+		hist_drops++;
+		return -1;
+	}
+	clock_gettime(CLOCK_REALTIME, &ts);
+	r->ts = (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	hist_copy_in(head, r, sizeof *r);
+	hist_copy_in(head + sizeof *r, room, r->rlen);
+	hist_copy_in(head + sizeof *r + r->rlen, name, r->nlen);
+	hist_copy_in(head + sizeof *r + r->rlen + r->nlen, text, r->len);
+	atomic_store_explicit(&hist_head, head + r->size, memory_order_release);
+	return 0;
+}
+
+// A line of chat for the log (the server's own notices are not kept)
+void hist_message(const char *room, const char *name, const char *text) {
+	hist_rec_t r;
+
+	memset(&r, 0, sizeof r);
+	r.kind = HIST_MSG;
+	hist_put(&r, room, name, text, strlen(text));
+}
+
+void hist_send(int client, int session, const char *msg, int len) {
+	if (session >= 0) {
+		session_text(&sessions[session], msg, len);
+	} else {
+		send_encrypted(&clients[client], msg, len);
+	}
+}
+
+// /search from a user (session -1) or a gateway session; the indexer answers
+void hist_query(int client, int session, const char *room, const char *query) {
+	static const char off[] = "Search is off: this server keeps no history.";
+	static const char busy[] = "Search is busy; try again in a moment.";
+	hist_rec_t r;
+
+	if (!hist_on) {
+		hist_send(client, session, off, sizeof off - 1);
+		return;
+	}
+	memset(&r, 0, sizeof r);
+	r.kind = HIST_QUERY;
+	r.client = client;
+	r.session = session;
+	r.gen = clients[client].gen;
+	r.stream = session >= 0 ? sessions[session].stream : 0;
+	if (hist_put(&r, room, "", query, strlen(query)) == -1) {
+		hist_send(client, session, busy, sizeof busy - 1);
+	}
+}
+
+// Deliver the indexer's answers to askers that are still here
+void hist_complete(void) {
+	uint64_t n;
+	if (read(hist_efd, &n, sizeof n) == -1 && errno != EAGAIN) {
+		perror("history: eventfd");
+	}
+	pthread_mutex_lock(&hist_done_lock);
+	hist_reply_t *a = hist_done;
+	hist_done = hist_done_tail = NULL;
+	pthread_mutex_unlock(&hist_done_lock);
+
+	while (a != NULL) {
+		hist_reply_t *next = a->next;
+		client_t *c = &clients[a->client];
+		int here = c->fd != -1 && !c->dead && c->gen == a->gen;
+		if (here && a->session >= 0) {
+			session_t *s = &sessions[a->session];
+			here = s->gw == a->client && s->stream == a->stream;
+		}
+		for (int off = 0; here && off < a->len; off += strlen(a->text + off) + 1) {
+			hist_send(a->client, a->session, a->text + off, strlen(a->text + off));
+		}
+		free(a);
+		a = next;
+	}
+}
+
+// Open the log and start the indexer; load: index what the log holds first
+int hist_start(int load) {
+	if (hist_ring == NULL && (hist_ring = malloc(HIST_RING)) == NULL) {
+		fprintf(stderr, "history: out of memory\n");
+		return -1;
+	}
+	if (hist_file == NULL) {
+		hist_fd = open(hist_path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+		if (hist_fd == -1 || (hist_file = fdopen(hist_fd, "a")) == NULL) {
+			perror(hist_path);
+			return -1;
+		}
+	}
+	if (hist_efd == -1) {
+		if ((hist_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1) {
+			perror("eventfd");
+			return -1;
+		}
+		ev_read(hist_efd, 1);
+	}
+	atomic_store(&hist_head, 0);
+	atomic_store(&hist_tail, 0);
+	atomic_store(&hist_stopping, 0);
+	hist_drops = 0;
+	hist_load = load;
+	if (pthread_create(&hist_thread, NULL, hist_indexer, NULL) != 0) {
+		perror("pthread_create");
+		return -1;
+	}
+	busy_pin(hist_thread);
+	hist_on = 1;
+	return 0;
+}
+
+// Let the indexer work through the ring and answer the searches in it. The
+// index stays, should we carry on after all.
+void hist_stop(void) {
+	if (!hist_on) return;
+	hist_on = 0;
+	atomic_store(&hist_stopping, 1);
+	pthread_join(hist_thread, NULL);
+	hist_complete();
+	if (hist_drops > 0) {
+		printf("History dropped %llu record(s)\n", (unsigned long long)hist_drops);
+	}
+}
+
+_Static_assert(RBUF_LEN <= BUF_SIZE, "a read buffer must hold a whole frame");
+
+// Borrow a buffer from the pool
+void *buf_get(void) {
+	void *b = buf_pool;
+	if (b == NULL) return malloc(BUF_SIZE);
+	memcpy(&buf_pool, b, sizeof buf_pool);
+	buf_pooled--;
+	return b;
+}
+
+// Give one back; past BUF_POOL_KEEP spare ones the allocator gets it
+void buf_put(void *b) {
+	if (buf_pooled >= BUF_POOL_KEEP) {
+		free(b);
+		return;
+	}
+	memcpy(b, &buf_pool, sizeof buf_pool);
+	buf_pool = b;
+	buf_pooled++;
+}
+
+// The output queue has drained. A queue that never outgrew one pooled buffer
+// goes back to the pool, a bigger one back to malloc.
+void obuf_release(client_t *c) {
+	if (c->obuf != NULL) {
+		if (c->ocap == BUF_SIZE) buf_put(c->obuf); else free(c->obuf);
+	}
+	c->obuf = NULL;
+	c->ooff = c->olen = c->ocap = 0;
+}
+
+// A connection with no partial frame gives its read buffer back
+void rbuf_release(client_t *c) {
+	if (c->rlen == 0 && c->rbuf != NULL) {
+		buf_put(c->rbuf);
+		c->rbuf = NULL;
+	}
+}
+
+// Append to the socket queue (bytes committed to the wire in this order)
+int obuf_append(client_t *c, const void *data, int len) {
+	int pending = c->olen - c->ooff;
+	if (c->ooff > 0) {
+		memmove(c->obuf, c->obuf + c->ooff, pending);
+		c->ooff = 0;
+		c->olen = pending;
+	}
+	if (c->olen + len > c->ocap) {
+		int cap = c->ocap ? c->ocap : BUF_SIZE;
+		while (cap < c->olen + len) cap *= 2;
+		char *nbuf = cap == BUF_SIZE ? buf_get() : realloc(c->obuf, cap);
+		if (nbuf == NULL) return -1;
+		c->obuf = nbuf;
+		c->ocap = cap;
+	}
+	memcpy(c->obuf + c->olen, data, len);
+	c->olen += len;
+	return 0;
+}
+
+// Relative share of a room's chat on a busy connection (-W)
+int room_weight(const char *room) {
+	for (int i = 0; i < room_weight_count; i++) {
+		if (strcmp(room_weights[i].room, room) == 0) return room_weights[i].weight;
+	}
+	return 1;
+}
+
+// Output tag for a room's chat
+uint32_t room_hash(const char *room) {
+	uint32_t h = 2166136261u;
+	for (const char *p = room; *p != '\0'; p++) {
+		h = (h ^ (unsigned char)*p) * 16777619u;   // FNV-1a
+	}
+	return h;
+}
+
+out_tag_t room_tag(const char *room) {
+	out_tag_t t = { OUT_BULK, room_hash(room), room_weight(room) };
+	return t;
+}
+
+// Queue a frame in its class (out_tag): control in order ahead of
+// everything, chat in its room's lane
+int outq_push(client_t *c, const void *data, int len) {
+	if (c->q == NULL && (c->q = calloc(1, sizeof *c->q)) == NULL) return -1;
+	qframe_t *f = malloc(sizeof *f + len);
+	if (f == NULL) return -1;
+	f->next = NULL;
+	f->len = len;
+	memcpy(f->data, data, len);
+
+	outq_t *q = c->q;
+	q->bytes += len;
+	if (out_tag.cls == OUT_CTRL) {
+		if (q->ctrl_tail != NULL) q->ctrl_tail->next = f; else q->ctrl = f;
+		q->ctrl_tail = f;
+		return 0;
+	}
+	// The room's lane, else an empty one, else the one its hash lands on
+	lane_t *l = NULL;
+	for (int k = 0; k < OUT_LANES && l == NULL; k++) {
+		if (q->lane[k].head != NULL && q->lane[k].key == out_tag.key) l = &q->lane[k];
+	}
+	for (int k = 0; k < OUT_LANES && l == NULL; k++) {
+		if (q->lane[k].head == NULL) l = &q->lane[k];
+	}
+	if (l == NULL) l = &q->lane[out_tag.key % OUT_LANES];
+	if (l->head == NULL) {
+		l->key = out_tag.key;
+		l->weight = out_tag.weight;
+	}
+	if (l->head != NULL) l->tail->next = f; else l->head = f;
+	l->tail = f;
+	q->bulk += len;
+	return 0;
+}
+
+// Move one waiting frame to the socket queue
+int outq_commit(client_t *c, qframe_t *f) {
+	int r = obuf_append(c, f->data, f->len);
+	if (tap_on) tap_segment(c, TAP_OUT, f->data, f->len);
+	c->q->bytes -= f->len;
+	free(f);
+	return r;
+}
+
+// Fill the socket queue from the lanes, up to about 'limit' pending bytes:
+// every control frame first, then chat by deficit round robin. Returns the
+// bytes moved; the lanes are freed once empty.
+int outq_fill(client_t *c, int limit) {
+	outq_t *q = c->q;
+	int moved = 0;
+
+	while (q->ctrl != NULL) {
+		qframe_t *f = q->ctrl;
+		if (c->olen - c->ooff > 0 && c->olen - c->ooff + f->len > limit) break;
+		q->ctrl = f->next;
+		if (q->ctrl == NULL) q->ctrl_tail = NULL;
+		moved += f->len;
+		if (outq_commit(c, f) == -1) return -1;
+	}
+	while (q->ctrl == NULL && q->bulk > 0) {
+		lane_t *l = &q->lane[q->cur];
+		if (l->head == NULL) {
+			l->deficit = 0;
+			q->cur = (q->cur + 1) % OUT_LANES;
+			q->topped = 0;
+			continue;
+		}
+		if (!q->topped) {
+			l->deficit += LANE_QUANTUM * l->weight;
+			q->topped = 1;
+		}
+		qframe_t *f = l->head;
+		if (f->len > l->deficit) {   // its turn is over
+			q->cur = (q->cur + 1) % OUT_LANES;
+			q->topped = 0;
+			continue;
+		}
+		if (c->olen - c->ooff > 0 && c->olen - c->ooff + f->len > limit) break;
+		l->head = f->next;
+		if (l->head == NULL) l->tail = NULL;
+		l->deficit -= f->len;
+		q->bulk -= f->len;
+		moved += f->len;
+		if (outq_commit(c, f) == -1) return -1;
+	}
+	if (q->bytes == 0) {
+		free(q);
+		c->q = NULL;
+	}
+	return moved;
+}
+
+// Drop whatever is still waiting (the connection is going away)
+void outq_free(client_t *c) {
+	outq_t *q = c->q;
+	if (q == NULL) return;
+	for (int k = -1; k < OUT_LANES; k++) {
+		qframe_t *f = k == -1 ? q->ctrl : q->lane[k].head;
+		while (f != NULL) {
+			qframe_t *next = f->next;
+			free(f);
+			f = next;
+		}
+	}
+	free(q);
+	c->q = NULL;
+}
+
+void flush_client(client_t *c);
+
+// Write to a client, straight through when nothing is waiting. What the
+// socket will not take waits in its lane and is flushed when epoll reports
+// the socket writable; a frame already partly sent finishes first.
+void client_queue(client_t *c, const void *data, int len) {
+	int sent = 0;
+
+	if (c->dead || c->handshaking) return;   // nothing goes out before the TLS handshake is done
+	int pending = c->olen - c->ooff + (c->q != NULL ? c->q->bytes : 0);
+	if (pending + len > OUTQ_MAX) {
+		printf("%s is not reading; dropping\n", c->username[0] ? c->username : "Unknown");
+		mark_dead(c);
+		return;
+	}
+	if (pending == 0 && !c->connecting && !c->local) {
+		if (tap_on) tap_segment(c, TAP_OUT, data, len);
+		sent = conn_send(c, data, len);
+		if (sent > 0 && lat_wake != 0) lat_record();   // queued output is the reader's delay, not ours
+		if (sent == len) return;
+		if (sent == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				mark_dead(c);
+				return;
+			}
+			sent = 0;
+		}
+		if (obuf_append(c, (const char *)data + sent, len - sent) == -1) {
+			mark_dead(c);
+			return;
+		}
+		ev_write(c->fd, 1);
+		return;
+	}
+
+	if (outq_push(c, data, len) == -1) {
+		mark_dead(c);
+		return;
+	}
+	ev_write(c->fd, 1);
+	if (c->local && pending == 0) {
+		flush_client(c);   // packets must be cut on frame boundaries; flush does that
+		if (c->olen == 0 && lat_wake != 0) lat_record();
+	}
+}
+
+void crypto_hold(client_t *c, const void *data, int len);
+
+// Send or queue output. While frames for this client are still being
+// encrypted by the pool, it waits behind them.
+void client_write(client_t *c, const void *data, int len) {
+	if (c->out_seq != c->out_done) {
+		crypto_hold(c, data, len);
+		return;
+	}
+	client_queue(c, data, len);
+}
+
+void peer_link_up(client_t *c);
+
+// Socket became writable: push out as much of the queue as it takes
+void flush_client(client_t *c) {
+	if (c->connecting) {
+		int err = 0;
+		socklen_t len = sizeof err;
+		getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err != 0) {
+			fprintf(stderr, "peer %s:%s: %s\n", peers[c->peer].host, peers[c->peer].port, strerror(err));
+			mark_dead(c);
+			return;
+		}
+		c->connecting = 0;
+		peer_link_up(c);
+	}
+	for (;;) {
+		while (c->ooff < c->olen) {
+			int chunk = c->olen - c->ooff;
+			if (c->local) {   // one frame per packet
+				unsigned char *h = (unsigned char *)c->obuf + c->ooff;
+				chunk = FRAME_HDR + ((h[0] << 8) | h[1]);
+			}
+			int n = conn_send(c, c->obuf + c->ooff, chunk);
+			if (n == -1) {
+				if (errno != EAGAIN && errno != EWOULDBLOCK) mark_dead(c);
+				return;
+			}
+			c->ooff += n;
+		}
+		c->ooff = c->olen = 0;
+		if (c->q == NULL) break;
+		if (outq_fill(c, OUT_FILL) == -1) {   // a small refill, so control never waits long
+			mark_dead(c);
+			return;
+		}
+	}
+	obuf_release(c);
+	ev_write(c->fd, 0);
+}
+
+// Lay out a frame in 'frame'; returns its total length
+int build_frame(unsigned char *frame, int type, const unsigned char *payload, int len) {
+	frame[0] = (len >> 8) & 0xff;
+	frame[1] = len & 0xff;
+	frame[2] = type;
+	if (len > 0) {
+		memcpy(frame + FRAME_HDR, payload, len);
+	}
+	return FRAME_HDR + len;
+}
+
+// Send one frame
+void send_frame(client_t *c, int type, const unsigned char *payload, int len) {
+	unsigned char frame[FRAME_HDR + FRAME_MAX];
+
+	client_write(c, frame, build_frame(frame, type, payload, len));
+}
+
+void crypto_send(client_t *c, const char *message, int len);
+
+// Encrypt a message and send it as a chat frame (TLS connections are
+// already encrypted and get it as text; session keys go through the pool)
+void send_encrypted(client_t *c, const char *message, int len) {
+	unsigned char ciphertext[16 + MAXDATASIZE + 16];
+
+	if (c->tls) {
+		send_frame(c, FRAME_TEXT, (const unsigned char *)message, len);
+		return;
+	}
+	if (c->sess) {
+		crypto_send(c, message, len);
+		return;
+	}
+	int ciphertext_len = aes_encrypt((unsigned char*)message, len, ciphertext);
+	if (ciphertext_len < 0) {
+		fprintf(stderr, "Encryption failed\n");
+		return;
+	}
+	send_frame(c, FRAME_CHAT, ciphertext, ciphertext_len);
+}
+
+// Store n bytes of v big-endian
+void put_be(unsigned char *p, uint64_t v, int n) {
+	while (n-- > 0) {
+		p[n] = v & 0xff;
+		v >>= 8;
+	}
+}
+
+int mcast_header(unsigned char *d, int kind, uint64_t seq, const char *room) {
+	int rl = room ? strlen(room) : 0;
+	put_be(d, MCAST_MAGIC, 4);
+	put_be(d + 4, node_epoch, 4);
+	put_be(d + 8, seq, 8);
+	d[16] = kind;
+	d[17] = rl;
+	memcpy(d + MCAST_HDR, room, rl);
+	return MCAST_HDR + rl;
+}
+
+// Publish one encrypted chat frame to the group, keeping a copy for repair
+void mcast_publish(const char *room, const unsigned char *frame, int len) {
+	if (MCAST_HDR + (int)strlen(room) + len > MCAST_DGRAM_MAX) {
+		return;   // more than a slot holds (a relayed room or frame out of bounds)
+	}
+	uint64_t seq = mcast_seq++;
+	mcast_slot_t *slot = &mcast_ring[seq & (MCAST_HISTORY - 1)];
+
+	int n = mcast_header(slot->data, MCAST_DATA, seq, room);
+	memcpy(slot->data + n, frame, len);
+	slot->seq = seq;
+	slot->len = n + len;
+	sendto(mcast_fd, slot->data, slot->len, 0, (struct sockaddr *)&mcast_group, sizeof mcast_group);
+}
+
+// Announce the last sequence number so a receiver that lost the tail of a
+// burst finds out without waiting for the next message
+void on_mcast_heartbeat(timer_node_t *t) {
+	unsigned char d[MCAST_HDR];
+
+	if (mcast_subs == 0) return;
+	if (mcast_seq > 0) {
+		mcast_header(d, MCAST_HEARTBEAT, mcast_seq - 1, NULL);
+		sendto(mcast_fd, d, sizeof d, 0, (struct sockaddr *)&mcast_group, sizeof mcast_group);
+	}
+	timer_arm(t, MCAST_HEARTBEAT_MS);
+}
+
+void mcast_subscribe(client_t *c) {
+	c->mcast = 1;
+	if (mcast_subs++ == 0) {
+		timer_arm(&mcast_heartbeat, MCAST_HEARTBEAT_MS);
+	}
+}
+
+// Resend what we still have of [first, first + count) over the client's TCP connection
+void mcast_repair(client_t *c, const unsigned char *payload, int len) {
+	if (len < 10) return;
+
+	uint64_t first = 0;
+	for (int k = 0; k < 8; k++) first = (first << 8) | payload[k];
+	int count = (payload[8] << 8) | payload[9], lost = 0;
+	if (count > NAK_MAX) count = NAK_MAX;
+
+	out_tag_t tag = out_tag;
+	out_tag = room_tag(c->room);
+	for (uint64_t seq = first; seq < first + count; seq++) {
+		mcast_slot_t *slot = &mcast_ring[seq & (MCAST_HISTORY - 1)];
+		if (seq < mcast_seq && slot->len > 0 && slot->seq == seq) {
+			send_frame(c, FRAME_REPAIR, slot->data, slot->len);
+		} else {
+			lost++;
+		}
+	}
+	out_tag = tag;
+	if (lost > 0) {
+		char msg[80];
+		int n = snprintf(msg, sizeof msg, "%d message(s) are too old to repair.\n", lost);
+		send_frame(c, FRAME_NOTICE, (const unsigned char *)msg, n);
+	}
+}
+
+// Content filter. Terms match case-insensitively anywhere in a message; a
+// term ending in '*' (http://*, www.*) masks on to the end of the word, for
+// links. Bytes map to input classes first, and every byte no term uses
+// shares class 0, so the table is states x classes rather than states x 256.
+// Failure links are folded into the table: one lookup per byte, no backing up.
+typedef struct {
+	uint8_t cls[256];        // byte -> input class, letters folded
+	int nclass;
+	int nstates;
+	int terms;
+	uint32_t *next;          // nstates x nclass: next state x nclass, | FILTER_HIT if a term ends there
+	uint16_t *out;           // longest term ending in each state: length | FILTER_WORD
+	uint8_t lead[32];        // bitmap of the bytes that leave the root state
+	int sparse;              // few enough of them that skipping to the next pays
+	uint8_t lead_low[16];    // the same set by low nibble, bytes 0x00-0x7f ...
+	uint8_t lead_high[16];   // ... and 0x80-0xff, for the SSSE3 skip
+} filter_t;
+
+#define FILTER_WORD 0x100         // out[]: mask to the end of the word
+#define FILTER_HIT  0x80000000u   // next[]: the state entered has a term in out[]
+
+filter_t *filter = NULL;
+int filter_ssse3 = 0;
+
+void filter_free(filter_t *f) {
+	if (f == NULL) return;
+	free(f->next);
+	free(f->out);
+	free(f);
+}
+
+// Compile a term list. NULL (and a message) if it cannot be read or is too big.
+filter_t *filter_load(const char *path) {
+	FILE *fp = fopen(path, "r");
+	if (fp == NULL) {
+		perror(path);
+		return NULL;
+	}
+	
+	// Terms, folded to lower case, one per line; '#' starts a comment line
+	char **terms = NULL, *line = NULL;
+	size_t cap = 0, bytes = 0;
+	int n = 0, max = 0;
+	ssize_t len;
+	filter_t *f = NULL;
+	uint32_t *fail = NULL, *queue = NULL;
+	while ((len = getline(&line, &cap, fp)) != -1) {
+		len = strcspn(line, "\r\n");
+		if (len == 0 || line[0] == '#') continue;
+		if (len - (len > 1 && line[len - 1] == '*') > FILTER_TERM_MAX) {
+			fprintf(stderr, "%s: term over %d bytes skipped: %.32s...\n", path, FILTER_TERM_MAX, line);
+			continue;
+		}
+		if (n == max) {
+			char **grown = realloc(terms, (max ? max * 2 : 256) * sizeof *terms);
+			if (grown == NULL) break;
+			terms = grown;
+			max = max ? max * 2 : 256;
+		}
+		for (ssize_t k = 0; k < len; k++) {
+			if (line[k] >= 'A' && line[k] <= 'Z') line[k] += 'a' - 'A';
+		}
+		if ((terms[n] = strndup(line, len)) == NULL) break;
+		n++;
+		bytes += len;
+	}
+	int short_read = len != -1;   // stopped early: out of memory
+	free(line);
+	fclose(fp);
+	if (short_read || (f = calloc(1, sizeof *f)) == NULL) {
+		fprintf(stderr, "%s: out of memory\n", path);
+		goto fail;
+	}
+	f->terms = n;
+	f->nclass = 1;
+	for (int t = 0; t < n; t++) {
+		for (unsigned char *p = (unsigned char *)terms[t]; *p != '\0'; p++) {
+			if (f->cls[*p] == 0) f->cls[*p] = f->nclass++;
+		}
+	}
+	for (int c = 'A'; c <= 'Z'; c++) f->cls[c] = f->cls[c + 'a' - 'A'];
+	
+	size_t states = bytes + 1;
+	if (states * f->nclass > FILTER_DFA_MAX) {
+		fprintf(stderr, "%s: %d terms need %zu x %d transitions, over %d\n", path, n, states, f->nclass, FILTER_DFA_MAX);
+		goto fail;
+	}
+	f->next = calloc(states * f->nclass, sizeof *f->next);
+	f->out = calloc(states, sizeof *f->out);
+	fail = calloc(states, sizeof *fail);
+	queue = calloc(states, sizeof *queue);
+	if (f->next == NULL || f->out == NULL || fail == NULL || queue == NULL) {
+		fprintf(stderr, "%s: out of memory for %zu states\n", path, states);
+		goto fail;
+	}
+	
+	// The trie; 0 is the root, and no edge leads back to it yet
+	f->nstates = 1;
+	for (int t = 0; t < n; t++) {
+		int tlen = strlen(terms[t]), word = 0;
+		if (tlen > 1 && terms[t][tlen - 1] == '*') {
+			tlen--;
+			word = FILTER_WORD;
+		}
+		uint32_t s = 0;
+		for (int k = 0; k < tlen; k++) {
+			uint32_t *e = &f->next[s * f->nclass + f->cls[(unsigned char)terms[t][k]]];
+			if (*e == 0) *e = f->nstates++;
+			s = *e;
+		}
+		f->out[s] = tlen | word;
+	}
+	
+	// Breadth first: a missing edge becomes the edge of the state's failure
+	// link, which is shallower and so already complete
+	int head = 0, tail = 0;
+	for (int c = 0; c < f->nclass; c++) {
+		if (f->next[c] != 0) queue[tail++] = f->next[c];
+	}
+	while (head < tail) {
+		uint32_t s = queue[head++];
+		if (f->out[s] == 0) {
+			f->out[s] = f->out[fail[s]];
+		} else {
+			f->out[s] |= f->out[fail[s]] & FILTER_WORD;   // a link term ending here still masks the word
+		}
+		for (int c = 0; c < f->nclass; c++) {
+			uint32_t *e = &f->next[s * f->nclass + c];
+			if (*e != 0) {
+				fail[*e] = f->next[fail[s] * f->nclass + c];
+				queue[tail++] = *e;
+			} else {
+				*e = f->next[fail[s] * f->nclass + c];
+			}
+		}
+	}
+	free(fail);
+	free(queue);
+	
+	// Row offsets instead of state numbers spare the scan a multiply per byte
+	for (size_t e = 0; e < (size_t)f->nstates * f->nclass; e++) {
+		uint32_t t = f->next[e];
+		f->next[e] = t * f->nclass | (f->out[t] != 0 ? FILTER_HIT : 0);
+	}
+	for (int b = 0; b < 256; b++) {
+		if (f->next[f->cls[b]] == 0) continue;
+		f->lead[b >> 3] |= 1 << (b & 7);
+		f->sparse++;
+		if (b < 0x80) f->lead_low[b & 15] |= 1 << (b >> 4);
+		else f->lead_high[b & 15] |= 1 << ((b >> 4) - 8);
+	}
+	f->sparse = f->sparse <= FILTER_SPARSE;
+#if defined(__x86_64__)
+	filter_ssse3 = __builtin_cpu_supports("ssse3");
+#endif
+	
+	for (int t = 0; t < n; t++) free(terms[t]);
+	free(terms);
+	return f;
+	
+fail:
+	for (int t = 0; t < n; t++) free(terms[t]);
+	free(terms);
+	free(fail);
+	free(queue);
+	filter_free(f);
+	return NULL;
+}
+
+#if defined(__x86_64__)
+// filter_skip, 16 bytes at a time: a byte's low nibble picks its row of the
+// set, its high nibble the bit in that row
+__attribute__((target("ssse3")))
+int filter_skip_ssse3(const filter_t *f, const unsigned char *p, int i, int len) {
+	const __m128i low = _mm_loadu_si128((const __m128i *)f->lead_low);
+	const __m128i high = _mm_loadu_si128((const __m128i *)f->lead_high);
+	const __m128i bit = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+	const __m128i nibble = _mm_set1_epi8(0x0f), seven = _mm_set1_epi8(7);
+	
+	for (; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+		__m128i lo = _mm_and_si128(v, nibble);
+		__m128i hi = _mm_and_si128(_mm_srli_epi16(v, 4), nibble);
+		__m128i top = _mm_cmpgt_epi8(hi, seven);
+		__m128i row = _mm_or_si128(_mm_andnot_si128(top, _mm_shuffle_epi8(low, lo)),
+			_mm_and_si128(top, _mm_shuffle_epi8(high, lo)));
+		__m128i hit = _mm_and_si128(row, _mm_shuffle_epi8(bit, hi));
+		int miss = _mm_movemask_epi8(_mm_cmpeq_epi8(hit, _mm_setzero_si128()));
+		if (miss != 0xffff) return i + __builtin_ctz(~miss);
+	}
+	while (i < len && !(f->lead[p[i] >> 3] & (1 << (p[i] & 7)))) i++;
+	return i;
+}
+#endif
+
+// First byte at or after i that can start a term, len if none
+int filter_skip(const filter_t *f, const unsigned char *p, int i, int len) {
+#if defined(__x86_64__)
+	if (filter_ssse3) return filter_skip_ssse3(f, p, i, len);
+#endif
+	while (i < len && !(f->lead[p[i] >> 3] & (1 << (p[i] & 7)))) i++;
+	return i;
+}
+
+// Mask every term in text[0..len) in place. Returns the number found.
+int filter_apply(const filter_t *f, char *text, int len) {
+	const unsigned char *p = (const unsigned char *)text;
+	const uint32_t *next = f->next;
+	const uint8_t *cls = f->cls;
+	const uint32_t skip_from = f->sparse ? 0 : FILTER_HIT;   // a row the scan never enters: no skipping
+	uint32_t s = 0;
+	int hits = 0;
+	
+	for (int i = 0; i < len; i++) {
+		if (s == skip_from && !(f->lead[p[i] >> 3] & (1 << (p[i] & 7)))) {
+			// Nothing partly matched and no term starts here: jump to where one
+			// could. With a long list most letters start a term and it is
+			// cheaper to step the table through every byte.
+			i = filter_skip(f, p, i + 1, len);
+			if (i == len) break;
+		}
+		uint32_t e = next[s + cls[p[i]]];
+		s = e & ~FILTER_HIT;
+		if (!(e & FILTER_HIT)) continue;
+		int out = f->out[s / f->nclass];
+		int tlen = out & 0xff;
+		memset(text + i + 1 - tlen, FILTER_MASK, tlen);
+		hits++;
+		if (out & FILTER_WORD) {
+			while (i + 1 < len && text[i + 1] != ' ' && text[i + 1] != '\t' && text[i + 1] != '\n') {
+				text[++i] = FILTER_MASK;
+			}
+			s = 0;
+		}
+	}
+	return hits;
+}
+
+int mux_deliver(client_t *g, const char *room, int sender_fd, const unsigned char *frame, int flen);
+
+// Deliver a message to the members of a room on this node, except the sender
+void deliver_local(const char *room, const char *message, int sender_fd, const char *sender_name) {
+    char plaintext[MAXDATASIZE];
+    unsigned char frame[FRAME_HDR + MAXDATASIZE + 16]; // Extra space for padding
+    char timestamp[64];
+    get_timestamp(timestamp, sizeof(timestamp));
+    
+    if (hist_on && strcmp(sender_name, "Server") != 0) {
+        hist_message(room, sender_name, message);
+    }
+    
+    // Format: [timestamp] Username: message
+    int plaintext_len = snprintf(plaintext, sizeof(plaintext), "%s %s: %s", 
+                                  timestamp, sender_name, message);
+    if (plaintext_len >= (int)sizeof(plaintext)) {
+        plaintext_len = sizeof(plaintext) - 1;
+    }
+    
+    // Encrypt the message straight into the frame body
+    int ciphertext_len = aes_encrypt((unsigned char*)plaintext, plaintext_len, frame + FRAME_HDR);
+    if (ciphertext_len < 0) {
+        fprintf(stderr, "Encryption failed\n");
+        return;
+    }
+    frame[0] = (ciphertext_len >> 8) & 0xff;
+    frame[1] = ciphertext_len & 0xff;
+    frame[2] = FRAME_CHAT;
+    
+    // Chat goes in the room's lane; the server's own joins and leaves are control
+    out_tag_t tag = out_tag;
+    if (strcmp(sender_name, "Server") != 0) out_tag = room_tag(room);
+    
+    // One datagram covers every multicast subscriber, whatever the room size
+    if (mcast_subs > 0) {
+        mcast_publish(room, frame, FRAME_HDR + ciphertext_len);
+    }
+    
+    // Broadcast to everyone else in the room; TLS clients share one text frame,
+    // clients with their own session keys get their own ciphertext from the pool
+    unsigned char text[FRAME_HDR + MAXDATASIZE];
+    int text_len = 0, sent = 0, pooled = 0;
+    int64_t start = tap_on ? now_ns() : 0;
+    for (int i = 0; i < client_hwm; i++) {
+        client_t *c = &clients[i];
+        if (c->kind == CONN_GATEWAY && c->fd != -1 && c->mux_count > 0) {
+            if (!c->tls) {
+                sent += mux_deliver(c, room, sender_fd, frame, FRAME_HDR + ciphertext_len);
+                continue;
+            }
+            if (text_len == 0) {
+                text_len = build_frame(text, FRAME_TEXT, (unsigned char *)plaintext, plaintext_len);
+            }
+            sent += mux_deliver(c, room, sender_fd, text, text_len);
+            continue;
+        }
+        if (c->fd != sender_fd && c->fd != -1 && c->kind == CONN_USER && !c->mcast &&
+                !(roster_quiet && c->roster) && strcmp(c->room, room) == 0) {
+            sent++;
+            if (c->sess) {
+                send_encrypted(c, plaintext, plaintext_len);
+                pooled++;
+                continue;
+            }
+            if (!c->tls) {
+                client_write(c, frame, FRAME_HDR + ciphertext_len);
+                continue;
+            }
+            if (text_len == 0) {
+                text_len = build_frame(text, FRAME_TEXT, (unsigned char *)plaintext, plaintext_len);
+            }
+            client_write(c, text, text_len);
+        }
+    }
+    out_tag = tag;
+    if (tap_on) {
+        tap_stage("broadcast in %s from %s: %d recipient(s), %d through the crypto pool, %.1f us",
+            room, sender_name, sent, pooled, (now_ns() - start) / 1e3);
+    }
+}
+
+void relay_publish(const char *room, const char *sender_name, const char *message);
+
+// Broadcast message to a room, here and on every peer node
+void broadcast_message(const char *room, const char *message, int sender_fd, const char *sender_name) {
+    char clean[MAXDATASIZE];
+    
+    // Filtered once here, so peers get the masked text too
+    if (filter != NULL) {
+        int len = snprintf(clean, sizeof(clean), "%s", message);
+        if (len >= (int)sizeof(clean)) len = sizeof(clean) - 1;
+        if (filter_apply(filter, clean, len) > 0) message = clean;
+    }
+    deliver_local(room, message, sender_fd, sender_name);
+    relay_publish(room, sender_name, message);
+}
+
+// Users online across the federation
+int total_users(void) {
+	int total = local_users;
+	for (int n = 1; n < MAX_NODES; n++) {
+		if (n != node_id) total += nodes[n].users;
+	}
+	return total;
+}
+
+void listener_update(int64_t now);
+void on_deadline(timer_node_t *t);
+void on_keepalive(timer_node_t *t);
+void on_wake(timer_node_t *t);
+
+// Pick a slot for a connection: the most recently freed one, so the set of
+// slots in use (and the pages they live on) stays as small as it can
+int client_slot(void) {
+	if (client_nfree > 0) return client_free[--client_nfree];
+	return client_hwm++;
+}
+
+// Take a free slot for a new connection and register it for reading
+int init_client(int fd, const struct sockaddr_storage *addr, int kind, int ip_slot, int64_t now) {
+	int idx = client_slot();
+	client_t *c = &clients[idx];
+	c->fd = fd;
+	c->kind = kind;
+	c->peer = -1;
+	c->connecting = 0;
+	c->mcast = 0;
+	c->local = addr->ss_family == AF_UNIX;
+	c->ring = NULL;
+	c->ring_name = NULL;
+	c->ssl = NULL;
+	c->tls = c->handshaking = 0;
+	c->ktls_tx = c->ktls_rx = 0;
+	c->sess = 0;
+	c->keys = NULL;
+	c->gen++;
+	c->sig_key = NULL;
+	c->sig_seq = 0;
+	c->in_seq = c->in_done = c->out_seq = c->out_done = 0;
+	c->in_held = c->out_held = NULL;
+	c->stalled = 0;
+	c->tap_open = 0;
+	c->roster = ROSTER_OFF;
+	c->mux_head = -1;
+	c->mux_count = 0;
+	memcpy(&c->addr, addr, sizeof c->addr);
+	c->username[0] = '\0';
+	strcpy(c->room, DEFAULT_ROOM);
+	c->ip_slot = ip_slot;
+	c->throttled = 0;
+	c->last_rx = c->last_chat = now;
+	c->ping_out = 0;
+	c->dead = 0;
+	c->obuf = NULL;
+	c->ooff = c->olen = c->ocap = 0;
+	c->q = NULL;
+	c->rlen = 0;
+	c->rbuf = NULL;
+	bucket_init(&c->msgs, CONN_MSG_BURST, now);
+	bucket_init(&c->bytes, CONN_BYTE_BURST, now);
+	timer_init(&c->deadline, on_deadline);
+	timer_init(&c->keepalive, on_keepalive);
+	timer_init(&c->wake, on_wake);
+	fd_client[fd] = idx;
+	ev_read(fd, 1);
+	client_count++;
+	return idx;
+}
+
+// Add client to list
+int add_client(int fd, struct sockaddr_storage *addr) {
+	if (client_count >= MAX_CLIENTS) {
+		return -1;
+	}
+	
+	int64_t now = now_ms();
+	int slot = -1;
+	if (addr->ss_family != AF_UNIX) {   // local clients have no address to account
+		slot = ip_acquire(addr, now);
+		if (slot == -1) {
+			return -1;
+		}
+		if (!ip_admit(slot, now)) {
+			ip_release(slot);
+			return -1;
+		}
+	}
+	
+	int idx = init_client(fd, addr, CONN_USER, slot, now);
+	timer_arm(&clients[idx].deadline, HANDSHAKE_TIMEOUT_MS);
+	return idx;
+}
+
+// Map a local producer's ring. The shm object must belong to the uid at the
+// other end of the socket, so one local user cannot feed us another's ring.
+int ring_attach(client_t *c, const char *name) {
+	struct ucred cred;
+	socklen_t credlen = sizeof cred;
+	struct stat st;
+
+	if (!c->local || name[0] != '/' || strchr(name + 1, '/') != NULL || strlen(name) >= RING_NAME) {
+		return -1;
+	}
+	int fd = shm_open(name, O_RDWR | O_CLOEXEC, 0);
+	if (fd == -1) {
+		perror("ring: shm_open");
+		return -1;
+	}
+	if (getsockopt(c->fd, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) == -1 ||
+			fstat(fd, &st) == -1 || st.st_uid != cred.uid || st.st_size < (off_t)sizeof(ring_t)) {
+		fprintf(stderr, "ring: %s is not %s's or is too small\n", name, c->username);
+		close(fd);
+		return -1;
+	}
+	ring_t *r = mmap(NULL, sizeof(ring_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (r == MAP_FAILED) {
+		perror("ring: mmap");
+		return -1;
+	}
+	if (r->magic != RING_MAGIC || r->slots != RING_SLOTS) {
+		fprintf(stderr, "ring: %s has the wrong layout\n", name);
+		munmap(r, sizeof(ring_t));
+		return -1;
+	}
+	c->ring = r;
+	c->ring_name = strdup(name);
+	ring_count++;
+	return 0;
+}
+
+void ring_detach(client_t *c) {
+	if (c->ring != NULL) {
+		munmap(c->ring, sizeof(ring_t));
+		c->ring = NULL;
+		free(c->ring_name);
+		c->ring_name = NULL;
+		ring_count--;
+	}
+}
+
+// Broadcast up to RING_BUDGET messages from a producer's ring; returns 1 if
+// more are waiting. Ring traffic is not rate limited: only a local user who
+// created the shm object can write to it.
+int ring_drain(client_t *c) {
+	ring_t *r = c->ring;
+	uint32_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	uint32_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+	char text[MAXDATASIZE + 1];
+	int n;
+
+	for (n = 0; tail != head && n < RING_BUDGET; n++) {
+		int len = r->slot[tail & (RING_SLOTS - 1)].len;
+		if (len > MAXDATASIZE) len = MAXDATASIZE;
+		memcpy(text, r->slot[tail & (RING_SLOTS - 1)].text, len);
+		text[len] = '\0';
+		atomic_store_explicit(&r->tail, ++tail, memory_order_release);   // slot is free again
+		broadcast_message(c->room, text, c->fd, c->username);
+	}
+	if (n > 0) {
+		c->last_chat = now_ms();
+	}
+	return tail != atomic_load_explicit(&r->head, memory_order_acquire);
+}
+
+// Drain every attached ring once; returns 1 if any still has messages queued
+int ring_poll(void) {
+	int more = 0;
+	if (ring_count == 0) return 0;
+	for (int i = 0; i < client_hwm; i++) {
+		if (clients[i].fd != -1 && clients[i].ring != NULL && !clients[i].dead) {
+			more |= ring_drain(&clients[i]);
+		}
+	}
+	return more;
+}
+
+// About to block in epoll_wait(): ask every producer for a doorbell, then look
+// once more so a message published in between is not slept through.
+// Returns 1 (and cancels the request) if a ring is already non-empty.
+int ring_sleep(int on) {
+	int pending = 0;
+	if (ring_count == 0) return 0;
+	for (int i = 0; i < client_hwm; i++) {
+		ring_t *r = clients[i].fd != -1 ? clients[i].ring : NULL;
+		if (r == NULL) continue;
+		atomic_store(&r->sleeping, on);
+		if (on && atomic_load(&r->head) != atomic_load_explicit(&r->tail, memory_order_relaxed)) {
+			pending = 1;
+		}
+	}
+	if (pending) ring_sleep(0);
+	return pending;
+}
+
+// Remove client from list
+void crypto_free_list(crypto_job_t *j);
+void session_close(session_t *s, int tell);
+void roster_note(const char *room, const char *name, int op);
+void roster_leave(const char *room, uint8_t *state);
+
+void remove_client(int index) {
+	if (index < 0 || index >= client_hwm || clients[index].fd == -1) return;
+	
+	client_t *c = &clients[index];
+	printf("%s disconnected\n", c->username[0] ? c->username : "Unknown");
+	if (c->kind == CONN_USER && c->username[0] != '\0') {
+		local_users--;
+		roster_note(c->room, c->username, ROSTER_DEL);
+	}
+	roster_leave(c->room, &c->roster);
+	if (c->mcast) {
+		c->mcast = 0;
+		mcast_subs--;
+	}
+	ring_detach(c);
+	while (c->kind == CONN_GATEWAY && c->mux_head != -1) {
+		session_close(&sessions[c->mux_head], 0);
+	}
+	if (tap_on && c->tap_open) tap_close(c);
+	EVP_PKEY_free(c->sig_key);   // jobs in flight hold their own references
+	c->sig_key = NULL;
+	crypto_free_list(c->in_held);   // jobs still in flight are dropped when they finish
+	crypto_free_list(c->out_held);
+	c->in_held = c->out_held = NULL;
+	if (c->ssl != NULL) {
+		if (!c->handshaking && !c->dead) SSL_shutdown(c->ssl);   // best-effort close_notify
+		SSL_free(c->ssl);
+		c->ssl = NULL;
+	}
+	if (c->kind == CONN_PEER_OUT) {
+		peer_t *pr = &peers[c->peer];
+		pr->conn = -1;
+		timer_arm(&pr->retry, pr->backoff);
+		pr->backoff = pr->backoff * 2 > PEER_RETRY_MAX_MS ? PEER_RETRY_MAX_MS : pr->backoff * 2;
+	}
+	ev_read(c->fd, 0);
+	ev_write(c->fd, 0);
+	close(c->fd);
+	fd_client[c->fd] = -1;
+	ip_release(c->ip_slot);
+	timer_cancel(&c->deadline);
+	timer_cancel(&c->keepalive);
+	timer_cancel(&c->wake);
+	obuf_release(c);
+	outq_free(c);
+	c->rlen = 0;
+	rbuf_release(c);
+	free(c->keys);
+	c->keys = NULL;
+	
+	c->fd = -1;
+	client_free[client_nfree++] = index;
+	client_count--;
+	if (client_count == MAX_CLIENTS - 1) {
+		listener_update(now_ms());   // a slot opened up
+	}
+}
+
+// Close everything mark_dead() collected during this loop pass
+void reap_clients(void) {
+	for (int i = 0; i < reap_count; i++) {
+		if (clients[reap_list[i]].fd != -1) {
+			remove_client(reap_list[i]);
+		}
+	}
+	reap_count = 0;
+}
+
+// Stop reading a client until its buckets have refilled
+void throttle_client(client_t *c, int64_t wait) {
+	if (!c->throttled) {
+		c->throttled = 1;
+		ev_read(c->fd, 0);
+		printf("Throttling %s (socket %d)\n", c->username[0] ? c->username : "Unknown", c->fd);
+	}
+	timer_arm(&c->wake, wait);
+}
+
+void handle_client_data(int client_idx);
+
+// Reading waits while the client has too much chat in the crypto pool
+int crypto_blocked(client_t *c) {
+	return c->stalled || c->in_seq - c->in_done >= CRYPTO_INFLIGHT_MAX;
+}
+
+void on_wake(timer_node_t *t) {
+	client_t *c = client_of(t, wake);
+	int64_t wait = rate_wait(c, now_ms());
+
+	if (wait > 0) {
+		timer_arm(&c->wake, wait);
+	} else {
+		c->throttled = 0;
+		if (!c->dead && !crypto_blocked(c)) ev_read(c->fd, 1);
+		if (!c->stalled && tls_buffered(c)) handle_client_data(c - clients);
+	}
+}
+
+// Handshake deadline, then idle eviction. The idle timer is not re-armed on
+// every message; it fires once per period and re-arms for the remainder.
+void on_deadline(timer_node_t *t) {
+	client_t *c = client_of(t, deadline);
+	int64_t idle = now_ms() - c->last_chat;
+
+	if (c->username[0] == '\0') {
+		printf("Handshake timeout on socket %d\n", c->fd);
+		remove_client(c - clients);
+	} else if (idle >= IDLE_TIMEOUT_MS) {
+		const char *msg = "Disconnected after being idle too long.\n";
+		send_frame(c, FRAME_NOTICE, (const unsigned char *)msg, strlen(msg));
+		flush_client(c);
+		printf("Evicting idle user '%s'\n", c->username);
+		remove_client(c - clients);
+	} else {
+		timer_arm(&c->deadline, IDLE_TIMEOUT_MS - idle);
+	}
+}
+
+// Probe peers that have gone quiet; drop them if the probe goes unanswered.
+// Any received byte clears ping_out, so a live peer never needs a re-arm.
+void on_keepalive(timer_node_t *t) {
+	client_t *c = client_of(t, keepalive);
+	int64_t quiet = now_ms() - c->last_rx;
+
+	if (c->ping_out) {
+		printf("%s timed out\n", c->username[0] ? c->username : "Unknown");
+		remove_client(c - clients);
+	} else if (quiet >= KEEPALIVE_MS) {
+		send_frame(c, FRAME_PING, NULL, 0);
+		c->ping_out = 1;
+		timer_arm(&c->keepalive, PONG_TIMEOUT_MS);
+	} else {
+		timer_arm(&c->keepalive, KEEPALIVE_MS - quiet);
+	}
+}
+
+// Find client index by fd
+int find_client(int fd) {
+	if (fd < 0 || fd >= fd_limit) return -1;
+	return fd_client[fd];
+}
+
+// Poll the listener only while we can admit someone: below MAX_CLIENTS and
+// with an accept token in hand. Otherwise new connections wait in the backlog.
+void accept_refill(int64_t now) {
+	if (accept_rate == 0) {
+		accept_bucket.level = 1000;   // -A 0: never runs dry
+	} else {
+		bucket_refill(&accept_bucket, accept_rate, accept_burst, now);
+	}
+}
+
+void listener_update(int64_t now) {
+	accept_refill(now);
+	int on = accept_bucket.level >= 1000 && client_count < MAX_CLIENTS;
+	if (accept_bucket.level < 1000) {
+		timer_arm(&accept_wake, (1000 - accept_bucket.level) / accept_rate + 1);
+	}
+	ev_read(listener, on);
+	if (local_listener != -1) {
+		ev_read(local_listener, on);
+	}
+	if (tls_listener != -1) {
+		ev_read(tls_listener, on);
+	}
+}
+
+void on_accept_wake(timer_node_t *t) {
+	(void)t;
+	listener_update(now_ms());
+}
+
+void send_welcome(client_t *c) {
+	char welcome[] = "=== Connected to Chat Server ===\nType your messages and press Enter. Type 'quit' to exit.\n";
+	send_frame(c, FRAME_NOTICE, (unsigned char *)welcome, strlen(welcome));
+}
+
+// Drive a nonblocking TLS handshake on whatever readiness it last asked for.
+// When it completes, OpenSSL has already tried to move the record keys into
+// the kernel (SSL_OP_ENABLE_KTLS); we only note which directions took.
+void tls_handshake(client_t *c) {
+	ERR_clear_error();
+	int r = SSL_accept(c->ssl);
+	if (r == 1) {
+		c->handshaking = 0;
+		c->ktls_tx = BIO_get_ktls_send(SSL_get_wbio(c->ssl));
+		c->ktls_rx = BIO_get_ktls_recv(SSL_get_rbio(c->ssl));
+		ev_write(c->fd, 0);
+		ev_read(c->fd, 1);
+		printf("TLS on socket %d: %s, kernel TLS %s\n", c->fd, SSL_get_cipher(c->ssl),
+			c->ktls_tx && c->ktls_rx ? "tx+rx" : c->ktls_tx ? "tx only" : "off (userspace records)");
+		send_welcome(c);
+		return;
+	}
+	switch (SSL_get_error(c->ssl, r)) {
+	case SSL_ERROR_WANT_READ:
+		ev_write(c->fd, 0);
+		break;
+	case SSL_ERROR_WANT_WRITE:
+		ev_write(c->fd, 1);
+		break;
+	default:
+		fprintf(stderr, "TLS handshake failed on socket %d\n", c->fd);
+		ERR_print_errors_fp(stderr);
+		remove_client(c - clients);
+	}
+}
+
+void tls_start(client_t *c) {
+	c->ssl = SSL_new(tls_ctx);
+	if (c->ssl == NULL || SSL_set_fd(c->ssl, c->fd) != 1) {
+		ERR_print_errors_fp(stderr);
+		remove_client(c - clients);
+		return;
+	}
+	c->tls = 1;
+	c->handshaking = 1;
+	tls_handshake(c);
+}
+
+// Drain the accept queue, up to ACCEPT_BATCH connections per wakeup.
+// Every connection costs an accept token; addresses over their connect rate
+// are reset before any client state is set up.
+void accept_connections(int lfd) {
+	struct sockaddr_storage remoteaddr; // client address
+	socklen_t addrlen;
+	char remoteIP[INET6_ADDRSTRLEN];
+	int64_t now = now_ms();
+	
+	for (int n = 0; n < ACCEPT_BATCH; n++) {
+		accept_refill(now);
+		if (accept_bucket.level < 1000) {
+			break;
+		}
+		
+		addrlen = sizeof remoteaddr;
+		int newfd = accept4(lfd, (struct sockaddr *)&remoteaddr, &addrlen,
+			SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (newfd == -1) {
+			if (errno == ECONNABORTED || errno == EINTR) continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				perror("accept");
+			}
+			break;
+		}
+		accept_bucket.level -= 1000;
+		
+		if (client_count >= MAX_CLIENTS) {
+			// Best effort, never blocks and allocates nothing
+			unsigned char full[FRAME_HDR + 64];
+			char *msg = "Server is full. Please try again later.\n";
+			int len = build_frame(full, FRAME_NOTICE, (unsigned char *)msg, strlen(msg));
+			send(newfd, full, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+			close(newfd);
+			continue;
+		}
+		if (newfd >= fd_limit || add_client(newfd, &remoteaddr) == -1) {
+			reset_close(newfd);
+			continue;
+		}
+		if (busy_poll || lat_on) {
+			busy_socket(newfd);
+		}
+		
+		if (remoteaddr.ss_family == AF_UNIX) {
+			strcpy(remoteIP, "local socket");
+		} else {
+			inet_ntop(remoteaddr.ss_family,
+				get_in_addr((struct sockaddr*)&remoteaddr),
+				remoteIP, INET6_ADDRSTRLEN);
+		}
+		printf("New connection from %s on socket %d%s\n", remoteIP, newfd, lfd == tls_listener ? " (TLS)" : "");
+		
+		if (lfd == tls_listener) {
+			tls_start(&clients[fd_client[newfd]]);   // welcomed once the handshake is done
+		} else {
+			send_welcome(&clients[fd_client[newfd]]);
+		}
+	}
+	listener_update(now);
+}
+
+// void xor_encrypt_decrypt(char *data, int length, const char *key) { ... }
+
+// Add AES encryption function
+int aes_encrypt(unsigned char *plaintext, int plaintext_len,
+                unsigned char *ciphertext) {
+    EVP_CIPHER_CTX *ctx;
+    int len;
+    int ciphertext_len;
+
+    // Create and initialize the context
+    if (!(ctx = EVP_CIPHER_CTX_new()))
+        return -1;
+
+    // Initialize encryption operation with AES-256-CBC
+    if (1 != EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, AES_KEY, AES_IV))
+        return -1;
+
+    // Encrypt the plaintext
+    if (1 != EVP_EncryptUpdate(ctx, ciphertext, &len, plaintext, plaintext_len))
+        return -1;
+    ciphertext_len = len;
+
+    // Finalize encryption (handles padding)
+    if (1 != EVP_EncryptFinal_ex(ctx, ciphertext + len, &len))
+        return -1;
+    ciphertext_len += len;
+
+    // Clean up
+    EVP_CIPHER_CTX_free(ctx);
+
+    return ciphertext_len;
+}
+
+// Add AES decryption function
+int aes_decrypt(unsigned char *ciphertext, int ciphertext_len,
+                unsigned char *plaintext) {
+    EVP_CIPHER_CTX *ctx;
+    int len;
+    int plaintext_len;
+
+    // Create and initialize the context
+    if (!(ctx = EVP_CIPHER_CTX_new()))
+        return -1;
+
+    // Initialize decryption operation with AES-256-CBC
+    if (1 != EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, AES_KEY, AES_IV))
+        return -1;
+
+    // Decrypt the ciphertext
+    if (1 != EVP_DecryptUpdate(ctx, plaintext, &len, ciphertext, ciphertext_len))
+        return -1;
+    plaintext_len = len;
+
+    // Finalize decryption (removes padding)
+    if (1 != EVP_DecryptFinal_ex(ctx, plaintext + len, &len))
+        return -1;
+    plaintext_len += len;
+
+    // Clean up
+    EVP_CIPHER_CTX_free(ctx);
+
+    return plaintext_len;
+}
+
+// Encrypt with random IV and prepend IV to output
+int aes_encrypt_with_random_iv(const unsigned char *key, const unsigned char *plaintext, int plaintext_len,
+                               unsigned char *output) {
+    unsigned char iv[16];
+    int len, ciphertext_len = -1;
+    
+    // Generate random IV
+    if (RAND_bytes(iv, sizeof(iv)) != 1)
+        return -1;
+    
+    // Copy IV to output (first 16 bytes)
+    memcpy(output, iv, 16);
+    
+    // Encrypt with random IV
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL)
+        return -1;
+    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, iv) == 1 &&
+        EVP_EncryptUpdate(ctx, output + 16, &len, plaintext, plaintext_len) == 1) {
+        ciphertext_len = len;
+        if (EVP_EncryptFinal_ex(ctx, output + 16 + len, &len) == 1)
+            ciphertext_len += len;
+        else
+            ciphertext_len = -1;
+    }
+    
+    EVP_CIPHER_CTX_free(ctx);
+    
+    return ciphertext_len < 0 ? -1 : ciphertext_len + 16; // Total: IV + ciphertext
+}
+
+// Decrypt with IV extraction
+int aes_decrypt_with_iv(const unsigned char *key, const unsigned char *input, int input_len,
+                        unsigned char *plaintext) {
+    int len, plaintext_len = -1;
+    
+    if (input_len < 32)   // IV plus at least one block
+        return -1;
+    
+    // Decrypt (skip first 16 bytes, the IV)
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    if (ctx == NULL)
+        return -1;
+    if (EVP_DecryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, key, input) == 1 &&
+        EVP_DecryptUpdate(ctx, plaintext, &len, input + 16, input_len - 16) == 1) {
+        plaintext_len = len;
+        if (EVP_DecryptFinal_ex(ctx, plaintext + len, &len) == 1)
+            plaintext_len += len;
+        else
+            plaintext_len = -1;
+    }
+    
+    EVP_CIPHER_CTX_free(ctx);
+    
+    return plaintext_len;
+}
+
+// Multi-buffer AES-256-CBC. A broadcast to users with session keys encrypts
+// one plaintext under many keys. CBC is serial within a stream, but the
+// streams are independent, so we run them side by side and keep the AES
+// unit's pipeline full: AES-NI takes 8 streams, VAES (AVX-512) puts 4 in each
+// register and takes 16.
+enum { MB_NONE = 0, MB_AESNI, MB_VAES };
+int mb_impl = MB_NONE;   // set by mb_init()
+
+#if defined(__x86_64__)
+__attribute__((target("aes,sse2")))
+static inline __m128i ks_mix(__m128i k, __m128i t) {
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    k = _mm_xor_si128(k, _mm_slli_si128(k, 4));
+    return _mm_xor_si128(k, t);
+}
+
+// Expand a 32-byte key into ks[AES_SCHED]
+__attribute__((target("aes,sse2")))
+void aes256_schedule(const unsigned char *key, unsigned char *ks) {
+    __m128i k0 = _mm_loadu_si128((const __m128i *)key);
+    __m128i k1 = _mm_loadu_si128((const __m128i *)(key + 16));
+    __m128i *rk = (__m128i *)ks;
+
+    _mm_storeu_si128(rk, k0);
+    _mm_storeu_si128(rk + 1, k1);
+#define KS_ROUND(i, rcon) \
+    k0 = ks_mix(k0, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k1, rcon), 0xff)); \
+    _mm_storeu_si128(rk + i, k0); \
+    if (i < 14) { \
+        k1 = ks_mix(k1, _mm_shuffle_epi32(_mm_aeskeygenassist_si128(k0, 0), 0xaa)); \
+        _mm_storeu_si128(rk + i + 1, k1); \
+    }
+    KS_ROUND(2, 0x01) KS_ROUND(4, 0x02) KS_ROUND(6, 0x04) KS_ROUND(8, 0x08)
+    KS_ROUND(10, 0x10) KS_ROUND(12, 0x20) KS_ROUND(14, 0x40)
+#undef KS_ROUND
+}
+
+// 8 streams with AES-NI; out[l] holds stream l's IV, ciphertext goes after it
+__attribute__((target("aes,sse2")))
+void cbc_aesni_x8(const unsigned char *plain, int nblocks, unsigned char *const ks[8],
+                  unsigned char *const out[8]) {
+    __m128i x[8];
+
+#pragma GCC unroll 8
+    for (int l = 0; l < 8; l++)
+        x[l] = _mm_loadu_si128((const __m128i *)out[l]);
+    for (int b = 0; b < nblocks; b++) {
+        __m128i p = _mm_loadu_si128((const __m128i *)(plain + 16 * b));
+#pragma GCC unroll 8
+        for (int l = 0; l < 8; l++)
+            x[l] = _mm_xor_si128(_mm_xor_si128(x[l], p), _mm_loadu_si128((const __m128i *)ks[l]));
+        for (int r = 1; r < 14; r++) {
+#pragma GCC unroll 8
+            for (int l = 0; l < 8; l++)
+                x[l] = _mm_aesenc_si128(x[l], _mm_loadu_si128((const __m128i *)(ks[l] + 16 * r)));
+        }
+#pragma GCC unroll 8
+        for (int l = 0; l < 8; l++) {
+            x[l] = _mm_aesenclast_si128(x[l], _mm_loadu_si128((const __m128i *)(ks[l] + 224)));
+            _mm_storeu_si128((__m128i *)(out[l] + 16 + 16 * b), x[l]);
+        }
+    }
+}
+
+// Four 16-byte values, one per 128-bit lane
+__attribute__((target("avx512f")))
+static inline __m512i lanes4(const unsigned char *a, const unsigned char *b,
+                             const unsigned char *c, const unsigned char *d) {
+    __m512i v = _mm512_castsi128_si512(_mm_loadu_si128((const __m128i *)a));
+    v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *)b), 1);
+    v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *)c), 2);
+    return _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *)d), 3);
+}
+
+// 16 streams with VAES, four to a register; same layout as cbc_aesni_x8()
+__attribute__((target("vaes,avx512f")))
+void cbc_vaes_x16(const unsigned char *plain, int nblocks, unsigned char *const ks[16],
+                  unsigned char *const out[16]) {
+    __m512i rk[4][15], x[4];
+
+    for (int g = 0; g < 4; g++) {
+        unsigned char *const *k = ks + 4 * g, *const *o = out + 4 * g;
+        for (int r = 0; r < 15; r++)
+            rk[g][r] = lanes4(k[0] + 16 * r, k[1] + 16 * r, k[2] + 16 * r, k[3] + 16 * r);
+        x[g] = lanes4(o[0], o[1], o[2], o[3]);
+    }
+    for (int b = 0; b < nblocks; b++) {
+        __m512i p = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)(plain + 16 * b)));
+#pragma GCC unroll 4
+        for (int g = 0; g < 4; g++)
+            x[g] = _mm512_xor_si512(_mm512_xor_si512(x[g], p), rk[g][0]);
+        for (int r = 1; r < 14; r++) {
+#pragma GCC unroll 4
+            for (int g = 0; g < 4; g++)
+                x[g] = _mm512_aesenc_epi128(x[g], rk[g][r]);
+        }
+#pragma GCC unroll 4
+        for (int g = 0; g < 4; g++) {
+            unsigned char *const *o = out + 4 * g;
+            int off = 16 + 16 * b;
+            x[g] = _mm512_aesenclast_epi128(x[g], rk[g][14]);
+            _mm_storeu_si128((__m128i *)(o[0] + off), _mm512_extracti32x4_epi32(x[g], 0));
+            _mm_storeu_si128((__m128i *)(o[1] + off), _mm512_extracti32x4_epi32(x[g], 1));
+            _mm_storeu_si128((__m128i *)(o[2] + off), _mm512_extracti32x4_epi32(x[g], 2));
+            _mm_storeu_si128((__m128i *)(o[3] + off), _mm512_extracti32x4_epi32(x[g], 3));
+        }
+    }
+}
+#else
+void aes256_schedule(const unsigned char *key, unsigned char *ks) { (void)key; (void)ks; }
+#endif
+
+// CBC-encrypt one padded plaintext (nblocks * 16 bytes) for n <= MB_LANES
+// streams. ks[l] is stream l's expanded key; out[l] starts with its IV and
+// the ciphertext is written after it. Spare lanes encrypt into scratch.
+void aes256_cbc_multi(const unsigned char *plain, int nblocks, unsigned char *const ks[],
+                      unsigned char *const out[], int n) {
+#if defined(__x86_64__)
+    unsigned char scratch[16 + MAXDATASIZE + 16] = { 0 };
+    unsigned char *k[MB_LANES], *o[MB_LANES];
+    int width = mb_impl == MB_VAES && n > 8 ? 16 : 8;
+
+    for (int l = 0; l < width; l++) {
+        k[l] = l < n ? ks[l] : ks[0];
+        o[l] = l < n ? out[l] : scratch;
+    }
+    if (width == 16) {
+        cbc_vaes_x16(plain, nblocks, k, o);
+    } else {
+        cbc_aesni_x8(plain, nblocks, k, o);
+    }
+#else
+    (void)plain; (void)nblocks; (void)ks; (void)out; (void)n;
+#endif
+}
+
+// Pick the widest multi-buffer path this CPU has, and check it against EVP
+// before trusting it
+void mb_init(void) {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("aes")) {
+        mb_impl = MB_AESNI;
+        if (__builtin_cpu_supports("vaes") && __builtin_cpu_supports("avx512f")) mb_impl = MB_VAES;
+    }
+#endif
+    for (int n = 1; n <= MB_LANES && mb_impl != MB_NONE; n += 7) {
+        unsigned char plain[48] = "multi-buffer self test\x0a\x0a\x0a\x0a\x0a\x0a\x0a\x0a\x0a\x0a";
+        unsigned char ks[AES_SCHED], want[48], got[MB_LANES][16 + 48];
+        unsigned char *kp[MB_LANES], *op[MB_LANES];
+
+        aes256_schedule(AES_KEY, ks);
+        for (int l = 0; l < n; l++) {
+            kp[l] = ks;
+            op[l] = got[l];
+            memcpy(got[l], AES_IV, 16);
+        }
+        aes256_cbc_multi(plain, 2, kp, op, n);
+        if (aes_encrypt(plain, 22, want) != 32 || memcmp(got[n - 1] + 16, want, 32) != 0) {
+            fprintf(stderr, "multi-buffer AES self test failed; using EVP\n");
+            mb_impl = MB_NONE;
+        }
+    }
+}
+
+// HKDF-SHA256, extract and expand in one go
+int hkdf(const unsigned char *salt, int salt_len, const unsigned char *ikm, int ikm_len,
+         const char *info, unsigned char *out, size_t out_len) {
+    EVP_PKEY_CTX *pctx = EVP_PKEY_CTX_new_id(EVP_PKEY_HKDF, NULL);
+    int ok = pctx != NULL &&
+        EVP_PKEY_derive_init(pctx) == 1 &&
+        EVP_PKEY_CTX_set_hkdf_md(pctx, EVP_sha256()) == 1 &&
+        EVP_PKEY_CTX_set1_hkdf_salt(pctx, salt, salt_len) == 1 &&
+        EVP_PKEY_CTX_set1_hkdf_key(pctx, ikm, ikm_len) == 1 &&
+        EVP_PKEY_CTX_add1_hkdf_info(pctx, (const unsigned char *)info, strlen(info)) == 1 &&
+        EVP_PKEY_derive(pctx, out, &out_len) == 1;
+    EVP_PKEY_CTX_free(pctx);
+    return ok ? 0 : -1;
+}
+
+// Fresh X25519 key pair; the caller frees it
+EVP_PKEY *x25519_keygen(unsigned char pub[KEX_PUB]) {
+    size_t len = KEX_PUB;
+    EVP_PKEY *key = EVP_PKEY_Q_keygen(NULL, NULL, "X25519");
+    if (key != NULL && EVP_PKEY_get_raw_public_key(key, pub, &len) != 1) {
+        EVP_PKEY_free(key);
+        key = NULL;
+    }
+    return key;
+}
+
+// X25519(our key, their public key); fails on a low-order point
+int x25519_derive(EVP_PKEY *key, const unsigned char peer_pub[KEX_PUB], unsigned char secret[32]) {
+    size_t len = 32;
+    EVP_PKEY *peer = EVP_PKEY_new_raw_public_key(EVP_PKEY_X25519, NULL, peer_pub, KEX_PUB);
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new(key, NULL);
+    int ok = peer != NULL && ctx != NULL &&
+        EVP_PKEY_derive_init(ctx) == 1 &&
+        EVP_PKEY_derive_set_peer(ctx, peer) == 1 &&
+        EVP_PKEY_derive(ctx, secret, &len) == 1 && len == 32;
+    EVP_PKEY_CTX_free(ctx);
+    EVP_PKEY_free(peer);
+    return ok ? 0 : -1;
+}
+
+// Seal a session secret into a ticket: AES-256-GCM under the current ticket
+// key, with the key id as additional data
+int ticket_seal(const unsigned char psk[32], unsigned char *t) {
+    unsigned char plain[40];
+    int len, ok;
+
+    put_be(plain, (uint64_t)time(NULL) + TICKET_LIFETIME_S, 8);
+    memcpy(plain + 8, psk, 32);
+    t[0] = ticket_gen & 0xff;
+    if (RAND_bytes(t + 1, 12) != 1)
+        return -1;
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    ok = ctx != NULL &&
+        EVP_EncryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, ticket_key[ticket_gen & 1], t + 1) == 1 &&
+        EVP_EncryptUpdate(ctx, NULL, &len, t, 1) == 1 &&
+        EVP_EncryptUpdate(ctx, t + 13, &len, plain, sizeof plain) == 1 &&
+        EVP_EncryptFinal_ex(ctx, t + 13 + len, &len) == 1 &&
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_GET_TAG, 16, t + 53) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+    OPENSSL_cleanse(plain, sizeof plain);
+    return ok ? 0 : -1;
+}
+
+// Open a ticket sealed under the current or the retired key; -1 if it is
+// forged, from an older key, or expired
+int ticket_open(const unsigned char *t, unsigned char psk[32]) {
+    unsigned char plain[40] = { 0 };
+    int len, ok;
+    const unsigned char *key;
+
+    if (t[0] == (ticket_gen & 0xff))
+        key = ticket_key[ticket_gen & 1];
+    else if (t[0] == ((ticket_gen - 1) & 0xff))
+        key = ticket_key[(ticket_gen - 1) & 1];
+    else
+        return -1;
+
+    EVP_CIPHER_CTX *ctx = EVP_CIPHER_CTX_new();
+    ok = ctx != NULL &&
+        EVP_DecryptInit_ex(ctx, EVP_aes_256_gcm(), NULL, key, t + 1) == 1 &&
+        EVP_DecryptUpdate(ctx, NULL, &len, t, 1) == 1 &&
+        EVP_DecryptUpdate(ctx, plain, &len, t + 13, sizeof plain) == 1 &&
+        EVP_CIPHER_CTX_ctrl(ctx, EVP_CTRL_GCM_SET_TAG, 16, (void *)(t + 53)) == 1 &&
+        EVP_DecryptFinal_ex(ctx, plain + len, &len) == 1;
+    EVP_CIPHER_CTX_free(ctx);
+
+    uint64_t expiry = 0;
+    for (int k = 0; k < 8; k++) expiry = (expiry << 8) | plain[k];
+    if (ok && expiry >= (uint64_t)time(NULL)) {
+        memcpy(psk, plain + 8, 32);
+    } else {
+        ok = 0;
+    }
+    OPENSSL_cleanse(plain, sizeof plain);
+    return ok ? 0 : -1;
+}
+
+// Retire the current ticket key; tickets under it stay good for one more period
+void on_ticket_rotate(timer_node_t *t) {
+    ticket_gen++;
+    RAND_bytes(ticket_key[ticket_gen & 1], 32);
+    timer_arm(t, TICKET_ROTATE_MS);
+}
+
+// Answer a FRAME_KEX. A valid ticket resumes its session secret with no
+// public-key work at all; anything else costs one X25519 key pair and derive.
+void kex_handle(client_t *c, const unsigned char *p, int len) {
+    unsigned char salt[2 * KEX_RANDOM], secret[32], psk[32], keys[64];
+    unsigned char reply[1 + KEX_RANDOM + KEX_PUB + TICKET_LEN];
+    int n = 1 + KEX_RANDOM, resumed = 0;
+
+    if (c->sess || c->tls || c->username[0] != '\0' || len < 1 + KEX_RANDOM + KEX_PUB) {
+        return;   // once per connection, before the username
+    }
+    memcpy(salt, p + 1, KEX_RANDOM);
+    if (RAND_bytes(salt + KEX_RANDOM, KEX_RANDOM) != 1) {
+        return;
+    }
+    memcpy(reply + 1, salt + KEX_RANDOM, KEX_RANDOM);
+
+    if (p[0] == KEX_RESUME && len >= 1 + KEX_RANDOM + KEX_PUB + TICKET_LEN &&
+            ticket_open(p + 1 + KEX_RANDOM + KEX_PUB, secret) == 0) {
+        resumed = 1;
+        reply[0] = KEX_RESUME;
+    } else {
+        EVP_PKEY *key = x25519_keygen(reply + n);
+        int ok = key != NULL && x25519_derive(key, p + 1 + KEX_RANDOM, secret) == 0;
+        EVP_PKEY_free(key);
+        if (!ok) {
+            fprintf(stderr, "Key exchange failed on socket %d\n", c->fd);
+            mark_dead(c);
+            return;
+        }
+        reply[0] = KEX_FULL;
+        n += KEX_PUB;
+    }
+
+    if (hkdf(salt, sizeof salt, secret, 32, "chat psk", psk, 32) == -1 ||
+            hkdf(salt, sizeof salt, psk, 32, "chat keys", keys, 64) == -1 ||
+            ticket_seal(psk, reply + n) == -1) {
+        mark_dead(c);
+        return;
+    }
+    if (c->keys == NULL && (c->keys = malloc(sizeof *c->keys)) == NULL) {
+        mark_dead(c);
+        return;
+    }
+    send_frame(c, FRAME_KEX, reply, n + TICKET_LEN);   // the last frame under no key
+    memcpy(c->keys->key_in, keys, 32);
+    memcpy(c->keys->key_out, keys + 32, 32);
+    if (mb_impl != MB_NONE) aes256_schedule(c->keys->key_out, c->keys->ks_out);
+    c->sess = 1;
+    printf("Session keys for socket %d (%s)\n", c->fd, resumed ? "resumed from ticket" : "X25519 exchange");
+    OPENSSL_cleanse(secret, sizeof secret);
+    OPENSSL_cleanse(psk, sizeof psk);
+    OPENSSL_cleanse(keys, sizeof keys);
+}
+
+// Do one job; runs on a worker (or inline with -V 0)
+void crypto_run(crypto_job_t *j, EVP_MD_CTX *md) {
+    if (j->t_queued != 0) j->t_ran = now_ns();
+    if (j->kind == JOB_OUT) {
+        int n = aes_encrypt_with_random_iv(j->key, j->in, j->in_len, j->out + FRAME_HDR);
+        j->ok = n >= 0;
+        if (j->ok) {
+            j->out[0] = (n >> 8) & 0xff;
+            j->out[1] = n & 0xff;
+            j->out[2] = FRAME_CHAT;
+            j->out_len = FRAME_HDR + n;
+        }
+        return;
+    }
+
+    unsigned char *text = j->out + JOB_TEXT;
+    int n = j->in_len;
+    if (j->cipher == CIPHER_NONE) {
+        memcpy(text, j->in, n);   // the TLS record layer already decrypted it
+    } else {
+        n = j->cipher == CIPHER_SESS ? aes_decrypt_with_iv(j->key, j->in, j->in_len, text) :
+            aes_decrypt(j->in, j->in_len, text);
+    }
+    if (n < 0) {
+        j->ok = -1;
+        if (j->t_queued != 0) j->t_done = now_ns();
+        return;
+    }
+    text[n] = '\0';
+    j->out_len = JOB_TEXT + n;
+
+    // Ed25519 and ML-DSA sign the message itself: no digest, one shot
+    j->ok = j->sig_key == NULL ||
+        (EVP_DigestVerifyInit(md, NULL, NULL, NULL, j->sig_key) == 1 &&
+         EVP_DigestVerify(md, j->sig, j->sig_len, j->out, j->out_len) == 1);
+    EVP_MD_CTX_reset(md);
+    if (j->t_queued != 0) j->t_done = now_ns();
+}
+
+// Encrypt a run of JOB_OUTs carrying the same plaintext in one multi-buffer pass
+void crypto_run_fan(crypto_job_t **lane, int n) {
+    unsigned char plain[MAXDATASIZE + 16], iv[MB_LANES * 16];
+    unsigned char *ks[MB_LANES], *out[MB_LANES];
+    int len = lane[0]->in_len, pad = 16 - len % 16, nblocks = (len + pad) / 16;
+
+    memcpy(plain, lane[0]->in, len);
+    memset(plain + len, pad, pad);   // PKCS#7, as EVP does
+    int ok = RAND_bytes(iv, 16 * n) == 1;
+    for (int l = 0; l < n; l++) {
+        memcpy(lane[l]->out + FRAME_HDR, iv + 16 * l, 16);
+        ks[l] = lane[l]->ks;
+        out[l] = lane[l]->out + FRAME_HDR;
+    }
+    if (ok) {
+        aes256_cbc_multi(plain, nblocks, ks, out, n);
+    }
+    for (int l = 0; l < n; l++) {
+        int clen = 16 + 16 * nblocks;
+        lane[l]->ok = ok;
+        lane[l]->out[0] = (clen >> 8) & 0xff;
+        lane[l]->out[1] = clen & 0xff;
+        lane[l]->out[2] = FRAME_CHAT;
+        lane[l]->out_len = FRAME_HDR + clen;
+    }
+}
+
+// Do a batch of jobs: runs of the same broadcast to several session-key
+// clients share multi-buffer passes, the rest go one at a time
+void crypto_run_batch(crypto_job_t *batch, EVP_MD_CTX *md) {
+    crypto_job_t *j = batch;
+
+    while (j != NULL) {
+        crypto_job_t *lane[MB_LANES];
+        int n = 0;
+        if (mb_impl != MB_NONE && j->kind == JOB_OUT && j->in_len <= MAXDATASIZE) {
+            for (crypto_job_t *k = j; k != NULL && n < MB_LANES && k->kind == JOB_OUT &&
+                    k->in_len == j->in_len && memcmp(k->in, j->in, j->in_len) == 0; k = k->next) {
+                lane[n++] = k;
+            }
+        }
+        if (n >= 2) {
+            crypto_run_fan(lane, n);
+            j = lane[n - 1]->next;
+        } else {
+            crypto_run(j, md);
+            j = j->next;
+        }
+    }
+}
+
+// Take up to CRYPTO_BATCH jobs off a queue: all of them from our own,
+// half from someone else's if it is long enough to need the help
+crypto_job_t *crypto_take(crypto_worker_t *w, int steal) {
+    crypto_job_t *batch = NULL;
+
+    pthread_mutex_lock(&w->lock);
+    int n = !steal ? w->queued : w->queued >= CRYPTO_STEAL_MIN ? (w->queued + 1) / 2 : 0;
+    if (n > CRYPTO_BATCH) n = CRYPTO_BATCH;
+    if (n > 0) {
+        crypto_job_t *last = batch = w->head;
+        for (int k = 1; k < n; k++) last = last->next;
+        w->head = last->next;
+        if (w->head == NULL) w->tail = NULL;
+        last->next = NULL;
+        w->queued -= n;
+    }
+    pthread_mutex_unlock(&w->lock);
+    return batch;
+}
+
+// Is there a queue long enough to steal from?
+int crypto_surplus(void) {
+    for (int k = 0; k < crypto_threads; k++) {
+        if (crypto_workers[k].queued >= CRYPTO_STEAL_MIN) return 1;
+    }
+    return 0;
+}
+
+void *crypto_worker(void *arg) {
+    crypto_worker_t *w = arg;
+    int self = w - crypto_workers;
+    EVP_MD_CTX *md = EVP_MD_CTX_new();
+
+    if (md == NULL) {
+        fprintf(stderr, "crypto: out of memory\n");
+        exit(1);
+    }
+    for (;;) {
+        crypto_job_t *batch = crypto_take(w, 0);
+        int stolen = 0;
+        for (int k = 1; batch == NULL && k < crypto_threads; k++) {
+            batch = crypto_take(&crypto_workers[(self + k) % crypto_threads], 1);
+            stolen = batch != NULL;
+        }
+        if (batch == NULL) {
+            pthread_mutex_lock(&crypto_idle_lock);
+            while (w->queued == 0 && !crypto_surplus())
+                pthread_cond_wait(&w->wake, &crypto_idle_lock);
+            pthread_mutex_unlock(&crypto_idle_lock);
+            continue;
+        }
+
+        crypto_job_t *last = batch;
+        int n = 1;
+        crypto_run_batch(batch, md);
+        while (last->next != NULL) last = last->next, n++;
+        atomic_fetch_add_explicit(stolen ? &w->stolen : &w->ran, n, memory_order_relaxed);
+
+        // One wakeup for the whole batch
+        uint64_t one = 1;
+        pthread_mutex_lock(&crypto_done_lock);
+        if (crypto_done_tail != NULL) crypto_done_tail->next = batch; else crypto_done = batch;
+        crypto_done_tail = last;
+        pthread_mutex_unlock(&crypto_done_lock);
+        if (write(crypto_efd, &one, sizeof one) == -1) {
+            perror("crypto: eventfd");
+        }
+    }
+    return NULL;
+}
+
+uint32_t mix32(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x85ebca6bu;
+    x ^= x >> 13;
+    x *= 0xc2b2ae35u;
+    x ^= x >> 16;
+    return x;
+}
+
+int crypto_vnode_cmp(const void *a, const void *b) {
+    uint32_t x = ((const crypto_vnode_t *)a)->point, y = ((const crypto_vnode_t *)b)->point;
+    return x < y ? -1 : x > y;
+}
+
+// Place CRYPTO_VNODES points per worker on the ring
+void crypto_ring_init(int n) {
+    for (int w = 0; w < n; w++) {
+        for (int v = 0; v < CRYPTO_VNODES; v++) {
+            crypto_ring[w * CRYPTO_VNODES + v].point = mix32(((uint32_t)w << 16 | v) * 0x9e3779b9u + 1);
+            crypto_ring[w * CRYPTO_VNODES + v].worker = w;
+        }
+    }
+    qsort(crypto_ring, n * CRYPTO_VNODES, sizeof crypto_ring[0], crypto_vnode_cmp);
+    for (int i = 0; i < ROOM_OWNER_SLOTS; i++) {
+        room_owners[i].owner = -1;
+    }
+}
+
+// A room's entry in its set of ROOM_OWNER_WAYS. A room not there takes a
+// free way, else the one least recently checked, so two busy rooms that
+// share a set keep their owners and load history.
+room_owner_t *room_owner_slot(uint32_t room) {
+    room_owner_t *set = &room_owners[(room * ROOM_OWNER_WAYS) & (ROOM_OWNER_SLOTS - 1)], *victim = set;
+
+    for (int w = 0; w < ROOM_OWNER_WAYS; w++) {
+        if (set[w].owner != -1 && set[w].room == room) return &set[w];
+        if (victim->owner != -1 && (set[w].owner == -1 || set[w].until < victim->until)) victim = &set[w];
+    }
+    victim->owner = -1;
+    return victim;
+}
+
+// The worker that runs a room's crypto. The choice holds for a load window;
+// then the room stays put unless its owner is over the bound, in which case
+// it goes to the first worker after its ring point that can take it. One
+// room too hot for any bound stays too, and other workers steal from it.
+int crypto_owner(uint32_t room) {
+    room_owner_t *o = room_owner_slot(room);
+    int64_t now = now_ms();
+
+    if (now >= crypto_window_end) {
+        for (int k = 0; k < crypto_threads; k++) {
+            crypto_load[k] = (crypto_load[k] + crypto_handed[k]) / 2;
+            crypto_handed[k] = 0;
+        }
+        crypto_window_end = now + CRYPTO_REBALANCE_MS;
+    }
+    if (o->owner != -1 && o->room == room && now < o->until) {
+        o->jobs++;
+        return o->owner;
+    }
+
+    uint64_t total = 0;
+    for (int k = 0; k < crypto_threads; k++) total += crypto_load[k];
+    uint32_t bound = total * CRYPTO_LOAD_SLACK / 100 / crypto_threads + CRYPTO_BATCH;
+    uint32_t load = o->owner != -1 && o->room == room ? (o->jobs + o->load) / 2 : 0;
+    int owner = o->owner != -1 && o->room == room ? o->owner : -1;
+
+    if (owner == -1 || crypto_load[owner] > bound) {
+        int n = crypto_threads * CRYPTO_VNODES, lo = 0, hi = n;
+        uint32_t h = mix32(room);
+        while (lo < hi) {   // first point >= h, wrapping to 0
+            int mid = (lo + hi) / 2;
+            if (crypto_ring[mid].point < h) lo = mid + 1; else hi = mid;
+        }
+        int home = crypto_ring[lo % n].worker, pick = owner != -1 ? owner : home;
+        for (int k = 0; k < n; k++) {
+            int w = crypto_ring[(lo + k) % n].worker;
+            if (w != owner && crypto_load[w] + load <= bound) {
+                pick = w;
+                break;
+            }
+        }
+        if (owner != -1 && pick != owner) crypto_moves++;
+        owner = pick;
+    }
+    o->room = room;
+    o->owner = owner;
+    o->until = now + CRYPTO_REBALANCE_MS;
+    o->load = load;
+    o->jobs = 1;
+    return owner;
+}
+
+// Start the pool; n < 0 means one thread per online CPU, 0 means none
+void crypto_start(int n) {
+    if (n < 0) n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n > CRYPTO_THREADS_MAX) n = CRYPTO_THREADS_MAX;
+
+    if ((crypto_md = EVP_MD_CTX_new()) == NULL) {
+        fprintf(stderr, "crypto: out of memory\n");
+        exit(1);
+    }
+    if (n <= 0) {
+        return;
+    }
+    crypto_efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (crypto_efd == -1) {
+        perror("eventfd");
+        exit(1);
+    }
+    crypto_threads = n;   // workers steal from every queue, so set it before any runs
+    for (int i = 0; i < n; i++) {
+        pthread_mutex_init(&crypto_workers[i].lock, NULL);
+        pthread_cond_init(&crypto_workers[i].wake, NULL);
+    }
+    crypto_ring_init(n);
+    for (int i = 0; i < n; i++) {
+        if (pthread_create(&crypto_workers[i].thread, NULL, crypto_worker, &crypto_workers[i]) != 0) {
+            perror("pthread_create");
+            exit(1);
+        }
+    }
+    ev_read(crypto_efd, 1);
+}
+
+// Allocate a job for a client and give it the next number in its in_ or out_
+// order. NULL (and the client is dropped) if memory ran out.
+crypto_job_t *crypto_job(client_t *c, int kind, int sig_len, int in_len, int out_cap) {
+    crypto_job_t *j = malloc(sizeof *j + sig_len + in_len + out_cap);
+    if (j == NULL) {
+        mark_dead(c);
+        return NULL;
+    }
+    j->next = NULL;
+    j->kind = kind;
+    j->client = c - clients;
+    j->gen = c->gen;
+    j->seq = kind == JOB_IN ? c->in_seq++ : c->out_seq++;
+    j->cipher = CIPHER_NONE;
+    j->sig_key = NULL;
+    j->t_queued = tap_on ? now_ns() : 0;
+    j->t_ran = j->t_done = 0;
+    j->t_wake = lat_wake;
+    j->tag = out_tag;
+    j->ok = 1;
+    j->sig_len = sig_len;
+    j->in_len = in_len;
+    j->out_len = 0;
+    j->sig = j->data;
+    j->in = j->sig + sig_len;
+    j->out = j->in + in_len;
+    return j;
+}
+
+void crypto_free_list(crypto_job_t *j) {
+    while (j != NULL) {
+        crypto_job_t *next = j->next;
+        EVP_PKEY_free(j->sig_key);
+        free(j);
+        j = next;
+    }
+}
+
+int crypto_finish(crypto_job_t *j);
+
+// Hand the jobs staged for worker k to it as one batch (or, without
+// workers, run them here)
+void crypto_flush_to(int k) {
+    if (crypto_staged[k] == NULL) return;
+
+    if (crypto_threads == 0) {
+        crypto_job_t *j = crypto_staged[k];
+        crypto_staged[k] = crypto_staged_tail[k] = NULL;
+        crypto_staged_n[k] = 0;
+        crypto_run_batch(j, crypto_md);
+        while (j != NULL) {
+            crypto_job_t *next = j->next;
+            crypto_finish(j);
+            j = next;
+        }
+        return;
+    }
+
+    crypto_worker_t *w = &crypto_workers[k];
+    pthread_mutex_lock(&w->lock);
+    if (w->tail != NULL) w->tail->next = crypto_staged[k]; else w->head = crypto_staged[k];
+    w->tail = crypto_staged_tail[k];
+    w->queued += crypto_staged_n[k];
+    int backlog = w->queued >= CRYPTO_STEAL_MIN;
+    pthread_mutex_unlock(&w->lock);
+
+    pthread_mutex_lock(&crypto_idle_lock);
+    pthread_cond_signal(&w->wake);
+    if (backlog) {
+        for (int i = 0; i < crypto_threads; i++) {   // the others come to steal
+            if (i != k) pthread_cond_signal(&crypto_workers[i].wake);
+        }
+    }
+    pthread_mutex_unlock(&crypto_idle_lock);
+    crypto_staged[k] = crypto_staged_tail[k] = NULL;
+    crypto_staged_n[k] = 0;
+}
+
+void crypto_flush(void) {
+    for (int k = 0; k < (crypto_threads > 0 ? crypto_threads : 1); k++) {
+        crypto_flush_to(k);
+    }
+}
+
+// Queue a job. Without workers, input runs here and now and output waits for
+// crypto_flush(), so a broadcast still gets multi-buffer passes. Returns -1 if
+// acting on it dropped the client.
+int crypto_submit(crypto_job_t *j) {
+    client_t *c = &clients[j->client];
+
+    crypto_inflight++;
+    if (crypto_threads == 0 && j->kind == JOB_IN) {
+        crypto_run(j, crypto_md);
+        return crypto_finish(j);
+    }
+    int k = crypto_threads > 0 ? crypto_owner(room_hash(c->room)) : 0;
+    if (crypto_staged_tail[k] != NULL) crypto_staged_tail[k]->next = j; else crypto_staged[k] = j;
+    crypto_staged_tail[k] = j;
+    crypto_handed[k]++;
+    if (++crypto_staged_n[k] == CRYPTO_BATCH) {
+        crypto_flush_to(k);
+    }
+    if (j->kind == JOB_IN && c->in_seq - c->in_done == CRYPTO_INFLIGHT_MAX) {
+        ev_read(c->fd, 0);   // back-pressure, as for throttling
+    }
+    return 0;
+}
+
+// Queue one chat frame (signed when sig is not NULL) for decryption
+int crypto_recv(client_t *c, const unsigned char *sig, int sig_len, const unsigned char *payload, int len) {
+    crypto_job_t *j = crypto_job(c, JOB_IN, sig_len, len, JOB_TEXT + len + 16 + 1);
+    if (j == NULL) return 0;
+
+    j->cipher = c->tls ? CIPHER_NONE : c->sess ? CIPHER_SESS : CIPHER_STATIC;
+    if (j->cipher == CIPHER_SESS) memcpy(j->key, c->keys->key_in, 32);
+    memcpy(j->in, payload, len);
+    if (sig != NULL) {
+        j->sig_key = c->sig_key;
+        EVP_PKEY_up_ref(j->sig_key);
+        memcpy(j->sig, sig, sig_len);
+        memcpy(j->out, "chat-sig", 8);
+        memcpy(j->out + 8, c->sig_nonce, SIG_NONCE);
+        put_be(j->out + 8 + SIG_NONCE, c->sig_seq++, 8);
+    }
+    return crypto_submit(j);
+}
+
+// Queue a message for encryption under the client's session key
+void crypto_send(client_t *c, const char *message, int len) {
+    crypto_job_t *j = crypto_job(c, JOB_OUT, 0, len, FRAME_HDR + 16 + len + 16);
+    if (j == NULL) return;
+
+    j->cipher = CIPHER_SESS;
+    memcpy(j->key, c->keys->key_out, 32);
+    if (mb_impl != MB_NONE) memcpy(j->ks, c->keys->ks_out, AES_SCHED);
+    memcpy(j->in, message, len);
+    crypto_submit(j);
+}
+
+// Park an already-built frame behind the client's pending encryptions
+void crypto_hold(client_t *c, const void *data, int len) {
+    crypto_job_t *j = crypto_job(c, JOB_RAW, 0, 0, len);
+    if (j == NULL) return;
+
+    memcpy(j->out, data, len);
+    j->out_len = len;
+    crypto_job_t **p = &c->out_held;
+    while (*p != NULL) p = &(*p)->next;   // newest number: always last
+    *p = j;
+}
+
+int handle_chat(int client_idx, char *text);
+int dispatch_frames(int client_idx);
+void handle_client_data(int client_idx);
+
+// Act on the client's finished input in order. Returns -1 if the client left.
+int crypto_deliver_in(client_t *c) {
+    int idx = c - clients;
+    crypto_job_t *j;
+
+    while ((j = c->in_held) != NULL && j->seq == c->in_done) {
+        c->in_held = j->next;
+        c->in_done++;
+        if (tap_on && j->t_queued != 0) {
+            tap_stage("decrypt socket %d #%u: queued %.1f us, ran %.1f us%s, acted on %.1f us later",
+                c->fd, j->seq, (j->t_ran - j->t_queued) / 1e3, (j->t_done - j->t_ran) / 1e3,
+                j->sig_key != NULL ? " with the signature check" : "", (now_ns() - j->t_done) / 1e3);
+        }
+        int r = 0;
+        int64_t wake = lat_wake;
+        lat_wake = j->t_wake;   // what this causes is latency of the original input
+        if (c->dead) {
+            // the write side failed; it is closed at the end of the pass
+        } else if (j->ok == 1) {
+            r = handle_chat(idx, (char *)j->out + JOB_TEXT);
+        } else if (j->ok == 0) {
+            const char *msg = "Bad signature; message dropped.\n";
+            printf("Bad signature from %s\n", c->username);
+            send_frame(c, FRAME_NOTICE, (const unsigned char *)msg, strlen(msg));
+        } else {
+            fprintf(stderr, "Decryption failed\n");
+        }
+        lat_wake = wake;
+        j->next = NULL;
+        crypto_free_list(j);
+        if (r == -1) return -1;
+    }
+    if (c->dead || crypto_threads == 0) {
+        return 0;   // inline, we are still inside this client's dispatch
+    }
+
+    // A control frame was waiting for the pool to catch up
+    if (c->stalled && c->in_seq == c->in_done) {
+        c->stalled = 0;
+        int frames = dispatch_frames(idx);
+        if (frames == -1) return -1;
+        if (frames > 0) {
+            int64_t now = now_ms();
+            rate_charge(c, frames, 0, now);   // the bytes were charged when read
+            int64_t wait = rate_wait(c, now);
+            if (wait > 0) throttle_client(c, wait);
+        }
+    }
+    if (!c->throttled && !crypto_blocked(c)) {
+        ev_read(c->fd, 1);
+        if (tls_buffered(c)) handle_client_data(idx);
+    }
+    return 0;
+}
+
+// Put the client's finished output on the wire in order
+void crypto_deliver_out(client_t *c) {
+    crypto_job_t *j;
+
+    while ((j = c->out_held) != NULL && j->seq == c->out_done) {
+        c->out_held = j->next;
+        c->out_done++;
+        if (j->ok) {
+            int64_t wake = lat_wake;
+            out_tag_t tag = out_tag;
+            lat_wake = j->t_wake;
+            out_tag = j->tag;
+            client_queue(c, j->out, j->out_len);
+            lat_wake = wake;
+            out_tag = tag;
+        } else {
+            fprintf(stderr, "Encryption failed\n");
+        }
+        j->next = NULL;
+        crypto_free_list(j);
+    }
+}
+
+// File a finished job with its client. Jobs for clients that left (or whose
+// slot now holds someone else) are dropped. Returns -1 if the client left.
+int crypto_finish(crypto_job_t *j) {
+    client_t *c = &clients[j->client];
+
+    crypto_inflight--;
+    if (c->fd == -1 || c->gen != j->gen) {
+        j->next = NULL;
+        crypto_free_list(j);
+        return 0;
+    }
+    crypto_job_t **p = j->kind == JOB_IN ? &c->in_held : &c->out_held;
+    while (*p != NULL && (int32_t)((*p)->seq - j->seq) < 0) p = &(*p)->next;
+    j->next = *p;
+    *p = j;
+    if (j->kind == JOB_IN) {
+        return crypto_deliver_in(c);
+    }
+    crypto_deliver_out(c);
+    return 0;
+}
+
+// Act on whatever the workers have finished
+void crypto_complete(void) {
+    uint64_t n;
+    if (read(crypto_efd, &n, sizeof n) == -1 && errno != EAGAIN) {
+        perror("crypto: eventfd");
+    }
+    pthread_mutex_lock(&crypto_done_lock);
+    crypto_job_t *j = crypto_done;
+    crypto_done = crypto_done_tail = NULL;
+    pthread_mutex_unlock(&crypto_done_lock);
+
+    while (j != NULL) {
+        crypto_job_t *next = j->next;
+        crypto_finish(j);
+        j = next;
+    }
+}
+
+// Block until every job is done and acted on (before a handoff)
+void crypto_drain(void) {
+    crypto_flush();   // without workers this finishes everything
+    while (crypto_inflight > 0) {
+        fd_set rfds;
+        FD_ZERO(&rfds);
+        FD_SET(crypto_efd, &rfds);
+        select(crypto_efd + 1, &rfds, NULL, NULL, NULL);
+        crypto_complete();
+        crypto_flush();   // acting on input may have queued output
+    }
+}
+
+// Take a client's public key; chat on this connection must be signed from now on
+void sig_register(client_t *c, const unsigned char *der, int len) {
+    const unsigned char *p = der;
+    EVP_PKEY *key = len <= SIG_KEY_MAX ? d2i_PUBKEY(NULL, &p, len) : NULL;
+    const char *msg = NULL;
+
+    if (c->sig_key != NULL) {
+        msg = "A signing key is already registered on this connection.\n";
+    } else if (key == NULL || p != der + len) {
+        msg = "Could not read that signing key.\n";
+    }
+    if (msg != NULL) {
+        EVP_PKEY_free(key);
+        send_frame(c, FRAME_NOTICE, (const unsigned char *)msg, strlen(msg));
+        return;
+    }
+    c->sig_key = key;
+    c->sig_seq = 0;
+    RAND_bytes(c->sig_nonce, SIG_NONCE);
+    send_frame(c, FRAME_SIGKEY, c->sig_nonce, SIG_NONCE);   // goes into every signature
+    printf("%s signs with %s\n", c->username, EVP_PKEY_get0_type_name(key));
+}
+
+// Append a relay record to the pending batch, flushing first if it is full
+void relay_append(const unsigned char *rec, int len) {
+	void relay_flush(void);
+
+	if (relay_len + len > (int)sizeof(relay_batch)) {
+		relay_flush();
+	}
+	memcpy(relay_batch + relay_len, rec, len);
+	relay_len += len;
+	relay_count++;
+}
+
+// Record header: [u8 type][u16 origin][u32 epoch][u32 seq]
+int relay_header(unsigned char *rec, int type, uint32_t seq) {
+	rec[0] = type;
+	rec[1] = node_id >> 8; rec[2] = node_id & 0xff;
+	for (int k = 0; k < 4; k++) {
+		rec[3 + k] = node_epoch >> (24 - 8 * k);
+		rec[7 + k] = seq >> (24 - 8 * k);
+	}
+	return 11;
+}
+
+// Queue a room message for every peer: [header][u8 len][room][u8 len][name][u16 len][text]
+void relay_publish(const char *room, const char *sender_name, const char *message) {
+	unsigned char rec[MAXDATASIZE];
+	int rl = strlen(room), nl = strlen(sender_name), tl = strlen(message);
+
+	if (peer_count == 0) return;
+	if (rl > 255) rl = 255;
+	if (nl > 255) nl = 255;
+	if (11 + 1 + rl + 1 + nl + 2 + tl > (int)sizeof(relay_batch) - 2) {
+		tl = sizeof(relay_batch) - 2 - (11 + 1 + rl + 1 + nl + 2);
+	}
+
+	int n = relay_header(rec, RELAY_MSG, ++relay_seq);
+	rec[n++] = rl; memcpy(rec + n, room, rl); n += rl;
+	rec[n++] = nl; memcpy(rec + n, sender_name, nl); n += nl;
+	rec[n++] = tl >> 8; rec[n++] = tl & 0xff;
+	memcpy(rec + n, message, tl); n += tl;
+	relay_append(rec, n);
+}
+
+// Encrypt the pending batch once and write it to every outbound peer link.
+// Called at the end of each loop pass, so a burst of messages costs one
+// encryption and one write per peer rather than one per message.
+void relay_flush(void) {
+	if (peer_count == 0) return;
+	if (local_users != announced_users) {
+		unsigned char rec[16];
+		int n = relay_header(rec, RELAY_USERS, 0);
+		for (int k = 0; k < 4; k++) rec[n + k] = local_users >> (24 - 8 * k);
+		announced_users = local_users;
+		relay_append(rec, n + 4);
+	}
+	if (relay_count == 0) return;
+
+	unsigned char frame[FRAME_HDR + sizeof(relay_batch) + 16];
+	relay_batch[0] = relay_count >> 8;
+	relay_batch[1] = relay_count & 0xff;
+	int len = aes_encrypt(relay_batch, relay_len, frame + FRAME_HDR);
+	relay_len = 2;
+	relay_count = 0;
+	if (len < 0) return;
+	frame[0] = (len >> 8) & 0xff;
+	frame[1] = len & 0xff;
+	frame[2] = FRAME_RELAY;
+
+	out_tag_t tag = out_tag;
+	out_tag = room_tag("");   // every room's relayed chat, one lane
+	for (int p = 0; p < peer_count; p++) {
+		if (peers[p].conn != -1) {
+			client_write(&clients[peers[p].conn], frame, FRAME_HDR + len);
+		}
+	}
+	out_tag = tag;
+}
+
+// Sliding-window duplicate check per origin node; marks seq as seen
+int relay_duplicate(int origin, uint32_t epoch, uint32_t seq) {
+	node_state_t *n = &nodes[origin];
+
+	if (n->epoch != epoch) {   // origin restarted cold: start a fresh window
+		n->epoch = epoch;
+		n->top = seq;
+		n->window = 1;
+		return 0;
+	}
+	if (seq > n->top) {
+		uint32_t shift = seq - n->top;
+		n->window = shift >= RELAY_WINDOW ? 0 : n->window << shift;
+		n->window |= 1;
+		n->top = seq;
+		return 0;
+	}
+	uint32_t age = n->top - seq;
+	if (age >= RELAY_WINDOW || (n->window & ((uint64_t)1 << age))) {
+		return 1;
+	}
+	n->window |= (uint64_t)1 << age;
+	return 0;
+}
+
+uint32_t get_u32(const unsigned char *b) {
+	return ((uint32_t)b[0] << 24) | ((uint32_t)b[1] << 16) | ((uint32_t)b[2] << 8) | b[3];
+}
+
+// Unpack a relay batch from a peer and deliver its messages locally
+void relay_receive(client_t *from, const unsigned char *payload, int len) {
+	unsigned char batch[FRAME_MAX + 32];
+	int blen = aes_decrypt((unsigned char *)payload, len, batch);
+	if (blen < 2) {
+		fprintf(stderr, "Bad relay batch from %s\n", from->username);
+		return;
+	}
+
+	int count = (batch[0] << 8) | batch[1], off = 2;
+	while (count-- > 0 && off + 11 <= blen) {
+		const unsigned char *r = batch + off;
+		int origin = (r[1] << 8) | r[2];
+		uint32_t epoch = get_u32(r + 3), seq = get_u32(r + 7);
+		off += 11;
+		if (origin <= 0 || origin >= MAX_NODES) return;
+
+		if (r[0] == RELAY_USERS) {
+			if (off + 4 > blen) return;
+			nodes[origin].users = get_u32(batch + off);
+			off += 4;
+			continue;
+		}
+		if (r[0] != RELAY_MSG) return;
+
+		char room[256], name[256], text[MAXDATASIZE];
+		int rl, nl, tl;
+		if (off + 1 > blen || off + 1 + (rl = batch[off]) + 1 > blen || rl >= ROOM_LEN) return;
+		memcpy(room, batch + off + 1, rl); room[rl] = '\0'; off += 1 + rl;
+		if (off + 1 + (nl = batch[off]) + 2 > blen || nl >= (int)sizeof(from->username)) return;
+		memcpy(name, batch + off + 1, nl); name[nl] = '\0'; off += 1 + nl;
+		tl = (batch[off] << 8) | batch[off + 1];
+		if (off + 2 + tl > blen || tl >= (int)sizeof(text)) return;
+		memcpy(text, batch + off + 2, tl); text[tl] = '\0'; off += 2 + tl;
+
+		if (origin != node_id && !relay_duplicate(origin, epoch, seq)) {
+			deliver_local(room, text, -1, name);
+		}
+	}
+}
+
+// Send our node id on a fresh link (encrypted, so it doubles as proof of the shared key)
+void send_peer_hello(client_t *c) {
+	unsigned char id[2] = { node_id >> 8, node_id & 0xff };
+	unsigned char cipher[32];
+	int len = aes_encrypt(id, sizeof id, cipher);
+	if (len > 0) send_frame(c, FRAME_PEER_HELLO, cipher, len);
+}
+
+// Outbound link finished connecting
+void peer_link_up(client_t *c) {
+	peer_t *pr = &peers[c->peer];
+	printf("Linked to peer %s:%s\n", pr->host, pr->port);
+	pr->backoff = PEER_RETRY_MS;
+	pr->conn = c - clients;
+	send_peer_hello(c);
+	announced_users = -1;   // (re)announce our user count on the next flush
+	timer_arm(&c->keepalive, KEEPALIVE_MS);
+}
+
+// Dial a peer node (non-blocking; completion is reported as writability)
+void peer_connect(int p) {
+	peer_t *pr = &peers[p];
+	struct addrinfo hints, *ai, *a;
+	int fd = -1;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(pr->host, pr->port, &hints, &ai) != 0) {
+		timer_arm(&pr->retry, PEER_RETRY_MAX_MS);
+		return;
+	}
+	for (a = ai; a != NULL; a = a->ai_next) {
+		fd = socket(a->ai_family, a->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, a->ai_protocol);
+		if (fd == -1) continue;
+		if (connect(fd, a->ai_addr, a->ai_addrlen) == 0 || errno == EINPROGRESS) break;
+		close(fd);
+		fd = -1;
+	}
+	if (fd == -1 || fd >= fd_limit || client_count >= MAX_CLIENTS) {
+		if (fd != -1) close(fd);
+		freeaddrinfo(ai);
+		timer_arm(&pr->retry, pr->backoff);
+		return;
+	}
+
+	struct sockaddr_storage addr;
+	memset(&addr, 0, sizeof addr);
+	memcpy(&addr, a->ai_addr, a->ai_addrlen);
+	freeaddrinfo(ai);
+
+	int idx = init_client(fd, &addr, CONN_PEER_OUT, -1, now_ms());
+	client_t *c = &clients[idx];
+	c->peer = p;
+	c->connecting = 1;
+	snprintf(c->username, sizeof c->username, "peer %.40s:%s", pr->host, pr->port);
+	ev_write(fd, 1);
+}
+
+void on_peer_retry(timer_node_t *t) {
+	peer_t *pr = (peer_t *)((char *)t - offsetof(peer_t, retry));
+	peer_connect(pr - peers);
+}
+
+// Presence rosters. A subscriber's room list arrives as a snapshot, then as
+// diffs, all built once per batch and shared by every subscriber in the room.
+void session_send(session_t *s, int type, const unsigned char *payload, int len);
+
+// Append to a growable buffer; on allocation failure the bytes are dropped
+void roster_put(unsigned char **buf, int *len, int *cap, const void *data, int n) {
+	if (*len + n > *cap) {
+		int want = *cap ? *cap : 256;
+		while (want < *len + n) want *= 2;
+		unsigned char *nbuf = realloc(*buf, want);
+		if (nbuf == NULL) return;
+		*buf = nbuf;
+		*cap = want;
+	}
+	memcpy(*buf + *len, data, n);
+	*len += n;
+}
+
+void roster_entry(unsigned char **buf, int *len, int *cap, int op, const char *name) {
+	unsigned char e[2 + 64];
+	int n = strlen(name);
+	if (n > 63) n = 63;
+	e[0] = op;
+	e[1] = n;
+	memcpy(e + 2, name, n);
+	roster_put(buf, len, cap, e, 2 + n);
+}
+
+roster_t *roster_find(const char *room, int create) {
+	roster_t **head = &rosters[room_tag(room).key & (ROSTER_HASH - 1)];
+	for (roster_t *r = *head; r != NULL; r = r->next) {
+		if (strcmp(r->room, room) == 0) return r;
+	}
+	if (!create) return NULL;
+	roster_t *r = calloc(1, sizeof *r);
+	if (r == NULL) return NULL;
+	snprintf(r->room, sizeof r->room, "%s", room);
+	r->next = *head;
+	*head = r;
+	return r;
+}
+
+void roster_arm(void) {
+	if (roster_tick.next == NULL) timer_arm(&roster_tick, ROSTER_BATCH_MS);
+}
+
+// Someone arrived in or left a room; its subscribers hear at the next batch
+void roster_note(const char *room, const char *name, int op) {
+	roster_t *r = roster_find(room, 0);
+	if (r == NULL) return;   // nobody there is subscribed
+	roster_entry(&r->diff, &r->dlen, &r->dcap, op, name);
+	roster_arm();
+}
+
+// A user or session asks for its room's roster (again, after a gap); the
+// snapshot comes with the next batch
+void roster_subscribe(const char *room, uint8_t *state) {
+	roster_t *r = roster_find(room, 1);
+	if (r == NULL || *state == ROSTER_WANT) return;
+	if (*state == ROSTER_OFF) r->subs++;
+	r->want++;
+	*state = ROSTER_WANT;
+	roster_arm();
+}
+
+// A subscriber leaves the room, or the server
+void roster_leave(const char *room, uint8_t *state) {
+	roster_t *r = roster_find(room, 0);
+	if (r != NULL && *state != ROSTER_OFF) {
+		r->subs--;
+		if (*state == ROSTER_WANT) r->want--;
+	}
+	*state = ROSTER_OFF;
+}
+
+// Cut entries into FRAME_ROSTER frames of at most ROSTER_CHUNK payload bytes,
+// appended to r->out. Each diff frame is a version of its own.
+void roster_frames(roster_t *r, int kind, const unsigned char *e, int elen) {
+	int off = 0;
+	do {
+		int n = 0;
+		while (off + n < elen && 5 + n + 2 + e[off + n + 1] <= ROSTER_CHUNK) {
+			n += 2 + e[off + n + 1];
+		}
+		if (kind == ROSTER_DIFF) r->version++;
+		unsigned char hdr[FRAME_HDR + 5];
+		hdr[0] = (5 + n) >> 8;
+		hdr[1] = (5 + n) & 0xff;
+		hdr[2] = FRAME_ROSTER;
+		hdr[3] = kind;
+		put_be(hdr + 4, r->version, 4);
+		roster_put(&r->out, &r->olen, &r->ocap, hdr, sizeof hdr);
+		roster_put(&r->out, &r->olen, &r->ocap, e + off, n);
+		off += n;
+		if (kind == ROSTER_SNAP) kind = ROSTER_MORE;
+	} while (off < elen);
+}
+
+// A subscriber's share of the batch: the snapshot if it is owed one, else the diffs
+void roster_deliver(client_t *c, session_t *s, roster_t *r, uint8_t *state) {
+	int from = *state == ROSTER_WANT ? r->snap : 0;
+	int to = *state == ROSTER_WANT ? r->olen : r->snap;
+
+	*state = ROSTER_ON;
+	while (from < to) {
+		int len = (r->out[from] << 8) | r->out[from + 1];
+		if (c != NULL) {
+			client_write(c, r->out + from, FRAME_HDR + len);
+		} else {
+			session_send(s, FRAME_ROSTER, r->out + from + FRAME_HDR, len);
+		}
+		from += FRAME_HDR + len;
+	}
+}
+
+// Send what the batch collected. Room lists for snapshots come from one pass
+// over the users, however many subscribers are owed one.
+void roster_flush(void) {
+	int snaps = 0;
+
+	timer_cancel(&roster_tick);
+	for (int h = 0; h < ROSTER_HASH; h++) {
+		for (roster_t *r = rosters[h]; r != NULL; r = r->next) {
+			r->olen = 0;
+			if (r->dlen > 0) roster_frames(r, ROSTER_DIFF, r->diff, r->dlen);
+			r->dlen = 0;
+			r->snap = r->olen;
+			r->mlen = 0;
+			if (r->want > 0) snaps++;
+		}
+	}
+	if (snaps > 0) {
+		for (int i = 0; i < client_hwm; i++) {
+			client_t *c = &clients[i];
+			roster_t *r;
+			if (c->fd == -1) continue;
+			if (c->kind == CONN_USER && c->username[0] != '\0' &&
+					(r = roster_find(c->room, 0)) != NULL && r->want > 0) {
+				roster_entry(&r->members, &r->mlen, &r->mcap, ROSTER_ADD, c->username);
+			}
+			for (int k = c->kind == CONN_GATEWAY ? c->mux_head : -1; k != -1; k = sessions[k].next) {
+				session_t *s = &sessions[k];
+				if (s->username[0] != '\0' && (r = roster_find(s->room, 0)) != NULL && r->want > 0) {
+					roster_entry(&r->members, &r->mlen, &r->mcap, ROSTER_ADD, s->username);
+				}
+			}
+		}
+		for (int h = 0; h < ROSTER_HASH; h++) {
+			for (roster_t *r = rosters[h]; r != NULL; r = r->next) {
+				if (r->want > 0) roster_frames(r, ROSTER_SNAP, r->members, r->mlen);
+			}
+		}
+	}
+	
+	out_tag_t tag = out_tag;
+	for (int i = 0; i < client_hwm; i++) {
+		client_t *c = &clients[i];
+		if (c->fd == -1) continue;
+		if (c->roster != ROSTER_OFF) {
+			roster_t *r = roster_find(c->room, 0);
+			out_tag = room_tag(c->room);
+			if (r != NULL) roster_deliver(c, NULL, r, &c->roster);
+		}
+		for (int k = c->kind == CONN_GATEWAY ? c->mux_head : -1, next; k != -1; k = next) {
+			session_t *s = &sessions[k];
+			next = s->next;   // a session that overflows is closed here
+			roster_t *r = s->roster != ROSTER_OFF ? roster_find(s->room, 0) : NULL;
+			if (r != NULL) roster_deliver(NULL, s, r, &s->roster);
+		}
+	}
+	out_tag = tag;
+	
+	// Rooms nobody listens to any more are forgotten
+	for (int h = 0; h < ROSTER_HASH; h++) {
+		for (roster_t **p = &rosters[h]; *p != NULL; ) {
+			roster_t *r = *p;
+			r->want = 0;
+			if (r->subs > 0) {
+				p = &r->next;
+				continue;
+			}
+			*p = r->next;
+			free(r->diff);
+			free(r->members);
+			free(r->out);
+			free(r);
+		}
+	}
+}
+
+void on_roster_tick(timer_node_t *t) {
+	(void)t;
+	roster_flush();
+}
+
+// A join or leave line, for everyone but roster subscribers (and for peer nodes)
+void presence_line(const char *room, const char *msg, int sender_fd) {
+	roster_quiet = 1;
+	broadcast_message(room, msg, sender_fd, "Server");
+	roster_quiet = 0;
+}
+
+// Move a user to another room, telling both rooms
+void join_room(client_t *c, const char *name) {
+	char room[ROOM_LEN], msg[256];
+	int n = 0;
+
+	while (*name == ' ') name++;
+	while (n < ROOM_LEN - 1 && name[n] != '\0' && name[n] != '\n' && name[n] != ' ') {
+		room[n] = name[n];
+		n++;
+	}
+	room[n] = '\0';
+	if (n == 0) {
+		n = snprintf(msg, sizeof(msg), "You are in room '%s'.", c->room);
+		send_encrypted(c, msg, n);
+		return;
+	}
+
+	int sub = c->roster != ROSTER_OFF;
+	snprintf(msg, sizeof(msg), "%s has left the room\n", c->username);
+	roster_note(c->room, c->username, ROSTER_DEL);
+	presence_line(c->room, msg, c->fd);
+	roster_leave(c->room, &c->roster);
+	strcpy(c->room, room);
+	if (sub) roster_subscribe(c->room, &c->roster);   // a snapshot of the new room
+	snprintf(msg, sizeof(msg), "%s has joined the room\n", c->username);
+	roster_note(c->room, c->username, ROSTER_ADD);
+	presence_line(c->room, msg, c->fd);
+
+	n = snprintf(msg, sizeof(msg), "You are now in room '%s'.", c->room);
+	send_encrypted(c, msg, n);
+	printf("%s moved to room '%s'\n", c->username, c->room);
+}
+
+// Gateway sessions. Everything a session receives goes out on its gateway's
+// connection, wrapped in FRAME_MUX (or, for room traffic, FRAME_MUX_FAN).
+
+int session_slot(int gw, uint32_t stream) {
+	return ((stream * 2654435761u) ^ ((uint32_t)gw * 40503u)) & (SESSION_HASH - 1);
+}
+
+session_t *session_find(int gw, uint32_t stream) {
+	for (int i = session_hash[session_slot(gw, stream)]; i != -1; i = sessions[i].hnext) {
+		if (sessions[i].gw == gw && sessions[i].stream == stream) return &sessions[i];
+	}
+	return NULL;
+}
+
+session_t *session_open(client_t *g, uint32_t stream, uint32_t window) {
+	int i = session_free;
+	if (i == -1 || g->mux_count >= GATEWAY_SESSIONS) return NULL;
+
+	session_t *s = &sessions[i];
+	session_free = s->next;
+	s->gw = g - clients;
+	s->stream = stream;
+	s->username[0] = '\0';
+	strcpy(s->room, DEFAULT_ROOM);
+	s->roster = ROSTER_OFF;
+	s->window = window;
+	s->last_chat = now_ms();
+	bucket_init(&s->msgs, CONN_MSG_BURST, s->last_chat);
+	s->q = NULL;
+	s->qoff = s->qlen = s->qcap = 0;
+
+	s->prev = -1;
+	s->next = g->mux_head;
+	if (g->mux_head != -1) sessions[g->mux_head].prev = i;
+	g->mux_head = i;
+	g->mux_count++;
+	int h = session_slot(s->gw, stream);
+	s->hnext = session_hash[h];
+	session_hash[h] = i;
+	session_count++;
+	return s;
+}
+
+// End a session; with tell, the gateway hears about it (FRAME_MUX_CLOSE)
+void session_close(session_t *s, int tell) {
+	int i = s - sessions;
+	client_t *g = &clients[s->gw];
+
+	if (s->username[0] != '\0') {
+		printf("%s disconnected\n", s->username);
+		local_users--;
+		roster_note(s->room, s->username, ROSTER_DEL);
+	}
+	roster_leave(s->room, &s->roster);
+	if (tell) {
+		unsigned char id[4];
+		put_be(id, s->stream, 4);
+		send_frame(g, FRAME_MUX_CLOSE, id, 4);
+	}
+	if (s->prev != -1) sessions[s->prev].next = s->next; else g->mux_head = s->next;
+	if (s->next != -1) sessions[s->next].prev = s->prev;
+	int *p = &session_hash[session_slot(s->gw, s->stream)];
+	while (*p != i) p = &sessions[*p].hnext;
+	*p = s->hnext;
+	free(s->q);
+	s->q = NULL;
+	s->gw = -1;
+	s->next = session_free;
+	session_free = i;
+	g->mux_count--;
+	session_count--;
+}
+
+void session_write(session_t *s, int type, const unsigned char *payload, int len) {
+	unsigned char frame[FRAME_HDR + 5 + FRAME_MAX];
+	int n = 5 + len;
+
+	frame[0] = (n >> 8) & 0xff;
+	frame[1] = n & 0xff;
+	frame[2] = FRAME_MUX;
+	put_be(frame + FRAME_HDR, s->stream, 4);
+	frame[FRAME_HDR + 4] = type;
+	memcpy(frame + FRAME_HDR + 5, payload, len);
+	s->window -= 1 + len;
+	client_write(&clients[s->gw], frame, FRAME_HDR + n);
+}
+
+// Keep a frame until the gateway opens the window. Returns -1 (and the
+// session is closed) once too much is waiting.
+int session_hold(session_t *s, int type, const unsigned char *payload, int len) {
+	if (s->qlen - s->qoff + 3 + len > SESSION_QUEUE_MAX) {
+		printf("Gateway session %s is not reading; dropping\n", s->username[0] ? s->username : "Unknown");
+		session_close(s, 1);
+		return -1;
+	}
+	if (s->qlen + 3 + len > s->qcap) {
+		int cap = s->qcap ? s->qcap : 1024;
+		while (cap < s->qlen + 3 + len) cap *= 2;
+		unsigned char *nq = realloc(s->q, cap);
+		if (nq == NULL) {
+			session_close(s, 1);
+			return -1;
+		}
+		s->q = nq;
+		s->qcap = cap;
+	}
+	put_be(s->q + s->qlen, len, 2);
+	s->q[s->qlen + 2] = type;
+	memcpy(s->q + s->qlen + 3, payload, len);
+	s->qlen += 3 + len;
+	return 0;
+}
+
+// Send what was held, as far as the window now allows
+void session_flush(session_t *s) {
+	out_tag_t tag = out_tag;
+	out_tag = room_tag(s->room);   // mostly room chat the window held back
+	while (s->qoff < s->qlen) {
+		unsigned char *f = s->q + s->qoff;
+		int len = (f[0] << 8) | f[1];
+		if (s->window < 1 + len) break;
+		session_write(s, f[2], f + 3, len);
+		s->qoff += 3 + len;
+	}
+	if (s->qoff == s->qlen) {
+		s->qoff = s->qlen = 0;
+	}
+	out_tag = tag;
+}
+
+// One frame to a session, through its window
+void session_send(session_t *s, int type, const unsigned char *payload, int len) {
+	if (s->qoff == s->qlen && s->window >= 1 + len) {
+		session_write(s, type, payload, len);
+	} else {
+		session_hold(s, type, payload, len);
+	}
+}
+
+// Text to one session, encrypted as its gateway's link requires
+void session_text(session_t *s, const char *msg, int len) {
+	unsigned char ciphertext[16 + MAXDATASIZE + 16];
+
+	if (clients[s->gw].tls) {
+		session_send(s, FRAME_TEXT, (const unsigned char *)msg, len);
+		return;
+	}
+	int n = aes_encrypt((unsigned char *)msg, len, ciphertext);
+	if (n < 0) {
+		fprintf(stderr, "Encryption failed\n");
+		return;
+	}
+	session_send(s, FRAME_CHAT, ciphertext, n);
+}
+
+// Room traffic for a gateway: one FRAME_MUX_FAN names every session in the
+// room that has the window for it; the others hold their own copy. Returns
+// the number of sessions reached.
+int mux_deliver(client_t *g, const char *room, int sender_fd, const unsigned char *frame, int flen) {
+	static unsigned char fan[FRAME_HDR + 2 + 4 * MAX_SESSIONS + FRAME_HDR + MAXDATASIZE + 16];
+	unsigned char *ids = fan + FRAME_HDR + 2;
+	int body = flen - FRAME_HDR, count = 0, reached = 0;
+
+	for (int i = g->mux_head, next; i != -1; i = next) {
+		session_t *s = &sessions[i];
+		next = s->next;   // a session that overflows is closed here
+		if (SESSION_ID(i) == sender_fd || s->username[0] == '\0' || (roster_quiet && s->roster) ||
+				strcmp(s->room, room) != 0) {
+			continue;
+		}
+		reached++;
+		if (s->qoff == s->qlen && s->window >= 1 + body) {
+			s->window -= 1 + body;
+			put_be(ids + 4 * count++, s->stream, 4);
+		} else {
+			session_hold(s, frame[2], frame + FRAME_HDR, body);
+		}
+	}
+	if (count == 0) {
+		return reached;
+	}
+	int n = 2 + 4 * count + 1 + body;
+	fan[0] = (n >> 8) & 0xff;
+	fan[1] = n & 0xff;
+	fan[2] = FRAME_MUX_FAN;
+	put_be(fan + FRAME_HDR, count, 2);
+	memcpy(ids + 4 * count, frame + 2, 1 + body);   // type and payload, once
+	client_write(g, fan, FRAME_HDR + n);
+	return reached;
+}
+
+// Move a session to another room, telling both rooms (as join_room())
+void session_join(session_t *s, const char *name) {
+	char room[ROOM_LEN], msg[256];
+	int n = 0, id = SESSION_ID(s - sessions);
+
+	while (*name == ' ') name++;
+	while (n < ROOM_LEN - 1 && name[n] != '\0' && name[n] != '\n' && name[n] != ' ') {
+		room[n] = name[n];
+		n++;
+	}
+	room[n] = '\0';
+	if (n == 0) {
+		n = snprintf(msg, sizeof(msg), "You are in room '%s'.", s->room);
+		session_text(s, msg, n);
+		return;
+	}
+
+	int sub = s->roster != ROSTER_OFF;
+	snprintf(msg, sizeof(msg), "%s has left the room\n", s->username);
+	roster_note(s->room, s->username, ROSTER_DEL);
+	presence_line(s->room, msg, id);
+	roster_leave(s->room, &s->roster);
+	strcpy(s->room, room);
+	if (sub) roster_subscribe(s->room, &s->roster);
+	snprintf(msg, sizeof(msg), "%s has joined the room\n", s->username);
+	roster_note(s->room, s->username, ROSTER_ADD);
+	presence_line(s->room, msg, id);
+
+	n = snprintf(msg, sizeof(msg), "You are now in room '%s'.", s->room);
+	session_text(s, msg, n);
+	printf("%s moved to room '%s'\n", s->username, s->room);
+}
+
+// A line of chat from a session: the username, a command or a message (as handle_chat())
+void session_chat(session_t *s, char *text) {
+	int id = SESSION_ID(s - sessions);
+	char msg[256];
+
+	if (s->username[0] == '\0') {
+		snprintf(s->username, sizeof s->username, "%s", text);
+		if (s->username[0] == '\0') {
+			return;
+		}
+		printf("User '%s' joined the chat (gateway socket %d)\n", s->username, clients[s->gw].fd);
+		local_users++;
+		int n = snprintf(msg, sizeof(msg), "Welcome, %s! You are now connected. There are %d user(s) online.",
+			s->username, total_users());
+		session_text(s, msg, n);
+		snprintf(msg, sizeof(msg), "%s has joined the chat\n", s->username);
+		roster_note(s->room, s->username, ROSTER_ADD);
+		presence_line(s->room, msg, id);
+	} else if (strncmp(text, "/join ", 6) == 0) {
+		session_join(s, text + 6);
+	} else if (strncmp(text, "/search", 7) == 0 && (text[7] == ' ' || text[7] == '\0')) {
+		hist_query(s->gw, s - sessions, s->room, text + 7);
+	} else if (strncmp(text, "quit", 4) == 0) {
+		printf("%s is leaving the chat\n", s->username);
+		snprintf(msg, sizeof(msg), "%s has left the chat\n", s->username);
+		presence_line(s->room, msg, id);   // the roster hears from session_close()
+		session_close(s, 1);
+	} else {
+		s->last_chat = now_ms();
+		printf("[%s]: %s\n", s->username, text);
+		broadcast_message(s->room, text, id, s->username);
+	}
+}
+
+// The first FRAME_MUX_OPEN turns a fresh connection from a -G address into a
+// gateway link. It carries many users' traffic, so the per-address limits
+// give way to a link-sized bucket and one message bucket per session.
+void gateway_start(client_t *c) {
+	int64_t now = now_ms();
+	c->kind = CONN_GATEWAY;
+	bucket_init(&c->msgs, GATEWAY_MSG_BURST, now);
+	bucket_init(&c->bytes, GATEWAY_BYTE_BURST, now);
+	snprintf(c->username, sizeof c->username, "gateway on socket %d", c->fd);
+	ip_release(c->ip_slot);
+	c->ip_slot = -1;
+	timer_cancel(&c->deadline);
+	timer_arm(&c->keepalive, KEEPALIVE_MS);
+	printf("Socket %d is a gateway\n", c->fd);
+}
+
+// A FRAME_MUX_* frame on a gateway link
+void mux_handle(client_t *g, int type, const unsigned char *payload, int len) {
+	if (len < 4) return;
+	uint32_t stream = get_u32(payload);
+	session_t *s = session_find(g - clients, stream);
+
+	if (type == FRAME_MUX_OPEN) {
+		if (s != NULL || len < 8) return;
+		if (session_open(g, stream, get_u32(payload + 4)) == NULL) {
+			unsigned char id[4];
+			put_be(id, stream, 4);
+			send_frame(g, FRAME_MUX_CLOSE, id, 4);   // server full
+		}
+		return;
+	}
+	if (s == NULL) return;
+	if (type == FRAME_MUX_CLOSE) {
+		session_close(s, 0);
+	} else if (type == FRAME_MUX_WINDOW && len >= 8) {
+		s->window += get_u32(payload + 4);
+		session_flush(s);
+	} else if (type == FRAME_MUX && len >= 5 && payload[4] == FRAME_ROSTER && s->username[0] != '\0') {
+		roster_subscribe(s->room, &s->roster);
+	} else if (type == FRAME_MUX && len >= 5 && payload[4] == (g->tls ? FRAME_TEXT : FRAME_CHAT)) {
+		char text[FRAME_MAX + 1];
+		int n = len - 5;
+		if (g->tls) {
+			memcpy(text, payload + 5, n);
+		} else if ((n = aes_decrypt((unsigned char *)payload + 5, n, (unsigned char *)text)) < 0) {
+			fprintf(stderr, "Decryption failed\n");
+			return;
+		}
+		text[n] = '\0';
+
+		int64_t now = now_ms();
+		bucket_refill(&s->msgs, CONN_MSG_RATE, CONN_MSG_BURST, now);
+		if (s->msgs.level < 1000) {
+			const char *msg = "Slow down; message dropped.";
+			session_text(s, msg, strlen(msg));
+			return;
+		}
+		s->msgs.level -= 1000;
+		session_chat(s, text);
+	}
+}
+
+// A peer node introduced itself on an inbound connection
+int peer_hello(int client_idx, const unsigned char *payload, int len) {
+	client_t *c = &clients[client_idx];
+	unsigned char id[32];
+
+	if (c->kind != CONN_USER || c->username[0] != '\0') {
+		return 0;
+	}
+	if (!addr_listed(&c->addr, peer_addrs, peer_addr_count)) {
+		fprintf(stderr, "Peer hello from socket %d, not a -P address\n", c->fd);
+		remove_client(client_idx);
+		return -1;
+	}
+	if (aes_decrypt((unsigned char *)payload, len, id) != 2 ||
+			((id[0] << 8) | id[1]) <= 0 || ((id[0] << 8) | id[1]) >= MAX_NODES) {
+		fprintf(stderr, "Bad peer hello on socket %d\n", c->fd);
+		remove_client(client_idx);
+		return -1;
+	}
+	c->kind = CONN_PEER_IN;
+	snprintf(c->username, sizeof c->username, "node%d", (id[0] << 8) | id[1]);
+	ip_release(c->ip_slot);   // peers are not charged against their address
+	c->ip_slot = -1;
+	timer_cancel(&c->deadline);
+	timer_arm(&c->keepalive, KEEPALIVE_MS);
+	announced_users = -1;
+	printf("Peer %s linked in\n", c->username);
+	return 0;
+}
+
+// Handle one complete frame from a client. Returns -1 if the client was
+// dropped, 1 if the frame has to wait for chat still in the crypto pool.
+int handle_frame(int client_idx, int type, unsigned char *payload, int len) {
+	client_t *c = &clients[client_idx];
+	int is_signed = type == FRAME_SIGNED && c->sig_key != NULL;
+	int is_chat = c->kind == CONN_USER && (is_signed || type == (c->tls ? FRAME_TEXT : FRAME_CHAT));
+	int pooled = is_chat && (c->sig_key != NULL ? is_signed : !c->tls);
+	
+	if (!pooled && c->in_seq != c->in_done) {
+		c->stalled = 1;   // must not overtake them
+		return 1;
+	}
+	if (type == FRAME_PING) {
+		send_frame(c, FRAME_PONG, NULL, 0);
+		return 0;
+	}
+	if (type == FRAME_RELAY) {
+		if (c->kind == CONN_PEER_IN) relay_receive(c, payload, len);
+		return 0;
+	}
+	if (type == FRAME_PEER_HELLO) {
+		return peer_hello(client_idx, payload, len);
+	}
+	if (type >= FRAME_MUX_OPEN && type <= FRAME_MUX_WINDOW) {
+		if (type == FRAME_MUX_OPEN && c->kind == CONN_USER && c->username[0] == '\0' && !c->sess) {
+			if (!addr_listed(&c->addr, gateway_addrs, gateway_count)) {
+				fprintf(stderr, "Gateway frame from socket %d, not a -G address\n", c->fd);
+				remove_client(client_idx);
+				return -1;
+			}
+			gateway_start(c);   // sessions use the link's cipher, so not after FRAME_KEX
+		}
+		if (c->kind == CONN_GATEWAY) mux_handle(c, type, payload, len);
+		return 0;
+	}
+	if (type == FRAME_KEX && c->kind == CONN_USER) {
+		kex_handle(c, payload, len);
+		return 0;
+	}
+	if ((type == FRAME_MCAST || type == FRAME_NAK) && c->kind == CONN_USER && c->username[0] != '\0') {
+		if (mcast_fd == -1) {
+			const char *msg = "Multicast is not enabled on this server.\n";
+			send_frame(c, FRAME_NOTICE, (const unsigned char *)msg, strlen(msg));
+		} else if (type == FRAME_NAK) {
+			mcast_repair(c, payload, len);
+		} else {
+			unsigned char start[12];
+			if (!c->mcast) mcast_subscribe(c);
+			put_be(start, node_epoch, 4);
+			put_be(start + 4, mcast_seq, 8);
+			send_frame(c, FRAME_MCAST, start, sizeof start);
+			printf("%s takes room traffic from the multicast group\n", c->username);
+		}
+		return 0;
+	}
+	if (type == FRAME_RING && c->kind == CONN_USER && c->username[0] != '\0') {
+		if (len > 0 && c->ring == NULL) {   // otherwise a doorbell: waking us was the point
+			char name[RING_NAME];
+			const char *msg = "Ring attached.\n";
+			snprintf(name, sizeof name, "%.*s", len, (const char *)payload);
+			if (ring_attach(c, name) == -1) {
+				msg = "Could not attach the ring.\n";
+			} else {
+				printf("%s publishes through ring %s\n", c->username, name);
+			}
+			send_frame(c, FRAME_NOTICE, (const unsigned char *)msg, strlen(msg));
+		}
+		return 0;
+	}
+	if (type == FRAME_SIGKEY && c->kind == CONN_USER && c->username[0] != '\0') {
+		sig_register(c, payload, len);
+		return 0;
+	}
+	if (type == FRAME_ROSTER && c->kind == CONN_USER && c->username[0] != '\0') {
+		roster_subscribe(c->room, &c->roster);
+		return 0;
+	}
+	if (!is_chat) {
+		return 0;   // PONG only needs to count as traffic
+	}
+	if (c->sig_key != NULL && !is_signed) {
+		const char *msg = "Unsigned message dropped: this connection signs its messages.\n";
+		send_frame(c, FRAME_NOTICE, (const unsigned char *)msg, strlen(msg));
+		return 0;
+	}
 	
-	char buf[MAXDATASIZE];
-	int nbytes;
+	// A signed frame wraps what would otherwise be the whole chat payload
+	const unsigned char *sig = NULL;
+	int sig_len = 0;
+	if (is_signed) {
+		sig_len = len >= 2 ? (payload[0] << 8) | payload[1] : -1;
+		if (sig_len < 0 || sig_len > SIG_MAX || 2 + sig_len > len) {
+			return 0;
+		}
+		sig = payload + 2;
+		payload += 2 + sig_len;
+		len -= 2 + sig_len;
+	}
 	
-	char remoteIP[INET6_ADDRSTRLEN];
+	if (pooled) {
+		return crypto_recv(c, sig, sig_len, payload, len);   // handle_chat() runs when it comes back
+	}
 	
-	int yes=1;
-	int i, rv;
+	char text[FRAME_MAX + 1];   // TLS: the record layer already decrypted it
+	memcpy(text, payload, len);
+	text[len] = '\0';
+	return handle_chat(client_idx, text);
+}
+
+// One decrypted (and, for a signing client, verified) line of chat: the
+// username, a command, or a message for the room. Returns -1 if the client left.
+int handle_chat(int client_idx, char *text) {
+	client_t *c = &clients[client_idx];
+	int fd = c->fd;
 	
-	fd_set master;   // master file descriptor list
-	fd_set read_fds; // temp file descriptor list for select()
-	int fdmax;       // maximum file descriptor number
+	// If username not set, this is the username
+	if (c->username[0] == '\0') {
+	    strncpy(c->username, text, sizeof(c->username) - 1);
+	    c->username[sizeof(c->username) - 1] = '\0';
+	    if (c->username[0] == '\0') {
+	        return 0;
+	    }
+	    
+	    printf("User '%s' joined the chat\n", c->username);
+	    local_users++;
+	    c->last_chat = now_ms();
+	    timer_arm(&c->deadline, IDLE_TIMEOUT_MS);
+	    timer_arm(&c->keepalive, KEEPALIVE_MS);
+	    
+	    // Send acknowledgment
+	    char ack_plain[256];
+	    int ack_plain_len = snprintf(ack_plain, sizeof(ack_plain), 
+	        "Welcome, %s! You are now connected. There are %d user(s) online.", 
+	        c->username, total_users());
+	    send_encrypted(c, ack_plain, ack_plain_len);
+	    
+	    // Notify other users
+	    char join_msg[256];
+	    snprintf(join_msg, sizeof(join_msg), "%s has joined the chat\n", c->username);
+	    roster_note(c->room, c->username, ROSTER_ADD);
+	    presence_line(c->room, join_msg, fd);
+	} else if (strncmp(text, "/join ", 6) == 0) {
+	    join_room(c, text + 6);
+	} else if (strncmp(text, "/search", 7) == 0 && (text[7] == ' ' || text[7] == '\0')) {
+	    hist_query(client_idx, -1, c->room, text + 7);
+	} else if (strncmp(text, "quit", 4) == 0) {
+	    printf("%s is leaving the chat\n", c->username);
+	    
+	    // Notify other users
+	    char leave_msg[256];
+	    snprintf(leave_msg, sizeof(leave_msg), "%s has left the chat\n", c->username);
+	    presence_line(c->room, leave_msg, fd);   // the roster hears from remove_client()
+	    
+	    remove_client(client_idx);
+	    return -1;
+	} else {
+	    // Broadcast to all other clients
+	    c->last_chat = now_ms();
+	    printf("[%s]: %s\n", c->username, text);
+	    broadcast_message(c->room, text, fd, c->username);
+	}
+	return 0;
+}
+
+// Dispatch every complete frame in rbuf, up to one that has to wait for the
+// crypto pool. Returns the number handled, -1 if the client was dropped.
+int dispatch_frames(int client_idx) {
+	client_t *c = &clients[client_idx];
+	int off = 0, frames = 0;
 	
-	struct addrinfo hints, *ai, *p;
+	while (c->rlen - off >= FRAME_HDR) {
+		unsigned char *hdr = c->rbuf + off;
+		int len = (hdr[0] << 8) | hdr[1];
+		if (len > FRAME_MAX) {
+			fprintf(stderr, "Oversized frame from socket %d\n", c->fd);
+			remove_client(client_idx);
+			return -1;
+		}
+		if (c->rlen - off < FRAME_HDR + len) {
+			break;
+		}
+		int r = handle_frame(client_idx, hdr[2], hdr + FRAME_HDR, len);
+		if (r == -1) {
+			return -1;
+		}
+		if (r == 1) {
+			ev_read(c->fd, 0);   // the rest stays in rbuf; see crypto_deliver_in()
+			break;
+		}
+		frames++;
+		off += FRAME_HDR + len;
+	}
+	c->rlen -= off;
+	if (c->rlen == 0) {
+		rbuf_release(c);
+	} else if (off > 0) {
+		memmove(c->rbuf, c->rbuf + off, c->rlen);
+	}
+	if (c->local && c->rlen > 0 && !c->stalled) {
+		fprintf(stderr, "Partial frame in a packet from socket %d\n", c->fd);
+		remove_client(client_idx);
+		return -1;
+	}
+	return frames;
+}
+
+// Read what the socket has, then dispatch every complete frame in the buffer
+void handle_client_data(int client_idx) {
+	client_t *c = &clients[client_idx];
+	if (c->rbuf == NULL && (c->rbuf = buf_get()) == NULL) {
+		remove_client(client_idx);
+		return;
+	}
+	int nbytes = conn_recv(c, c->rbuf + c->rlen, RBUF_LEN - c->rlen);
 	
-	// Initialize client list
-	for (i = 0; i < MAX_CLIENTS; i++) {
-		clients[i].fd = -1;
+	if (nbytes <= 0) {
+		if (nbytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			rbuf_release(c);
+			return;
+		}
+		// Connection closed or error
+		if (nbytes < 0) {
+			perror("recv");
+		}
+		remove_client(client_idx);
+		return;
 	}
 	
-	FD_ZERO(&master);
-	FD_ZERO(&read_fds);
+	int64_t now = now_ms();
+	c->last_rx = now;
+	c->ping_out = 0;
+	if (tap_on) tap_segment(c, TAP_IN, c->rbuf + c->rlen, nbytes);
+	c->rlen += nbytes;
+	
+	int frames = dispatch_frames(client_idx);
+	if (frames == -1) {
+		return;
+	}
 	
+	if (c->kind != CONN_USER && c->kind != CONN_GATEWAY) {
+		return;   // peer links carry everyone's traffic; they are not rate limited
+	}
+	rate_charge(c, frames, nbytes, now);
+	int64_t wait = rate_wait(c, now);
+	if (wait > 0) {
+		throttle_client(c, wait);
+	}
+}
+
+// Send a buffer with a file descriptor attached (fd -1 = none)
+int send_with_fd(int sock, int fd, const void *data, size_t len) {
+	struct msghdr msg;
+	struct iovec iov = { (void *)data, len };
+	char ctl[CMSG_SPACE(sizeof(int))];
+
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	if (fd != -1) {
+		memset(ctl, 0, sizeof ctl);
+		msg.msg_control = ctl;
+		msg.msg_controllen = sizeof ctl;
+		struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+		cm->cmsg_level = SOL_SOCKET;
+		cm->cmsg_type = SCM_RIGHTS;
+		cm->cmsg_len = CMSG_LEN(sizeof(int));
+		memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+	}
+	return sendmsg(sock, &msg, MSG_NOSIGNAL) == (ssize_t)len ? 0 : -1;
+}
+
+// Receive exactly len bytes; returns the attached descriptor, or -1 if none came
+int recv_with_fd(int sock, void *data, size_t len, int *fd) {
+	struct msghdr msg;
+	struct iovec iov = { data, len };
+	char ctl[CMSG_SPACE(sizeof(int))];
+
+	memset(&msg, 0, sizeof msg);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctl;
+	msg.msg_controllen = sizeof ctl;
+	*fd = -1;
+	if (recvmsg(sock, &msg, MSG_WAITALL | MSG_CMSG_CLOEXEC) != (ssize_t)len) {
+		return -1;
+	}
+	struct cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+	if (cm != NULL && cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_RIGHTS) {
+		memcpy(fd, CMSG_DATA(cm), sizeof(int));
+	}
+	return 0;
+}
+
+int send_all(int sock, const void *data, size_t len) {
+	while (len > 0) {
+		ssize_t n = send(sock, data, len, MSG_NOSIGNAL);
+		if (n <= 0) return -1;
+		data = (const char *)data + n;
+		len -= n;
+	}
+	return 0;
+}
+
+// Control socket path for this port, so several nodes can share a host
+void handoff_path(struct sockaddr_un *sun) {
+	memset(sun, 0, sizeof *sun);
+	sun->sun_family = AF_UNIX;
+	snprintf(sun->sun_path, sizeof(sun->sun_path), HANDOFF_SOCK, listen_port);
+}
+
+// Open the control socket a successor process will connect to
+void handoff_listen(void) {
+	struct sockaddr_un sun;
+
+	handoff_path(&sun);
+	unlink(sun.sun_path);
+
+	handoff_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (handoff_fd == -1 || bind(handoff_fd, (struct sockaddr *)&sun, sizeof sun) == -1 ||
+			chmod(sun.sun_path, 0600) == -1 || listen(handoff_fd, 1) == -1) {
+		perror("handoff socket");
+		if (handoff_fd != -1) close(handoff_fd);
+		handoff_fd = -1;
+		return;
+	}
+	ev_read(handoff_fd, 1);
+}
+
+// Outbound peer links are not handed over (the successor redials them), nor
+// are TLS connections whose records OpenSSL still seals in this process:
+// only a socket with kTLS in both directions carries its crypto state along.
+int handoff_skip(client_t *c) {
+	return c->kind == CONN_PEER_OUT || (c->tls && !(c->ktls_tx && c->ktls_rx));
+}
+
+// A successor connected: hand it the listener and every live client, then
+// exit once it confirms. On any failure we keep serving as if nothing happened.
+void handoff_send(void) {
+	int ctl = accept4(handoff_fd, NULL, NULL, SOCK_CLOEXEC);
+	if (ctl == -1) return;
+
+	struct ucred cred;
+	socklen_t credlen = sizeof cred;
+	if (getsockopt(ctl, SOL_SOCKET, SO_PEERCRED, &cred, &credlen) == -1 || cred.uid != getuid()) {
+		fprintf(stderr, "handoff: rejecting peer with another uid\n");
+		close(ctl);
+		return;
+	}
+
+	printf("Handing off to pid %d...\n", (int)cred.pid);
+	ev_read(listener, 0);
+	if (local_listener != -1) ev_read(local_listener, 0);
+	if (tls_listener != -1) ev_read(tls_listener, 0);
+	crypto_drain();   // jobs in the pool are finished, not carried
+	hist_stop();      // messages logged and searches answered ...
+	crypto_drain();   // ... and those answers encrypted
+	reap_clients();
+
+	int nsend = 0, nkept = 0;
+	for (int i = 0; i < client_hwm; i++) {
+		if (clients[i].fd == -1) continue;
+		if (handoff_skip(&clients[i])) nkept++; else nsend++;
+	}
+	relay_flush();
+	roster_flush();
+	tap_stop();   // closed before the successor can open it and append
+	handoff_hdr_t hdr = { HANDOFF_MAGIC, HANDOFF_VERSION, sizeof(handoff_client_t), nsend,
+		node_epoch, relay_seq, mcast_seq, tls_listener != -1 };
+	hdr.ticket_gen = ticket_gen;
+	memcpy(hdr.ticket_key, ticket_key, sizeof ticket_key);
+	int ok = send_with_fd(ctl, listener, &hdr, sizeof hdr) == 0;
+	if (ok && tls_listener != -1) {
+		ok = send_with_fd(ctl, tls_listener, "T", 1) == 0;
+	}
+
+	for (int i = 0; ok && i < client_hwm; i++) {
+		client_t *c = &clients[i];
+		if (c->fd == -1 || handoff_skip(c)) continue;
+
+		flush_client(c);   // whatever the socket takes now need not travel
+		if (c->q != NULL && outq_fill(c, INT_MAX) == -1) {   // the rest travels in wire order
+			ok = 0;
+			break;
+		}
+		handoff_client_t rec;
+		memset(&rec, 0, sizeof rec);
+		rec.kind = c->kind;
+		memcpy(rec.username, c->username, sizeof rec.username);
+		memcpy(rec.room, c->room, sizeof rec.room);
+		memcpy(&rec.addr, &c->addr, sizeof c->addr);
+		rec.msgs = c->msgs;
+		rec.bytes = c->bytes;
+		rec.last_rx = c->last_rx;
+		rec.last_chat = c->last_chat;
+		rec.throttled = c->throttled;
+		rec.ping_out = c->ping_out;
+		rec.mcast = c->mcast;
+		rec.local = c->local;
+		if (c->ring_name != NULL) snprintf(rec.ring_name, sizeof rec.ring_name, "%s", c->ring_name);
+		rec.tls = c->tls;
+		rec.sess = c->sess;
+		if (c->keys != NULL) {
+			memcpy(rec.key_in, c->keys->key_in, sizeof rec.key_in);
+			memcpy(rec.key_out, c->keys->key_out, sizeof rec.key_out);
+		}
+		if (c->sig_key != NULL) {
+			unsigned char *der = rec.sig_key;
+			rec.sig_key_len = i2d_PUBKEY(c->sig_key, &der);
+			memcpy(rec.sig_nonce, c->sig_nonce, SIG_NONCE);
+			rec.sig_seq = c->sig_seq;
+		}
+		rec.roster = c->roster != ROSTER_OFF;
+		rec.rlen = c->rlen;
+		rec.olen = c->olen - c->ooff;
+		rec.nsessions = c->mux_count;
+
+		ok = send_with_fd(ctl, c->fd, &rec, sizeof rec) == 0 &&
+			send_all(ctl, c->rbuf, rec.rlen) == 0 &&
+			send_all(ctl, c->obuf + c->ooff, rec.olen) == 0;
+
+		for (int k = c->mux_head; ok && k != -1; k = sessions[k].next) {
+			session_t *ss = &sessions[k];
+			handoff_session_t srec;
+			memset(&srec, 0, sizeof srec);
+			srec.stream = ss->stream;
+			memcpy(srec.username, ss->username, sizeof srec.username);
+			memcpy(srec.room, ss->room, sizeof srec.room);
+			srec.window = ss->window;
+			srec.msgs = ss->msgs;
+			srec.last_chat = ss->last_chat;
+			srec.roster = ss->roster != ROSTER_OFF;
+			srec.qlen = ss->qlen - ss->qoff;
+			ok = send_all(ctl, &srec, sizeof srec) == 0 &&
+				send_all(ctl, ss->q + ss->qoff, srec.qlen) == 0;
+		}
+	}
+
+	char ack;
+	if (ok && recv(ctl, &ack, 1, MSG_WAITALL) == 1 && ack == 'K') {
+		printf("Handed off %d connection(s); exiting\n", nsend);
+		if (nkept > 0) {
+			printf("%d connection(s) could not be handed over and are closed\n", nkept);
+		}
+		exit(0);   // our copies of the sockets close, the successor's stay open
+	}
+
+	fprintf(stderr, "handoff: successor failed, resuming service\n");
+	close(ctl);
+	if (tap_path != NULL && tap_start(tap_path, 1) == -1) {
+		tap_path = NULL;
+	}
+	if (hist_path != NULL && hist_start(0) == -1) {
+		hist_path = NULL;
+	}
+	listener_update(now_ms());
+}
+
+// Re-create a client from a handoff record
+void restore_client(int fd, const handoff_client_t *rec, int64_t now) {
+	int peer = rec->kind == CONN_PEER_IN, gateway = rec->kind == CONN_GATEWAY;
+	int noaddr = peer || gateway || rec->addr.ss_family == AF_UNIX;
+	int slot = noaddr ? -1 : ip_acquire(&rec->addr, now);
+
+	if ((slot == -1 && !noaddr) || fd >= fd_limit || client_count >= MAX_CLIENTS) {
+		if (slot != -1) ip_release(slot);
+		close(fd);
+		return;
+	}
+	int idx = client_slot();
+	client_t *c = &clients[idx];
+	memset(c, 0, sizeof *c);
+	c->fd = fd;
+	c->kind = peer ? CONN_PEER_IN : gateway ? CONN_GATEWAY : CONN_USER;
+	c->peer = -1;
+	c->mux_head = -1;
+	memcpy(&c->addr, &rec->addr, sizeof c->addr);
+	memcpy(c->username, rec->username, sizeof c->username);
+	c->username[sizeof c->username - 1] = '\0';
+	if (gateway) snprintf(c->username, sizeof c->username, "gateway on socket %d", fd);
+	memcpy(c->room, rec->room, sizeof c->room);
+	c->room[sizeof c->room - 1] = '\0';
+	if (c->room[0] == '\0') strcpy(c->room, DEFAULT_ROOM);
+	c->ip_slot = slot;
+	c->msgs = rec->msgs;
+	c->bytes = rec->bytes;
+	c->last_rx = rec->last_rx;
+	c->last_chat = rec->last_chat;
+	c->ping_out = rec->ping_out;
+	if (rec->mcast && mcast_fd != -1) {
+		mcast_subscribe(c);   // without -m on the successor they fall back to TCP
+	}
+	c->local = rec->local;
+	c->tls = c->ktls_tx = c->ktls_rx = rec->tls != 0;
+	c->sess = rec->sess != 0;
+	if (c->sess && (c->keys = malloc(sizeof *c->keys)) == NULL) {
+		c->sess = 0;   // its chat will not decrypt; better than losing the rest
+	}
+	if (c->sess) {
+		memcpy(c->keys->key_in, rec->key_in, sizeof c->keys->key_in);
+		memcpy(c->keys->key_out, rec->key_out, sizeof c->keys->key_out);
+		if (mb_impl != MB_NONE) aes256_schedule(c->keys->key_out, c->keys->ks_out);
+	}
+	if (rec->sig_key_len > 0 && rec->sig_key_len <= SIG_KEY_MAX) {
+		const unsigned char *der = rec->sig_key;
+		c->sig_key = d2i_PUBKEY(NULL, &der, rec->sig_key_len);   // NULL if we cannot parse it: unsigned chat
+		memcpy(c->sig_nonce, rec->sig_nonce, SIG_NONCE);
+		c->sig_seq = rec->sig_seq;
+	}
+	if (rec->ring_name[0] != '\0') {
+		char name[RING_NAME];
+		memcpy(name, rec->ring_name, sizeof name);
+		name[sizeof name - 1] = '\0';
+		ring_attach(c, name);   // needs fd set for the SO_PEERCRED check
+	}
+	timer_init(&c->deadline, on_deadline);
+	timer_init(&c->keepalive, on_keepalive);
+	timer_init(&c->wake, on_wake);
+	fd_client[fd] = idx;
+	client_count++;
+
+	if (c->username[0] == '\0') {
+		timer_arm(&c->deadline, HANDSHAKE_TIMEOUT_MS);
+	} else {
+		if (c->kind == CONN_USER) {
+			local_users++;
+			timer_arm(&c->deadline, IDLE_TIMEOUT_MS - (now - c->last_chat));
+			if (rec->roster) roster_subscribe(c->room, &c->roster);
+		}
+		timer_arm(&c->keepalive, c->ping_out ? PONG_TIMEOUT_MS : KEEPALIVE_MS - (now - c->last_rx));
+	}
+	if (rec->throttled) {
+		throttle_client(c, 1);   // on_wake re-checks the buckets
+	} else {
+		ev_read(fd, 1);
+	}
+}
+
+// Take over from a running server: receive its listener and clients
+int handoff_receive(void) {
+	struct sockaddr_un sun;
+	int ctl = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	handoff_path(&sun);
+	if (ctl == -1 || connect(ctl, (struct sockaddr *)&sun, sizeof sun) == -1) {
+		perror("handoff: connect");
+		return -1;
+	}
+
+	handoff_hdr_t hdr;
+	int fd;
+	if (recv_with_fd(ctl, &hdr, sizeof hdr, &listener) == -1 || listener == -1 ||
+			hdr.magic != HANDOFF_MAGIC || hdr.version != HANDOFF_VERSION ||
+			hdr.record_size != sizeof(handoff_client_t)) {
+		fprintf(stderr, "handoff: incompatible or missing state\n");
+		close(ctl);   // the old server resumes
+		return -1;
+	}
+
+	if (hdr.tls_listener) {
+		char tag;
+		if (recv_with_fd(ctl, &tag, 1, &tls_listener) == -1 || tls_listener == -1) {
+			fprintf(stderr, "handoff: truncated state\n");
+			close(ctl);
+			return -1;
+		}
+		if (tls_ctx == NULL) {   // started without -c: TLS clients get refused from now on
+			close(tls_listener);
+			tls_listener = -1;
+		}
+	}
+
+	ticket_gen = hdr.ticket_gen;
+	memcpy(ticket_key, hdr.ticket_key, sizeof ticket_key);
+	node_epoch = hdr.node_epoch;
+	relay_seq = hdr.relay_seq;
+	mcast_seq = hdr.mcast_seq;   // the history itself is not carried; older NAKs go unrepaired
+
+	int64_t now = now_ms();
+	for (int n = 0; n < hdr.nclients; n++) {
+		handoff_client_t rec;
+		if (recv_with_fd(ctl, &rec, sizeof rec, &fd) == -1 || fd == -1 ||
+				rec.rlen < 0 || rec.rlen > RBUF_LEN || rec.olen < 0 || rec.olen > OUTQ_MAX) {
+			fprintf(stderr, "handoff: truncated state\n");
+			exit(1);   // the old server still holds every socket and resumes
+		}
+
+		unsigned char *out = malloc(rec.olen ? rec.olen : 1);
+		unsigned char in[RBUF_LEN];
+		if (out == NULL || (rec.rlen && recv(ctl, in, rec.rlen, MSG_WAITALL) != rec.rlen) ||
+				(rec.olen && recv(ctl, out, rec.olen, MSG_WAITALL) != rec.olen)) {
+			fprintf(stderr, "handoff: truncated state\n");
+			exit(1);
+		}
+
+		restore_client(fd, &rec, now);
+		client_t *c = NULL;
+		if (fd_client[fd] != -1 && clients[fd_client[fd]].fd == fd) {
+			c = &clients[fd_client[fd]];
+			if (rec.rlen > 0 && (c->rbuf = buf_get()) != NULL) {
+				memcpy(c->rbuf, in, rec.rlen);
+				c->rlen = rec.rlen;
+			}
+			if (rec.olen) client_write(c, out, rec.olen);
+		}
+		free(out);
+
+		for (int k = 0; k < rec.nsessions; k++) {
+			handoff_session_t srec;
+			unsigned char held[SESSION_QUEUE_MAX];
+			if (recv(ctl, &srec, sizeof srec, MSG_WAITALL) != sizeof srec || srec.qlen < 0 ||
+					srec.qlen > SESSION_QUEUE_MAX ||
+					(srec.qlen && recv(ctl, held, srec.qlen, MSG_WAITALL) != srec.qlen)) {
+				fprintf(stderr, "handoff: truncated state\n");
+				exit(1);
+			}
+			session_t *ss = c != NULL && c->kind == CONN_GATEWAY ? session_open(c, srec.stream, 0) : NULL;
+			if (ss == NULL) continue;
+			memcpy(ss->username, srec.username, sizeof ss->username);
+			ss->username[sizeof ss->username - 1] = '\0';
+			memcpy(ss->room, srec.room, sizeof ss->room);
+			ss->room[sizeof ss->room - 1] = '\0';
+			if (ss->room[0] == '\0') strcpy(ss->room, DEFAULT_ROOM);
+			ss->window = srec.window;
+			ss->msgs = srec.msgs;
+			ss->last_chat = srec.last_chat;
+			if (ss->username[0] != '\0') local_users++;
+			if (srec.roster && ss->username[0] != '\0') roster_subscribe(ss->room, &ss->roster);
+			for (int off = 0; off + 3 <= srec.qlen; ) {
+				int len = (held[off] << 8) | held[off + 1];
+				if (off + 3 + len > srec.qlen) break;
+				session_hold(ss, held[off + 2], held + off + 3, len);
+				off += 3 + len;
+			}
+		}
+	}
+
+	if (send(ctl, "K", 1, MSG_NOSIGNAL) != 1) {
+		exit(1);
+	}
+	close(ctl);
+	printf("Took over %d connection(s)\n", client_count);
+	return 0;
+}
+
+// Bind a TCP listener on port
+int open_listener(const char *port) {
+	struct addrinfo hints, *ai, *p;
+	int yes = 1, rv, listener;
+
 	// Get us a socket and bind it
 	memset(&hints, 0, sizeof hints);
 	hints.ai_family = AF_UNSPEC;
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_flags = AI_PASSIVE;
 	// Get address info
-	if ((rv = getaddrinfo(NULL, PORT, &hints, &ai)) != 0) {
+	if ((rv = getaddrinfo(NULL, port, &hints, &ai)) != 0) {
 		fprintf(stderr, "selectserver: %s\n", gai_strerror(rv));
 		exit(1);
 	}
 	// Bind to the first available address
 	for(p = ai; p != NULL; p = p->ai_next) {
-		listener = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+		listener = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, p->ai_protocol);
 		if (listener < 0) { 
 			continue;
 		}
@@ -311,130 +6097,415 @@ int main(void)
 		exit(3);
 	}
 	
-	// Add the listener to the master set
-	FD_SET(listener, &master);
-	fdmax = listener;
+	if (DEFER_ACCEPT_SECS > 0) {
+		int secs = DEFER_ACCEPT_SECS;
+		setsockopt(listener, IPPROTO_TCP, TCP_DEFER_ACCEPT, &secs, sizeof secs);
+	}
+	return listener;
+}
+
+// Listen for same-host clients on LOCAL_SOCK. A successor simply binds a
+// fresh socket at the same path; connected local clients are handed over
+// like any other.
+void open_local_listener(void) {
+	struct sockaddr_un sun;
+
+	memset(&sun, 0, sizeof sun);
+	sun.sun_family = AF_UNIX;
+	snprintf(sun.sun_path, sizeof(sun.sun_path), LOCAL_SOCK, listen_port);
+	unlink(sun.sun_path);
+
+	local_listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (local_listener == -1 || bind(local_listener, (struct sockaddr *)&sun, sizeof sun) == -1 ||
+			chmod(sun.sun_path, 0660) == -1 || listen(local_listener, BACKLOG) == -1) {
+		perror("local socket");
+		if (local_listener != -1) close(local_listener);
+		local_listener = -1;
+		return;
+	}
+	printf("Local clients: %s\n", sun.sun_path);
+}
+
+// TLS 1.3 only, no session tickets (a ticket sent after the handshake would be
+// a record OpenSSL has to write, and a resumed session is no cheaper here).
+void tls_init(const char *cert, const char *key) {
+	tls_ctx = SSL_CTX_new(TLS_server_method());
+	if (tls_ctx == NULL ||
+			!SSL_CTX_set_min_proto_version(tls_ctx, TLS1_3_VERSION) ||
+			SSL_CTX_use_certificate_chain_file(tls_ctx, cert) != 1 ||
+			SSL_CTX_use_PrivateKey_file(tls_ctx, key, SSL_FILETYPE_PEM) != 1) {
+		fprintf(stderr, "TLS setup failed (%s, %s)\n", cert, key);
+		ERR_print_errors_fp(stderr);
+		exit(1);
+	}
+	SSL_CTX_set_options(tls_ctx, SSL_OP_ENABLE_KTLS | SSL_OP_IGNORE_UNEXPECTED_EOF);
+	SSL_CTX_set_num_tickets(tls_ctx, 0);
+	// RELEASE_BUFFERS: an idle TLS connection gives its record buffers back too
+	SSL_CTX_set_mode(tls_ctx, SSL_MODE_ENABLE_PARTIAL_WRITE | SSL_MODE_ACCEPT_MOVING_WRITE_BUFFER |
+		SSL_MODE_RELEASE_BUFFERS);
+}
+
+// Set up the multicast publisher from "group:port[@interface address]"
+void mcast_open(const char *spec) {
+	char group[64], ifaddr[64] = "0.0.0.0";
+	int port, ttl = MCAST_TTL;
+	unsigned char loop = 1;   // receivers on this host (and loopback tests) see the group
+	struct in_addr iface;
+
+	if (sscanf(spec, "%63[^:]:%d@%63s", group, &port, ifaddr) < 2 ||
+			inet_pton(AF_INET, ifaddr, &iface) != 1) {
+		fprintf(stderr, "bad multicast group: %s (want group:port[@ifaddr])\n", spec);
+		exit(1);
+	}
+	memset(&mcast_group, 0, sizeof mcast_group);
+	mcast_group.sin_family = AF_INET;
+	mcast_group.sin_port = htons(port);
+	if (inet_pton(AF_INET, group, &mcast_group.sin_addr) != 1 ||
+			!IN_MULTICAST(ntohl(mcast_group.sin_addr.s_addr))) {
+		fprintf(stderr, "%s is not an IPv4 multicast address\n", group);
+		exit(1);
+	}
+
+	mcast_fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (mcast_fd == -1 ||
+			setsockopt(mcast_fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof ttl) == -1 ||
+			setsockopt(mcast_fd, IPPROTO_IP, IP_MULTICAST_LOOP, &loop, sizeof loop) == -1 ||
+			setsockopt(mcast_fd, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof iface) == -1) {
+		perror("multicast socket");
+		exit(1);
+	}
+	timer_init(&mcast_heartbeat, on_mcast_heartbeat);
+}
+
+int main(int argc, char *argv[]) 
+{ 
+	int i, opt;
+	int takeover = 0;
+	const char *mcast_spec = NULL;
+	const char *tls_cert = NULL, *tls_key = NULL;
+	int ring_more = 0, crypto_workers_opt = -1;
+	struct epoll_event events[EV_BATCH];
+	struct rlimit rl;
+	
+	int busy_cpu = -1;
+	
+	while ((opt = getopt(argc, argv, "up:n:P:m:c:k:T:V:w:A:B:HW:F:G:L:")) != -1) {
+		switch (opt) {
+		case 'u':   // upgrade: take over from the running server
+			takeover = 1;
+			break;
+		case 'p':
+			listen_port = optarg;
+			break;
+		case 'n':   // node id, unique within the federation
+			node_id = atoi(optarg);
+			break;
+		case 'P': { // peer node, host:port (repeatable)
+			char *colon = strrchr(optarg, ':');
+			if (colon == NULL || peer_count == MAX_PEERS) {
+				fprintf(stderr, "bad or too many peers: %s\n", optarg);
+				exit(1);
+			}
+			peer_t *pr = &peers[peer_count++];
+			snprintf(pr->host, sizeof pr->host, "%.*s", (int)(colon - optarg), optarg);
+			snprintf(pr->port, sizeof pr->port, "%s", colon + 1);
+			if (addr_list_add(pr->host, peer_addrs, &peer_addr_count, MAX_PEERS * 4) == -1) {
+				fprintf(stderr, "cannot resolve peer %s; it will not be able to link in\n", pr->host);
+			}
+			break;
+		}
+		case 'm':   // multicast fan-out, group:port[@ifaddr]
+			mcast_spec = optarg;
+			break;
+		case 'c':   // TLS certificate (PEM); the key may be in the same file
+			tls_cert = optarg;
+			break;
+		case 'k':
+			tls_key = optarg;
+			break;
+		case 'T':
+			tls_port = optarg;
+			break;
+		case 'V':   // crypto worker threads; 0 keeps all crypto on the loop thread
+			crypto_workers_opt = atoi(optarg);
+			break;
+		case 'w':   // wire trace, pcapng
+			tap_path = optarg;
+			break;
+		case 'A':   // accepts/sec; 0 = no connection rate limits at all
+			accept_rate = atoi(optarg);
+			accept_burst = accept_rate * 2;
+			break;
+		case 'B':   // busy poll, loop pinned to the first CPU of the list
+			if ((busy_cpu = busy_cpus(optarg)) == -1) {
+				fprintf(stderr, "bad CPU list: %s\n", optarg);
+				exit(1);
+			}
+			busy_poll = 1;
+			break;
+		case 'H':   // wakeup-to-send latency histogram, printed on SIGUSR1
+			lat_on = 1;
+			break;
+		case 'F':   // banned terms and links, reloaded on SIGHUP
+			filter_path = optarg;
+			break;
+		case 'G':   // address allowed to open gateway links (repeatable)
+			if (addr_list_add(optarg, gateway_addrs, &gateway_count, MAX_GATEWAYS) == -1) {
+				fprintf(stderr, "bad gateway address: %s\n", optarg);
+				exit(1);
+			}
+			break;
+		case 'L':   // message history, searched with /search
+			hist_path = optarg;
+			break;
+		case 'W': { // room=weight, the room's share of a backlogged connection (repeatable)
+			char *eq = strchr(optarg, '=');
+			int w = eq != NULL ? atoi(eq + 1) : 0;
+			if (eq == NULL || eq - optarg >= ROOM_LEN || w < 1 || w > 64 ||
+					room_weight_count == MAX_ROOM_WEIGHTS) {
+				fprintf(stderr, "bad or too many room weights: %s\n", optarg);
+				exit(1);
+			}
+			snprintf(room_weights[room_weight_count].room, ROOM_LEN, "%.*s", (int)(eq - optarg), optarg);
+			room_weights[room_weight_count++].weight = w;
+			break;
+		}
+		default:
+			fprintf(stderr, "usage: server [-u] [-p port] [-n node-id -P host:port ...] "
+				"[-m group:port[@ifaddr]] [-c cert.pem [-k key.pem] [-T tls-port]] [-V crypto-threads] [-w trace.pcapng] "
+				"[-A accepts/sec] [-B cpu-list] [-H] [-W room=weight ...] [-F filter-list] [-G gateway-host ...] [-L history-log]\n");
+			exit(1);
+		}
+	}
+	if (peer_count > 0 && (node_id <= 0 || node_id >= MAX_NODES)) {
+		fprintf(stderr, "peers need a node id between 1 and %d (-n)\n", MAX_NODES - 1);
+		exit(1);
+	}
+	
+	// Descriptors: as many as the hard limit lets us have, up to what
+	// MAX_CLIENTS needs. The client table itself is left untouched here; a
+	// slot's page is only faulted in when a connection first uses it.
+	if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+		rlim_t want = MAX_CLIENTS + FD_RESERVE;
+		rl.rlim_cur = rl.rlim_max < want ? rl.rlim_max : want;
+		setrlimit(RLIMIT_NOFILE, &rl);
+		getrlimit(RLIMIT_NOFILE, &rl);
+		fd_limit = rl.rlim_cur < want ? (int)rl.rlim_cur : (int)want;
+	} else {
+		fd_limit = FD_SETSIZE;
+	}
+	fd_client = malloc(fd_limit * sizeof *fd_client);
+	fd_events = calloc(fd_limit, sizeof *fd_events);
+	if ((epfd = epoll_create1(EPOLL_CLOEXEC)) == -1 || fd_client == NULL || fd_events == NULL) {
+		perror("epoll");
+		exit(1);
+	}
+	for (i = 0; i < fd_limit; i++) {
+		fd_client[i] = -1;
+	}
+	for (i = MAX_SESSIONS - 1; i >= 0; i--) {
+		sessions[i].gw = -1;
+		sessions[i].next = session_free;
+		session_free = i;
+	}
+	for (i = 0; i < SESSION_HASH; i++) {
+		session_hash[i] = -1;
+	}
+	
+	wheel_init(now_ms());
+	timer_init(&accept_wake, on_accept_wake);
+	timer_init(&roster_tick, on_roster_tick);
+	bucket_init(&accept_bucket, accept_burst, now_ms());
+	if (mcast_spec != NULL) {
+		mcast_open(mcast_spec);
+	}
+	if (tls_cert != NULL) {
+		tls_init(tls_cert, tls_key ? tls_key : tls_cert);
+	}
+	mb_init();
+	crypto_start(crypto_workers_opt);
+	
+	RAND_bytes(ticket_key[0], sizeof ticket_key[0]);
+	RAND_bytes(ticket_key[1], sizeof ticket_key[1]);
+	timer_init(&ticket_rotate, on_ticket_rotate);
+	timer_arm(&ticket_rotate, TICKET_ROTATE_MS);
+	
+	if (takeover) {
+		if (handoff_receive() == -1) {
+			exit(2);
+		}
+	} else {
+		listener = open_listener(listen_port);
+		node_epoch = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+	}
+	// After a handoff the old server has closed the trace; we append to it
+	if (tap_path != NULL && tap_start(tap_path, takeover) == -1) {
+		exit(1);
+	}
+	// Likewise the history log: the old server stopped writing it before the handoff
+	if (hist_path != NULL && hist_start(1) == -1) {
+		exit(1);
+	}
+	
+	if (tls_ctx != NULL && tls_listener == -1) {
+		tls_listener = open_listener(tls_port);
+	}
+	
+	// Dial the other nodes; links that fail keep retrying with backoff
+	for (i = 0; i < peer_count; i++) {
+		peers[i].conn = -1;
+		peers[i].backoff = PEER_RETRY_MS;
+		timer_init(&peers[i].retry, on_peer_retry);
+		peer_connect(i);
+	}
+	
+	// Register the listeners, and accept successors
+	open_local_listener();
+	listener_update(now_ms());
+	handoff_listen();
 	
 	printf("=== Chat Server Started ===\n");
-	printf("Listening on port %s\n", PORT);
+	printf("Listening on port %s\n", listen_port);
+	if (peer_count > 0) {
+		printf("Node %d, %d peer(s)\n", node_id, peer_count);
+	}
+	if (mcast_fd != -1) {
+		printf("Multicast fan-out on %s\n", mcast_spec);
+	}
+	if (tls_listener != -1) {
+		printf("TLS on port %s\n", tls_port);
+	}
+	if (crypto_threads > 0) {
+		printf("%d crypto worker thread(s)\n", crypto_threads);
+	}
+	if (mb_impl != MB_NONE) {
+		printf("Multi-buffer AES: %s\n", mb_impl == MB_VAES ? "VAES, 16 streams" : "AES-NI, 8 streams");
+	}
+	if (tap_on) {
+		printf("Wire trace to %s\n", tap_path);
+	}
+	if (busy_poll) {
+		busy_start(busy_cpu);
+		printf("Busy polling, loop pinned to CPU %d\n", busy_cpu);
+	}
+	if (lat_on) {
+		struct sigaction sa;
+		memset(&sa, 0, sizeof sa);
+		sa.sa_handler = on_sigusr1;   // no SA_RESTART: a sleeping loop wakes up to report
+		sigaction(SIGUSR1, &sa, NULL);
+		printf("Latency histogram on SIGUSR1 (kill -USR1 %d)\n", (int)getpid());
+	}
+	if (filter_path != NULL) {
+		filter = filter_load(filter_path);
+		if (filter == NULL) exit(1);
+		printf("Content filter: %d term(s) from %s, %d states x %d classes\n",
+			filter->terms, filter_path, filter->nstates, filter->nclass);
+		struct sigaction sa;
+		memset(&sa, 0, sizeof sa);
+		sa.sa_handler = on_sighup;
+		sigaction(SIGHUP, &sa, NULL);
+	}
 	printf("Waiting for connections...\n\n");
 	
 	// Main loop
 	while(1) {
-		read_fds = master;
-		if (select(fdmax+1, &read_fds, NULL, NULL, NULL) == -1) {
-			perror("select");
+		if (lat_report_due) {
+			lat_report();
+		}
+		if (filter_reload_due) {
+			// A list that does not load leaves the old one in place
+			filter_reload_due = 0;
+			filter_t *f = filter_load(filter_path);
+			if (f != NULL) {
+				filter_free(filter);
+				filter = f;
+				printf("Content filter reloaded: %d term(s), %d states x %d classes\n",
+					f->terms, f->nstates, f->nclass);
+			} else {
+				fprintf(stderr, "Content filter: keeping the previous list\n");
+			}
+		}
+		
+		// Sleep until the next timer is due (or forever if none are armed).
+		// Busy polling never sleeps; rings are drained every pass anyway.
+		int64_t wait = wheel_next_ms(now_ms());
+		if (busy_poll || ring_more || (ring_count > 0 && ring_sleep(1))) {
+			wait = 0;   // a producer's ring has messages waiting
+		}
+		int nev = epoll_wait(epfd, events, EV_BATCH, wait > INT_MAX ? INT_MAX : (int)wait);
+		if (nev == -1) {
+			if (errno == EINTR) continue;
+			perror("epoll_wait");
 			exit(4);
 		}
+		int64_t pass_wake = lat_on && nev > 0 ? now_ns() : 0;
+		if (ring_count > 0 && !busy_poll) {
+			ring_sleep(0);
+		}
 		
-		// Run through the existing connections looking for data to read
-		for(i = 0; i <= fdmax; i++) {
-			if (FD_ISSET(i, &read_fds)) {
-				if (i == listener) {
-					// Handle new connections
-					addrlen = sizeof remoteaddr;
-					newfd = accept(listener, (struct sockaddr *)&remoteaddr, &addrlen);
-					
-					if (newfd == -1) {
-						perror("accept");
-					} else {
-						if (add_client(newfd, &remoteaddr) == -1) {
-							char *msg = "Server is full. Please try again later.\n";
-							send(newfd, msg, strlen(msg), 0);
-							close(newfd);
-						} else {
-							FD_SET(newfd, &master);
-							if (newfd > fdmax) {
-								fdmax = newfd;
-							}
-							
-							inet_ntop(remoteaddr.ss_family,
-								get_in_addr((struct sockaddr*)&remoteaddr),
-								remoteIP, INET6_ADDRSTRLEN);
-							
-							printf("New connection from %s on socket %d\n", remoteIP, newfd);
-							
-							// Send welcome message
-							char welcome[] = "=== Connected to Chat Server ===\nType your messages and press Enter. Type 'quit' to exit.\n";
-							send(newfd, welcome, strlen(welcome), 0);
-						}
-					}
-				} else {
-					// Handle data from a client
-					int client_idx = find_client(i);
-					if (client_idx == -1) continue;
-					
-					if ((nbytes = recv(i, buf, sizeof buf, 0)) <= 0) {
-						// Connection closed or error
-						if (nbytes == 0) {
-							printf("%s disconnected\n", 
-								clients[client_idx].username[0] ? clients[client_idx].username : "Unknown");
-						} else {
-							perror("recv");
-						}
-						close(i);
-						FD_CLR(i, &master);
-						remove_client(client_idx);
-					} else {
-						// We got some data from a client
-						buf[nbytes] = '\0';
-						
-						unsigned char decrypted[MAXDATASIZE];
-						int decrypted_len = aes_decrypt((unsigned char*)buf, nbytes, decrypted);
-						if (decrypted_len < 0) {
-						    fprintf(stderr, "Decryption failed\n");
-						    continue;
-						}
-						decrypted[decrypted_len] = '\0';
-						
-						// If username not set, this is the username
-						if (clients[client_idx].username[0] == '\0') {
-						    strncpy(clients[client_idx].username, (char*)decrypted, 
-								    sizeof(clients[client_idx].username) - 1);
-						    clients[client_idx].username[sizeof(clients[client_idx].username) - 1] = '\0';
-						    
-						    printf("User '%s' joined the chat\n", clients[client_idx].username);
-						    
-						    // Send acknowledgment
-						    char ack_plain[256];
-						    unsigned char ack_cipher[256 + 16];
-						    int ack_plain_len = snprintf(ack_plain, sizeof(ack_plain), 
-						        "Welcome, %s! You are now connected. There are %d user(s) online.", 
-						        clients[client_idx].username, client_count);
-						    
-						    int ack_cipher_len = aes_encrypt((unsigned char*)ack_plain, ack_plain_len, ack_cipher);
-						    if (ack_cipher_len > 0) {
-						        send(i, ack_cipher, ack_cipher_len, 0);
-						    }
-						    
-						    // Notify other users
-						    char join_msg[256];
-						    snprintf(join_msg, sizeof(join_msg), "%s has joined the chat\n", 
-						             clients[client_idx].username);
-						    broadcast_message(join_msg, i, "Server");
-						} else {
-						    // Regular message - check for quit
-						    if (strncmp((char*)decrypted, "quit", 4) == 0) {
-						        printf("%s is leaving the chat\n", clients[client_idx].username);
-						        
-						        // Notify other users
-						        char leave_msg[256];
-						        snprintf(leave_msg, sizeof(leave_msg), "%s has left the chat\n", clients[client_idx].username);
-						        broadcast_message(leave_msg, i, "Server");
-						        
-						        close(i);
-						        FD_CLR(i, &master);
-						        remove_client(client_idx);
-						    } else {
-						        // Broadcast to all other clients
-						        printf("[%s]: %s", clients[client_idx].username, decrypted);
-						        broadcast_message((char*)decrypted, i, clients[client_idx].username);
-						    }
-						}
-					}
+		// Only the descriptors that are ready, however many are connected.
+		// An error or hangup counts as readable: the read finds out which.
+		for (int e = 0; e < nev; e++) {
+			i = events[e].data.fd;
+			int readable = (events[e].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) != 0;
+			int writable = (events[e].events & (EPOLLOUT | EPOLLHUP | EPOLLERR)) != 0;
+			if (i == listener || i == local_listener || i == tls_listener) {
+				if (readable) {
+					accept_connections(i);
+				}
+				continue;
+			}
+			if (i == handoff_fd) {
+				if (readable) {
+					handoff_send();
+				}
+				continue;
+			}
+			if (i == crypto_efd) {
+				if (readable) {
+					crypto_complete();
+				}
+				continue;
+			}
+			if (i == hist_efd) {
+				if (readable) {
+					hist_complete();
 				}
+				continue;
+			}
+			
+			int client_idx = find_client(i);
+			if (client_idx == -1 || clients[client_idx].dead) continue;
+			
+			if (clients[client_idx].handshaking) {
+				tls_handshake(&clients[client_idx]);
+				continue;
+			}
+			if (writable && (fd_events[i] & EV_OUT)) {
+				flush_client(&clients[client_idx]);
+			}
+			if (readable && (fd_events[i] & EV_IN) && !clients[client_idx].dead) {
+				do {
+					lat_wake = pass_wake;
+					handle_client_data(client_idx);
+				} while (clients[client_idx].fd == i && !clients[client_idx].stalled &&
+					tls_buffered(&clients[client_idx]));
+				lat_wake = 0;
 			}
 		}
+		
+		// Messages local producers left in their rings
+		ring_more = ring_count > 0 && ring_poll();
+		
+		// Deadlines, keepalives and throttle expiry
+		wheel_advance(now_ms());
+		reap_clients();
+		
+		// One batch per pass to every peer
+		relay_flush();
+		
+		// Whatever crypto this pass queued
+		crypto_flush();
 	}
 	
 	return 0;
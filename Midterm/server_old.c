@@ -1,4 +1,9 @@
 /* ** server.c -- a stream socket server demo 
+**
+** By default every connection gets its own forked child. With -w N the
+** server preforks N worker processes instead; each serves many connections
+** from its own SO_REUSEPORT listener, and chat lines reach the users of every
+** worker through a shared-memory ring.
 */ 
 
 #include <stdio.h> 
@@ -12,13 +17,25 @@
 #include <netdb.h> 
 #include <arpa/inet.h> 
 #include <sys/wait.h> 
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/select.h>
 #include <signal.h> 
 #include <time.h> 
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdatomic.h>
 
 #define PORT "3490" // the port users will be connecting to 
 
 #define BACKLOG 10	 // how many pending connections queue will hold 
 
+// Prefork mode (-w N)
+#define MAX_WORKERS   64
+#define WORKER_CONNS  256    // connections per worker; stays below FD_SETSIZE
+#define RING_SLOTS    1024   // chat lines kept for slow workers (power of two)
+#define RING_TEXT     1200   // "[timestamp] username: " plus a 1024-byte message
+
 // Encryption key - must match client
 #define ENCRYPTION_KEY "NetworksCS522Key"
 
@@ -58,25 +75,47 @@ void *get_in_addr(struct sockaddr *sa)
 	return &(((struct sockaddr_in6*)sa)->sin6_addr); 
 } 
 
-int main(void) 
-{ 
-	int sockfd, new_fd;  // listen on sock_fd, new connection on new_fd 
+// Shared by the master and every worker; mapped before the fork. A writer
+// claims a slot number with fetch_add and publishes it by storing seq = n + 1
+// once the text is in, so readers can tell a slot that is not written yet
+// (seq <= n) from one that has been lapped (seq > n + 1).
+typedef struct {
+	_Atomic uint64_t head;   // next message number
+	struct {
+		_Atomic uint64_t seq;
+		int worker;          // who published it, and for which socket:
+		int fd;              // the sender does not get its own line back
+		int len;
+		char text[RING_TEXT];
+	} slot[RING_SLOTS];
+} bcast_ring_t;
+
+typedef struct {
+	int fd;                  // -1 = free
+	char username[64];       // empty until the client has sent it
+	char addr[INET6_ADDRSTRLEN];
+} conn_t;
+
+bcast_ring_t *ring;
+int worker_efd[MAX_WORKERS];   // written to wake a worker when the ring moves
+int nworkers = 0;
+int shared_listener = -1;      // only when SO_REUSEPORT is not available
+const char *port = PORT;
+
+// Bind a listening socket to the port; reuseport lets several processes
+// each bind their own
+int open_listener(int reuseport) {
 	struct addrinfo hints, *servinfo, *p; 
-	struct sockaddr_storage their_addr; // connector's address information 
-	socklen_t sin_size; 
-	struct sigaction sa; 
-	int yes=1; 
-	char s[INET6_ADDRSTRLEN]; 
-	int rv; 
+	int sockfd = -1, yes = 1, rv;
 
 	memset(&hints, 0, sizeof hints); 
 	hints.ai_family = AF_UNSPEC; 
 	hints.ai_socktype = SOCK_STREAM; 
 	hints.ai_flags = AI_PASSIVE; // use my IP 
 
-	if ((rv = getaddrinfo(NULL, PORT, &hints, &servinfo)) != 0) { 
+	if ((rv = getaddrinfo(NULL, port, &hints, &servinfo)) != 0) { 
 		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv)); 
-		return 1; 
+		exit(1); 
 	} 
 
 	// loop through all the results and bind to the first we can 
@@ -92,6 +131,11 @@ int main(void)
 			perror("setsockopt"); 
 			exit(1); 
 		} 
+		if (reuseport && setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(int)) == -1) {
+			close(sockfd);
+			freeaddrinfo(servinfo);
+			return -1;
+		}
 
 		if (bind(sockfd, p->ai_addr, p->ai_addrlen) == -1) { 
 			close(sockfd); 
@@ -113,6 +157,283 @@ int main(void)
 		perror("listen"); 
 		exit(1); 
 	} 
+	return sockfd;
+}
+
+// Put a chat line in the ring and wake every worker, ourselves included
+void ring_publish(int worker, int fd, const char *text, int len) {
+	uint64_t n = atomic_fetch_add(&ring->head, 1);
+	uint64_t one = 1;
+
+	if (len > RING_TEXT) len = RING_TEXT;
+	atomic_store_explicit(&ring->slot[n % RING_SLOTS].seq, 0, memory_order_relaxed);   // being rewritten
+	atomic_thread_fence(memory_order_release);   // readers see seq 0 before any new payload
+	ring->slot[n % RING_SLOTS].worker = worker;
+	ring->slot[n % RING_SLOTS].fd = fd;
+	ring->slot[n % RING_SLOTS].len = len;
+	memcpy(ring->slot[n % RING_SLOTS].text, text, len);
+	atomic_store_explicit(&ring->slot[n % RING_SLOTS].seq, n + 1, memory_order_release);
+	for (int w = 0; w < nworkers; w++) {
+		if (write(worker_efd[w], &one, sizeof one) == -1 && errno != EAGAIN) {
+			perror("ring: eventfd");
+		}
+	}
+}
+
+// Send everything published since *cursor to this worker's users. A worker
+// that fell a whole ring behind skips what it lost.
+void ring_deliver(int worker, uint64_t *cursor, conn_t *conns) {
+	char text[RING_TEXT];
+
+	while (*cursor < atomic_load(&ring->head)) {
+		uint64_t n = *cursor;
+		uint64_t seq = atomic_load_explicit(&ring->slot[n % RING_SLOTS].seq, memory_order_acquire);
+		if (seq <= n) {
+			break;   // claimed but not written yet; its writer wakes us again
+		}
+		int from = ring->slot[n % RING_SLOTS].worker, fd = ring->slot[n % RING_SLOTS].fd;
+		int len = ring->slot[n % RING_SLOTS].len;
+		memcpy(text, ring->slot[n % RING_SLOTS].text, len);
+		atomic_thread_fence(memory_order_acquire);   // the copy above is done before seq is checked again
+		if (seq > n + 1 || atomic_load_explicit(&ring->slot[n % RING_SLOTS].seq, memory_order_relaxed) != seq) {
+			uint64_t head = atomic_load(&ring->head);
+			fprintf(stderr, "worker %d: fell behind, skipping %llu line(s)\n", worker,
+				(unsigned long long)(head - RING_SLOTS + 1 - n));
+			*cursor = head - RING_SLOTS + 1;
+			continue;
+		}
+		(*cursor)++;
+
+		// XOR restarts from the key's first byte each send, so one copy serves everyone
+		xor_encrypt_decrypt(text, len, ENCRYPTION_KEY);
+		for (int i = 0; i < WORKER_CONNS; i++) {
+			if (conns[i].fd == -1 || conns[i].username[0] == '\0' || (from == worker && conns[i].fd == fd)) {
+				continue;
+			}
+			// never block the worker on one slow reader; it misses the line instead
+			send(conns[i].fd, text, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+		}
+	}
+}
+
+void worker_accept(int worker, int lfd, conn_t *conns, int *fdmax, fd_set *master) {
+	struct sockaddr_storage their_addr;
+	socklen_t sin_size = sizeof their_addr;
+	int new_fd = accept(lfd, (struct sockaddr *)&their_addr, &sin_size);
+	int i;
+
+	if (new_fd == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) perror("accept");
+		return;   // another worker took it off the shared listener
+	}
+	for (i = 0; i < WORKER_CONNS && conns[i].fd != -1; i++)
+		;
+	if (i == WORKER_CONNS || new_fd >= FD_SETSIZE) {
+		close(new_fd);
+		return;
+	}
+
+	char welcome[] = "=== Connected to Chat Server ===\nType your messages and press Enter. Type 'quit' to exit.\n";
+	if (send(new_fd, welcome, strlen(welcome), MSG_NOSIGNAL) == -1) {
+		perror("send");
+		close(new_fd);
+		return;
+	}
+	conns[i].fd = new_fd;
+	conns[i].username[0] = '\0';
+	inet_ntop(their_addr.ss_family, get_in_addr((struct sockaddr *)&their_addr),
+		conns[i].addr, sizeof conns[i].addr);
+	FD_SET(new_fd, master);
+	if (new_fd > *fdmax) *fdmax = new_fd;
+	printf("worker %d: got connection from %s\n", worker, conns[i].addr);
+}
+
+// One connection has data: the username first, then chat lines
+void worker_read(int worker, conn_t *c, fd_set *master) {
+	char buf[1024];
+	ssize_t numbytes = recv(c->fd, buf, c->username[0] == '\0' ? sizeof(c->username) - 1 : sizeof(buf) - 1, 0);
+
+	if (numbytes <= 0) {
+		if (numbytes == 0) {
+			printf("%s disconnected\n", c->username[0] ? c->username : c->addr);
+		} else {
+			perror("recv");
+		}
+		goto done;
+	}
+	buf[numbytes] = '\0';
+	xor_encrypt_decrypt(buf, numbytes, ENCRYPTION_KEY);
+
+	if (c->username[0] == '\0') {
+		char ack_msg[128];
+		snprintf(c->username, sizeof c->username, "%.*s", (int)sizeof c->username - 1, buf);
+		snprintf(ack_msg, sizeof(ack_msg), "Welcome, %s! You are now connected to the chat server.", c->username);
+		int ack_len = strlen(ack_msg);
+		xor_encrypt_decrypt(ack_msg, ack_len, ENCRYPTION_KEY);
+		if (send(c->fd, ack_msg, ack_len, MSG_NOSIGNAL) == -1) {
+			perror("send acknowledgment");
+			goto done;
+		}
+		printf("Chat session started with %s (username: %s) on worker %d\n", c->addr, c->username, worker);
+		return;
+	}
+	if (strncmp(buf, "quit", 4) == 0) {
+		printf("%s ended the chat\n", c->username);
+		goto done;
+	}
+
+	char timestamp[64], line[RING_TEXT];
+	get_timestamp(timestamp, sizeof(timestamp));
+	int len = snprintf(line, sizeof line, "%s %s: %s", timestamp, c->username, buf);
+	if (len >= (int)sizeof line) len = sizeof line - 1;
+	printf("%s", line);
+	fflush(stdout);
+	ring_publish(worker, c->fd, line, len);
+	return;
+
+done:
+	FD_CLR(c->fd, master);
+	close(c->fd);
+	c->fd = -1;
+}
+
+// A prefork worker: a select() loop over its own listener, its wakeup
+// eventfd and up to WORKER_CONNS users
+void worker_main(int worker) {
+	conn_t conns[WORKER_CONNS];
+	uint64_t cursor = atomic_load(&ring->head);   // only lines from now on
+	fd_set master, read_fds;
+	int lfd = shared_listener != -1 ? shared_listener : open_listener(1);
+	int efd = worker_efd[worker], fdmax;
+
+	if (lfd == -1) {
+		perror("worker: SO_REUSEPORT");
+		exit(1);
+	}
+	fcntl(lfd, F_SETFL, O_NONBLOCK);   // a shared listener wakes every worker
+	for (int i = 0; i < WORKER_CONNS; i++) {
+		conns[i].fd = -1;
+	}
+	FD_ZERO(&master);
+	FD_SET(lfd, &master);
+	FD_SET(efd, &master);
+	fdmax = lfd > efd ? lfd : efd;
+
+	while(1) {
+		read_fds = master;
+		if (select(fdmax + 1, &read_fds, NULL, NULL, NULL) == -1) {
+			if (errno == EINTR) continue;
+			perror("select");
+			exit(1);
+		}
+		if (FD_ISSET(lfd, &read_fds)) {
+			worker_accept(worker, lfd, conns, &fdmax, &master);
+		}
+		for (int i = 0; i < WORKER_CONNS; i++) {
+			if (conns[i].fd != -1 && FD_ISSET(conns[i].fd, &read_fds)) {
+				worker_read(worker, &conns[i], &master);
+			}
+		}
+		if (FD_ISSET(efd, &read_fds)) {
+			uint64_t n;
+			if (read(efd, &n, sizeof n) == -1 && errno != EAGAIN) perror("eventfd");
+		}
+		ring_deliver(worker, &cursor, conns);   // also catches lines we published ourselves
+	}
+}
+
+pid_t spawn_worker(int worker) {
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		exit(1);
+	}
+	if (pid == 0) {
+		worker_main(worker);
+		exit(0);
+	}
+	return pid;
+}
+
+// Prefork mode: set up the ring, start the workers, and replace any that die
+void prefork(void) {
+	pid_t pids[MAX_WORKERS];
+	int probe = open_listener(1);   // can every worker bind its own?
+
+	ring = mmap(NULL, sizeof *ring, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ring == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	for (int w = 0; w < nworkers; w++) {
+		if ((worker_efd[w] = eventfd(0, EFD_NONBLOCK)) == -1) {
+			perror("eventfd");
+			exit(1);
+		}
+	}
+	if (probe == -1) {
+		shared_listener = open_listener(0);
+		printf("server: no SO_REUSEPORT; workers share one listener\n");
+	} else {
+		close(probe);
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+	for (int w = 0; w < nworkers; w++) {
+		pids[w] = spawn_worker(w);
+	}
+	printf("server: %d worker processes on port %s, waiting for connections...\n", nworkers, port);
+	fflush(stdout);
+
+	while(1) {
+		int status;
+		pid_t pid = wait(&status);
+		if (pid == -1) {
+			if (errno == EINTR) continue;
+			perror("wait");
+			exit(1);
+		}
+		for (int w = 0; w < nworkers; w++) {
+			if (pids[w] == pid) {
+				fprintf(stderr, "server: worker %d (pid %d) exited; restarting it\n", w, (int)pid);
+				if (WIFEXITED(status) && WEXITSTATUS(status) != 0) sleep(1);   // it failed to start
+				pids[w] = spawn_worker(w);   // its users are gone, everyone else carries on
+			}
+		}
+	}
+}
+
+int main(int argc, char *argv[]) 
+{ 
+	int sockfd, new_fd;  // listen on sock_fd, new connection on new_fd 
+	struct sockaddr_storage their_addr; // connector's address information 
+	socklen_t sin_size; 
+	struct sigaction sa; 
+	char s[INET6_ADDRSTRLEN]; 
+	int opt;
+
+	while ((opt = getopt(argc, argv, "p:w:")) != -1) {
+		switch (opt) {
+		case 'p':
+			port = optarg;
+			break;
+		case 'w':   // prefork this many workers instead of forking per connection
+			nworkers = atoi(optarg);
+			break;
+		default:
+			fprintf(stderr, "usage: server_old [-p port] [-w workers]\n");
+			exit(1);
+		}
+	}
+	if (nworkers < 0 || nworkers > MAX_WORKERS) {
+		fprintf(stderr, "server: -w takes 1..%d workers\n", MAX_WORKERS);
+		exit(1);
+	}
+	if (nworkers > 0) {
+		prefork();
+	}
+
+	sockfd = open_listener(0);
 
 	sa.sa_handler = sigchld_handler; // reap all dead processes 
 	sigemptyset(&sa.sa_mask); 
@@ -0,0 +1,313 @@
+/* ** sigbench.c -- cost of signed chat
+**
+** 1. Signs and verifies chat-sized messages in a loop and prints
+**    signatures/sec: signing on one core, verifying on one core and on -t
+**    threads (the server's verify pool).
+** 2. With -c host[:port], logs two users into a running server and times
+**    -n round trips from one to the other, unsigned and then signed, so the
+**    difference is the latency the verify stage adds to a relayed message.
+**
+** Uses ML-DSA-44 where OpenSSL has it (3.5+), Ed25519 otherwise; -a picks.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+#define PORT        "3490"
+#define MAXDATASIZE 1024
+#define SIG_MAX     2420
+#define SIG_NONCE   16
+#define FRAME_HDR   3
+#define FRAME_MAX   (MAXDATASIZE + 64 + 2 + SIG_MAX)
+#define MSG_LEN     100      // bytes per benchmark message
+#define PACE_US     70000    // between round trips; stays under the server's 20 msg/s
+
+enum { FRAME_CHAT = 1, FRAME_NOTICE, FRAME_PING, FRAME_PONG, FRAME_SIGKEY = 13, FRAME_SIGNED };
+
+// AES-256 key and IV - must match server
+static const unsigned char AES_KEY[32] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+    0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F
+};
+
+static const unsigned char AES_IV[16] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F
+};
+
+EVP_PKEY *key;
+unsigned char msg[8 + SIG_NONCE + 8 + MSG_LEN], sig[SIG_MAX];
+size_t sig_len;
+double duration = 2;
+
+// AES-256-CBC encrypt/decrypt (enc = 1 / 0); returns output length or -1
+int aes_crypt(int enc, const unsigned char *in, int in_len, unsigned char *out) {
+    EVP_CIPHER_CTX *ctx;
+    int len, out_len = -1;
+
+    if (!(ctx = EVP_CIPHER_CTX_new()))
+        return -1;
+
+    if (EVP_CipherInit_ex(ctx, EVP_aes_256_cbc(), NULL, AES_KEY, AES_IV, enc) == 1 &&
+        EVP_CipherUpdate(ctx, out, &len, in, in_len) == 1) {
+        out_len = len;
+        if (EVP_CipherFinal_ex(ctx, out + len, &len) == 1)
+            out_len += len;
+        else
+            out_len = -1;
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+    return out_len;
+}
+
+double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int sign(const unsigned char *m, int len, unsigned char *out, size_t *out_len) {
+	EVP_MD_CTX *md = EVP_MD_CTX_new();
+	*out_len = SIG_MAX;
+	int ok = md != NULL && EVP_DigestSignInit(md, NULL, NULL, NULL, key) == 1 &&
+		EVP_DigestSign(md, out, out_len, m, len) == 1;
+	EVP_MD_CTX_free(md);
+	return ok ? 0 : -1;
+}
+
+// Verify loop, as a server worker runs it; returns verifications done
+void *verify_loop(void *arg) {
+	long n = 0;
+	double end = now_sec() + duration;
+	EVP_MD_CTX *md = EVP_MD_CTX_new();
+
+	(void)arg;
+	do {
+		for (int k = 0; k < 16; k++, n++) {
+			if (EVP_DigestVerifyInit(md, NULL, NULL, NULL, key) != 1 ||
+					EVP_DigestVerify(md, sig, sig_len, msg, sizeof msg) != 1) {
+				fprintf(stderr, "sigbench: verify failed\n");
+				exit(1);
+			}
+			EVP_MD_CTX_reset(md);
+		}
+	} while (now_sec() < end);
+	EVP_MD_CTX_free(md);
+	return (void *)n;
+}
+
+void throughput(int threads) {
+	pthread_t tid[64];
+	long n = 0, total = 0;
+	double start = now_sec(), end = start + duration, t;
+
+	do {
+		for (int k = 0; k < 16; k++, n++) {
+			if (sign(msg, sizeof msg, sig, &sig_len) == -1) {
+				fprintf(stderr, "sigbench: sign failed\n");
+				exit(1);
+			}
+		}
+	} while ((t = now_sec()) < end);
+	printf("%s: %zu-byte signatures, %d-byte public key\n", EVP_PKEY_get0_type_name(key), sig_len,
+		i2d_PUBKEY(key, NULL));
+	printf("sign    1 thread    %9.0f /s\n", n / (t - start));
+
+	long one = (long)verify_loop(NULL);
+	printf("verify  1 thread    %9.0f /s\n", one / duration);
+
+	for (int i = 0; i < threads; i++) {
+		pthread_create(&tid[i], NULL, verify_loop, NULL);
+	}
+	for (int i = 0; i < threads; i++) {
+		void *r;
+		pthread_join(tid[i], &r);
+		total += (long)r;
+	}
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	int cores = threads < cpus ? threads : cpus;
+	printf("verify  %d thread(s) %9.0f /s  (%.0f per core, %ld CPU(s))\n", threads, total / duration,
+		total / duration / cores, cpus);
+}
+
+// --- Relay latency against a live server ---
+
+int send_frame(int fd, int type, const unsigned char *payload, int len) {
+	unsigned char frame[FRAME_HDR + FRAME_MAX];
+
+	frame[0] = (len >> 8) & 0xff;
+	frame[1] = len & 0xff;
+	frame[2] = type;
+	memcpy(frame + FRAME_HDR, payload, len);
+	return send(fd, frame, FRAME_HDR + len, 0);
+}
+
+int recv_frame(int fd, int *type, unsigned char *payload) {
+	unsigned char hdr[FRAME_HDR];
+	if (recv(fd, hdr, FRAME_HDR, MSG_WAITALL) != FRAME_HDR) return -1;
+	int len = (hdr[0] << 8) | hdr[1];
+	if (len > FRAME_MAX || (len > 0 && recv(fd, payload, len, MSG_WAITALL) != len)) return -1;
+	*type = hdr[2];
+	if (*type == FRAME_PING) send_frame(fd, FRAME_PONG, NULL, 0);
+	return len;
+}
+
+// Wait for a frame of one type; chat frames come back decrypted
+int wait_frame(int fd, int want, unsigned char *out) {
+	unsigned char payload[FRAME_MAX];
+	int type, len;
+
+	while ((len = recv_frame(fd, &type, payload)) >= 0) {
+		if (type != want) continue;
+		if (type != FRAME_CHAT) {
+			memcpy(out, payload, len);
+			return len;
+		}
+		len = aes_crypt(0, payload, len, out);
+		if (len >= 0) out[len] = '\0';
+		return len;
+	}
+	fprintf(stderr, "sigbench: server closed the connection\n");
+	exit(1);
+}
+
+int login(const char *host, const char *port, const char *name) {
+	struct addrinfo hints, *ai;
+	unsigned char buf[FRAME_MAX + 32];
+	int fd;
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, port, &hints, &ai) != 0 ||
+			(fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol)) == -1 ||
+			connect(fd, ai->ai_addr, ai->ai_addrlen) == -1) {
+		perror("sigbench: connect");
+		exit(1);
+	}
+	freeaddrinfo(ai);
+	wait_frame(fd, FRAME_NOTICE, buf);
+	int len = aes_crypt(1, (const unsigned char *)name, strlen(name), buf);
+	send_frame(fd, FRAME_CHAT, buf, len);
+	wait_frame(fd, FRAME_CHAT, buf);   // welcome
+	return fd;
+}
+
+int cmp_double(const void *a, const void *b) {
+	double x = *(const double *)a, y = *(const double *)b;
+	return x < y ? -1 : x > y;
+}
+
+// n round trips tx -> server -> rx; prints mean / p50 / p99 in microseconds
+void latency(int tx, int rx, int n, const unsigned char *nonce, const char *label) {
+	double *lat = malloc(n * sizeof *lat), sum = 0;
+	unsigned char buf[FRAME_MAX + 32], frame[2 + SIG_MAX + MAXDATASIZE + 16];
+	char text[MSG_LEN + 16];
+
+	for (int i = 0; i < n; i++) {
+		snprintf(text, sizeof text, "lat %08d %0*d", i, MSG_LEN - 13, 0);
+		unsigned char *cipher = frame + (nonce ? 2 + SIG_MAX : 0);
+		int len = aes_crypt(1, (const unsigned char *)text, strlen(text), cipher);
+		double t0 = now_sec();
+		if (nonce) {
+			size_t slen;
+			memcpy(msg + 8, nonce, SIG_NONCE);
+			for (int k = 0; k < 8; k++) msg[8 + SIG_NONCE + k] = ((uint64_t)i >> (56 - 8 * k)) & 0xff;
+			memcpy(msg + 16 + SIG_NONCE, text, MSG_LEN);
+			sign(msg, sizeof msg, frame + 2, &slen);
+			frame[0] = slen >> 8;
+			frame[1] = slen & 0xff;
+			memmove(frame + 2 + slen, cipher, len);
+			send_frame(tx, FRAME_SIGNED, frame, 2 + slen + len);
+		} else {
+			send_frame(tx, FRAME_CHAT, cipher, len);
+		}
+		do {
+			wait_frame(rx, FRAME_CHAT, buf);
+		} while (strstr((char *)buf, text) == NULL);
+		lat[i] = (now_sec() - t0) * 1e6;
+		sum += lat[i];
+		usleep(PACE_US);
+	}
+	qsort(lat, n, sizeof *lat, cmp_double);
+	printf("%-9s %d msgs  mean %7.0f us  p50 %7.0f us  p99 %7.0f us\n", label, n,
+		sum / n, lat[n / 2], lat[n * 99 / 100]);
+	free(lat);
+}
+
+void relay_latency(char *target, int n) {
+	char *port = strrchr(target, ':');
+	unsigned char der[4096], *p = der, nonce[SIG_NONCE];
+
+	if (port != NULL) *port++ = '\0'; else port = PORT;
+	int rx = login(target, port, "sigbench-rx");
+	int tx = login(target, port, "sigbench-tx");
+
+	latency(tx, rx, n, NULL, "unsigned");
+	int len = i2d_PUBKEY(key, &p);
+	send_frame(tx, FRAME_SIGKEY, der, len);
+	if (wait_frame(tx, FRAME_SIGKEY, nonce) != SIG_NONCE) {
+		fprintf(stderr, "sigbench: server refused the key\n");
+		exit(1);
+	}
+	latency(tx, rx, n, nonce, "signed");   // numbering restarts at 0 with the nonce
+	close(tx);
+	close(rx);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *alg = NULL;
+	char *target = NULL;
+	int opt, threads = 4, n = 100;
+
+	while ((opt = getopt(argc, argv, "a:d:t:c:n:")) != -1) {
+		switch (opt) {
+		case 'a': alg = optarg; break;
+		case 'd': duration = atof(optarg); break;
+		case 't': threads = atoi(optarg); break;
+		case 'c': target = optarg; break;
+		case 'n': n = atoi(optarg); break;
+		default:
+			fprintf(stderr, "usage: sigbench [-a ML-DSA-44|ED25519] [-d seconds] [-t threads] "
+				"[-c host[:port] [-n round trips]]\n");
+			exit(1);
+		}
+	}
+	if (threads < 1 || threads > 64 || n < 1) {
+		fprintf(stderr, "sigbench: -t is 1..64, -n at least 1\n");
+		exit(1);
+	}
+
+	key = alg ? EVP_PKEY_Q_keygen(NULL, NULL, alg) : EVP_PKEY_Q_keygen(NULL, NULL, "ML-DSA-44");
+	if (key == NULL && alg == NULL) {
+		printf("ML-DSA-44 is not in this OpenSSL; using Ed25519\n");
+		key = EVP_PKEY_Q_keygen(NULL, NULL, "ED25519");
+	}
+	if (key == NULL) {
+		fprintf(stderr, "sigbench: cannot make a %s key\n", alg);
+		exit(1);
+	}
+	memcpy(msg, "chat-sig", 8);
+	memset(msg + 8, 'x', sizeof msg - 8);
+
+	throughput(threads);
+	if (target != NULL) {
+		relay_latency(target, n);
+	}
+	return 0;
+}
@@ -11,7 +11,7 @@ echo === Chat Client Startup ===
 echo.
 
 echo Compiling client.c using WSL...
-wsl gcc -o client client.c -Wall
+wsl gcc -o client client.c -Wall -lssl -lcrypto
 
 if %ERRORLEVEL% EQU 0 (
     echo Compilation successful!
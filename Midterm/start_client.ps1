@@ -47,7 +47,7 @@ if ($useWSL) {
     }
     
     # Compile using WSL
-    wsl bash -c "cd '$wslDir' && gcc -o client client.c -Wall" 2>&1 | Where-Object { $_ -notmatch "wslpath" }
+    wsl bash -c "cd '$wslDir' && gcc -o client client.c -Wall -lssl -lcrypto" 2>&1 | Where-Object { $_ -notmatch "wslpath" }
     
     if ($LASTEXITCODE -eq 0) {
         Write-Host "Compilation successful!" -ForegroundColor Green
@@ -63,7 +63,7 @@ if ($useWSL) {
     }
 } else {
     # Try direct compilation (MinGW/Cygwin)
-    gcc -o "$PSScriptRoot\client.exe" "$PSScriptRoot\client.c" -lws2_32 -Wall 2>&1
+    gcc -o "$PSScriptRoot\client.exe" "$PSScriptRoot\client.c" -lws2_32 -lssl -lcrypto -Wall 2>&1
     
     if ($LASTEXITCODE -eq 0) {
         Write-Host "Compilation successful!" -ForegroundColor Green
@@ -6,7 +6,7 @@ echo === Chat Server Startup ===
 echo.
 
 echo Compiling server.c using WSL...
-wsl gcc -o server server.c -Wall
+wsl gcc -o server server.c -Wall -lssl -lcrypto -pthread
 
 if %ERRORLEVEL% EQU 0 (
     echo Compilation successful!
@@ -40,7 +40,7 @@ if ($useWSL) {
     }
     
     # Compile using WSL
-    wsl bash -c "cd '$wslDir' && gcc -o server server.c -Wall" 2>&1 | Where-Object { $_ -notmatch "wslpath" }
+    wsl bash -c "cd '$wslDir' && gcc -o server server.c -Wall -lssl -lcrypto -pthread" 2>&1 | Where-Object { $_ -notmatch "wslpath" }
     
     if ($LASTEXITCODE -eq 0) {
         Write-Host "Compilation successful!" -ForegroundColor Green
@@ -58,7 +58,7 @@ if ($useWSL) {
     }
 } else {
     # Try direct compilation (MinGW/Cygwin)
-    gcc -o "$PSScriptRoot\server.exe" "$PSScriptRoot\server.c" -lws2_32 -Wall 2>&1
+    gcc -o "$PSScriptRoot\server.exe" "$PSScriptRoot\server.c" -lws2_32 -lssl -lcrypto -pthread -Wall 2>&1
     
     if ($LASTEXITCODE -eq 0) {
         Write-Host "Compilation successful!" -ForegroundColor Green
@@ -1,67 +1,261 @@
-/* ** talker.c -- a datagram "client" demo 
-*/ 
-
-#include <stdio.h> 
-#include <stdlib.h> 
-#include <unistd.h> 
-#include <errno.h> 
-#include <string.h> 
-#include <sys/types.h> 
-#include <sys/socket.h> 
-#include <netinet/in.h> 
-#include <arpa/inet.h> 
-#include <netdb.h> 
-
-#define SERVERPORT "4950" // the port users will be connecting to 
-
-int main(int argc, char *argv[]) 
-{ 
-	int sockfd; 
-	struct addrinfo hints, *servinfo, *p; 
-	int rv; 
-	int numbytes; 
-
-	if (argc != 3) { 
-		fprintf(stderr,"usage: talker hostname message\n"); 
-		exit(1); 
-	} 
-
-	memset(&hints, 0, sizeof hints); 
-	hints.ai_family = AF_INET6; // set to AF_INET to use IPv4 
-	hints.ai_socktype = SOCK_DGRAM; 
-
-	if ((rv = getaddrinfo(argv[1], SERVERPORT, &hints, &servinfo)) != 0) { 
-		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv)); 
-		return 1; 
-	} 
-
-	// loop through all the results and make a socket 
-	for(p = servinfo; p != NULL; p = p->ai_next) { 
-		if ((sockfd = socket(p->ai_family, p->ai_socktype, 
-				p->ai_protocol)) == -1) { 
-			perror("talker: socket"); 
-			continue; 
-		} 
-
-		break; 
-	} 
-
-	if (p == NULL) { 
-		fprintf(stderr, "talker: failed to create socket\n"); 
-		return 2; 
-	} 
-
-	if ((numbytes = sendto(sockfd, argv[2], strlen(argv[2]), 0, 
-			 p->ai_addr, p->ai_addrlen)) == -1) { 
-		perror("talker: sendto"); 
-		exit(1); 
-	} 
-
-	freeaddrinfo(servinfo); 
-
-	printf("talker: sent %d bytes to %s\n", numbytes, argv[1]); 
-
-	close(sockfd); 
-
-	return 0; 
-}
\ No newline at end of file
+/* ** talker.c -- a datagram "client" demo
+**
+** "talker hostname message" sends one datagram. With -b it becomes a load
+** generator for listener.c: numbered datagrams of -s bytes at -r packets/sec
+** (0 = as fast as possible) for -d seconds, sent in sendmmsg() batches and,
+** where the kernel has it, as UDP GSO super-datagrams.
+*/
+
+#define _GNU_SOURCE   // sendmmsg()
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+
+#define SERVERPORT "4950" // the port users will be connecting to
+
+#define TX_BATCH   64      // messages per sendmmsg()
+#define GSO_SEGS   64      // datagrams per GSO message (kernel limit)
+#define GSO_MAX    65000   // bytes per GSO message
+#define MAXPAYLOAD 65507
+#define SNDBUF     (4 * 1024 * 1024)
+
+// Benchmark datagram header (see listener.c)
+#define BENCH_MAGIC 0x55445042   // "UDPB"
+#define BENCH_END   UINT64_MAX   // seq of the end marker; payload = packets sent
+
+typedef struct {
+	uint32_t magic;
+	uint32_t run;
+	uint64_t seq;
+} bench_hdr_t;
+
+// Send ring: every message's buffer and iovec are set up once; a send only
+// stamps sequence numbers into the headers
+static char *bufs[TX_BATCH];
+static struct iovec iovs[TX_BATCH];
+static struct mmsghdr msgs[TX_BATCH];
+static char cmsgs[TX_BATCH][CMSG_SPACE(sizeof(uint16_t))];
+
+double now_sec(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void sleep_until(double t)
+{
+	double d = t - now_sec();
+	if (d > 0) {
+		struct timespec ts = { (time_t)d, (long)((d - (time_t)d) * 1e9) };
+		nanosleep(&ts, NULL);
+	}
+}
+
+// Attach a UDP_SEGMENT cmsg so the kernel splits the message into size-byte datagrams
+void set_gso(struct msghdr *mh, char *ctl, int size)
+{
+#ifdef UDP_SEGMENT
+	uint16_t seg = size;
+	mh->msg_control = ctl;
+	mh->msg_controllen = CMSG_SPACE(sizeof seg);
+	struct cmsghdr *cm = CMSG_FIRSTHDR(mh);
+	cm->cmsg_level = SOL_UDP;
+	cm->cmsg_type = UDP_SEGMENT;
+	cm->cmsg_len = CMSG_LEN(sizeof seg);
+	memcpy(CMSG_DATA(cm), &seg, sizeof seg);
+#else
+	(void)mh; (void)ctl; (void)size;
+#endif
+}
+
+void usage(void)
+{
+	fprintf(stderr,"usage: talker hostname message\n"
+		"       talker -b [-s size] [-r pkts/sec] [-d seconds] [-g] hostname\n");
+	exit(1);
+}
+
+int bench(int sockfd, struct addrinfo *p, int size, long rate, double duration, int gso)
+{
+	bench_hdr_t h = { BENCH_MAGIC, 0, 0 };
+	int segs = 1, i, k;
+
+	h.run = (uint32_t)time(NULL) ^ ((uint32_t)getpid() << 16);
+	if (gso) {
+		segs = GSO_MAX / size;
+		if (segs > GSO_SEGS) segs = GSO_SEGS;
+		if (segs < 2) gso = 0, segs = 1;
+	}
+
+	for (i = 0; i < TX_BATCH; i++) {
+		bufs[i] = calloc(segs, size);
+		if (bufs[i] == NULL) {
+			perror("talker: calloc");
+			exit(1);
+		}
+		for (k = 0; k < segs; k++) {
+			memcpy(bufs[i] + k * size, &h, sizeof h);
+		}
+		iovs[i].iov_base = bufs[i];
+		iovs[i].iov_len = segs * size;
+		msgs[i].msg_hdr.msg_name = p->ai_addr;
+		msgs[i].msg_hdr.msg_namelen = p->ai_addrlen;
+		msgs[i].msg_hdr.msg_iov = &iovs[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+		if (gso) set_gso(&msgs[i].msg_hdr, cmsgs[i], size);
+	}
+
+	char pace[32] = "max";
+	if (rate) snprintf(pace, sizeof pace, "%ld", rate);
+	printf("talker: run %u, %d-byte datagrams, %s pkt/s for %.0f s, %s\n", h.run, size,
+		pace, duration, gso ? "GSO" : "no GSO");
+
+	// Each batch is at most TX_BATCH * segs datagrams; pacing shrinks it so
+	// we never run more than ~1 ms ahead of the requested rate
+	long per_batch = TX_BATCH * segs;
+	if (rate && rate / 1000 < per_batch) {
+		per_batch = rate / 1000 > 0 ? rate / 1000 : 1;
+	}
+
+	uint64_t seq = 0, calls = 0;
+	double start = now_sec(), end = start + duration;
+
+	while (now_sec() < end) {
+		if (rate) sleep_until(start + (double)seq / rate);
+
+		// Fill as many messages as this batch needs
+		long want = per_batch;
+		int nmsg = 0;
+		while (want > 0 && nmsg < TX_BATCH) {
+			int take = want < segs ? want : segs;
+			for (k = 0; k < take; k++) {
+				uint64_t s = seq + k;
+				memcpy(bufs[nmsg] + k * size + offsetof(bench_hdr_t, seq), &s, sizeof s);
+			}
+			iovs[nmsg].iov_len = take * size;
+			seq += take;
+			want -= take;
+			nmsg++;
+		}
+
+		int sent = 0;
+		while (sent < nmsg) {
+			int n = sendmmsg(sockfd, msgs + sent, nmsg - sent, 0);
+			if (n == -1) {
+				if (errno == EINTR || errno == ENOBUFS || errno == EAGAIN) continue;
+				if (errno == EIO && gso) {
+					fprintf(stderr, "talker: GSO rejected by this path; rerun without -g\n");
+				}
+				perror("talker: sendmmsg");
+				exit(1);
+			}
+			sent += n;
+			calls++;
+		}
+	}
+
+	double secs = now_sec() - start;
+
+	// The end marker tells the listener how many datagrams to expect; it is
+	// repeated because it can be lost like any other datagram
+	char end_pkt[sizeof h + sizeof seq];
+	h.seq = BENCH_END;
+	memcpy(end_pkt, &h, sizeof h);
+	memcpy(end_pkt + sizeof h, &seq, sizeof seq);
+	usleep(100000);
+	for (i = 0; i < 3; i++) {
+		sendto(sockfd, end_pkt, sizeof end_pkt, 0, p->ai_addr, p->ai_addrlen);
+		usleep(10000);
+	}
+
+	printf("talker: sent %llu datagrams in %.2f s (%.0f pkt/s, %.1f per syscall)\n",
+		(unsigned long long)seq, secs, seq / secs, calls ? (double)seq / calls : 0.0);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int sockfd;
+	struct addrinfo hints, *servinfo, *p;
+	int rv, opt;
+	int numbytes;
+	int benchmark = 0, size = 64, gso = 0;
+	long rate = 0;
+	double duration = 5;
+
+	while ((opt = getopt(argc, argv, "bs:r:d:g")) != -1) {
+		switch (opt) {
+		case 'b': benchmark = 1; break;
+		case 's': size = atoi(optarg); break;
+		case 'r': rate = atol(optarg); break;
+		case 'd': duration = atof(optarg); break;
+		case 'g': gso = 1; break;
+		default: usage();
+		}
+	}
+
+	if (argc - optind != (benchmark ? 1 : 2) || size < (int)sizeof(bench_hdr_t) ||
+			size > MAXPAYLOAD || rate < 0 || duration <= 0) {
+		usage();
+	}
+
+	memset(&hints, 0, sizeof hints);
+	hints.ai_family = AF_INET6; // set to AF_INET to use IPv4
+	hints.ai_socktype = SOCK_DGRAM;
+
+	if ((rv = getaddrinfo(argv[optind], SERVERPORT, &hints, &servinfo)) != 0) {
+		fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(rv));
+		return 1;
+	}
+
+	// loop through all the results and make a socket
+	for(p = servinfo; p != NULL; p = p->ai_next) {
+		if ((sockfd = socket(p->ai_family, p->ai_socktype,
+				p->ai_protocol)) == -1) {
+			perror("talker: socket");
+			continue;
+		}
+
+		break;
+	}
+
+	if (p == NULL) {
+		fprintf(stderr, "talker: failed to create socket\n");
+		return 2;
+	}
+
+	if (benchmark) {
+		int sndbuf = SNDBUF;
+		setsockopt(sockfd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof sndbuf);
+		rv = bench(sockfd, p, size, rate, duration, gso);
+		freeaddrinfo(servinfo);
+		close(sockfd);
+		return rv;
+	}
+
+	if ((numbytes = sendto(sockfd, argv[optind + 1], strlen(argv[optind + 1]), 0,
+			 p->ai_addr, p->ai_addrlen)) == -1) {
+		perror("talker: sendto");
+		exit(1);
+	}
+
+	freeaddrinfo(servinfo);
+
+	printf("talker: sent %d bytes to %s\n", numbytes, argv[optind]);
+
+	close(sockfd);
+
+	return 0;
+}
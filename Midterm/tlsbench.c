@@ -0,0 +1,264 @@
+/* ** tlsbench.c -- what the chat server pays to encrypt a broadcast
+**
+** Sends -n messages of -s bytes to -f receivers over loopback, three ways:
+**   aes   the server's own path: one AES-256-CBC frame per message, the same
+**         ciphertext send()s to every receiver
+**   tls   TLS 1.3 with OpenSSL sealing every record in userspace
+**   ktls  TLS 1.3 with the record keys handed to the kernel after the
+**         handshake; falls back to userspace when the kernel has no kTLS
+** and reports the sender's wall time and CPU. Receivers are child processes.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <openssl/evp.h>
+#include <openssl/ssl.h>
+#include <openssl/err.h>
+
+#define MAXDATASIZE 1024
+#define FRAME_HDR   3
+#define MAX_FANOUT  64
+
+enum { FRAME_CHAT = 1, FRAME_TEXT = 11 };
+enum { MODE_AES, MODE_TLS, MODE_KTLS };
+static const char *mode_name[] = { "aes", "tls", "ktls" };
+
+// AES-256 key and IV - same as the server
+static const unsigned char AES_KEY[32] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17,
+    0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F
+};
+
+static const unsigned char AES_IV[16] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F
+};
+
+const char *cert_file, *key_file;
+
+// AES-256-CBC encrypt, set up per message exactly as server.c does
+int aes_encrypt(const unsigned char *in, int in_len, unsigned char *out) {
+    EVP_CIPHER_CTX *ctx;
+    int len, out_len = -1;
+
+    if (!(ctx = EVP_CIPHER_CTX_new()))
+        return -1;
+
+    if (EVP_EncryptInit_ex(ctx, EVP_aes_256_cbc(), NULL, AES_KEY, AES_IV) == 1 &&
+        EVP_EncryptUpdate(ctx, out, &len, in, in_len) == 1) {
+        out_len = len;
+        if (EVP_EncryptFinal_ex(ctx, out + len, &len) == 1)
+            out_len += len;
+        else
+            out_len = -1;
+    }
+
+    EVP_CIPHER_CTX_free(ctx);
+    return out_len;
+}
+
+double now_sec(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double cpu_sec(void) {
+	struct rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+void die_ssl(const char *what) {
+	fprintf(stderr, "tlsbench: %s failed\n", what);
+	ERR_print_errors_fp(stderr);
+	exit(1);
+}
+
+SSL_CTX *make_ctx(int server, int mode) {
+	SSL_CTX *ctx = SSL_CTX_new(server ? TLS_server_method() : TLS_client_method());
+	if (ctx == NULL || !SSL_CTX_set_min_proto_version(ctx, TLS1_3_VERSION)) die_ssl("SSL_CTX_new");
+	if (mode == MODE_KTLS) {
+		SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+	}
+	SSL_CTX_set_options(ctx, SSL_OP_IGNORE_UNEXPECTED_EOF);
+	if (server) {
+		SSL_CTX_set_num_tickets(ctx, 0);
+		if (SSL_CTX_use_certificate_chain_file(ctx, cert_file) != 1 ||
+				SSL_CTX_use_PrivateKey_file(ctx, key_file, SSL_FILETYPE_PEM) != 1) {
+			die_ssl("loading the certificate");
+		}
+	}
+	return ctx;
+}
+
+// Receiver: connect, then read until the sender closes
+void receiver(struct sockaddr_in *addr, int mode) {
+	char buf[16384];
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	SSL *ssl = NULL;
+
+	if (fd == -1 || connect(fd, (struct sockaddr *)addr, sizeof *addr) == -1) {
+		perror("tlsbench: connect");
+		exit(1);
+	}
+	if (mode != MODE_AES) {
+		ssl = SSL_new(make_ctx(0, mode));
+		if (ssl == NULL || SSL_set_fd(ssl, fd) != 1 || SSL_connect(ssl) != 1) die_ssl("SSL_connect");
+	}
+	for (;;) {
+		int n = ssl ? SSL_read(ssl, buf, sizeof buf) : recv(fd, buf, sizeof buf, 0);
+		if (n <= 0) break;
+	}
+	exit(0);
+}
+
+// Write all of buf to one receiver
+int put_all(int fd, SSL *ssl, int ktls, const unsigned char *buf, int len) {
+	while (len > 0) {
+		int n = ssl && !ktls ? SSL_write(ssl, buf, len) : send(fd, buf, len, MSG_NOSIGNAL);
+		if (n <= 0) {
+			if (n == -1 && errno == EINTR) continue;
+			return -1;
+		}
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+void run(int mode, int size, long count, int fanout) {
+	int lfd = socket(AF_INET, SOCK_STREAM, 0), fds[MAX_FANOUT], i, yes = 1;
+	SSL *ssl[MAX_FANOUT] = { NULL };
+	int ktls_tx = 0, ktls_rx = 0;
+	struct sockaddr_in addr;
+	socklen_t alen = sizeof addr;
+
+	memset(&addr, 0, sizeof addr);
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (lfd == -1 || bind(lfd, (struct sockaddr *)&addr, sizeof addr) == -1 ||
+			listen(lfd, MAX_FANOUT) == -1 || getsockname(lfd, (struct sockaddr *)&addr, &alen) == -1) {
+		perror("tlsbench: listen");
+		exit(1);
+	}
+	fflush(stdout);   // or every receiver prints our buffered lines again
+	for (i = 0; i < fanout; i++) {
+		pid_t pid = fork();
+		if (pid == -1) {
+			perror("tlsbench: fork");
+			exit(1);
+		}
+		if (pid == 0) {
+			close(lfd);
+			receiver(&addr, mode);
+		}
+	}
+
+	SSL_CTX *ctx = mode == MODE_AES ? NULL : make_ctx(1, mode);
+	for (i = 0; i < fanout; i++) {
+		if ((fds[i] = accept(lfd, NULL, NULL)) == -1) {
+			perror("tlsbench: accept");
+			exit(1);
+		}
+		setsockopt(fds[i], IPPROTO_TCP, TCP_NODELAY, &yes, sizeof yes);   // like a chat server, no batching
+		if (ctx != NULL) {
+			ssl[i] = SSL_new(ctx);
+			if (ssl[i] == NULL || SSL_set_fd(ssl[i], fds[i]) != 1 || SSL_accept(ssl[i]) != 1) die_ssl("SSL_accept");
+			ktls_tx = BIO_get_ktls_send(SSL_get_wbio(ssl[i]));
+			ktls_rx = BIO_get_ktls_recv(SSL_get_rbio(ssl[i]));
+		}
+	}
+	close(lfd);
+
+	unsigned char msg[MAXDATASIZE], frame[FRAME_HDR + MAXDATASIZE + 16];
+	memset(msg, 'x', sizeof msg);
+
+	double t0 = now_sec(), c0 = cpu_sec();
+	for (long k = 0; k < count; k++) {
+		int len;
+		msg[0] = 'a' + k % 26;
+		if (mode == MODE_AES) {   // encrypt once, send to everyone
+			len = aes_encrypt(msg, size, frame + FRAME_HDR);
+			frame[2] = FRAME_CHAT;
+		} else {                  // the record layer encrypts per connection
+			memcpy(frame + FRAME_HDR, msg, size);
+			len = size;
+			frame[2] = FRAME_TEXT;
+		}
+		frame[0] = (len >> 8) & 0xff;
+		frame[1] = len & 0xff;
+		for (i = 0; i < fanout; i++) {
+			if (put_all(fds[i], ssl[i], ktls_tx, frame, FRAME_HDR + len) == -1) {
+				fprintf(stderr, "tlsbench: send failed\n");
+				exit(1);
+			}
+		}
+	}
+	double wall = now_sec() - t0, cpu = cpu_sec() - c0;
+
+	for (i = 0; i < fanout; i++) {
+		if (ssl[i] != NULL) SSL_shutdown(ssl[i]);
+		close(fds[i]);
+	}
+	while (wait(NULL) > 0)
+		;
+
+	double sends = (double)count * fanout;
+	const char *how = mode == MODE_AES ? "AES-256-CBC frames" :
+		mode == MODE_TLS || !ktls_tx ? (mode == MODE_KTLS ? "no kernel TLS here, userspace fallback" : "userspace records") :
+		ktls_rx ? "kernel TLS tx+rx" : "kernel TLS tx";
+	printf("%-4s %5d B x %-3d  %9.0f msg/s  %7.1f MB/s  %6.2f us CPU/send  (%s)\n",
+		mode_name[mode], size, fanout, sends / wall, sends * size / wall / 1e6,
+		cpu / sends * 1e6, how);
+	if (ctx != NULL) SSL_CTX_free(ctx);
+}
+
+void usage(void) {
+	fprintf(stderr, "usage: tlsbench [-m aes|tls|ktls] [-s size] [-n count] [-f fanout] cert.pem key.pem\n");
+	exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, size = 128, fanout = 1, only = -1;
+	long count = 200000;
+
+	while ((opt = getopt(argc, argv, "m:s:n:f:")) != -1) {
+		switch (opt) {
+		case 'm':
+			for (only = 2; only >= 0 && strcmp(optarg, mode_name[only]) != 0; only--)
+				;
+			if (only < 0) usage();
+			break;
+		case 's': size = atoi(optarg); break;
+		case 'n': count = atol(optarg); break;
+		case 'f': fanout = atoi(optarg); break;
+		default: usage();
+		}
+	}
+	if (argc - optind != 2 || size < 1 || size > MAXDATASIZE || count < 1 ||
+			fanout < 1 || fanout > MAX_FANOUT) {
+		usage();
+	}
+	cert_file = argv[optind];
+	key_file = argv[optind + 1];
+
+	for (int m = MODE_AES; m <= MODE_KTLS; m++) {
+		if (only == -1 || only == m) run(m, size, count, fanout);
+	}
+	return 0;
+}